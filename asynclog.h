@@ -0,0 +1,39 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _V4L2TEST_ASYNCLOG_H
+#define _V4L2TEST_ASYNCLOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+
+/*
+ * Asynchronous log output.  Each thread formats its records into its own
+ * lock-free ring and a background writer thread writes them, in the order
+ * they were logged, to stderr and optionally the report file.  Level 0
+ * records are never lost: a thread whose ring is full waits for the writer.
+ * Records at other levels are dropped when the ring is full and the number
+ * dropped is logged at stop.  Before LogStart and after LogStop records are
+ * written synchronously.
+ */
+bool LogStart( FILE *report );
+void LogStop( void );
+void LogVPrintf( int level, bool toReport, const char *fmt, va_list argptr );
+
+#endif
+
@@ -0,0 +1,52 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _V4L2TEST_CADENCE_H
+#define _V4L2TEST_CADENCE_H
+
+/*
+ * Frame cadence classification.  A displayed frame lasts a whole number of
+ * refresh periods; it is a cadence error (judder, a repeat or a drop) when
+ * that whole number of periods differs from the content's frame period by
+ * more than a quarter period.  24 fps on 60 Hz alternates 2 and 3 vblanks,
+ * each 8.3 ms from 41.7 ms, so every frame judders; 24 fps on 24 Hz or 48 Hz
+ * shows none.  Times are microseconds.
+ */
+static inline long long CadenceVblanks( long long duration, long long refreshPeriod )
+{
+   long long vblanks= (duration+refreshPeriod/2)/refreshPeriod;
+
+   return (vblanks < 1 ? 1 : vblanks);
+}
+
+static inline bool CadenceIsError( long long duration, long long nominal, long long refreshPeriod )
+{
+   long long error;
+
+   if ( refreshPeriod <= 0 )
+   {
+      return false;
+   }
+   error= CadenceVblanks( duration, refreshPeriod )*refreshPeriod-nominal;
+   if ( error < 0 ) error= -error;
+
+   return (error > refreshPeriod/4);
+}
+
+#endif
+
@@ -22,9 +22,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <memory.h>
+#include <string.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/un.h>
@@ -39,6 +42,7 @@
 #include <drm/drm_fourcc.h>
 
 #include "platform.h"
+#include "timeline.h"
 
 #include <vector>
 
@@ -48,6 +52,47 @@ typedef EGLSurface (*PREALEGLCREATEWINDOWSURFACE)(EGLDisplay,
                                                   EGLNativeWindowType,
                                                   const EGLint *attrib_list);
 
+#define DEFAULT_FLIP_QUEUE_DEPTH (2)
+#define MAX_FLIP_QUEUE_DEPTH (4)
+#define FLIP_TIMEOUT_MS (100)
+#define FLIP_HISTORY (64)
+#define VIDEO_FB_CACHE (16)
+#define MAX_VIDEO_DISABLE (PLATFORM_MAX_VIDEO_LAYERS*2)
+#define WRITEBACK_BUFFERS (2)
+#define MAX_MODIFIERS (32)
+
+/* Where a video layer's frame is scanned out by a commit */
+typedef struct _PlatformVideoPlacement
+{
+   struct _PlatformOverlayPlane *plane;
+   uint32_t fbId;
+   int width;
+   int height;
+   int x;
+   int y;
+   int w;
+   int h;
+} PlatformVideoPlacement;
+
+typedef struct _PlatformScanout
+{
+   struct gbm_bo *bo;
+   uint32_t fbId;
+   int fenceFd;
+   unsigned int sequence;
+   int videoCount;
+   PlatformVideoPlacement video[PLATFORM_MAX_VIDEO_LAYERS];
+   int disableCount;
+   struct _PlatformOverlayPlane *disable[MAX_VIDEO_DISABLE];
+} PlatformScanout;
+
+typedef struct _PlatformVideoFb
+{
+   int fd;
+   uint32_t handle[2];
+   uint32_t fbId;
+} PlatformVideoFb;
+
 typedef struct _PlatformFormatInfo
 {
    uint32_t format;
@@ -85,23 +130,77 @@ typedef struct _PlatformOverlayPlanes
    PlatformOverlayPlane *primary;
 } PlatformOverlayPlanes;
 
-typedef struct _PlatformCtx
+typedef struct _PlatformVideoLayer
+{
+   bool active;
+   int generation;
+   int fd0;
+   int fd1;
+   int offset1;
+   uint64_t modifier;
+   int width;
+   int height;
+   int stride;
+   int x;
+   int y;
+   int w;
+   int h;
+   PlatformOverlayPlane *plane;
+   int fbCount;
+   PlatformVideoFb fbs[VIDEO_FB_CACHE];
+} PlatformVideoLayer;
+
+typedef struct _PlatformWritebackBuffer
+{
+   uint32_t handle;
+   uint32_t pitch;
+   uint64_t size;
+   uint32_t fbId;
+   unsigned char *map;
+} PlatformWritebackBuffer;
+
+/*
+ * A writeback connector attached to output 0's crtc.  One capture is
+ * written while the previous one waits to be collected.
+ */
+typedef struct _PlatformWriteback
 {
-   pthread_mutex_t mutex;
-   int drmFd;
-   drmModeRes *res;
    drmModeConnector *conn;
-   drmModeEncoder *enc;
+   drmModeObjectProperties *props;
+   drmModePropertyRes **propRes;
+   int interval;
+   int width;
+   int height;
+   PlatformWritebackBuffer buffer[WRITEBACK_BUFFERS];
+   int fenceFd;
+   int pendingIndex;
+   unsigned int pendingSequence;
+   int readyIndex;
+   unsigned int readySequence;
+   uint32_t readyChecksum;
+   int captureCount;
+   int skipCount;
+   int overrunCount;
+} PlatformWriteback;
+
+/*
+ * A connector and the crtc driving it.  Outputs composed independently each
+ * have their own window and flip queue.  Mirrored outputs scan out output 0's
+ * buffers through their primary plane in the same commit.
+ */
+typedef struct _PlatformOutput
+{
+   int index;
+   char name[32];
+   drmModeConnector *conn;
    drmModeCrtc *crtc;
+   int crtcIndex;
    drmModeModeInfo *modeInfo;
    drmModeObjectProperties *connectorProps;
    drmModePropertyRes **connectorPropRes;
    drmModeObjectProperties *crtcProps;
    drmModePropertyRes **crtcPropRes;
    PlatformOverlayPlanes overlayPlanes;
-   struct gbm_device* gbm;
-   bool useZPos;
-   bool haveAtomic;
    bool graphicsPreferPrimary;
    bool modeSet;
    void *nativeWindow;
@@ -109,14 +208,57 @@ typedef struct _PlatformCtx
    int windowWidth;
    int windowHeight;
    EGLSurface surfaceDirect;
-   uint32_t handle;
-   uint32_t fbId;
-   int flipPending;
-   struct gbm_bo *prevBo;
-   uint32_t prevFbId;
+   bool flipPending;
+   int flipEventsPending;
+   PlatformScanout onScreen;
+   PlatformScanout flipping;
+   PlatformScanout queued[MAX_FLIP_QUEUE_DEPTH];
+   int queuedCount;
+   unsigned int swapSequence;
+   unsigned int flipSequence[FLIP_HISTORY];
+   long long flipTime[FLIP_HISTORY];
+   int commitCount;
+   int flipCount;
+   int backPressureCount;
+   long long backPressureTime;
+   long long backPressureMax;
+} PlatformOutput;
+
+typedef struct _PlatformCtx
+{
+   pthread_mutex_t mutex;
+   int drmFd;
+   char card[64];
+   drmModeRes *res;
+   struct gbm_device* gbm;
+   bool useZPos;
+   bool haveAtomic;
+   bool haveModifiers;
+   bool useModifiers;
+   bool mirror;
+   int flipQueueDepth;
+   int contentFrameRate;
+   int outputCount;
+   PlatformOutput output[PLATFORM_MAX_OUTPUTS];
+   PlatformVideoLayer videoLayer[PLATFORM_MAX_VIDEO_LAYERS];
+   bool assignDirty;
+   unsigned int planeMask;
+   int disableCount;
+   PlatformOverlayPlane *disable[MAX_VIDEO_DISABLE];
+   int assignCount;
+   int testCount;
+   int testFailCount;
+   int planeFrameCount;
+   int layerFrameCount;
+   PlatformWriteback writeback;
 } PlatformCtx;
 
 static PREALEGLSWAPBUFFERS gRealEGLSwapBuffers= 0;
+static PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC gRealEGLSwapBuffersWithDamage= 0;
+static PFNEGLCREATESYNCKHRPROC gEGLCreateSyncKHR= 0;
+static PFNEGLDESTROYSYNCKHRPROC gEGLDestroySyncKHR= 0;
+static PFNEGLDUPNATIVEFENCEFDANDROIDPROC gEGLDupNativeFenceFDANDROID= 0;
+static int gNativeFenceSupport= 0;
 static PREALEGLCREATEWINDOWSURFACE gRealEGLCreateWindowSurface= 0;
 static PlatformCtx *gCtx= 0;
 static bool emitFPS= false;
@@ -126,51 +268,59 @@ extern bool gVerbose;
 static void pageFlipEventHandler(int fd, unsigned int frame,
 				 unsigned int sec, unsigned int usec,
 				 void *data);
-
-static void platformReleaseConnectorProperties( PlatformCtx *ctx )
+static void platformFlipDone( PlatformCtx *ctx, PlatformOutput *output, long long flipTime );
+static void platformCommitQueued( PlatformCtx *ctx, PlatformOutput *output );
+static void platformReleaseScanout( PlatformCtx *ctx, PlatformOutput *output, PlatformScanout *scanout );
+static long long platformModeRefresh( drmModeModeInfo *mode );
+static bool platformModeMatchesRate( drmModeModeInfo *mode, int frameRate );
+static bool platformDispatchFlipEvents( PlatformCtx *ctx, int timeout );
+static void platformVideoLayerFlush( PlatformCtx *ctx, PlatformVideoLayer *layer );
+static void platformWritebackTerm( PlatformCtx *ctx );
+
+static void platformReleaseConnectorProperties( PlatformCtx *ctx, PlatformOutput *output )
 {
    int i;
-   if ( ctx->connectorProps )
+   if ( output->connectorProps )
    {
-      if ( ctx->connectorPropRes )
+      if ( output->connectorPropRes )
       {
-         for( i= 0; i < ctx->connectorProps->count_props; ++i )
+         for( i= 0; i < output->connectorProps->count_props; ++i )
          {
-            if ( ctx->connectorPropRes[i] )
+            if ( output->connectorPropRes[i] )
             {
-               drmModeFreeProperty( ctx->connectorPropRes[i] );
-               ctx->connectorPropRes[i]= 0;
+               drmModeFreeProperty( output->connectorPropRes[i] );
+               output->connectorPropRes[i]= 0;
             }
          }
-         free( ctx->connectorPropRes );
-         ctx->connectorPropRes= 0;
+         free( output->connectorPropRes );
+         output->connectorPropRes= 0;
       }
-      drmModeFreeObjectProperties( ctx->connectorProps );
-      ctx->connectorProps= 0;
+      drmModeFreeObjectProperties( output->connectorProps );
+      output->connectorProps= 0;
    }
 }
 
-static bool platformAcquireConnectorProperties( PlatformCtx *ctx )
+static bool platformAcquireConnectorProperties( PlatformCtx *ctx, PlatformOutput *output )
 {
    bool error= false;
    int i;
 
-   if ( ctx->conn )
+   if ( output->conn )
    {
-      ctx->connectorProps= drmModeObjectGetProperties( ctx->drmFd, ctx->conn->connector_id, DRM_MODE_OBJECT_CONNECTOR );
-      if ( ctx->connectorProps )
+      output->connectorProps= drmModeObjectGetProperties( ctx->drmFd, output->conn->connector_id, DRM_MODE_OBJECT_CONNECTOR );
+      if ( output->connectorProps )
       {
-         ctx->connectorPropRes= (drmModePropertyRes**)calloc( ctx->connectorProps->count_props, sizeof(drmModePropertyRes*) );
-         if ( ctx->connectorPropRes )
+         output->connectorPropRes= (drmModePropertyRes**)calloc( output->connectorProps->count_props, sizeof(drmModePropertyRes*) );
+         if ( output->connectorPropRes )
          {
-            for( i= 0; i < ctx->connectorProps->count_props; ++i )
+            for( i= 0; i < output->connectorProps->count_props; ++i )
             {
-               ctx->connectorPropRes[i]= drmModeGetProperty( ctx->drmFd, ctx->connectorProps->props[i] );
-               if ( ctx->connectorPropRes[i] )
+               output->connectorPropRes[i]= drmModeGetProperty( ctx->drmFd, output->connectorProps->props[i] );
+               if ( output->connectorPropRes[i] )
                {
                   if ( gVerbose )
                   fprintf(stderr,"connector property %d name (%s) value (%lld)\n",
-                        ctx->connectorProps->props[i], ctx->connectorPropRes[i]->name, ctx->connectorProps->prop_values[i] );
+                        output->connectorProps->props[i], output->connectorPropRes[i]->name, output->connectorProps->prop_values[i] );
                }
                else
                {
@@ -190,7 +340,7 @@ static bool platformAcquireConnectorProperties( PlatformCtx *ctx )
       }
       if ( error )
       {
-         platformReleaseConnectorProperties( ctx );
+         platformReleaseConnectorProperties( ctx, output );
          ctx->haveAtomic= false;
       }
    }
@@ -198,48 +348,48 @@ static bool platformAcquireConnectorProperties( PlatformCtx *ctx )
    return !error;
 }
 
-static void platformReleaseCrtcProperties( PlatformCtx *ctx )
+static void platformReleaseCrtcProperties( PlatformCtx *ctx, PlatformOutput *output )
 {
    int i;
-   if ( ctx->crtcProps )
+   if ( output->crtcProps )
    {
-      if ( ctx->crtcPropRes )
+      if ( output->crtcPropRes )
       {
-         for( i= 0; i < ctx->crtcProps->count_props; ++i )
+         for( i= 0; i < output->crtcProps->count_props; ++i )
          {
-            if ( ctx->crtcPropRes[i] )
+            if ( output->crtcPropRes[i] )
             {
-               drmModeFreeProperty( ctx->crtcPropRes[i] );
-               ctx->crtcPropRes[i]= 0;
+               drmModeFreeProperty( output->crtcPropRes[i] );
+               output->crtcPropRes[i]= 0;
             }
          }
-         free( ctx->crtcPropRes );
-         ctx->crtcPropRes= 0;
+         free( output->crtcPropRes );
+         output->crtcPropRes= 0;
       }
-      drmModeFreeObjectProperties( ctx->crtcProps );
-      ctx->crtcProps= 0;
+      drmModeFreeObjectProperties( output->crtcProps );
+      output->crtcProps= 0;
    }
 }
 
-static bool platformAcquireCrtcProperties( PlatformCtx *ctx )
+static bool platformAcquireCrtcProperties( PlatformCtx *ctx, PlatformOutput *output )
 {
    bool error= false;
    int i;
 
-   ctx->crtcProps= drmModeObjectGetProperties( ctx->drmFd, ctx->crtc->crtc_id, DRM_MODE_OBJECT_CRTC );
-   if ( ctx->crtcProps )
+   output->crtcProps= drmModeObjectGetProperties( ctx->drmFd, output->crtc->crtc_id, DRM_MODE_OBJECT_CRTC );
+   if ( output->crtcProps )
    {
-      ctx->crtcPropRes= (drmModePropertyRes**)calloc( ctx->crtcProps->count_props, sizeof(drmModePropertyRes*) );
-      if ( ctx->crtcPropRes )
+      output->crtcPropRes= (drmModePropertyRes**)calloc( output->crtcProps->count_props, sizeof(drmModePropertyRes*) );
+      if ( output->crtcPropRes )
       {
-         for( i= 0; i < ctx->crtcProps->count_props; ++i )
+         for( i= 0; i < output->crtcProps->count_props; ++i )
          {
-            ctx->crtcPropRes[i]= drmModeGetProperty( ctx->drmFd, ctx->crtcProps->props[i] );
-            if ( ctx->crtcPropRes[i] )
+            output->crtcPropRes[i]= drmModeGetProperty( ctx->drmFd, output->crtcProps->props[i] );
+            if ( output->crtcPropRes[i] )
             {
                if ( gVerbose )
                fprintf(stderr,"crtc property %d name (%s) value (%lld)\n",
-                     ctx->crtcProps->props[i], ctx->crtcPropRes[i]->name, ctx->crtcProps->prop_values[i] );
+                     output->crtcProps->props[i], output->crtcPropRes[i]->name, output->crtcProps->prop_values[i] );
             }
             else
             {
@@ -259,7 +409,7 @@ static bool platformAcquireCrtcProperties( PlatformCtx *ctx )
    }
    if ( error )
    {
-      platformReleaseCrtcProperties( ctx );
+      platformReleaseCrtcProperties( ctx, output );
       ctx->haveAtomic= false;
    }
 
@@ -389,6 +539,41 @@ static void platformOverlayAppendUnused( PlatformOverlayPlanes *planes, Platform
    overlay->prev= insertAfter;
 }
 
+static void platformOverlayTake( PlatformOverlayPlanes *planes, PlatformOverlayPlane *overlay )
+{
+   ++planes->usedCount;
+
+   if ( overlay->next )
+   {
+      overlay->next->prev= overlay->prev;
+   }
+   else
+   {
+      planes->availTail= overlay->prev;
+   }
+   if ( overlay->prev )
+   {
+      overlay->prev->next= overlay->next;
+   }
+   else
+   {
+      planes->availHead= overlay->next;
+   }
+
+   overlay->next= 0;
+   overlay->prev= planes->usedTail;
+   if ( planes->usedTail )
+   {
+      planes->usedTail->next= overlay;
+   }
+   else
+   {
+      planes->usedHead= overlay;
+   }
+   planes->usedTail= overlay;
+   overlay->inUse= true;
+}
+
 static PlatformOverlayPlane *platformOverlayAllocPrimary( PlatformOverlayPlanes *planes )
 {
    PlatformOverlayPlane *overlay= 0;
@@ -399,38 +584,8 @@ static PlatformOverlayPlane *platformOverlayAllocPrimary( PlatformOverlayPlanes
    {
       if ( !planes->primary->inUse )
       {
-         ++planes->usedCount;
-
          overlay= planes->primary;
-         if ( overlay->next )
-         {
-            overlay->next->prev= overlay->prev;
-         }
-         else
-         {
-            planes->availTail= overlay->prev;
-         }
-         if ( overlay->prev )
-         {
-            overlay->prev->next= overlay->next;
-         }
-         else
-         {
-            planes->availHead= overlay->next;
-         }
-
-         overlay->next= 0;
-         overlay->prev= planes->usedTail;
-         if ( planes->usedTail )
-         {
-            planes->usedTail->next= overlay;
-         }
-         else
-         {
-            planes->usedHead= overlay;
-         }
-         planes->usedTail= overlay;
-         overlay->inUse= true;
+         platformOverlayTake( planes, overlay );
       }
       else
       {
@@ -566,773 +721,2709 @@ static void platformOverlayFree( PlatformOverlayPlanes *planes, PlatformOverlayP
    }
 }
 
-PlatformCtx* PlatfromInit( void )
+static const char *platformConnectorTypeName( uint32_t type )
 {
-   PlatformCtx *ctx= 0;
-   drmModeRes *res= 0;
-   int rc;
-   int i, j, k, len;
-   uint32_t n;
-   const char *card= "/dev/dri/card0";
-   drmModeConnector *conn= 0;
-   drmModePlaneRes *planeRes= 0;
-   drmModePlane *plane= 0;
-   drmModeObjectProperties *props= 0;
-   drmModePropertyRes *prop= 0;
-   struct drm_set_client_cap clientCap;
-   struct drm_mode_atomic atom;
-   int crtc_idx= -1;
-   bool error= true;
+   switch( type )
+   {
+      case DRM_MODE_CONNECTOR_VGA: return "VGA";
+      case DRM_MODE_CONNECTOR_DVII: return "DVI-I";
+      case DRM_MODE_CONNECTOR_DVID: return "DVI-D";
+      case DRM_MODE_CONNECTOR_DVIA: return "DVI-A";
+      case DRM_MODE_CONNECTOR_Composite: return "Composite";
+      case DRM_MODE_CONNECTOR_SVIDEO: return "SVIDEO";
+      case DRM_MODE_CONNECTOR_LVDS: return "LVDS";
+      case DRM_MODE_CONNECTOR_Component: return "Component";
+      case DRM_MODE_CONNECTOR_9PinDIN: return "DIN";
+      case DRM_MODE_CONNECTOR_DisplayPort: return "DP";
+      case DRM_MODE_CONNECTOR_HDMIA: return "HDMI-A";
+      case DRM_MODE_CONNECTOR_HDMIB: return "HDMI-B";
+      case DRM_MODE_CONNECTOR_TV: return "TV";
+      case DRM_MODE_CONNECTOR_eDP: return "eDP";
+      case DRM_MODE_CONNECTOR_VIRTUAL: return "Virtual";
+      case DRM_MODE_CONNECTOR_DSI: return "DSI";
+      case DRM_MODE_CONNECTOR_DPI: return "DPI";
+      case DRM_MODE_CONNECTOR_WRITEBACK: return "Writeback";
+      default: return "Unknown";
+   }
+}
 
-   if ( getenv("PLATFORM_FPS" ) )
+static void platformConnectorName( drmModeConnector *conn, char *name, int size )
+{
+   /* The same names the kernel uses, eg HDMI-A-1 */
+   snprintf( name, size, "%s-%u", platformConnectorTypeName( conn->connector_type ), conn->connector_type_id );
+}
+
+static void platformCardName( const char *device, char *card, int size )
+{
+   if ( !device )
    {
-      emitFPS= true;
+      device= "0";
    }
+   if ( (device[0] >= '0') && (device[0] <= '9') )
+   {
+      snprintf( card, size, "/dev/dri/card%d", atoi(device) );
+   }
+   else
+   {
+      snprintf( card, size, "%s", device );
+   }
+}
 
-   ctx= (PlatformCtx*)calloc( 1, sizeof(PlatformCtx) );
-   if ( ctx )
+static drmModeConnector *platformFindConnector( PlatformCtx *ctx, const char *spec, int len )
+{
+   drmModeConnector *conn= 0;
+   char name[32];
+   bool isIndex= true;
+   int i;
+
+   for( i= 0; i < len; ++i )
    {
-      drmVersionPtr drmver= 0;
-      pthread_mutex_init( &ctx->mutex, 0 );
-      ctx->drmFd= -1;
-      ctx->drmFd= open(card, O_RDWR);
-      if ( ctx->drmFd < 0 )
+      if ( (spec[i] < '0') || (spec[i] > '9') )
       {
-         fprintf(stderr,"Error: PlatformInit: failed to open card (%s)\n", card);
-         goto exit;
+         isIndex= false;
+         break;
       }
-
-      drmver= drmGetVersion( ctx->drmFd );
-      if ( drmver )
+   }
+   for( i= 0; i < ctx->res->count_connectors; ++i )
+   {
+      conn= drmModeGetConnector( ctx->drmFd, ctx->res->connectors[i] );
+      if ( conn )
       {
-         int len;
-
-         if ( gVerbose )
-         fprintf(stderr,"PlatformInit: drmGetVersion: %d.%d.%d name (%.*s) date (%.*s) desc (%.*s)\n",
-               drmver->version_major, drmver->version_minor, drmver->version_patchlevel,
-               drmver->name_len, drmver->name,
-               drmver->date_len, drmver->date,
-               drmver->desc_len, drmver->desc );
-
-         len= strlen( drmver->name );
-         if ( (len == 3) && !strncmp( drmver->name, "vc4", len ) )
+         platformConnectorName( conn, name, sizeof(name) );
+         if ( isIndex ? (atoi(spec) == i) : (((int)strlen(name) == len) && !strncmp( name, spec, len )) )
          {
-            ctx->useZPos= true;
-            fprintf(stderr,"using zpos\n");
+            break;
          }
-
-         drmFreeVersion( drmver );
+         drmModeFreeConnector( conn );
+         conn= 0;
       }
+   }
 
-      clientCap.capability= DRM_CLIENT_CAP_UNIVERSAL_PLANES;
-      clientCap.value= 1;
-      rc= ioctl( ctx->drmFd, DRM_IOCTL_SET_CLIENT_CAP, &clientCap);
-      if ( gVerbose )
-      fprintf(stderr,"PlatformInit: DRM_IOCTL_SET_CLIENT_CAP: DRM_CLIENT_CAP_UNIVERSAL_PLANES rc %d\n", rc);
+   return conn;
+}
 
-      clientCap.capability= DRM_CLIENT_CAP_ATOMIC;
-      clientCap.value= 1;
-      rc= ioctl( ctx->drmFd, DRM_IOCTL_SET_CLIENT_CAP, &clientCap);
-      if ( gVerbose )
-      fprintf(stderr,"PlatformInit: DRM_IOCTL_SET_CLIENT_CAP: DRM_CLIENT_CAP_ATOMIC rc %d\n", rc);
-      if ( rc == 0 )
-      {
-         ctx->haveAtomic= true;
-         fprintf(stderr,"PlatformInit: have drm atomic mode setting\n");
-      }
+static int platformFindCrtc( PlatformCtx *ctx, drmModeConnector *conn, uint32_t usedCrtcs )
+{
+   drmModeEncoder *enc;
+   int crtcIndex= -1;
+   int i, j;
 
-      res= drmModeGetResources( ctx->drmFd );
-      if ( !res )
+   /* Keep the crtc already driving the connector unless another output has it */
+   if ( conn->encoder_id )
+   {
+      enc= drmModeGetEncoder( ctx->drmFd, conn->encoder_id );
+      if ( enc )
       {
-         fprintf(stderr,"Error: PlatformInit: failed to get resources from card (%s)\n", card);
-         goto exit;
+         for( j= 0; j < ctx->res->count_crtcs; ++j )
+         {
+            if ( (ctx->res->crtcs[j] == enc->crtc_id) && !(usedCrtcs & (1<<j)) )
+            {
+               crtcIndex= j;
+               break;
+            }
+         }
+         drmModeFreeEncoder( enc );
       }
-      for( i= 0; i < res->count_connectors; ++i )
+   }
+   for( i= 0; (crtcIndex < 0) && (i < conn->count_encoders); ++i )
+   {
+      enc= drmModeGetEncoder( ctx->drmFd, conn->encoders[i] );
+      if ( enc )
       {
-         conn= drmModeGetConnector( ctx->drmFd, res->connectors[i] );
-         if ( conn )
+         for( j= 0; j < ctx->res->count_crtcs; ++j )
          {
-            if ( conn->count_modes && (conn->connection == DRM_MODE_CONNECTED) )
+            if ( (enc->possible_crtcs & (1<<j)) && !(usedCrtcs & (1<<j)) )
             {
+               crtcIndex= j;
                break;
             }
-            drmModeFreeConnector(conn);
-            conn= 0;
          }
+         drmModeFreeEncoder( enc );
       }
-      if ( !conn )
+   }
+
+   return crtcIndex;
+}
+
+static bool platformPlaneClaimed( PlatformCtx *ctx, uint32_t planeId )
+{
+   PlatformOverlayPlane *iter;
+   int i;
+
+   for( i= 0; i < ctx->outputCount; ++i )
+   {
+      for( iter= ctx->output[i].overlayPlanes.availHead; iter; iter= iter->next )
       {
-         fprintf(stderr,"Error: PlatformInit: unable to get connector for card (%s)\n", card);
-         goto exit;
+         if ( iter->plane->plane_id == planeId ) return true;
       }
-      ctx->res= res;
-      ctx->conn= conn;
-      ctx->gbm= gbm_create_device( ctx->drmFd );
-      if ( !ctx->gbm )
+      for( iter= ctx->output[i].overlayPlanes.usedHead; iter; iter= iter->next )
       {
-         fprintf(stderr,"Error: PlatformInit: unable to create gbm device for card (%s)\n", card);
-         goto exit;
+         if ( iter->plane->plane_id == planeId ) return true;
       }
-      for( i= 0; i < res->count_encoders; ++i )
+   }
+
+   return false;
+}
+
+static void platformAcquirePlanes( PlatformCtx *ctx, PlatformOutput *output, bool primaryOnly )
+{
+   drmModePlaneRes *planeRes= 0;
+   drmModePlane *plane= 0;
+   drmModeObjectProperties *props= 0;
+   drmModePropertyRes *prop= 0;
+   bool haveVideoPlanes= false;
+   int crtc_idx= output->crtcIndex;
+   int j, len;
+   uint32_t n;
+
+   planeRes= drmModeGetPlaneResources( ctx->drmFd );
+   if ( planeRes )
+   {
+      bool isOverlay, isPrimary, isVideo, isGraphics;
+      int zpos;
+
+      if ( gVerbose )
+      fprintf(stderr,"PlatformInitCtx: planeRes %p count_planes %d\n", planeRes, planeRes->count_planes );
+      for( n= 0; n < planeRes->count_planes; ++n )
       {
-         uint32_t crtcId= 0;
-         bool found= false;
-         ctx->enc= drmModeGetEncoder(ctx->drmFd, res->encoders[i]);
-         if ( ctx->enc && (ctx->enc->encoder_id == conn->encoder_id) )
+         if ( platformPlaneClaimed( ctx, planeRes->planes[n] ) )
          {
-            found= true;
-            break;
-         } 
-         for( j= 0; j < res->count_crtcs; j++ )
+            continue;
+         }
+         plane= drmModeGetPlane( ctx->drmFd, planeRes->planes[n] );
+         if ( plane )
          {
-            if ( ctx->enc->possible_crtcs & (1 << j))
+            isOverlay= isPrimary= isVideo= isGraphics= false;
+            zpos= 0;
+
+            props= drmModeObjectGetProperties( ctx->drmFd, planeRes->planes[n], DRM_MODE_OBJECT_PLANE );
+            if ( props )
             {
-               crtcId= res->crtcs[j];
-               for( k= 0; k < res->count_crtcs; k++ )
+               for( j= 0; j < props->count_props; ++j )
                {
-                  if ( res->crtcs[k] == crtcId )
+                  prop= drmModeGetProperty( ctx->drmFd, props->props[j] );
+                  if ( prop )
                   {
-                     drmModeFreeEncoder( ctx->enc );
-                     ctx->enc= drmModeGetEncoder(ctx->drmFd, res->encoders[k]);
-                     ctx->enc->crtc_id= crtcId;
-                     found= true;
-                     break;
+                     if ( plane->possible_crtcs & (1<<crtc_idx) )
+                     {
+                        len= strlen(prop->name);
+                        if ( (len == 4) && !strncmp( prop->name, "type", len) )
+                        {
+                           if ( props->prop_values[j] == DRM_PLANE_TYPE_PRIMARY )
+                           {
+                              isPrimary= true;
+                           }
+                           else if ( props->prop_values[j] == DRM_PLANE_TYPE_OVERLAY )
+                           {
+                              isOverlay= true;
+                           }
+                        }
+                        else if ( (len == 4) && !strncmp( prop->name, "zpos", len) )
+                        {
+                           zpos= props->prop_values[j];
+                           if ( prop->flags & DRM_MODE_PROP_IMMUTABLE )
+                           {
+                              ctx->useZPos= false;
+                           }
+                        }
+                     }
                   }
                }
-               if ( found )
-               {
-                  break;
-               } 
             }
-         } 
-         if ( !found )
-         {
-            drmModeFreeEncoder( ctx->enc );
-            ctx->enc= 0;
-         }
-      }
-      if ( ctx->enc )
-      {
-         ctx->crtc= drmModeGetCrtc(ctx->drmFd, ctx->enc->crtc_id);
-         if ( ctx->crtc && ctx->crtc->mode_valid )
-         {
-            fprintf(stderr,"PlatformInit: current mode %dx%d@%d\n", ctx->crtc->mode.hdisplay, ctx->crtc->mode.vdisplay, ctx->crtc->mode.vrefresh );
-
-            for( j= 0; j < res->count_crtcs; ++j )
+            if ( primaryOnly )
+            {
+               /* Additional outputs only need the plane that shows their window */
+               isOverlay= false;
+            }
+            if ( isPrimary || isOverlay )
             {
-               drmModeCrtc *crtcTest= drmModeGetCrtc( ctx->drmFd, res->crtcs[j] );
-               if ( crtcTest )
+               PlatformOverlayPlane *newPlane;
+               newPlane= (PlatformOverlayPlane*)calloc( 1, sizeof(PlatformOverlayPlane) );
+               if ( newPlane )
                {
-                  if ( crtcTest->crtc_id == ctx->enc->crtc_id )
+                  int pfi;
+
+                  if ( gVerbose )
+                  fprintf(stderr,"plane %d count_formats %d\n", plane->plane_id, plane->count_formats);
+                  newPlane->formats= (PlatformFormatInfo*)calloc( plane->count_formats, sizeof(PlatformFormatInfo));
+                  if ( newPlane->formats )
                   {
-                     crtc_idx= j;
+                     newPlane->formatCount= plane->count_formats;
                   }
-                  drmModeFreeCrtc( crtcTest );
-                  if ( crtc_idx >= 0 )
+                  else
                   {
-                     break;
+                     fprintf(stderr,"No memory for plane formats\n");
                   }
-               }
-            }
-         }
-         else
-         {
-            fprintf(stderr,"Warning: PlatformInit: unable to determine current mode for connector %p on card %s\n", conn, card);
-            for( j= 0; j < res->count_crtcs; ++j )
-            {
-               drmModeCrtc *crtcTest= drmModeGetCrtc( ctx->drmFd, res->crtcs[j] );
-               if ( crtcTest )
-               {
-                  if ( crtcTest->crtc_id == ctx->enc->crtc_id )
+                  for( pfi= 0; pfi < plane->count_formats; ++pfi )
                   {
-                     crtc_idx= j;
+                     if ( gVerbose )
+                     fprintf(stderr,"plane %d format %d: %x (%.*s)\n", plane->plane_id, pfi, plane->formats[pfi], 4, &plane->formats[pfi]);
+                     if ( newPlane->formats )
+                     {
+                        newPlane->formats[pfi].format= plane->formats[pfi];
+                     }
+                     switch( plane->formats[pfi] )
+                     {
+                        case DRM_FORMAT_NV12:
+                           isVideo= true;
+                           if ( !haveVideoPlanes && !isPrimary )
+                           {
+                              newPlane->frameRateMatchingPlane= true;
+                              haveVideoPlanes= true;
+                           }
+                           break;
+                        case DRM_FORMAT_ARGB8888:
+                           isGraphics= true;
+                           break;
+                        default:
+                           break;
+                     }
                   }
-                  drmModeFreeCrtc( crtcTest );
-                  if ( crtc_idx >= 0 )
+                  ++output->overlayPlanes.totalCount;
+                  newPlane->plane= plane;
+                  newPlane->supportsVideo= isVideo;
+                  newPlane->supportsGraphics= isGraphics;
+                  if ( ctx->useZPos )
                   {
-                     break;
+                     newPlane->zOrder= n;
+                     if ( isPrimary )
+                     {
+                        newPlane->zOrder += planeRes->count_planes;
+                     }
+                     else if ( isGraphics && !isVideo )
+                     {
+                        newPlane->zOrder += planeRes->count_planes*2;
+                     }
+                  }
+                  else
+                  {
+                     newPlane->zOrder= n + zpos*16+((isVideo && !isGraphics) ? 0 : 256);
+                  }
+                  newPlane->inUse= false;
+                  newPlane->crtc_id= output->crtc->crtc_id;
+                  if ( gVerbose )
+                  fprintf(stderr,"plane zorder %d primary %d overlay %d video %d gfx %d crtc_id %d\n",
+                         newPlane->zOrder, isPrimary, isOverlay, isVideo, isGraphics, newPlane->crtc_id);
+                  if ( ctx->haveAtomic )
+                  {
+                     if ( platformAcquirePlaneProperties( ctx, newPlane ) )
+                     {
+                        if ( isPrimary )
+                        {
+                           output->overlayPlanes.primary= newPlane;
+                        }
+                     }
                   }
+                  platformOverlayAppendUnused( &output->overlayPlanes, newPlane );
+
+                  plane= 0;
+               }
+               else
+               {
+                  fprintf(stderr,"No memory for WstOverlayPlane\n");
                }
             }
+            if ( prop )
+            {
+               drmModeFreeProperty( prop );
+            }
+            if ( props )
+            {
+               drmModeFreeObjectProperties( props );
+            }
+            if ( plane )
+            {
+               drmModeFreePlane( plane );
+               plane= 0;
+            }
+         }
+         else
+         {
+            fprintf(stderr,"PlatformInitCtx: drmModeGetPlane failed: errno %d\n", errno);
          }
       }
-      else
+      drmModeFreePlaneResources( planeRes );
+   }
+   else
+   {
+      fprintf(stderr,"PlatformInitCtx: drmModePlaneGetResoures failed: errno %d\n", errno );
+   }
+
+   fprintf(stderr, "PlatformInitCtx; %s: found %d overlay planes\n", output->name, output->overlayPlanes.totalCount );
+
+   if (
+        haveVideoPlanes &&
+        output->overlayPlanes.primary &&
+        (output->overlayPlanes.availHead != output->overlayPlanes.primary)
+      )
+   {
+      output->graphicsPreferPrimary= true;
+   }
+}
+
+static bool platformAddOutput( PlatformCtx *ctx, drmModeConnector *conn )
+{
+   bool result= false;
+   PlatformOutput *output= 0;
+   uint32_t usedCrtcs= 0;
+   int i;
+
+   for( i= 0; i < ctx->outputCount; ++i )
+   {
+      if ( ctx->output[i].conn->connector_id == conn->connector_id )
       {
-         fprintf(stderr,"Error: PlatformInit: did not find encoder\n");
+         /* Named twice */
+         result= true;
+         goto exit;
       }
+      usedCrtcs |= (1<<ctx->output[i].crtcIndex);
+   }
+   if ( ctx->outputCount >= PLATFORM_MAX_OUTPUTS )
+   {
+      fprintf(stderr,"Error: PlatformInit: at most %d outputs are supported\n", PLATFORM_MAX_OUTPUTS);
+      goto exit;
    }
 
-   if ( ctx->haveAtomic )
+   output= &ctx->output[ctx->outputCount];
+   output->index= ctx->outputCount;
+   output->conn= conn;
+   platformConnectorName( conn, output->name, sizeof(output->name) );
+   if ( !conn->count_modes || (conn->connection != DRM_MODE_CONNECTED) )
    {
-      platformAcquireConnectorProperties( ctx );
+      fprintf(stderr,"Error: PlatformInit: connector %s is not connected\n", output->name);
+      goto exit;
    }
-   if ( ctx->haveAtomic )
+   output->crtcIndex= platformFindCrtc( ctx, conn, usedCrtcs );
+   if ( output->crtcIndex < 0 )
    {
-      platformAcquireCrtcProperties( ctx );
+      fprintf(stderr,"Error: PlatformInit: no free crtc for connector %s\n", output->name);
+      goto exit;
    }
-   if ( !ctx->haveAtomic )
+   output->crtc= drmModeGetCrtc( ctx->drmFd, ctx->res->crtcs[output->crtcIndex] );
+   if ( !output->crtc )
    {
-      platformReleaseConnectorProperties( ctx );
-      platformReleaseCrtcProperties( ctx );
+      fprintf(stderr,"Error: PlatformInit: unable to get crtc %u for connector %s\n", ctx->res->crtcs[output->crtcIndex], output->name);
+      goto exit;
    }
+   output->onScreen.fenceFd= -1;
+   output->flipping.fenceFd= -1;
+   ++ctx->outputCount;
 
-   if ( crtc_idx >= 0 )
+   if ( output->crtc->mode_valid )
+   {
+      fprintf(stderr,"PlatformInit: %s: crtc %u current mode %dx%d@%d\n", output->name, output->crtc->crtc_id,
+              output->crtc->mode.hdisplay, output->crtc->mode.vdisplay, output->crtc->mode.vrefresh );
+   }
+   else
    {
-      bool haveVideoPlanes= false;
+      fprintf(stderr,"PlatformInit: %s: crtc %u is not active\n", output->name, output->crtc->crtc_id);
+   }
 
-      planeRes= drmModeGetPlaneResources( ctx->drmFd );
-      if ( planeRes )
+   /* The output owns the connector now */
+   conn= 0;
+   result= true;
+
+exit:
+   if ( conn )
+   {
+      drmModeFreeConnector( conn );
+      if ( output )
       {
-         bool isOverlay, isPrimary, isVideo, isGraphics;
-         int zpos;
+         output->conn= 0;
+      }
+   }
 
-         if ( gVerbose )
-         fprintf(stderr,"PlatformInitCtx: planeRes %p count_planes %d\n", planeRes, planeRes->count_planes );
-         for( n= 0; n < planeRes->count_planes; ++n )
-         {
-            plane= drmModeGetPlane( ctx->drmFd, planeRes->planes[n] );
-            if ( plane )
-            {
-               isOverlay= isPrimary= isVideo= isGraphics= false;
-               zpos= 0;
+   return result;
+}
 
-               props= drmModeObjectGetProperties( ctx->drmFd, planeRes->planes[n], DRM_MODE_OBJECT_PLANE );
-               if ( props )
-               {
-                  for( j= 0; j < props->count_props; ++j )
-                  {
-                     prop= drmModeGetProperty( ctx->drmFd, props->props[j] );
-                     if ( prop )
-                     {
-                        if ( plane->possible_crtcs & (1<<crtc_idx) )
-                        {
-                           len= strlen(prop->name);
-                           if ( (len == 4) && !strncmp( prop->name, "type", len) )
-                           {
-                              if ( props->prop_values[j] == DRM_PLANE_TYPE_PRIMARY )
-                              {
-                                 isPrimary= true;
-                              }
-                              else if ( props->prop_values[j] == DRM_PLANE_TYPE_OVERLAY )
-                              {
-                                 isOverlay= true;
-                              }
-                           }
-                           else if ( (len == 4) && !strncmp( prop->name, "zpos", len) )
-                           {
-                              zpos= props->prop_values[j];
-                              if ( prop->flags & DRM_MODE_PROP_IMMUTABLE )
-                              {
-                                 ctx->useZPos= false;
-                              }
-                           }
-                        }
-                     }
-                  }
-               }
-               if ( isPrimary || isOverlay )
-               {
-                  PlatformOverlayPlane *newPlane;
-                  newPlane= (PlatformOverlayPlane*)calloc( 1, sizeof(PlatformOverlayPlane) );
-                  if ( newPlane )
-                  {
-                     int rc;
-                     int pfi;
+void PlatformListOutputs( const char *device )
+{
+   drmDevicePtr devices[DRM_MAX_MINOR];
+   char card[64];
+   int deviceCount, d;
 
-                     if ( gVerbose )
-                     fprintf(stderr,"plane %d count_formats %d\n", plane->plane_id, plane->count_formats);
-                     newPlane->formats= (PlatformFormatInfo*)calloc( plane->count_formats, sizeof(PlatformFormatInfo));
-                     if ( newPlane->formats )
-                     {
-                        newPlane->formatCount= plane->count_formats;
-                     }
-                     else
-                     {
-                        fprintf(stderr,"No memory for plane formats\n");
-                     }
-                     for( pfi= 0; pfi < plane->count_formats; ++pfi )
-                     {
-                        if ( gVerbose )
-                        fprintf(stderr,"plane %d format %d: %x (%.*s)\n", plane->plane_id, pfi, plane->formats[pfi], 4, &plane->formats[pfi]);
-                        if ( newPlane->formats )
-                        {
-                           newPlane->formats[pfi].format= plane->formats[pfi];
-                        }
-                        switch( plane->formats[pfi] )
-                        {
-                           case DRM_FORMAT_NV12:
-                              isVideo= true;
-                              if ( !haveVideoPlanes && !isPrimary )
-                              {
-                                 newPlane->frameRateMatchingPlane= true;
-                                 haveVideoPlanes= true;
-                              }
-                              break;
-                           case DRM_FORMAT_ARGB8888:
-                              isGraphics= true;
-                              break;
-                           default:
-                              break;
-                        }
-                     }
-                     ++ctx->overlayPlanes.totalCount;
-                     newPlane->plane= plane;
-                     newPlane->supportsVideo= isVideo;
-                     newPlane->supportsGraphics= isGraphics;
-                     if ( ctx->useZPos )
-                     {
-                        newPlane->zOrder= n;
-                        if ( isPrimary )
-                        {
-                           newPlane->zOrder += planeRes->count_planes;
-                        }
-                        else if ( isGraphics && !isVideo )
-                        {
-                           newPlane->zOrder += planeRes->count_planes*2;
-                        }
-                     }
-                     else
-                     {
-                        newPlane->zOrder= n + zpos*16+((isVideo && !isGraphics) ? 0 : 256);
-                     }
-                     newPlane->inUse= false;
-                     newPlane->crtc_id= ctx->enc->crtc_id;
-                     if ( gVerbose )
-                     fprintf(stderr,"plane zorder %d primary %d overlay %d video %d gfx %d crtc_id %d\n",
-                            newPlane->zOrder, isPrimary, isOverlay, isVideo, isGraphics, newPlane->crtc_id);
-                     if ( ctx->haveAtomic )
-                     {
-                        if ( platformAcquirePlaneProperties( ctx, newPlane ) )
-                        {
-                           if ( isPrimary )
-                           {
-                              ctx->overlayPlanes.primary= newPlane;
-                           }
-                        }
-                     }
-                     platformOverlayAppendUnused( &ctx->overlayPlanes, newPlane );
+   if ( device )
+   {
+      platformCardName( device, card, sizeof(card) );
+      deviceCount= 1;
+   }
+   else
+   {
+      deviceCount= drmGetDevices2( 0, devices, DRM_MAX_MINOR );
+      if ( deviceCount <= 0 )
+      {
+         printf("no DRM devices found\n");
+         return;
+      }
+   }
 
-                     plane= 0;
-                  }
-                  else
-                  {
-                     fprintf(stderr,"No memory for WstOverlayPlane\n");
-                  }
+   for( d= 0; d < deviceCount; ++d )
+   {
+      drmVersionPtr drmver;
+      drmModeRes *res;
+      drmModePlaneRes *planeRes;
+      int fd, i, j;
+
+      if ( !device )
+      {
+         if ( !(devices[d]->available_nodes & (1<<DRM_NODE_PRIMARY)) )
+         {
+            continue;
+         }
+         snprintf( card, sizeof(card), "%s", devices[d]->nodes[DRM_NODE_PRIMARY] );
+      }
+      fd= open( card, O_RDWR );
+      if ( fd < 0 )
+      {
+         printf("%s: unable to open: errno %d\n", card, errno);
+         continue;
+      }
+      drmSetClientCap( fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1 );
+      drmver= drmGetVersion( fd );
+      printf("%s: driver %s\n", card, drmver ? drmver->name : "unknown");
+      if ( drmver )
+      {
+         drmFreeVersion( drmver );
+      }
+      res= drmModeGetResources( fd );
+      if ( !res )
+      {
+         printf("  no mode setting resources\n");
+         close( fd );
+         continue;
+      }
+      for( i= 0; i < res->count_connectors; ++i )
+      {
+         drmModeConnector *conn= drmModeGetConnector( fd, res->connectors[i] );
+         if ( conn )
+         {
+            char name[32];
+            drmModeModeInfo *preferred= 0;
+            uint32_t possibleCrtcs= 0;
+
+            platformConnectorName( conn, name, sizeof(name) );
+            for( j= 0; j < conn->count_modes; ++j )
+            {
+               if ( !preferred || (conn->modes[j].type & DRM_MODE_TYPE_PREFERRED) )
+               {
+                  preferred= &conn->modes[j];
                }
-               if ( prop )
+            }
+            for( j= 0; j < conn->count_encoders; ++j )
+            {
+               drmModeEncoder *enc= drmModeGetEncoder( fd, conn->encoders[j] );
+               if ( enc )
                {
-                  drmModeFreeProperty( prop );
+                  possibleCrtcs |= enc->possible_crtcs;
+                  drmModeFreeEncoder( enc );
                }
-               if ( props )
+            }
+            printf("  connector %d: %s id %u %s modes %d", i, name, conn->connector_id,
+                   (conn->connection == DRM_MODE_CONNECTED) ? "connected" : "disconnected", conn->count_modes );
+            if ( preferred )
+            {
+               printf(" preferred %dx%d@%.3f", preferred->hdisplay, preferred->vdisplay, (double)platformModeRefresh( preferred )/1000.0 );
+            }
+            printf(" crtcs");
+            for( j= 0; j < res->count_crtcs; ++j )
+            {
+               if ( possibleCrtcs & (1<<j) )
                {
-                  drmModeFreeObjectProperties( props );
+                  printf(" %d", j);
                }
+            }
+            printf("\n");
+            drmModeFreeConnector( conn );
+         }
+      }
+      planeRes= drmModeGetPlaneResources( fd );
+      for( i= 0; i < res->count_crtcs; ++i )
+      {
+         drmModeCrtc *crtc= drmModeGetCrtc( fd, res->crtcs[i] );
+         int planeCount= 0;
+         if ( planeRes )
+         {
+            for( j= 0; j < (int)planeRes->count_planes; ++j )
+            {
+               drmModePlane *plane= drmModeGetPlane( fd, planeRes->planes[j] );
                if ( plane )
                {
+                  if ( plane->possible_crtcs & (1<<i) )
+                  {
+                     ++planeCount;
+                  }
                   drmModeFreePlane( plane );
-                  plane= 0;
                }
             }
+         }
+         if ( crtc )
+         {
+            printf("  crtc %d: id %u planes %d", i, crtc->crtc_id, planeCount);
+            if ( crtc->mode_valid )
+            {
+               printf(" mode %dx%d@%.3f\n", crtc->mode.hdisplay, crtc->mode.vdisplay, (double)platformModeRefresh( &crtc->mode )/1000.0 );
+            }
             else
             {
-               fprintf(stderr,"PlatformInitCtx: drmModeGetPlane failed: errno %d\n", errno);
+               printf(" inactive\n");
             }
+            drmModeFreeCrtc( crtc );
          }
+      }
+      if ( planeRes )
+      {
          drmModeFreePlaneResources( planeRes );
       }
-      else
+      drmModeFreeResources( res );
+      close( fd );
+   }
+
+   if ( !device )
+   {
+      drmFreeDevices( devices, deviceCount );
+   }
+}
+
+PlatformCtx* PlatfromInit( const char *device, const char *outputs, bool mirror )
+{
+   PlatformCtx *ctx= 0;
+   drmModeRes *res= 0;
+   int rc;
+   int i, len;
+   const char *card;
+   drmModeConnector *conn= 0;
+   struct drm_set_client_cap clientCap;
+   bool error= true;
+
+   if ( getenv("PLATFORM_FPS" ) )
+   {
+      emitFPS= true;
+   }
+
+   ctx= (PlatformCtx*)calloc( 1, sizeof(PlatformCtx) );
+   if ( ctx )
+   {
+      drmVersionPtr drmver= 0;
+      pthread_mutex_init( &ctx->mutex, 0 );
+      ctx->flipQueueDepth= DEFAULT_FLIP_QUEUE_DEPTH;
+      ctx->useModifiers= true;
+      ctx->mirror= mirror;
+      platformCardName( device, ctx->card, sizeof(ctx->card) );
+      card= ctx->card;
+      ctx->drmFd= -1;
+      ctx->drmFd= open(card, O_RDWR);
+      if ( ctx->drmFd < 0 )
+      {
+         fprintf(stderr,"Error: PlatformInit: failed to open card (%s)\n", card);
+         goto exit;
+      }
+
+      drmver= drmGetVersion( ctx->drmFd );
+      if ( drmver )
+      {
+         int len;
+
+         if ( gVerbose )
+         fprintf(stderr,"PlatformInit: drmGetVersion: %d.%d.%d name (%.*s) date (%.*s) desc (%.*s)\n",
+               drmver->version_major, drmver->version_minor, drmver->version_patchlevel,
+               drmver->name_len, drmver->name,
+               drmver->date_len, drmver->date,
+               drmver->desc_len, drmver->desc );
+
+         len= strlen( drmver->name );
+         if ( (len == 3) && !strncmp( drmver->name, "vc4", len ) )
+         {
+            ctx->useZPos= true;
+            fprintf(stderr,"using zpos\n");
+         }
+
+         drmFreeVersion( drmver );
+      }
+
+      clientCap.capability= DRM_CLIENT_CAP_UNIVERSAL_PLANES;
+      clientCap.value= 1;
+      rc= ioctl( ctx->drmFd, DRM_IOCTL_SET_CLIENT_CAP, &clientCap);
+      if ( gVerbose )
+      fprintf(stderr,"PlatformInit: DRM_IOCTL_SET_CLIENT_CAP: DRM_CLIENT_CAP_UNIVERSAL_PLANES rc %d\n", rc);
+
+      clientCap.capability= DRM_CLIENT_CAP_ATOMIC;
+      clientCap.value= 1;
+      rc= ioctl( ctx->drmFd, DRM_IOCTL_SET_CLIENT_CAP, &clientCap);
+      if ( gVerbose )
+      fprintf(stderr,"PlatformInit: DRM_IOCTL_SET_CLIENT_CAP: DRM_CLIENT_CAP_ATOMIC rc %d\n", rc);
+      if ( rc == 0 )
+      {
+         ctx->haveAtomic= true;
+         fprintf(stderr,"PlatformInit: have drm atomic mode setting\n");
+      }
+
+      {
+         uint64_t value= 0;
+         rc= drmGetCap( ctx->drmFd, DRM_CAP_ADDFB2_MODIFIERS, &value );
+         if ( (rc == 0) && value )
+         {
+            ctx->haveModifiers= true;
+            fprintf(stderr,"PlatformInit: have framebuffer modifiers\n");
+         }
+      }
+
+      res= drmModeGetResources( ctx->drmFd );
+      if ( !res )
       {
-         fprintf(stderr,"PlatformInitCtx: drmModePlaneGetResoures failed: errno %d\n", errno );
+         fprintf(stderr,"Error: PlatformInit: failed to get resources from card (%s)\n", card);
+         goto exit;
       }
+      ctx->res= res;
+
+      if ( !outputs )
+      {
+         /* By default the first connected connector with modes */
+         for( i= 0; i < res->count_connectors; ++i )
+         {
+            conn= drmModeGetConnector( ctx->drmFd, res->connectors[i] );
+            if ( conn )
+            {
+               if ( conn->count_modes && (conn->connection == DRM_MODE_CONNECTED) )
+               {
+                  break;
+               }
+               drmModeFreeConnector(conn);
+               conn= 0;
+            }
+         }
+         if ( !conn )
+         {
+            fprintf(stderr,"Error: PlatformInit: unable to get connector for card (%s)\n", card);
+            goto exit;
+         }
+         if ( !platformAddOutput( ctx, conn ) )
+         {
+            goto exit;
+         }
+      }
+      else if ( !strcmp( outputs, "all" ) )
+      {
+         for( i= 0; i < res->count_connectors; ++i )
+         {
+            conn= drmModeGetConnector( ctx->drmFd, res->connectors[i] );
+            if ( conn )
+            {
+               if ( conn->count_modes && (conn->connection == DRM_MODE_CONNECTED) )
+               {
+                  if ( !platformAddOutput( ctx, conn ) )
+                  {
+                     goto exit;
+                  }
+               }
+               else
+               {
+                  drmModeFreeConnector(conn);
+               }
+            }
+         }
+      }
+      else
+      {
+         const char *spec= outputs;
+         while ( *spec )
+         {
+            len= strcspn( spec, "," );
+            conn= platformFindConnector( ctx, spec, len );
+            if ( !conn )
+            {
+               fprintf(stderr,"Error: PlatformInit: no connector (%.*s) on card (%s)\n", len, spec, card);
+               goto exit;
+            }
+            if ( !platformAddOutput( ctx, conn ) )
+            {
+               goto exit;
+            }
+            spec += len;
+            if ( *spec == ',' )
+            {
+               ++spec;
+            }
+         }
+      }
+      if ( !ctx->outputCount )
+      {
+         fprintf(stderr,"Error: PlatformInit: no connected outputs on card (%s)\n", card);
+         goto exit;
+      }
+      if ( (ctx->outputCount > 1) && !ctx->haveAtomic )
+      {
+         fprintf(stderr,"Error: PlatformInit: driving %d outputs needs atomic mode setting\n", ctx->outputCount);
+         goto exit;
+      }
+
+      ctx->gbm= gbm_create_device( ctx->drmFd );
+      if ( !ctx->gbm )
+      {
+         fprintf(stderr,"Error: PlatformInit: unable to create gbm device for card (%s)\n", card);
+         goto exit;
+      }
+   }
+
+   for( i= 0; i < ctx->outputCount; ++i )
+   {
+      if ( ctx->haveAtomic )
+      {
+         platformAcquireConnectorProperties( ctx, &ctx->output[i] );
+      }
+      if ( ctx->haveAtomic )
+      {
+         platformAcquireCrtcProperties( ctx, &ctx->output[i] );
+      }
+   }
+   for( i= 0; i < ctx->outputCount; ++i )
+   {
+      if ( !ctx->haveAtomic )
+      {
+         platformReleaseConnectorProperties( ctx, &ctx->output[i] );
+         platformReleaseCrtcProperties( ctx, &ctx->output[i] );
+      }
+   }
+
+   /* Additional outputs claim their primary planes first, output 0 gets every remaining plane */
+   for( i= ctx->outputCount-1; i >= 0; --i )
+   {
+      platformAcquirePlanes( ctx, &ctx->output[i], (i > 0) );
+   }
+   if ( ctx->outputCount > 1 )
+   {
+      fprintf(stderr,"PlatformInit: %d outputs, %s\n", ctx->outputCount, ctx->mirror ? "mirrored" : "independent");
+   }
+
+   gRealEGLSwapBuffers= (PREALEGLSWAPBUFFERS)dlsym( RTLD_NEXT, "eglSwapBuffers" );
+   if ( !gRealEGLSwapBuffers )
+   {
+      fprintf(stderr,"Error: PlatformInit: unable to locate underlying eglSwapBuffers\n");
+      goto exit;
+   }
+
+   gRealEGLCreateWindowSurface= (PREALEGLCREATEWINDOWSURFACE)dlsym( RTLD_NEXT, "eglCreateWindowSurface" );
+   if ( !gRealEGLCreateWindowSurface )
+   {
+      fprintf(stderr,"Error: PlatformInit: unable to locate underlying eglCreateWindowSurface\n");
+      goto exit;
+   }
+
+   gCtx= ctx;
+
+   error= false;
+
+exit:
+   if ( error )
+   {
+      PlatformTerm(ctx);
+      ctx= 0;
+   }
+
+   return ctx;
+}
+
+void PlatformTerm( PlatformCtx *ctx )
+{
+   if ( ctx )
+   {
+      int i;
+
+      if ( ctx->gbm )
+      {
+         gbm_device_destroy(ctx->gbm);
+         ctx->gbm= 0;
+      }
+      if ( ctx->assignCount )
+      {
+         fprintf(stderr,"platform: %d plane assignments, %d TEST_ONLY commits %d rejected, %d frames with video on planes, %.2f layers per frame\n",
+                 ctx->assignCount, ctx->testCount, ctx->testFailCount, ctx->planeFrameCount,
+                 ctx->planeFrameCount ? (double)ctx->layerFrameCount/ctx->planeFrameCount : 0.0 );
+      }
+      for( i= 0; i < PLATFORM_MAX_VIDEO_LAYERS; ++i )
+      {
+         platformVideoLayerFlush( ctx, &ctx->videoLayer[i] );
+      }
+      if ( ctx->writeback.conn )
+      {
+         fprintf(stderr,"platform: writeback: %d captures, %d skipped while busy, %d not collected\n",
+                 ctx->writeback.captureCount, ctx->writeback.skipCount, ctx->writeback.overrunCount );
+         platformWritebackTerm( ctx );
+      }
+      for( i= 0; i < ctx->outputCount; ++i )
+      {
+         PlatformOutput *output= &ctx->output[i];
+
+         platformReleaseConnectorProperties( ctx, output );
+         platformReleaseCrtcProperties( ctx, output );
+         if ( output->crtc )
+         {
+            drmModeFreeCrtc(output->crtc);
+            output->crtc= 0;
+         }
+      }
+      for( i= 0; i < PLATFORM_MAX_OUTPUTS; ++i )
+      {
+         if ( ctx->output[i].conn )
+         {
+            drmModeFreeConnector(ctx->output[i].conn);
+            ctx->output[i].conn= 0;
+         }
+      }
+      if ( ctx->res )
+      {
+         drmModeFreeResources(ctx->res);
+         ctx->res= 0;
+      }
+      if ( ctx->drmFd >= 0 )
+      {
+         close( ctx->drmFd );
+         ctx->drmFd= -1;
+      }
+      pthread_mutex_destroy( &ctx->mutex );
+      free( ctx );
+      gCtx= 0;
+   }
+}
+
+NativeDisplayType PlatformGetEGLDisplayType( PlatformCtx *ctx )
+{
+   NativeDisplayType displayType;
+
+   displayType= (NativeDisplayType)ctx->gbm;
+
+   return displayType;
+}
+
+EGLDisplay PlatformGetEGLDisplay( PlatformCtx *ctx, NativeDisplayType type )
+{
+   EGLDisplay dpy= EGL_NO_DISPLAY;
+   PFNEGLGETPLATFORMDISPLAYEXTPROC realEGLGetPlatformDisplay= 0;
+   realEGLGetPlatformDisplay= (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+   if ( realEGLGetPlatformDisplay )
+   {
+      dpy= realEGLGetPlatformDisplay( EGL_PLATFORM_GBM_KHR, ctx->gbm, NULL );
+   }
+   else
+   {
+      dpy= eglGetDisplay( (NativeDisplayType)ctx->gbm );
+   }
+
+   return dpy;
+}
+
+EGLDisplay PlatformGetEGLDisplayWayland( PlatformCtx *ctx, struct wl_display *display )
+{
+   EGLDisplay dpy= EGL_NO_DISPLAY;
+
+   dpy= eglGetDisplay( (NativeDisplayType)display );
+
+   return dpy;
+}
+
+static void platformSelectMode( PlatformCtx *ctx, PlatformOutput *output, int width, int height )
+{
+   bool found= false;
+   drmModeModeInfo *matched= 0;
+   int i;
+   for( i= 0; i < output->conn->count_modes; ++i )
+   {
+      if ( (output->conn->modes[i].hdisplay == width) &&
+           (output->conn->modes[i].vdisplay == height) &&
+           (output->conn->modes[i].type & DRM_MODE_TYPE_DRIVER) )
+      {
+         if ( !found )
+         {
+            found= true;
+            output->modeInfo= &output->conn->modes[i];
+         }
+         /* Any integer multiple of the content rate shows every frame for the same number of refreshes */
+         if ( ctx->contentFrameRate && platformModeMatchesRate( &output->conn->modes[i], ctx->contentFrameRate ) &&
+              (!matched || (platformModeRefresh( &output->conn->modes[i] ) > platformModeRefresh( matched ))) )
+         {
+            matched= &output->conn->modes[i];
+         }
+      }
+   }
+   if ( !found )
+   {
+      output->modeInfo= &output->conn->modes[0];
+   }
+   if ( matched )
+   {
+      output->modeInfo= matched;
+   }
+   else if ( ctx->contentFrameRate )
+   {
+      fprintf(stderr,"platform: %s: no %dx%d mode is a multiple of %d fps\n", output->name, width, height, ctx->contentFrameRate);
+   }
+   fprintf(stderr,"platform: %s: using mode %dx%d@%.3f\n", output->name, output->modeInfo->hdisplay, output->modeInfo->vdisplay,
+           (double)platformModeRefresh( output->modeInfo )/1000.0 );
+}
+
+static int platformPlaneModifiers( PlatformCtx *ctx, PlatformOverlayPlane *plane, uint32_t format, uint64_t *modifiers, int max )
+{
+   drmModePropertyBlobPtr blob= 0;
+   struct drm_format_modifier_blob *header;
+   struct drm_format_modifier *mods;
+   uint32_t *formats;
+   int count= -1;
+   int i, j;
+
+   /* The IN_FORMATS blob lists, per modifier, a bitmask of the formats it applies to */
+   if ( plane->planeProps )
+   {
+      for( i= 0; i < plane->planeProps->count_props; ++i )
+      {
+         if ( plane->planePropRes[i] && !strcmp( plane->planePropRes[i]->name, "IN_FORMATS" ) )
+         {
+            blob= drmModeGetPropertyBlob( ctx->drmFd, plane->planeProps->prop_values[i] );
+            break;
+         }
+      }
+   }
+   if ( !blob )
+   {
+      return -1;
+   }
+   header= (struct drm_format_modifier_blob*)blob->data;
+   formats= (uint32_t*)((char*)header+header->formats_offset);
+   mods= (struct drm_format_modifier*)((char*)header+header->modifiers_offset);
+   for( i= 0; i < (int)header->count_formats; ++i )
+   {
+      if ( formats[i] == format )
+      {
+         break;
+      }
+   }
+   if ( i < (int)header->count_formats )
+   {
+      count= 0;
+      for( j= 0; j < (int)header->count_modifiers; ++j )
+      {
+         if ( (i >= (int)mods[j].offset) && (i < (int)mods[j].offset+64) &&
+              (mods[j].formats & (1ULL << (i-mods[j].offset))) &&
+              (count < max) )
+         {
+            modifiers[count++]= mods[j].modifier;
+         }
+      }
+   }
+   else
+   {
+      count= 0;
+   }
+   drmModeFreePropertyBlob( blob );
+
+   return count;
+}
+
+static bool platformPlaneSupports( PlatformCtx *ctx, PlatformOverlayPlane *plane, uint32_t format, uint64_t modifier )
+{
+   uint64_t modifiers[MAX_MODIFIERS];
+   int count, i;
+
+   count= platformPlaneModifiers( ctx, plane, format, modifiers, MAX_MODIFIERS );
+   if ( count < 0 )
+   {
+      /* Without IN_FORMATS only linear buffers are known to work */
+      return (modifier == DRM_FORMAT_MOD_LINEAR);
+   }
+   for( i= 0; i < count; ++i )
+   {
+      if ( modifiers[i] == modifier )
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+static int platformWindowModifiers( PlatformCtx *ctx, PlatformOutput *output, uint64_t *modifiers, int max )
+{
+   uint64_t mirrorModifiers[MAX_MODIFIERS];
+   int count, mirrorCount, i, j, k;
+
+   if ( !ctx->haveModifiers || !ctx->useModifiers || !output->nativeWindowPlane )
+   {
+      return 0;
+   }
+   count= platformPlaneModifiers( ctx, output->nativeWindowPlane, DRM_FORMAT_ARGB8888, modifiers, max );
+   if ( count <= 0 )
+   {
+      return 0;
+   }
+
+   /* Mirrors scan out the same buffers, so only layouts every plane accepts will do */
+   if ( ctx->mirror && (output->index == 0) )
+   {
+      for( i= 1; i < ctx->outputCount; ++i )
+      {
+         if ( !ctx->output[i].nativeWindowPlane )
+         {
+            continue;
+         }
+         mirrorCount= platformPlaneModifiers( ctx, ctx->output[i].nativeWindowPlane, DRM_FORMAT_ARGB8888, mirrorModifiers, MAX_MODIFIERS );
+         if ( mirrorCount < 0 )
+         {
+            mirrorModifiers[0]= DRM_FORMAT_MOD_LINEAR;
+            mirrorCount= 1;
+         }
+         for( j= 0; j < count; )
+         {
+            for( k= 0; k < mirrorCount; ++k )
+            {
+               if ( mirrorModifiers[k] == modifiers[j] ) break;
+            }
+            if ( k == mirrorCount )
+            {
+               modifiers[j]= modifiers[--count];
+            }
+            else
+            {
+               ++j;
+            }
+         }
+      }
+   }
+
+   return count;
+}
+
+static void *platformCreateOutputWindow( PlatformCtx *ctx, PlatformOutput *output, int width, int height )
+{
+   void *nativeWindow= 0;
+   uint64_t modifiers[MAX_MODIFIERS];
+   int modifierCount;
+   int i;
+
+   platformSelectMode( ctx, output, width, height );
+
+   output->windowWidth= width;
+   output->windowHeight= height;
+
+   if ( !output->graphicsPreferPrimary && (output->index == 0) )
+   {
+      output->nativeWindowPlane= platformOverlayAlloc( &output->overlayPlanes, true, false );
+      fprintf(stderr,"plane %p : zorder: %d\n", output->nativeWindowPlane, (output->nativeWindowPlane ? output->nativeWindowPlane->zOrder: -1) );
+   }
+   else if ( ctx->haveAtomic )
+   {
+      output->nativeWindowPlane= platformOverlayAllocPrimary( &output->overlayPlanes );
+      fprintf(stderr,"plane %p : primary: zorder: %d\n", output->nativeWindowPlane, (output->nativeWindowPlane ? output->nativeWindowPlane->zOrder: -1) );
+   }
+
+   if ( ctx->mirror && (output->index == 0) )
+   {
+      /* Mirrors show output 0's buffers scaled to their own mode */
+      for( i= 1; i < ctx->outputCount; ++i )
+      {
+         PlatformOutput *mirror= &ctx->output[i];
+         platformSelectMode( ctx, mirror, width, height );
+         mirror->nativeWindowPlane= platformOverlayAllocPrimary( &mirror->overlayPlanes );
+         if ( !mirror->nativeWindowPlane )
+         {
+            fprintf(stderr,"Error: platform: %s: no primary plane to mirror %s\n", mirror->name, output->name);
+         }
+      }
+   }
+
+   /* The planes are known, so the window can use a tiled or compressed layout they scan out */
+   modifierCount= platformWindowModifiers( ctx, output, modifiers, MAX_MODIFIERS );
+   if ( modifierCount > 0 )
+   {
+      nativeWindow= gbm_surface_create_with_modifiers(ctx->gbm,
+                                                      width, height,
+                                                      GBM_FORMAT_ARGB8888,
+                                                      modifiers, modifierCount );
+      if ( !nativeWindow )
+      {
+         fprintf(stderr,"platform: %s: gbm_surface_create_with_modifiers failed with %d modifiers, using implicit layout\n", output->name, modifierCount);
+      }
+   }
+   if ( !nativeWindow )
+   {
+      /* Without modifiers the layout must be linear, as the driver's implicit layout may be tiled */
+      nativeWindow= gbm_surface_create(ctx->gbm,
+                                       width, height,
+                                       GBM_FORMAT_ARGB8888,
+                                       GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING |
+                                       (ctx->useModifiers ? 0 : GBM_BO_USE_LINEAR) );
+   }
+
+   output->nativeWindow= nativeWindow;
+
+   return nativeWindow;
+}
+
+void *PlatformCreateNativeWindow( PlatformCtx *ctx, int width, int height )
+{
+   void *nativeWindow= 0;
+
+   if ( ctx )
+   {
+      nativeWindow= platformCreateOutputWindow( ctx, &ctx->output[0], width, height );
+   }
+   
+   return nativeWindow;   
+}
+
+int PlatformGetWindowCount( PlatformCtx *ctx )
+{
+   int count= 0;
+
+   if ( ctx )
+   {
+      count= (ctx->mirror ? 1 : ctx->outputCount);
+   }
+
+   return count;
+}
+
+void *PlatformCreateOutputWindow( PlatformCtx *ctx, int index, int width, int height )
+{
+   void *nativeWindow= 0;
+
+   if ( ctx && (index >= 0) && (index < PlatformGetWindowCount( ctx )) )
+   {
+      nativeWindow= platformCreateOutputWindow( ctx, &ctx->output[index], width, height );
+   }
+
+   return nativeWindow;
+}
+
+void PlatformDestroyNativeWindow( PlatformCtx *ctx, void *nativeWindow )
+{
+   if ( ctx )
+   {
+      struct gbm_surface *gs = (struct gbm_surface*)nativeWindow;
+      PlatformOutput *output= 0;
+      int i;
+
+      for( i= 0; i < ctx->outputCount; ++i )
+      {
+         if ( ctx->output[i].nativeWindow == nativeWindow )
+         {
+            output= &ctx->output[i];
+            break;
+         }
+      }
+      if ( !output )
+      {
+         return;
+      }
+
+      /* Let the last flip land before its buffers are released */
+      while ( output->flipPending )
+      {
+         if ( !platformDispatchFlipEvents( ctx, FLIP_TIMEOUT_MS ) )
+         {
+            break;
+         }
+      }
+      while ( output->queuedCount )
+      {
+         platformReleaseScanout( ctx, output, &output->queued[--output->queuedCount] );
+      }
+      output->flipPending= false;
+      platformReleaseScanout( ctx, output, &output->flipping );
+      if ( output->onScreen.bo )
+      {
+         platformReleaseScanout( ctx, output, &output->onScreen );
+         output->modeSet= false;
+      }
+      fprintf(stderr,"platform: %s: %d commits %d flips, queue depth %d, back-pressure waits %d mean %.2f ms max %.2f ms\n",
+              output->name, output->commitCount, output->flipCount, ctx->flipQueueDepth, output->backPressureCount,
+              output->backPressureCount ? (double)output->backPressureTime/(1000.0*output->backPressureCount) : 0.0,
+              (double)output->backPressureMax/1000.0 );
+      gbm_surface_destroy( gs );
+      output->nativeWindow= 0;
+      if ( output->nativeWindowPlane )
+      {
+         platformOverlayFree( &output->overlayPlanes, output->nativeWindowPlane );
+         output->nativeWindowPlane= 0;
+      }
+      if ( ctx->mirror && (output->index == 0) )
+      {
+         for( i= 1; i < ctx->outputCount; ++i )
+         {
+            if ( ctx->output[i].nativeWindowPlane )
+            {
+               platformOverlayFree( &ctx->output[i].overlayPlanes, ctx->output[i].nativeWindowPlane );
+               ctx->output[i].nativeWindowPlane= 0;
+            }
+         }
+      }
+   }
+}
+
+int PlatformCreateDmaBuf( PlatformCtx *ctx, int width, int height )
+{
+   struct gbm_bo *bo;
+   int fd= -1;
+
+   if ( ctx && ctx->gbm )
+   {
+      bo= gbm_bo_create( ctx->gbm, width, height, GBM_FORMAT_R8, GBM_BO_USE_LINEAR );
+      if ( bo )
+      {
+         fd= gbm_bo_get_fd( bo );
+
+         /* The exported dma-buf keeps the memory alive without the bo */
+         gbm_bo_destroy( bo );
+      }
+      else
+      {
+         fprintf(stderr,"Error: PlatformCreateDmaBuf: gbm_bo_create %dx%d failed\n", width, height);
+      }
+   }
+
+   return fd;
+}
+
+static void pageFlipEventHandler(int fd, unsigned int frame,
+				 unsigned int sec, unsigned int usec,
+				 void *data)
+{
+   PlatformOutput *output= (PlatformOutput*)data;
+   /* A commit driving mirrors completes when every crtc in it has flipped */
+   if ( output->flipPending && (--output->flipEventsPending <= 0) )
+   {
+      /* Event times are the monotonic vblank timestamps */
+      platformFlipDone( gCtx, output, sec*1000000LL+usec );
+   }
+}
+
+static void platformAtomicAddProperty( PlatformCtx *ctx, drmModeAtomicReq *req, uint32_t objectId,
+                                       int countProps, drmModePropertyRes **propRes, const char *name, uint64_t value )
+{
+   int rc;
+   int i;
+   uint32_t propId= 0;
+
+   for( i= 0; i < countProps; ++i )
+   {
+      if ( !strcmp( name, propRes[i]->name ) )
+      {
+         propId= propRes[i]->prop_id;
+         break;
+      }
+   }
+
+   if ( propId > 0 )
+   {
+      if ( gVerbose )
+      fprintf(stderr,"platformAtomicAddProperty: objectId %d: %s, %lld\n", objectId, name, value);
+      rc= drmModeAtomicAddProperty( req, objectId, propId, value );
+      if ( rc < 0 )
+      {
+         fprintf(stderr,"platformAtomicAddProperty: drmModeAtomicAddProperty fail: obj %d prop %d (%s) value %lld: rc %d errno %d\n", objectId, propId, name, value, rc, errno );
+      }
+   }
+   else
+   {
+      fprintf(stderr,"platformAtomicAddProperty: skip prop %s\n", name);
+   }
+}
+
+static void platformReleaseScanout( PlatformCtx *ctx, PlatformOutput *output, PlatformScanout *scanout )
+{
+   if ( scanout->bo )
+   {
+      drmModeRmFB( ctx->drmFd, scanout->fbId );
+      gbm_surface_release_buffer( (struct gbm_surface*)output->nativeWindow, scanout->bo );
+      if ( scanout->fenceFd >= 0 )
+      {
+         close( scanout->fenceFd );
+      }
+   }
+   scanout->bo= 0;
+   scanout->fbId= 0;
+   scanout->fenceFd= -1;
+   scanout->videoCount= 0;
+   scanout->disableCount= 0;
+}
+
+static void platformAddScanoutPlane( PlatformCtx *ctx, drmModeAtomicReq *req, PlatformOutput *output,
+                                     PlatformOverlayPlane *plane, PlatformScanout *scanout, int width, int height )
+{
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "FB_ID", scanout->fbId );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_ID", plane->crtc_id );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "SRC_X", 0 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "SRC_Y", 0 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "SRC_W", width<<16 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "SRC_H", height<<16 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_X", 0 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_Y", 0 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_W", output->modeInfo->hdisplay );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_H", output->modeInfo->vdisplay );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "IN_FENCE_FD", scanout->fenceFd );
+   if ( ctx->useZPos )
+   {
+      platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                                 plane->planeProps->count_props, plane->planePropRes,
+                                 "zpos", plane->zOrder );
+   }
+}
+
+static void platformVideoLayerFlush( PlatformCtx *ctx, PlatformVideoLayer *layer )
+{
+   struct drm_gem_close gemClose;
+   int i;
+
+   /* The buffers were reallocated: a plane still showing one of them is turned off by the kernel */
+   for( i= 0; i < layer->fbCount; ++i )
+   {
+      drmModeRmFB( ctx->drmFd, layer->fbs[i].fbId );
+      memset( &gemClose, 0, sizeof(gemClose) );
+      gemClose.handle= layer->fbs[i].handle[0];
+      ioctl( ctx->drmFd, DRM_IOCTL_GEM_CLOSE, &gemClose );
+      if ( layer->fbs[i].handle[1] != layer->fbs[i].handle[0] )
+      {
+         gemClose.handle= layer->fbs[i].handle[1];
+         ioctl( ctx->drmFd, DRM_IOCTL_GEM_CLOSE, &gemClose );
+      }
+   }
+   layer->fbCount= 0;
+}
+
+static uint32_t platformVideoLayerFb( PlatformCtx *ctx, PlatformVideoLayer *layer )
+{
+   PlatformVideoFb *fb;
+   uint32_t handles[4], pitches[4], offsets[4];
+   struct drm_gem_close gemClose;
+   int rc, i;
+
+   /* Decoders cycle through a fixed set of buffers so each gets one framebuffer */
+   for( i= 0; i < layer->fbCount; ++i )
+   {
+      if ( layer->fbs[i].fd == layer->fd0 )
+      {
+         return layer->fbs[i].fbId;
+      }
+   }
+   if ( layer->fbCount >= VIDEO_FB_CACHE )
+   {
+      fprintf(stderr,"Warning: platform: more than %d video buffers in one layer\n", VIDEO_FB_CACHE);
+      return 0;
+   }
+
+   fb= &layer->fbs[layer->fbCount];
+   memset( fb, 0, sizeof(*fb) );
+   rc= drmPrimeFDToHandle( ctx->drmFd, layer->fd0, &fb->handle[0] );
+   if ( rc )
+   {
+      fprintf(stderr,"Error: platform: drmPrimeFDToHandle fd %d: rc %d errno %d\n", layer->fd0, rc, errno);
+      return 0;
+   }
+   fb->handle[1]= fb->handle[0];
+   if ( layer->fd1 != layer->fd0 )
+   {
+      rc= drmPrimeFDToHandle( ctx->drmFd, layer->fd1, &fb->handle[1] );
+      if ( rc )
+      {
+         fprintf(stderr,"Error: platform: drmPrimeFDToHandle fd %d: rc %d errno %d\n", layer->fd1, rc, errno);
+         /* Only this import is undone, cached framebuffers may be on screen or in queued commits */
+         memset( &gemClose, 0, sizeof(gemClose) );
+         gemClose.handle= fb->handle[0];
+         ioctl( ctx->drmFd, DRM_IOCTL_GEM_CLOSE, &gemClose );
+         return 0;
+      }
+   }
+
+   memset( handles, 0, sizeof(handles) );
+   memset( pitches, 0, sizeof(pitches) );
+   memset( offsets, 0, sizeof(offsets) );
+   handles[0]= fb->handle[0];
+   pitches[0]= layer->stride;
+   offsets[0]= 0;
+   handles[1]= fb->handle[1];
+   pitches[1]= layer->stride;
+   offsets[1]= layer->offset1;
+   if ( ctx->haveModifiers && ctx->useModifiers )
+   {
+      uint64_t modifiers[4];
+
+      memset( modifiers, 0, sizeof(modifiers) );
+      modifiers[0]= layer->modifier;
+      modifiers[1]= layer->modifier;
+      rc= drmModeAddFB2WithModifiers( ctx->drmFd, layer->width, layer->height, DRM_FORMAT_NV12, handles, pitches, offsets, modifiers, &fb->fbId, DRM_MODE_FB_MODIFIERS );
+   }
+   else
+   {
+      rc= drmModeAddFB2( ctx->drmFd, layer->width, layer->height, DRM_FORMAT_NV12, handles, pitches, offsets, &fb->fbId, 0 );
+   }
+   if ( rc )
+   {
+      fprintf(stderr,"Error: platform: drmModeAddFB2 NV12 %dx%d: rc %d errno %d\n", layer->width, layer->height, rc, errno);
+      memset( &gemClose, 0, sizeof(gemClose) );
+      gemClose.handle= fb->handle[0];
+      ioctl( ctx->drmFd, DRM_IOCTL_GEM_CLOSE, &gemClose );
+      if ( fb->handle[1] != fb->handle[0] )
+      {
+         gemClose.handle= fb->handle[1];
+         ioctl( ctx->drmFd, DRM_IOCTL_GEM_CLOSE, &gemClose );
+      }
+      return 0;
+   }
+   fb->fd= layer->fd0;
+   ++layer->fbCount;
+
+   return fb->fbId;
+}
+
+static void platformAddVideoPlane( PlatformCtx *ctx, drmModeAtomicReq *req, PlatformOutput *output, PlatformVideoPlacement *video )
+{
+   PlatformOverlayPlane *plane= video->plane;
+   int x, y, w, h;
+
+   /* Layer positions are in window coordinates, the window is scaled to the mode */
+   x= (video->x*output->modeInfo->hdisplay)/output->windowWidth;
+   y= (video->y*output->modeInfo->vdisplay)/output->windowHeight;
+   w= (video->w*output->modeInfo->hdisplay)/output->windowWidth;
+   h= (video->h*output->modeInfo->vdisplay)/output->windowHeight;
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "FB_ID", video->fbId );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_ID", plane->crtc_id );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "SRC_X", 0 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "SRC_Y", 0 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "SRC_W", video->width<<16 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "SRC_H", video->height<<16 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_X", x );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_Y", y );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_W", w );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_H", h );
+   if ( ctx->useZPos )
+   {
+      platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                                 plane->planeProps->count_props, plane->planePropRes,
+                                 "zpos", plane->zOrder );
+   }
+}
+
+static void platformDisableVideoPlane( PlatformCtx *ctx, drmModeAtomicReq *req, PlatformOverlayPlane *plane )
+{
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "FB_ID", 0 );
+
+   platformAtomicAddProperty( ctx, req, plane->plane->plane_id,
+                              plane->planeProps->count_props, plane->planePropRes,
+                              "CRTC_ID", 0 );
+}
+
+static void platformVideoPlacement( PlatformVideoLayer *layer, uint32_t fbId, PlatformVideoPlacement *video )
+{
+   video->plane= layer->plane;
+   video->fbId= fbId;
+   video->width= layer->width;
+   video->height= layer->height;
+   video->x= layer->x;
+   video->y= layer->y;
+   video->w= layer->w;
+   video->h= layer->h;
+}
+
+static void platformSnapshotVideo( PlatformCtx *ctx, PlatformScanout *scanout )
+{
+   PlatformVideoLayer *layer;
+   uint32_t fbId;
+   int i;
+
+   /* The frames shown by this swap, in case its commit is queued behind a pending flip */
+   scanout->videoCount= 0;
+   for( i= 0; i < PLATFORM_MAX_VIDEO_LAYERS; ++i )
+   {
+      layer= &ctx->videoLayer[i];
+      if ( layer->active && layer->plane )
+      {
+         fbId= platformVideoLayerFb( ctx, layer );
+         if ( fbId )
+         {
+            platformVideoPlacement( layer, fbId, &scanout->video[scanout->videoCount++] );
+         }
+      }
+   }
+   if ( ctx->planeMask )
+   {
+      ++ctx->planeFrameCount;
+      ctx->layerFrameCount += scanout->videoCount;
+   }
+   scanout->disableCount= ctx->disableCount;
+   memcpy( scanout->disable, ctx->disable, ctx->disableCount*sizeof(PlatformOverlayPlane*) );
+   ctx->disableCount= 0;
+}
+
+void PlatformSetVideoLayer( PlatformCtx *ctx, int layer, int generation, int fd0, int fd1, int offset1, unsigned long long modifier,
+                            int width, int height, int stride, int x, int y, int w, int h )
+{
+   PlatformVideoLayer *vl;
+
+   if ( !ctx || (layer < 0) || (layer >= PLATFORM_MAX_VIDEO_LAYERS) )
+   {
+      return;
+   }
+   vl= &ctx->videoLayer[layer];
+   if ( vl->generation != generation )
+   {
+      platformVideoLayerFlush( ctx, vl );
+      vl->generation= generation;
+      ctx->assignDirty= true;
+   }
+   if ( !vl->active || (vl->modifier != modifier) ||
+        (vl->width != width) || (vl->height != height) || (vl->stride != stride) || (vl->offset1 != offset1) ||
+        (vl->x != x) || (vl->y != y) || (vl->w != w) || (vl->h != h) )
+   {
+      ctx->assignDirty= true;
+   }
+   vl->active= true;
+   vl->fd0= fd0;
+   vl->fd1= fd1;
+   vl->offset1= offset1;
+   vl->modifier= modifier;
+   vl->width= width;
+   vl->height= height;
+   vl->stride= stride;
+   vl->x= x;
+   vl->y= y;
+   vl->w= w;
+   vl->h= h;
+}
+
+void PlatformClearVideoLayer( PlatformCtx *ctx, int layer )
+{
+   if ( ctx && (layer >= 0) && (layer < PLATFORM_MAX_VIDEO_LAYERS) && ctx->videoLayer[layer].active )
+   {
+      ctx->videoLayer[layer].active= false;
+      ctx->assignDirty= true;
+   }
+}
+
+unsigned int PlatformAssignPlanes( PlatformCtx *ctx )
+{
+   PlatformOutput *output;
+   PlatformVideoLayer *layer;
+   PlatformOverlayPlane *plane;
+   PlatformVideoPlacement video;
+   drmModeAtomicReq *req;
+   int order[PLATFORM_MAX_VIDEO_LAYERS];
+   int count, i, j, k, cursor, rc;
+   uint32_t fbId;
+
+   if ( !ctx )
+   {
+      return 0;
+   }
+   output= &ctx->output[0];
+   if ( !ctx->assignDirty )
+   {
+      return ctx->planeMask;
+   }
+   /* Mirrors cannot show output 0's planes, and there is nothing to test against before the mode set */
+   if ( !ctx->haveAtomic || ctx->mirror || !output->modeSet || !output->nativeWindowPlane )
+   {
+      return 0;
+   }
+   req= drmModeAtomicAlloc();
+   if ( !req )
+   {
+      return ctx->planeMask;
+   }
+   ctx->assignDirty= false;
+   ++ctx->assignCount;
+
+   /* Start over with every layer composed, a plane that was showing one is turned off unless reassigned */
+   for( i= 0; i < PLATFORM_MAX_VIDEO_LAYERS; ++i )
+   {
+      layer= &ctx->videoLayer[i];
+      if ( layer->plane )
+      {
+         for( k= 0; k < ctx->disableCount; ++k )
+         {
+            if ( ctx->disable[k] == layer->plane ) break;
+         }
+         if ( (k == ctx->disableCount) && (ctx->disableCount < MAX_VIDEO_DISABLE) )
+         {
+            ctx->disable[ctx->disableCount++]= layer->plane;
+         }
+         platformOverlayFree( &output->overlayPlanes, layer->plane );
+         layer->plane= 0;
+      }
+   }
+   ctx->planeMask= 0;
+   for( k= 0; k < ctx->disableCount; ++k )
+   {
+      platformDisableVideoPlane( ctx, req, ctx->disable[k] );
+   }
+
+   /* Largest layers first, they save the most composition bandwidth */
+   count= 0;
+   for( i= 0; i < PLATFORM_MAX_VIDEO_LAYERS; ++i )
+   {
+      if ( ctx->videoLayer[i].active )
+      {
+         for( j= count; j > 0; --j )
+         {
+            layer= &ctx->videoLayer[order[j-1]];
+            if ( layer->w*layer->h >= ctx->videoLayer[i].w*ctx->videoLayer[i].h ) break;
+            order[j]= order[j-1];
+         }
+         order[j]= i;
+         ++count;
+      }
+   }
+
+   for( i= 0; i < count; ++i )
+   {
+      layer= &ctx->videoLayer[order[i]];
+      fbId= platformVideoLayerFb( ctx, layer );
+      if ( !fbId )
+      {
+         continue;
+      }
+      for( plane= output->overlayPlanes.availHead; plane; plane= plane->next )
+      {
+         if ( !plane->supportsVideo || !plane->planeProps ||
+              (ctx->haveModifiers && !platformPlaneSupports( ctx, plane, DRM_FORMAT_NV12, layer->modifier )) )
+         {
+            continue;
+         }
+         /* Try the layer on this plane together with the layers already placed */
+         cursor= drmModeAtomicGetCursor( req );
+         layer->plane= plane;
+         platformVideoPlacement( layer, fbId, &video );
+         platformAddVideoPlane( ctx, req, output, &video );
+         rc= drmModeAtomicCommit( ctx->drmFd, req, DRM_MODE_ATOMIC_TEST_ONLY, 0 );
+         ++ctx->testCount;
+         if ( rc == 0 )
+         {
+            break;
+         }
+         ++ctx->testFailCount;
+         layer->plane= 0;
+         drmModeAtomicSetCursor( req, cursor );
+      }
+      if ( plane )
+      {
+         pthread_mutex_lock( &ctx->mutex );
+         platformOverlayTake( &output->overlayPlanes, plane );
+         pthread_mutex_unlock( &ctx->mutex );
+         for( k= 0; k < ctx->disableCount; ++k )
+         {
+            if ( ctx->disable[k] == plane )
+            {
+               ctx->disable[k]= ctx->disable[--ctx->disableCount];
+               break;
+            }
+         }
+         ctx->planeMask |= (1<<order[i]);
+      }
+   }
+   drmModeAtomicFree( req );
+
+   if ( gVerbose )
+   fprintf(stderr,"platform: plane assignment %d: %d of %d layers on planes (mask %x)\n", ctx->assignCount, __builtin_popcount( ctx->planeMask ), count, ctx->planeMask);
+
+   return ctx->planeMask;
+}
+
+static bool platformAddModeSet( PlatformCtx *ctx, drmModeAtomicReq *req, PlatformOutput *output, uint32_t *blobId )
+{
+   int rc;
+
+   platformAtomicAddProperty( ctx, req, output->conn->connector_id,
+                              output->connectorProps->count_props, output->connectorPropRes,
+                              "CRTC_ID", output->crtc->crtc_id );
+   if ( ctx->writeback.conn && (output->index == 0) )
+   {
+      /* Routing the writeback connector is a mode set, so it stays attached between captures */
+      platformAtomicAddProperty( ctx, req, ctx->writeback.conn->connector_id,
+                                 ctx->writeback.props->count_props, ctx->writeback.propRes,
+                                 "CRTC_ID", output->crtc->crtc_id );
+   }
+   rc= drmModeCreatePropertyBlob( ctx->drmFd, output->modeInfo, sizeof(*output->modeInfo), blobId );
+   if ( rc == 0 )
+   {
+      platformAtomicAddProperty( ctx, req, output->crtc->crtc_id,
+                                 output->crtcProps->count_props, output->crtcPropRes,
+                                 "MODE_ID", *blobId );
+
+      platformAtomicAddProperty( ctx, req, output->crtc->crtc_id,
+                                 output->crtcProps->count_props, output->crtcPropRes,
+                                 "ACTIVE", 1 );
+   }
+   else
+   {
+      fprintf(stderr,"Error: swapBuffers: drmModeCreatePropertyBlob fail: rc %d errno %d\n", rc, errno);
+      *blobId= 0;
+   }
+
+   return (rc == 0);
+}
+
+static void platformWritebackFreeBuffers( PlatformCtx *ctx )
+{
+   PlatformWriteback *wb= &ctx->writeback;
+   struct drm_mode_destroy_dumb destroyDumb;
+   int i;
+
+   for( i= 0; i < WRITEBACK_BUFFERS; ++i )
+   {
+      PlatformWritebackBuffer *buffer= &wb->buffer[i];
+      if ( buffer->map )
+      {
+         munmap( buffer->map, buffer->size );
+         buffer->map= 0;
+      }
+      if ( buffer->fbId )
+      {
+         drmModeRmFB( ctx->drmFd, buffer->fbId );
+         buffer->fbId= 0;
+      }
+      if ( buffer->handle )
+      {
+         memset( &destroyDumb, 0, sizeof(destroyDumb) );
+         destroyDumb.handle= buffer->handle;
+         ioctl( ctx->drmFd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroyDumb );
+         buffer->handle= 0;
+      }
+   }
+   wb->width= 0;
+   wb->height= 0;
+}
+
+static void platformWritebackTerm( PlatformCtx *ctx )
+{
+   PlatformWriteback *wb= &ctx->writeback;
+   int i;
+
+   if ( wb->fenceFd >= 0 )
+   {
+      close( wb->fenceFd );
+      wb->fenceFd= -1;
+   }
+   platformWritebackFreeBuffers( ctx );
+   if ( wb->propRes )
+   {
+      for( i= 0; i < wb->props->count_props; ++i )
+      {
+         if ( wb->propRes[i] )
+         {
+            drmModeFreeProperty( wb->propRes[i] );
+         }
+      }
+      free( wb->propRes );
+      wb->propRes= 0;
+   }
+   if ( wb->props )
+   {
+      drmModeFreeObjectProperties( wb->props );
+      wb->props= 0;
+   }
+   if ( wb->conn )
+   {
+      drmModeFreeConnector( wb->conn );
+      wb->conn= 0;
+   }
+}
+
+static bool platformWritebackAllocBuffers( PlatformCtx *ctx, int width, int height )
+{
+   PlatformWriteback *wb= &ctx->writeback;
+   struct drm_mode_create_dumb createDumb;
+   struct drm_mode_map_dumb mapDumb;
+   uint32_t handles[4], pitches[4], offsets[4];
+   int rc, i;
+
+   /* Writeback buffers must match the crtc's mode, dumb buffers can be read by the CPU */
+   platformWritebackFreeBuffers( ctx );
+   for( i= 0; i < WRITEBACK_BUFFERS; ++i )
+   {
+      PlatformWritebackBuffer *buffer= &wb->buffer[i];
+
+      memset( &createDumb, 0, sizeof(createDumb) );
+      createDumb.width= width;
+      createDumb.height= height;
+      createDumb.bpp= 32;
+      rc= ioctl( ctx->drmFd, DRM_IOCTL_MODE_CREATE_DUMB, &createDumb );
+      if ( rc )
+      {
+         fprintf(stderr,"Error: platform: writeback: DRM_IOCTL_MODE_CREATE_DUMB %dx%d: rc %d errno %d\n", width, height, rc, errno);
+         goto error;
+      }
+      buffer->handle= createDumb.handle;
+      buffer->pitch= createDumb.pitch;
+      buffer->size= createDumb.size;
+
+      memset( handles, 0, sizeof(handles) );
+      memset( pitches, 0, sizeof(pitches) );
+      memset( offsets, 0, sizeof(offsets) );
+      handles[0]= buffer->handle;
+      pitches[0]= buffer->pitch;
+      rc= drmModeAddFB2( ctx->drmFd, width, height, DRM_FORMAT_XRGB8888, handles, pitches, offsets, &buffer->fbId, 0 );
+      if ( rc )
+      {
+         fprintf(stderr,"Error: platform: writeback: drmModeAddFB2: rc %d errno %d\n", rc, errno);
+         buffer->fbId= 0;
+         goto error;
+      }
+
+      memset( &mapDumb, 0, sizeof(mapDumb) );
+      mapDumb.handle= buffer->handle;
+      rc= ioctl( ctx->drmFd, DRM_IOCTL_MODE_MAP_DUMB, &mapDumb );
+      if ( rc )
+      {
+         fprintf(stderr,"Error: platform: writeback: DRM_IOCTL_MODE_MAP_DUMB: rc %d errno %d\n", rc, errno);
+         goto error;
+      }
+      buffer->map= (unsigned char*)mmap( 0, buffer->size, PROT_READ, MAP_SHARED, ctx->drmFd, mapDumb.offset );
+      if ( buffer->map == MAP_FAILED )
+      {
+         fprintf(stderr,"Error: platform: writeback: mmap failed: errno %d\n", errno);
+         buffer->map= 0;
+         goto error;
+      }
+   }
+   wb->width= width;
+   wb->height= height;
+
+   return true;
+
+error:
+   platformWritebackFreeBuffers( ctx );
+
+   return false;
+}
+
+static void platformWritebackPoll( PlatformCtx *ctx, int timeout )
+{
+   PlatformWriteback *wb= &ctx->writeback;
+   PlatformWritebackBuffer *buffer;
+   struct pollfd pfd;
+   uint32_t checksum, pixel;
+   int rc, x, y;
+
+   if ( wb->pendingIndex < 0 )
+   {
+      return;
+   }
+   if ( wb->fenceFd >= 0 )
+   {
+      pfd.fd= wb->fenceFd;
+      pfd.events= POLLIN;
+      pfd.revents= 0;
+      rc= poll( &pfd, 1, timeout );
+      if ( rc == 0 )
+      {
+         return;
+      }
+      close( wb->fenceFd );
+      wb->fenceFd= -1;
+   }
+
+   /* A capture the caller has not collected yet is replaced by the newer one */
+   if ( wb->readyIndex >= 0 )
+   {
+      ++wb->overrunCount;
+   }
+   wb->readyIndex= wb->pendingIndex;
+   wb->readySequence= wb->pendingSequence;
+   wb->pendingIndex= -1;
+   ++wb->captureCount;
+
+   /* FNV-1a over the visible pixels, ignoring the undefined X byte, once per capture */
+   buffer= &wb->buffer[wb->readyIndex];
+   checksum= 2166136261U;
+   for( y= 0; y < wb->height; ++y )
+   {
+      const uint32_t *row= (const uint32_t*)(buffer->map+y*buffer->pitch);
+      for( x= 0; x < wb->width; ++x )
+      {
+         pixel= row[x] & 0x00FFFFFF;
+         checksum= (checksum ^ (pixel & 0xFF)) * 16777619U;
+         checksum= (checksum ^ ((pixel >> 8) & 0xFF)) * 16777619U;
+         checksum= (checksum ^ (pixel >> 16)) * 16777619U;
+      }
+   }
+   wb->readyChecksum= checksum;
+}
+
+static void platformAddWriteback( PlatformCtx *ctx, drmModeAtomicReq *req, PlatformOutput *output, PlatformScanout *scanout )
+{
+   PlatformWriteback *wb= &ctx->writeback;
+   int index;
+
+   if ( !wb->conn || (output->index != 0) || !output->modeSet || (scanout->sequence % wb->interval) )
+   {
+      return;
+   }
+   platformWritebackPoll( ctx, 0 );
+   if ( wb->pendingIndex >= 0 )
+   {
+      /* The previous capture is still being written */
+      ++wb->skipCount;
+      return;
+   }
+   if ( (wb->width != output->modeInfo->hdisplay) || (wb->height != output->modeInfo->vdisplay) )
+   {
+      wb->readyIndex= -1;
+      if ( !platformWritebackAllocBuffers( ctx, output->modeInfo->hdisplay, output->modeInfo->vdisplay ) )
+      {
+         return;
+      }
+   }
+   index= (wb->readyIndex == 0 ? 1 : 0);
+
+   platformAtomicAddProperty( ctx, req, wb->conn->connector_id,
+                              wb->props->count_props, wb->propRes,
+                              "WRITEBACK_FB_ID", wb->buffer[index].fbId );
+
+   platformAtomicAddProperty( ctx, req, wb->conn->connector_id,
+                              wb->props->count_props, wb->propRes,
+                              "WRITEBACK_OUT_FENCE_PTR", (uint64_t)(uintptr_t)&wb->fenceFd );
+
+   wb->fenceFd= -1;
+   wb->pendingIndex= index;
+   wb->pendingSequence= scanout->sequence;
+}
+
+bool PlatformEnableWriteback( PlatformCtx *ctx, int interval )
+{
+   PlatformWriteback *wb;
+   PlatformOutput *output;
+   drmModeRes *res= 0;
+   drmModeConnector *conn= 0;
+   drmModeEncoder *encoder;
+   drmModePropertyBlobPtr blob;
+   bool haveFormat;
+   int rc, i, j;
+
+   if ( !ctx || (interval < 1) )
+   {
+      return false;
+   }
+   wb= &ctx->writeback;
+   output= &ctx->output[0];
+   if ( !ctx->haveAtomic || output->modeSet )
+   {
+      fprintf(stderr,"Error: platform: writeback needs atomic mode setting and must be enabled before the first frame\n");
+      return false;
+   }
+
+   rc= drmSetClientCap( ctx->drmFd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1 );
+   if ( rc )
+   {
+      fprintf(stderr,"Error: platform: DRM_CLIENT_CAP_WRITEBACK_CONNECTORS not supported: rc %d errno %d\n", rc, errno);
+      return false;
+   }
+
+   /* Writeback connectors are only listed once the client cap is set */
+   res= drmModeGetResources( ctx->drmFd );
+   if ( !res )
+   {
+      return false;
+   }
+   for( i= 0; i < res->count_connectors; ++i )
+   {
+      conn= drmModeGetConnector( ctx->drmFd, res->connectors[i] );
+      if ( conn )
+      {
+         if ( (conn->connector_type == DRM_MODE_CONNECTOR_WRITEBACK) && conn->count_encoders )
+         {
+            encoder= drmModeGetEncoder( ctx->drmFd, conn->encoders[0] );
+            if ( encoder )
+            {
+               bool usable= (encoder->possible_crtcs & (1<<output->crtcIndex));
+               drmModeFreeEncoder( encoder );
+               if ( usable )
+               {
+                  break;
+               }
+            }
+         }
+         drmModeFreeConnector( conn );
+         conn= 0;
+      }
+   }
+   drmModeFreeResources( res );
+   if ( !conn )
+   {
+      fprintf(stderr,"Error: platform: no writeback connector for %s\n", output->name);
+      return false;
+   }
+
+   wb->props= drmModeObjectGetProperties( ctx->drmFd, conn->connector_id, DRM_MODE_OBJECT_CONNECTOR );
+   if ( !wb->props )
+   {
+      drmModeFreeConnector( conn );
+      return false;
+   }
+   wb->propRes= (drmModePropertyRes**)calloc( wb->props->count_props, sizeof(drmModePropertyRes*) );
+   if ( !wb->propRes )
+   {
+      drmModeFreeObjectProperties( wb->props );
+      wb->props= 0;
+      drmModeFreeConnector( conn );
+      return false;
+   }
+   haveFormat= false;
+   for( i= 0; i < wb->props->count_props; ++i )
+   {
+      wb->propRes[i]= drmModeGetProperty( ctx->drmFd, wb->props->props[i] );
+      if ( wb->propRes[i] && !strcmp( wb->propRes[i]->name, "WRITEBACK_PIXEL_FORMATS" ) )
+      {
+         blob= drmModeGetPropertyBlob( ctx->drmFd, wb->props->prop_values[i] );
+         if ( blob )
+         {
+            for( j= 0; j < (int)(blob->length/sizeof(uint32_t)); ++j )
+            {
+               if ( ((uint32_t*)blob->data)[j] == DRM_FORMAT_XRGB8888 )
+               {
+                  haveFormat= true;
+               }
+            }
+            drmModeFreePropertyBlob( blob );
+         }
+      }
+   }
+   wb->conn= conn;
+   if ( !haveFormat )
+   {
+      fprintf(stderr,"Error: platform: writeback connector %d does not support XRGB8888\n", conn->connector_id);
+      platformWritebackTerm( ctx );
+      return false;
+   }
+
+   wb->interval= interval;
+   wb->fenceFd= -1;
+   wb->pendingIndex= -1;
+   wb->readyIndex= -1;
+   fprintf(stderr,"platform: writeback connector %d capturing every %d frames of %s\n", conn->connector_id, interval, output->name);
+
+   return true;
+}
+
+bool PlatformGetCapture( PlatformCtx *ctx, PlatformCapture *capture )
+{
+   PlatformWriteback *wb;
+   PlatformWritebackBuffer *buffer;
+
+   if ( !ctx || !ctx->writeback.conn )
+   {
+      return false;
+   }
+   wb= &ctx->writeback;
+   platformWritebackPoll( ctx, 0 );
+   if ( wb->readyIndex < 0 )
+   {
+      return false;
+   }
+   buffer= &wb->buffer[wb->readyIndex];
+
+   capture->sequence= wb->readySequence;
+   capture->width= wb->width;
+   capture->height= wb->height;
+   capture->stride= buffer->pitch;
+   capture->pixels= buffer->map;
+   capture->checksum= wb->readyChecksum;
+
+   return true;
+}
+
+void PlatformReleaseCapture( PlatformCtx *ctx )
+{
+   if ( ctx )
+   {
+      ctx->writeback.readyIndex= -1;
+   }
+}
+
+static bool platformCommitScanout( PlatformCtx *ctx, PlatformOutput *output, PlatformScanout *scanout )
+{
+   bool result= false;
+   drmModeAtomicReq *req= 0;
+   uint32_t flags;
+   uint32_t blobId[PLATFORM_MAX_OUTPUTS];
+   int crtcCount= 1;
+   int rc, i;
+
+   memset( blobId, 0, sizeof(blobId) );
+
+   req= drmModeAtomicAlloc();
+   if ( !req )
+   {
+      fprintf(stderr,"Error: platformCommitScanout: drmModeAtomicAlloc failed, errno %x\n", errno);
+      platformReleaseScanout( ctx, output, scanout );
+      goto exit;
+   }
+
+   if ( !output->modeSet )
+   {
+      platformAddModeSet( ctx, req, output, &blobId[0] );
+   }
+
+   platformAddScanoutPlane( ctx, req, output, output->nativeWindowPlane, scanout, output->windowWidth, output->windowHeight );
+
+   if ( ctx->mirror && (output->index == 0) )
+   {
+      /* Every mirror flips to the same buffer in the same commit */
+      for( i= 1; i < ctx->outputCount; ++i )
+      {
+         PlatformOutput *mirror= &ctx->output[i];
+         if ( !mirror->nativeWindowPlane )
+         {
+            continue;
+         }
+         if ( !output->modeSet )
+         {
+            platformAddModeSet( ctx, req, mirror, &blobId[i] );
+         }
+         platformAddScanoutPlane( ctx, req, mirror, mirror->nativeWindowPlane, scanout, output->windowWidth, output->windowHeight );
+         ++crtcCount;
+      }
+   }
+
+   /* Video layers on planes flip with the window that has their holes */
+   for( i= 0; i < scanout->disableCount; ++i )
+   {
+      platformDisableVideoPlane( ctx, req, scanout->disable[i] );
+   }
+   for( i= 0; i < scanout->videoCount; ++i )
+   {
+      platformAddVideoPlane( ctx, req, output, &scanout->video[i] );
+   }
 
-      fprintf(stderr, "PlatformInitCtx; found %d overlay planes\n", ctx->overlayPlanes.totalCount );
+   platformAddWriteback( ctx, req, output, scanout );
 
-      if (
-           haveVideoPlanes &&
-           ctx->overlayPlanes.primary &&
-           (ctx->overlayPlanes.availHead != ctx->overlayPlanes.primary)
-         )
-      {
-         ctx->graphicsPreferPrimary= true;
-      }
+   /* The mode set is committed synchronously, every later frame is a non-blocking flip */
+   flags= (output->modeSet ? (DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT) : DRM_MODE_ATOMIC_ALLOW_MODESET);
+
+   {
+      long long commitTime= TimelineNow();
+      rc= drmModeAtomicCommit( ctx->drmFd, req, flags, output );
+      TimelineSpan( "atomic commit", -1, commitTime, TimelineNow() );
    }
+   if ( gVerbose ) fprintf(stderr,"drmModeAtomicCommit: done\n");
 
-   gRealEGLSwapBuffers= (PREALEGLSWAPBUFFERS)dlsym( RTLD_NEXT, "eglSwapBuffers" );
-   if ( !gRealEGLSwapBuffers )
+   /* The kernel holds its own reference to the fence */
+   if ( scanout->fenceFd >= 0 )
    {
-      fprintf(stderr,"Error: PlatformInit: unable to locate underlying eglSwapBuffers\n");
-      goto exit;
+      close( scanout->fenceFd );
+      scanout->fenceFd= -1;
    }
 
-   gRealEGLCreateWindowSurface= (PREALEGLCREATEWINDOWSURFACE)dlsym( RTLD_NEXT, "eglCreateWindowSurface" );
-   if ( !gRealEGLCreateWindowSurface )
+   if ( rc )
    {
-      fprintf(stderr,"Error: PlatformInit: unable to locate underlying eglCreateWindowSurface\n");
+      fprintf(stderr,"drmModeAtomicCommit failed: %s: rc %d errno %d\n", output->name, rc, errno );
+      if ( ctx->writeback.pendingIndex >= 0 && (ctx->writeback.pendingSequence == scanout->sequence) )
+      {
+         ctx->writeback.pendingIndex= -1;
+      }
+      platformReleaseScanout( ctx, output, scanout );
       goto exit;
    }
 
-   gCtx= ctx;
+   ++output->commitCount;
+   output->flipping= *scanout;
+   output->flipPending= true;
+   output->flipEventsPending= crtcCount;
+   if ( flags & DRM_MODE_ATOMIC_ALLOW_MODESET )
+   {
+      fprintf(stderr,"mode set: %s\n", output->name);
+      output->modeSet= true;
+      platformFlipDone( ctx, output, TimelineNow() );
+   }
 
-   error= false;
+   result= true;
 
 exit:
-   if ( error )
+   if ( req )
    {
-      PlatformTerm(ctx);
-      ctx= 0;
+      drmModeAtomicFree( req );
+   }
+   for( i= 0; i < PLATFORM_MAX_OUTPUTS; ++i )
+   {
+      if ( blobId[i] )
+      {
+         rc= drmModeDestroyPropertyBlob(ctx->drmFd, blobId[i]);
+         if ( rc )
+         {
+            fprintf(stderr,"drmModeDestroyPropertyBlob failed: rc %d errno %d\n", rc, errno );
+         }
+      }
    }
 
-   return ctx;
+   return result;
 }
 
-void PlatformTerm( PlatformCtx *ctx )
+static void platformFlipDone( PlatformCtx *ctx, PlatformOutput *output, long long flipTime )
 {
-   if ( ctx )
+   TimelineInstant( "page flip", -1 );
+   ++output->flipCount;
+   pthread_mutex_lock( &ctx->mutex );
+   output->flipSequence[output->flipping.sequence % FLIP_HISTORY]= output->flipping.sequence;
+   output->flipTime[output->flipping.sequence % FLIP_HISTORY]= flipTime;
+   pthread_mutex_unlock( &ctx->mutex );
+
+   /* The previous frame has left the screen so its buffer can be rendered to again */
+   platformReleaseScanout( ctx, output, &output->onScreen );
+   output->onScreen= output->flipping;
+   output->flipping.bo= 0;
+   output->flipping.fbId= 0;
+   output->flipping.fenceFd= -1;
+   output->flipPending= false;
+   output->flipEventsPending= 0;
+
+   platformCommitQueued( ctx, output );
+}
+
+static void platformCommitQueued( PlatformCtx *ctx, PlatformOutput *output )
+{
+   PlatformScanout next;
+
+   /* A failed commit releases its scanout, so keep going until one is pending or the queue is empty */
+   while ( output->queuedCount && !output->flipPending )
    {
-      if ( ctx->gbm )
-      {
-         gbm_device_destroy(ctx->gbm);
-         ctx->gbm= 0;
-      }
-      if ( ctx->crtc )
-      {
-         drmModeFreeCrtc(ctx->crtc);
-         ctx->crtc= 0;
-      }
-      if ( ctx->enc )
-      {
-         drmModeFreeEncoder(ctx->enc);
-         ctx->enc= 0;
-      }
-      if ( ctx->conn )
-      {
-         drmModeFreeConnector(ctx->conn);
-         ctx->conn= 0;
-      }
-      if ( ctx->res )
-      {
-         drmModeFreeResources(ctx->res);
-         ctx->res= 0;
-      }
-      if ( ctx->drmFd >= 0 )
-      {
-         close( ctx->drmFd );
-         ctx->drmFd= -1;
-      }
-      pthread_mutex_destroy( &ctx->mutex );
-      free( ctx );
-      gCtx= 0;
+      next= output->queued[0];
+      --output->queuedCount;
+      memmove( &output->queued[0], &output->queued[1], output->queuedCount*sizeof(PlatformScanout) );
+      platformCommitScanout( ctx, output, &next );
    }
 }
 
-NativeDisplayType PlatformGetEGLDisplayType( PlatformCtx *ctx )
+static bool platformDispatchFlipEvents( PlatformCtx *ctx, int timeout )
 {
-   NativeDisplayType displayType;
+   struct pollfd pfd;
+   drmEventContext ev;
+   bool flipPending= false;
+   int rc, i;
 
-   displayType= (NativeDisplayType)ctx->gbm;
+   for( i= 0; i < ctx->outputCount; ++i )
+   {
+      flipPending= flipPending || ctx->output[i].flipPending;
+   }
+   if ( !flipPending )
+   {
+      return false;
+   }
 
-   return displayType;
+   pfd.fd= ctx->drmFd;
+   pfd.events= POLLIN;
+   pfd.revents= 0;
+   rc= poll( &pfd, 1, timeout );
+   if ( (rc <= 0) || !(pfd.revents & POLLIN) )
+   {
+      return false;
+   }
+
+   /* Events for every output arrive on the one fd, each carries its output */
+   memset( &ev, 0, sizeof(ev) );
+   ev.version= 2;
+   ev.page_flip_handler= pageFlipEventHandler;
+   drmHandleEvent( ctx->drmFd, &ev );
+
+   return true;
 }
 
-EGLDisplay PlatformGetEGLDisplay( PlatformCtx *ctx, NativeDisplayType type )
+static int platformHeldCount( PlatformOutput *output )
 {
-   EGLDisplay dpy= EGL_NO_DISPLAY;
-   PFNEGLGETPLATFORMDISPLAYEXTPROC realEGLGetPlatformDisplay= 0;
-   realEGLGetPlatformDisplay= (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress( "eglGetPlatformDisplayEXT" );
-   if ( realEGLGetPlatformDisplay )
+   return (output->onScreen.bo ? 1 : 0) + (output->flipPending ? 1 : 0) + output->queuedCount;
+}
+
+static void platformWaitFlipQueue( PlatformCtx *ctx, PlatformOutput *output )
+{
+   long long startTime, waitTime;
+
+   /* Back-pressure: hold at most flipQueueDepth buffers so the next frame has one to render to */
+   if ( platformHeldCount( output ) <= ctx->flipQueueDepth )
    {
-      dpy= realEGLGetPlatformDisplay( EGL_PLATFORM_GBM_KHR, ctx->gbm, NULL );
+      return;
+   }
+
+   startTime= TimelineNow();
+   while ( (platformHeldCount( output ) > ctx->flipQueueDepth) && output->flipPending )
+   {
+      if ( !platformDispatchFlipEvents( ctx, FLIP_TIMEOUT_MS ) )
+      {
+         fprintf(stderr,"Warning: platform: %s: no flip event after %d ms\n", output->name, FLIP_TIMEOUT_MS);
+         break;
+      }
+   }
+   waitTime= TimelineNow()-startTime;
+   TimelineSpan( "flip wait", -1, startTime, startTime+waitTime );
+
+   ++output->backPressureCount;
+   output->backPressureTime += waitTime;
+   if ( waitTime > output->backPressureMax )
+   {
+      output->backPressureMax= waitTime;
+   }
+}
+
+static long long platformModeRefresh( drmModeModeInfo *mode )
+{
+   long long refresh;
+
+   /* Refresh in milli-Hz from the timings, since vrefresh is rounded */
+   if ( mode->htotal && mode->vtotal )
+   {
+      refresh= ((long long)mode->clock*1000000LL)/((long long)mode->htotal*mode->vtotal);
    }
    else
    {
-      dpy= eglGetDisplay( (NativeDisplayType)ctx->gbm );
+      refresh= mode->vrefresh*1000LL;
    }
 
-   return dpy;
+   return refresh;
 }
 
-EGLDisplay PlatformGetEGLDisplayWayland( PlatformCtx *ctx, struct wl_display *display )
+static bool platformModeMatchesRate( drmModeModeInfo *mode, int frameRate )
 {
-   EGLDisplay dpy= EGL_NO_DISPLAY;
+   long long refresh= platformModeRefresh( mode );
+   long long rate= frameRate*1000LL;
+   long long multiple, diff;
 
-   dpy= eglGetDisplay( (NativeDisplayType)display );
+   /* Allow 0.5% so that 1000/1001 modes match their nominal rate */
+   multiple= (refresh+rate/2)/rate;
+   if ( multiple < 1 )
+   {
+      return false;
+   }
+   diff= refresh-multiple*rate;
+   if ( diff < 0 )
+   {
+      diff= -diff;
+   }
 
-   return dpy;
+   return (diff*200 <= multiple*rate);
 }
 
-void *PlatformCreateNativeWindow( PlatformCtx *ctx, int width, int height )
+void PlatformSetUseModifiers( PlatformCtx *ctx, bool useModifiers )
 {
-   void *nativeWindow= 0;
+   if ( ctx )
+   {
+      ctx->useModifiers= useModifiers;
+   }
+}
 
+void PlatformSetFrameRate( PlatformCtx *ctx, int frameRate )
+{
    if ( ctx )
    {
-      bool found= false;
-      int i;
-      for( i= 0; i < ctx->conn->count_modes; ++i )
-      {
-         if ( (ctx->conn->modes[i].hdisplay == width) &&
-              (ctx->conn->modes[i].vdisplay == height) &&
-              (ctx->conn->modes[i].type & DRM_MODE_TYPE_DRIVER) )
-         {
-            found= true;
-            ctx->modeInfo= &ctx->conn->modes[i];
-            break;
-         }
-      }
-      if ( !found )
-      {
-         ctx->modeInfo= &ctx->conn->modes[0];
-      }
+      ctx->contentFrameRate= frameRate;
+   }
+}
 
-      nativeWindow= gbm_surface_create(ctx->gbm,
-                                       width, height,
-                                       GBM_FORMAT_ARGB8888,
-                                       GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING );
+long long PlatformGetRefreshRate( PlatformCtx *ctx )
+{
+   long long refresh= 0;
+
+   if ( ctx && ctx->output[0].modeInfo )
+   {
+      refresh= platformModeRefresh( ctx->output[0].modeInfo );
+   }
+
+   return refresh;
+}
+
+unsigned int PlatformGetSwapSequence( PlatformCtx *ctx )
+{
+   return (ctx ? ctx->output[0].swapSequence : 0);
+}
 
-      ctx->nativeWindow= nativeWindow;
-      ctx->windowWidth= width;
-      ctx->windowHeight= height;
+long long PlatformGetFlipTime( PlatformCtx *ctx, unsigned int sequence )
+{
+   long long flipTime= -1;
 
-      if ( !ctx->graphicsPreferPrimary )
+   if ( ctx )
+   {
+      /* Also used by decoder threads to learn when a frame on a plane has been replaced */
+      PlatformOutput *output= &ctx->output[0];
+      pthread_mutex_lock( &ctx->mutex );
+      if ( output->flipSequence[sequence % FLIP_HISTORY] == sequence )
       {
-         ctx->nativeWindowPlane= platformOverlayAlloc( &ctx->overlayPlanes, true, false );
-         fprintf(stderr,"plane %p : zorder: %d\n", ctx->nativeWindowPlane, (ctx->nativeWindowPlane ? ctx->nativeWindowPlane->zOrder: -1) );
+         flipTime= output->flipTime[sequence % FLIP_HISTORY];
       }
-      else if ( ctx->haveAtomic )
+      else if ( (int)(output->swapSequence-sequence) < FLIP_HISTORY )
       {
-         ctx->nativeWindowPlane= platformOverlayAllocPrimary( &ctx->overlayPlanes );
-         fprintf(stderr,"plane %p : primary: zorder: %d\n", ctx->nativeWindowPlane, (ctx->nativeWindowPlane ? ctx->nativeWindowPlane->zOrder: -1) );
+         /* Not on screen yet */
+         flipTime= 0;
       }
+      pthread_mutex_unlock( &ctx->mutex );
    }
-   
-   return nativeWindow;   
+
+   return flipTime;
 }
 
-void PlatformDestroyNativeWindow( PlatformCtx *ctx, void *nativeWindow )
+void PlatformSetFlipQueueDepth( PlatformCtx *ctx, int depth )
 {
    if ( ctx )
    {
-      struct gbm_surface *gs = (struct gbm_surface*)nativeWindow;
-      if ( ctx->prevBo )
+      if ( depth < 1 )
       {
-         gbm_surface_release_buffer(gs, ctx->prevBo);
-         drmModeRmFB( ctx->drmFd, ctx->prevFbId );
-         ctx->prevBo= 0;
-         ctx->prevFbId= 0;
-         ctx->modeSet= false;
+         depth= 1;
       }
-      gbm_surface_destroy( gs );
-      ctx->nativeWindow= 0;
-      if ( ctx->nativeWindowPlane )
+      if ( depth > MAX_FLIP_QUEUE_DEPTH )
       {
-         platformOverlayFree( &ctx->overlayPlanes, ctx->nativeWindowPlane );
-         ctx->nativeWindowPlane= 0;
+         depth= MAX_FLIP_QUEUE_DEPTH;
       }
+      ctx->flipQueueDepth= depth;
    }
 }
 
-static void pageFlipEventHandler(int fd, unsigned int frame,
-				 unsigned int sec, unsigned int usec,
-				 void *data)
+static bool platformInitNativeFence( EGLDisplay dpy )
 {
-   PlatformCtx *ctx= (PlatformCtx*)data;
-   if ( ctx->flipPending )
+   const char *extensions;
+
+   if ( gNativeFenceSupport == 0 )
    {
-      --ctx->flipPending;
+      gNativeFenceSupport= -1;
+      extensions= eglQueryString( dpy, EGL_EXTENSIONS );
+      if ( extensions && strstr( extensions, "EGL_ANDROID_native_fence_sync" ) )
+      {
+         gEGLCreateSyncKHR= (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress( "eglCreateSyncKHR" );
+         gEGLDestroySyncKHR= (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress( "eglDestroySyncKHR" );
+         gEGLDupNativeFenceFDANDROID= (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)eglGetProcAddress( "eglDupNativeFenceFDANDROID" );
+         if ( gEGLCreateSyncKHR && gEGLDestroySyncKHR && gEGLDupNativeFenceFDANDROID )
+         {
+            gNativeFenceSupport= 1;
+         }
+      }
+      fprintf(stderr,"platform: render fences for IN_FENCE_FD: %s\n", (gNativeFenceSupport > 0) ? "yes" : "no");
    }
+
+   return (gNativeFenceSupport > 0);
 }
 
-static void platformAtomicAddProperty( PlatformCtx *ctx, drmModeAtomicReq *req, uint32_t objectId,
-                                       int countProps, drmModePropertyRes **propRes, const char *name, uint64_t value )
+static EGLBoolean platformSwapBuffers( EGLDisplay dpy, EGLSurface surface, const EGLint *rects, EGLint nRects )
 {
-   int rc;
+   EGLBoolean result= EGL_FALSE;
+   EGLSyncKHR renderSync= EGL_NO_SYNC_KHR;
+   PlatformOutput *output= 0;
+   int inFenceFd= -1;
    int i;
-   uint32_t propId= 0;
 
-   for( i= 0; i < countProps; ++i )
+   for( i= 0; gCtx && (i < gCtx->outputCount); ++i )
    {
-      if ( !strcmp( name, propRes[i]->name ) )
+      if ( surface == gCtx->output[i].surfaceDirect )
       {
-         propId= propRes[i]->prop_id;
+         output= &gCtx->output[i];
          break;
       }
    }
 
-   if ( propId > 0 )
-   {
-      if ( gVerbose )
-      fprintf(stderr,"platformAtomicAddProperty: objectId %d: %s, %lld\n", objectId, name, value);
-      rc= drmModeAtomicAddProperty( req, objectId, propId, value );
-      if ( rc < 0 )
-      {
-         fprintf(stderr,"platformAtomicAddProperty: drmModeAtomicAddProperty fail: obj %d prop %d (%s) value %lld: rc %d errno %d\n", objectId, propId, name, value, rc, errno );
-      }
-   }
-   else
-   {
-      fprintf(stderr,"platformAtomicAddProperty: skip prop %s\n", name);
-   }
-}
-
-EGLAPI EGLBoolean eglSwapBuffers( EGLDisplay dpy, EGLSurface surface )
-{
-   EGLBoolean result= EGL_FALSE;
-
    if ( gRealEGLSwapBuffers )
    {
       struct gbm_surface* gs;
       struct gbm_bo *bo;
       uint32_t handle, stride;
-      fd_set fds;
-      drmEventContext ev;
+      uint64_t modifier;
       int rc;
 
       if ( gVerbose ) fprintf(stderr,"eglSwapBuffers: start\n");
-      result= gRealEGLSwapBuffers( dpy, surface );
 
-      if ( surface == gCtx->surfaceDirect )
+      /* Fence the frame's rendering so the commit waits for the GPU rather than the swap */
+      if ( output && platformInitNativeFence( dpy ) )
+      {
+         EGLint attrs[]= { EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID, EGL_NONE };
+         renderSync= gEGLCreateSyncKHR( dpy, EGL_SYNC_NATIVE_FENCE_ANDROID, attrs );
+      }
+
+      if ( nRects && gRealEGLSwapBuffersWithDamage )
+      {
+         result= gRealEGLSwapBuffersWithDamage( dpy, surface, rects, nRects );
+      }
+      else
+      {
+         result= gRealEGLSwapBuffers( dpy, surface );
+      }
+
+      if ( renderSync != EGL_NO_SYNC_KHR )
+      {
+         /* The fence fd exists once the swap has flushed the commands */
+         inFenceFd= gEGLDupNativeFenceFDANDROID( dpy, renderSync );
+         gEGLDestroySyncKHR( dpy, renderSync );
+         if ( inFenceFd == EGL_NO_NATIVE_FENCE_FD_ANDROID )
+         {
+            inFenceFd= -1;
+         }
+      }
+
+      if ( output )
       {
-         gs= (struct gbm_surface*)gCtx->nativeWindow;
+         gs= (struct gbm_surface*)output->nativeWindow;
          if ( gs )
          {
-            uint32_t flags= 0;
-            drmModeAtomicReq *req= 0;
-            uint32_t blobId= 0;
+            PlatformScanout scanout;
 
-            req= drmModeAtomicAlloc();
-            if ( !req )
+            /* Retire flips that completed while the frame was being rendered */
+            platformDispatchFlipEvents( gCtx, 0 );
+
+            bo= gbm_surface_lock_front_buffer(gs);
+            if ( !bo )
             {
-               fprintf(stderr,"Error: swapBuffers: drmModeAtomicAlloc failed, errno %x\n", errno);
+               fprintf(stderr,"Error: swapBuffers: gbm_surface_lock_front_buffer failed\n");
                goto exit;
             }
 
-            if ( !gCtx->modeSet )
+            handle= gbm_bo_get_handle(bo).u32;
+            stride = gbm_bo_get_stride(bo);
+            modifier= ((gCtx->haveModifiers && gCtx->useModifiers) ? gbm_bo_get_modifier(bo) : DRM_FORMAT_MOD_INVALID);
+
+            scanout.bo= bo;
+            scanout.fbId= 0;
+            scanout.fenceFd= inFenceFd;
+            scanout.videoCount= 0;
+            scanout.disableCount= 0;
+            if ( output->index == 0 )
             {
-               flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
-               platformAtomicAddProperty( gCtx, req, gCtx->conn->connector_id,
-                                     gCtx->connectorProps->count_props, gCtx->connectorPropRes,
-                                     "CRTC_ID", gCtx->crtc->crtc_id );
-               rc= drmModeCreatePropertyBlob( gCtx->drmFd, gCtx->modeInfo, sizeof(*gCtx->modeInfo), &blobId );
-               if ( rc == 0 )
-               {
-                  platformAtomicAddProperty( gCtx, req, gCtx->crtc->crtc_id,
-                                        gCtx->crtcProps->count_props, gCtx->crtcPropRes,
-                                        "MODE_ID", blobId );
-
-                  platformAtomicAddProperty( gCtx, req, gCtx->crtc->crtc_id,
-                                        gCtx->crtcProps->count_props, gCtx->crtcPropRes,
-                                        "ACTIVE", 1 );
-               }
-               else
+               platformSnapshotVideo( gCtx, &scanout );
+            }
+            pthread_mutex_lock( &gCtx->mutex );
+            scanout.sequence= ++output->swapSequence;
+            pthread_mutex_unlock( &gCtx->mutex );
+            inFenceFd= -1;
+            if ( modifier != DRM_FORMAT_MOD_INVALID )
+            {
+               uint32_t handles[4], pitches[4], offsets[4];
+               uint64_t modifiers[4];
+               int planeCount= gbm_bo_get_plane_count(bo);
+
+               /* Tiled and compressed layouts may carry an auxiliary plane */
+               memset( handles, 0, sizeof(handles) );
+               memset( pitches, 0, sizeof(pitches) );
+               memset( offsets, 0, sizeof(offsets) );
+               memset( modifiers, 0, sizeof(modifiers) );
+               for( int p= 0; (p < planeCount) && (p < 4); ++p )
                {
-                  fprintf(stderr,"Error: swapBuffers: drmModeCreatePropertyBlob fail: rc %d errno %d\n", rc, errno);
+                  handles[p]= gbm_bo_get_handle_for_plane(bo, p).u32;
+                  pitches[p]= gbm_bo_get_stride_for_plane(bo, p);
+                  offsets[p]= gbm_bo_get_offset(bo, p);
+                  modifiers[p]= modifier;
                }
+               rc= drmModeAddFB2WithModifiers( gCtx->drmFd,
+                                               output->windowWidth,
+                                               output->windowHeight,
+                                               gbm_bo_get_format(bo),
+                                               handles, pitches, offsets, modifiers,
+                                               &scanout.fbId,
+                                               DRM_MODE_FB_MODIFIERS );
             }
-
-            bo= gbm_surface_lock_front_buffer(gs);
-
-            handle= gbm_bo_get_handle(bo).u32;
-            stride = gbm_bo_get_stride(bo);
-
-            if ( gCtx->handle != handle )
+            else
             {
                rc= drmModeAddFB( gCtx->drmFd,
-                                 gCtx->windowWidth,
-                                 gCtx->windowHeight,
+                                 output->windowWidth,
+                                 output->windowHeight,
                                  32,
                                  32,
                                  stride,
                                  handle,
-                                 &gCtx->fbId );
-               if ( rc )
-               {
-                  fprintf(stderr,"Error: swapBuffers: drmModeAddFB rc %d errno %d\n", rc, errno);
-                  goto exit;
-               }
-               gCtx->handle= handle;
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "FB_ID", gCtx->fbId );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "CRTC_ID", gCtx->nativeWindowPlane->crtc_id );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "SRC_X", 0 );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "SRC_Y", 0 );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "SRC_W", gCtx->windowWidth<<16 );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "SRC_H", gCtx->windowHeight<<16 );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "CRTC_X", 0 );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "CRTC_Y", 0 );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "CRTC_W", gCtx->modeInfo->hdisplay );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "CRTC_H", gCtx->modeInfo->vdisplay );
-
-               platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                     gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                     "IN_FENCE_FD", -1 );
-               if ( gCtx->useZPos )
+                                 &scanout.fbId );
+            }
+            if ( rc )
+            {
+               fprintf(stderr,"Error: swapBuffers: drmModeAddFB rc %d errno %d\n", rc, errno);
+               gbm_surface_release_buffer( gs, bo );
+               if ( scanout.fenceFd >= 0 )
                {
-                  platformAtomicAddProperty( gCtx, req, gCtx->nativeWindowPlane->plane->plane_id,
-                                        gCtx->nativeWindowPlane->planeProps->count_props, gCtx->nativeWindowPlane->planePropRes,
-                                        "zpos", gCtx->nativeWindowPlane->zOrder );
+                  close( scanout.fenceFd );
                }
+               goto exit;
             }
 
-            if ( req )
+            /* Only one flip can be pending on the crtc: later frames wait their turn */
+            platformCommitQueued( gCtx, output );
+            if ( output->flipPending )
             {
-               rc= drmModeAtomicCommit( gCtx->drmFd, req, flags, 0 );
-               if ( rc )
-               {
-                  fprintf(stderr,"drmModeAtomicCommit failed: rc %d errno %d\n", rc, errno );
-               }
-               if ( gVerbose ) fprintf(stderr,"drmModeAtomicCommit: done\n");
-               if ( (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) && !rc )
-               {
-                  fprintf(stderr,"mode set\n");
-                  gCtx->modeSet= true;
-               }
-               drmModeAtomicFree( req );
-               if ( blobId )
+               while ( (output->queuedCount >= MAX_FLIP_QUEUE_DEPTH) && output->flipPending )
                {
-                  rc= drmModeDestroyPropertyBlob(gCtx->drmFd, blobId);
-                  if ( rc )
+                  if ( !platformDispatchFlipEvents( gCtx, FLIP_TIMEOUT_MS ) )
                   {
-                     fprintf(stderr,"drmModeDestroyPropertyBlob failed: rc %d errno %d\n", rc, errno );
+                     break;
                   }
                }
+               platformCommitQueued( gCtx, output );
             }
-
-            if ( gCtx->prevBo )
+            if ( !output->flipPending )
+            {
+               platformCommitScanout( gCtx, output, &scanout );
+            }
+            else if ( output->queuedCount < MAX_FLIP_QUEUE_DEPTH )
+            {
+               output->queued[output->queuedCount++]= scanout;
+            }
+            else
             {
-               drmModeRmFB( gCtx->drmFd, gCtx->prevFbId );
-               gbm_surface_release_buffer(gs, gCtx->prevBo);
+               fprintf(stderr,"Warning: platform: %s: flip queue full, dropping frame %u\n", output->name, scanout.sequence);
+               /* Planes this frame was to turn off are turned off by the next one */
+               for( int d= 0; (d < scanout.disableCount) && (gCtx->disableCount < MAX_VIDEO_DISABLE); ++d )
+               {
+                  gCtx->disable[gCtx->disableCount++]= scanout.disable[d];
+               }
+               platformReleaseScanout( gCtx, output, &scanout );
             }
-            gCtx->prevBo= bo;
-            gCtx->prevFbId= gCtx->fbId;
+
+            platformWaitFlipQueue( gCtx, output );
          }
       }
       if ( emitFPS )
@@ -1356,11 +3447,34 @@ EGLAPI EGLBoolean eglSwapBuffers( EGLDisplay dpy, EGLSurface surface )
    }
 
 exit:
+   if ( inFenceFd >= 0 )
+   {
+      close( inFenceFd );
+   }
    if ( gVerbose ) fprintf(stderr,"eglSwapBuffers: end\n");
 
    return result;    
 }
 
+EGLAPI EGLBoolean eglSwapBuffers( EGLDisplay dpy, EGLSurface surface )
+{
+   return platformSwapBuffers( dpy, surface, 0, 0 );
+}
+
+/* The damaged swap must present through the same KMS commit as a full swap */
+EGLAPI EGLBoolean EGLAPIENTRY eglSwapBuffersWithDamageKHR( EGLDisplay dpy, EGLSurface surface, const EGLint *rects, EGLint n_rects )
+{
+   if ( !gRealEGLSwapBuffersWithDamage )
+   {
+      gRealEGLSwapBuffersWithDamage= (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress( "eglSwapBuffersWithDamageKHR" );
+      if ( gRealEGLSwapBuffersWithDamage == eglSwapBuffersWithDamageKHR )
+      {
+         gRealEGLSwapBuffersWithDamage= 0;
+      }
+   }
+   return platformSwapBuffers( dpy, surface, rects, n_rects );
+}
+
 EGLAPI EGLSurface EGLAPIENTRY eglCreateWindowSurface( EGLDisplay dpy, EGLConfig config,
                                                       EGLNativeWindowType win,
                                                       const EGLint *attrib_list )
@@ -1372,9 +3486,12 @@ EGLAPI EGLSurface EGLAPIENTRY eglCreateWindowSurface( EGLDisplay dpy, EGLConfig
       eglSurface= gRealEGLCreateWindowSurface( dpy, config, win, attrib_list );
       if ( eglSurface != EGL_NO_SURFACE )
       {
-         if ( win == (EGLNativeWindowType)gCtx->nativeWindow )
+         for( int i= 0; i < gCtx->outputCount; ++i )
          {
-            gCtx->surfaceDirect= eglSurface;
+            if ( win == (EGLNativeWindowType)gCtx->output[i].nativeWindow )
+            {
+               gCtx->output[i].surfaceDirect= eglSurface;
+            }
          }
       }
    }
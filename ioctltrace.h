@@ -0,0 +1,48 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _V4L2TEST_IOCTLTRACE_H
+#define _V4L2TEST_IOCTLTRACE_H
+
+#include <sys/types.h>
+
+/*
+ * Binary trace of decoder device sessions.  Recording captures every open,
+ * close, ioctl and poll on a decoder fd with its arguments, result and
+ * timing.  Replay stands in for the device, returning the recorded results
+ * with the recorded timing.
+ */
+bool TraceRecordStart( const char *filename );
+void TraceRecordStop( void );
+bool TraceRecording( void );
+void TraceRecordOpen( int fd );
+void TraceRecordClose( int fd );
+void TraceRecordIoctl( int fd, unsigned int request, void *arg, int rc, int err, long long startTime, long long endTime );
+void TraceRecordPoll( int fd, short events, short revents, int rc, long long startTime, long long endTime );
+
+bool TraceReplayStart( const char *filename );
+void TraceReplayStop( void );
+int TraceReplayOpen( void );
+int TraceReplayClose( int fd );
+bool TraceReplayIsDevice( int fd );
+int TraceReplayIoctl( int fd, unsigned int request, void *arg );
+void *TraceReplayMmap( int fd, size_t length, int prot, int flags, off_t offset );
+int TraceReplayPoll( int fd, short events, short *revents, int timeout );
+
+#endif
+
@@ -0,0 +1,321 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <memory.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "asynclog.h"
+
+#include <vector>
+#include <algorithm>
+
+#define LOG_RING_SIZE (128)
+#define LOG_RECORD_SIZE (1024)
+#define LOG_WRITER_INTERVAL (2000)
+
+typedef struct _LogRecord
+{
+   unsigned long long seq;
+   bool toReport;
+   int length;
+   char text[LOG_RECORD_SIZE];
+} LogRecord;
+
+typedef struct _LogRing
+{
+   bool inUse;
+   unsigned int head;
+   unsigned int tail;
+   LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+typedef struct _LogPending
+{
+   unsigned long long seq;
+   LogRing *ring;
+   LogRecord *record;
+} LogPending;
+
+static pthread_mutex_t gMutex= PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t gRingKey;
+static bool gKeyCreated= false;
+static bool gStarted= false;
+static bool gStopRequested= false;
+static pthread_t gWriterThreadId;
+static FILE *gReport= 0;
+static unsigned long long gSeq= 0;
+static unsigned int gDropped= 0;
+static std::vector<LogRing*> gRings;
+static __thread LogRing *tRing= 0;
+
+static void logReleaseRing( void *arg )
+{
+   LogRing *ring= (LogRing*)arg;
+
+   /* Records still in the ring are written as usual, only ownership is given up */
+   pthread_mutex_lock( &gMutex );
+   ring->inUse= false;
+   pthread_mutex_unlock( &gMutex );
+}
+
+static LogRing *logGetRing( void )
+{
+   LogRing *ring= tRing;
+   int i;
+
+   if ( !ring )
+   {
+      pthread_mutex_lock( &gMutex );
+      for( i= 0; i < (int)gRings.size(); ++i )
+      {
+         if ( !gRings[i]->inUse )
+         {
+            ring= gRings[i];
+            break;
+         }
+      }
+      if ( !ring )
+      {
+         ring= (LogRing*)calloc( 1, sizeof(LogRing) );
+         if ( ring )
+         {
+            gRings.push_back( ring );
+         }
+      }
+      if ( ring )
+      {
+         ring->inUse= true;
+         pthread_setspecific( gRingKey, ring );
+      }
+      pthread_mutex_unlock( &gMutex );
+      tRing= ring;
+   }
+
+   return ring;
+}
+
+static bool logComparePending( const LogPending &a, const LogPending &b )
+{
+   return (a.seq < b.seq);
+}
+
+static int logWritePending( void )
+{
+   std::vector<LogPending> pending;
+   LogPending item;
+   LogRing *ring;
+   unsigned int head, tail, i, j;
+
+   pthread_mutex_lock( &gMutex );
+   for( i= 0; i < gRings.size(); ++i )
+   {
+      ring= gRings[i];
+      head= __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+      tail= ring->tail;
+      for( j= tail; j != head; ++j )
+      {
+         item.ring= ring;
+         item.record= &ring->records[j % LOG_RING_SIZE];
+         item.seq= item.record->seq;
+         pending.push_back( item );
+      }
+   }
+   pthread_mutex_unlock( &gMutex );
+
+   if ( pending.size() )
+   {
+      /* Records from different threads are merged back into logging order */
+      std::sort( pending.begin(), pending.end(), logComparePending );
+
+      for( i= 0; i < pending.size(); ++i )
+      {
+         fwrite( pending[i].record->text, 1, pending[i].record->length, stderr );
+         if ( gReport && pending[i].record->toReport )
+         {
+            fwrite( pending[i].record->text, 1, pending[i].record->length, gReport );
+         }
+      }
+      fflush( stderr );
+      if ( gReport )
+      {
+         fflush( gReport );
+      }
+
+      /* Each ring's records were collected in order, so release them in order */
+      for( i= 0; i < pending.size(); ++i )
+      {
+         ring= pending[i].ring;
+         __atomic_store_n( &ring->tail, ring->tail+1, __ATOMIC_RELEASE );
+      }
+   }
+
+   return (int)pending.size();
+}
+
+static void *logWriterThread( void *arg )
+{
+   for( ; ; )
+   {
+      if ( !logWritePending() )
+      {
+         if ( __atomic_load_n( &gStopRequested, __ATOMIC_ACQUIRE ) )
+         {
+            break;
+         }
+         usleep( LOG_WRITER_INTERVAL );
+      }
+   }
+
+   return 0;
+}
+
+static void logWriteSync( bool toReport, const char *fmt, va_list argptr )
+{
+   char text[LOG_RECORD_SIZE];
+   int length;
+
+   length= vsnprintf( text, sizeof(text), fmt, argptr );
+   if ( length >= (int)sizeof(text) )
+   {
+      length= sizeof(text)-1;
+   }
+   if ( length > 0 )
+   {
+      fwrite( text, 1, length, stderr );
+      if ( gReport && toReport )
+      {
+         fwrite( text, 1, length, gReport );
+      }
+   }
+}
+
+bool LogStart( FILE *report )
+{
+   bool result= false;
+   int rc;
+
+   if ( gStarted )
+   {
+      goto exit;
+   }
+
+   if ( !gKeyCreated )
+   {
+      if ( pthread_key_create( &gRingKey, logReleaseRing ) )
+      {
+         fprintf(stderr,"Error: LogStart: unable to create thread key\n");
+         goto exit;
+      }
+      gKeyCreated= true;
+   }
+
+   gReport= report;
+   gStopRequested= false;
+   __atomic_store_n( &gStarted, true, __ATOMIC_RELEASE );
+
+   rc= pthread_create( &gWriterThreadId, NULL, logWriterThread, NULL );
+   if ( rc )
+   {
+      fprintf(stderr,"Error: LogStart: unable to start writer thread: rc %d\n", rc);
+      __atomic_store_n( &gStarted, false, __ATOMIC_RELEASE );
+      goto exit;
+   }
+
+   result= true;
+
+exit:
+   return result;
+}
+
+void LogStop( void )
+{
+   unsigned int dropped;
+
+   if ( !gStarted )
+   {
+      return;
+   }
+
+   __atomic_store_n( &gStopRequested, true, __ATOMIC_RELEASE );
+   pthread_join( gWriterThreadId, NULL );
+
+   /* Pick up anything logged while the writer was finishing */
+   __atomic_store_n( &gStarted, false, __ATOMIC_RELEASE );
+   logWritePending();
+
+   dropped= __atomic_exchange_n( &gDropped, 0, __ATOMIC_RELAXED );
+   if ( dropped )
+   {
+      fprintf(stderr,"log: %u verbose records dropped\n", dropped);
+      if ( gReport )
+      {
+         fprintf(gReport,"log: %u verbose records dropped\n", dropped);
+      }
+   }
+   fflush( stderr );
+   gReport= 0;
+}
+
+void LogVPrintf( int level, bool toReport, const char *fmt, va_list argptr )
+{
+   LogRing *ring= 0;
+   LogRecord *record;
+   unsigned int head;
+   int length;
+
+   if ( __atomic_load_n( &gStarted, __ATOMIC_ACQUIRE ) )
+   {
+      ring= logGetRing();
+   }
+   if ( !ring )
+   {
+      logWriteSync( toReport, fmt, argptr );
+      return;
+   }
+
+   head= ring->head;
+   while ( head-__atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) >= LOG_RING_SIZE )
+   {
+      if ( !__atomic_load_n( &gStarted, __ATOMIC_ACQUIRE ) )
+      {
+         logWriteSync( toReport, fmt, argptr );
+         return;
+      }
+      if ( level > 0 )
+      {
+         __atomic_fetch_add( &gDropped, 1, __ATOMIC_RELAXED );
+         return;
+      }
+      usleep( 100 );
+   }
+
+   record= &ring->records[head % LOG_RING_SIZE];
+   length= vsnprintf( record->text, sizeof(record->text), fmt, argptr );
+   if ( length >= (int)sizeof(record->text) )
+   {
+      length= sizeof(record->text)-1;
+   }
+   record->length= (length > 0) ? length : 0;
+   record->toReport= toReport;
+   record->seq= __atomic_fetch_add( &gSeq, 1, __ATOMIC_RELAXED );
+   __atomic_store_n( &ring->head, head+1, __ATOMIC_RELEASE );
+}
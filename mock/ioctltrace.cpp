@@ -0,0 +1,702 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include "ioctltrace.h"
+
+#include <map>
+#include <deque>
+#include <vector>
+
+#define TRACE_MAGIC (0x52543456) /* "V4TR" */
+#define TRACE_VERSION (1)
+
+#define TRACE_OPEN (1)
+#define TRACE_CLOSE (2)
+#define TRACE_IOCTL (3)
+#define TRACE_POLL (4)
+
+#define TRACE_MAX_ARG_SIZE (16384)
+
+typedef struct _TraceFileHeader
+{
+   uint32_t magic;
+   uint32_t version;
+} TraceFileHeader;
+
+typedef struct _TraceRecordHeader
+{
+   uint32_t kind;
+   int32_t session;
+   uint32_t request;
+   int32_t rc;
+   int32_t err;
+   uint32_t argSize;
+   uint32_t extraSize;
+   uint32_t reserved;
+   int64_t startTime;
+   int64_t duration;
+} TraceRecordHeader;
+
+typedef struct _TraceRecord
+{
+   TraceRecordHeader hdr;
+   std::vector<unsigned char> arg;
+   std::vector<unsigned char> extra;
+} TraceRecord;
+
+typedef struct _TraceSession
+{
+   int fd;
+   long long openTime;
+   long long replayOpenTime;
+   std::map<uint64_t, std::deque<int> > pending;
+   std::map<uint64_t, uint32_t> planeLength;
+   bool warned;
+} TraceSession;
+
+typedef struct _TraceRecorder
+{
+   pthread_mutex_t mutex;
+   FILE *file;
+   long long baseTime;
+   int nextSession;
+   std::map<int, int> sessions;
+   int recordCount;
+} TraceRecorder;
+
+typedef struct _TraceReplay
+{
+   pthread_mutex_t mutex;
+   std::vector<TraceRecord> records;
+   std::vector<TraceSession> sessions;
+   int nextSession;
+} TraceReplay;
+
+static TraceRecorder *gRecorder= 0;
+static TraceReplay *gReplay= 0;
+
+extern bool gVerbose;
+
+static long long traceTimeMicros( void )
+{
+   struct timespec tm;
+
+   clock_gettime( CLOCK_MONOTONIC, &tm );
+
+   return tm.tv_sec*1000000LL + tm.tv_nsec/1000LL;
+}
+
+static uint32_t traceQueueType( unsigned int request, void *arg )
+{
+   switch( request )
+   {
+      case VIDIOC_QBUF:
+      case VIDIOC_DQBUF:
+      case VIDIOC_QUERYBUF:
+         return ((struct v4l2_buffer*)arg)->type;
+      case VIDIOC_EXPBUF:
+         return ((struct v4l2_exportbuffer*)arg)->type;
+      case VIDIOC_REQBUFS:
+         return ((struct v4l2_requestbuffers*)arg)->type;
+      case VIDIOC_STREAMON:
+      case VIDIOC_STREAMOFF:
+         return *(uint32_t*)arg;
+      case VIDIOC_G_FMT:
+      case VIDIOC_S_FMT:
+      case VIDIOC_TRY_FMT:
+         return ((struct v4l2_format*)arg)->type;
+      case VIDIOC_ENUM_FMT:
+         return ((struct v4l2_fmtdesc*)arg)->type;
+      case VIDIOC_G_SELECTION:
+         return ((struct v4l2_selection*)arg)->type;
+      default:
+         return 0;
+   }
+}
+
+static bool traceHasPlanes( unsigned int request, void *arg )
+{
+   if ( (request == VIDIOC_QBUF) || (request == VIDIOC_DQBUF) || (request == VIDIOC_QUERYBUF) )
+   {
+      struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
+      return buf->m.planes &&
+             ((buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) || (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE));
+   }
+   return false;
+}
+
+static bool traceBlocking( unsigned int request )
+{
+   /* Calls whose completion time reflects the device rather than the caller */
+   return (request == VIDIOC_DQBUF) || (request == VIDIOC_DQEVENT);
+}
+
+static void traceWriteRecord( TraceRecordHeader *hdr, const void *arg, const void *extra )
+{
+   fwrite( hdr, sizeof(TraceRecordHeader), 1, gRecorder->file );
+   if ( hdr->argSize )
+   {
+      fwrite( arg, hdr->argSize, 1, gRecorder->file );
+   }
+   if ( hdr->extraSize )
+   {
+      fwrite( extra, hdr->extraSize, 1, gRecorder->file );
+   }
+   ++gRecorder->recordCount;
+}
+
+bool TraceRecordStart( const char *filename )
+{
+   bool result= false;
+   TraceFileHeader hdr;
+
+   gRecorder= new TraceRecorder();
+   pthread_mutex_init( &gRecorder->mutex, 0 );
+   gRecorder->file= fopen( filename, "wb" );
+   if ( !gRecorder->file )
+   {
+      fprintf(stderr,"Error: TraceRecordStart: unable to create trace file (%s) errno %d\n", filename, errno);
+      goto exit;
+   }
+   hdr.magic= TRACE_MAGIC;
+   hdr.version= TRACE_VERSION;
+   fwrite( &hdr, sizeof(hdr), 1, gRecorder->file );
+   gRecorder->baseTime= traceTimeMicros();
+   gRecorder->nextSession= 0;
+   gRecorder->recordCount= 0;
+
+   result= true;
+
+exit:
+   if ( !result )
+   {
+      TraceRecordStop();
+   }
+   return result;
+}
+
+void TraceRecordStop( void )
+{
+   if ( gRecorder )
+   {
+      if ( gRecorder->file )
+      {
+         if ( gVerbose )
+         {
+            fprintf(stderr,"TraceRecordStop: %d records in %d sessions\n", gRecorder->recordCount, gRecorder->nextSession);
+         }
+         fclose( gRecorder->file );
+      }
+      pthread_mutex_destroy( &gRecorder->mutex );
+      delete gRecorder;
+      gRecorder= 0;
+   }
+}
+
+bool TraceRecording( void )
+{
+   return (gRecorder != 0);
+}
+
+void TraceRecordOpen( int fd )
+{
+   TraceRecordHeader hdr;
+
+   if ( !gRecorder || (fd < 0) )
+   {
+      return;
+   }
+   pthread_mutex_lock( &gRecorder->mutex );
+   memset( &hdr, 0, sizeof(hdr) );
+   hdr.kind= TRACE_OPEN;
+   hdr.session= gRecorder->nextSession++;
+   hdr.startTime= traceTimeMicros()-gRecorder->baseTime;
+   gRecorder->sessions[fd]= hdr.session;
+   traceWriteRecord( &hdr, 0, 0 );
+   pthread_mutex_unlock( &gRecorder->mutex );
+}
+
+void TraceRecordClose( int fd )
+{
+   TraceRecordHeader hdr;
+   std::map<int,int>::iterator it;
+
+   if ( !gRecorder )
+   {
+      return;
+   }
+   pthread_mutex_lock( &gRecorder->mutex );
+   it= gRecorder->sessions.find( fd );
+   if ( it != gRecorder->sessions.end() )
+   {
+      memset( &hdr, 0, sizeof(hdr) );
+      hdr.kind= TRACE_CLOSE;
+      hdr.session= it->second;
+      hdr.startTime= traceTimeMicros()-gRecorder->baseTime;
+      traceWriteRecord( &hdr, 0, 0 );
+      gRecorder->sessions.erase( it );
+   }
+   pthread_mutex_unlock( &gRecorder->mutex );
+}
+
+void TraceRecordIoctl( int fd, unsigned int request, void *arg, int rc, int err, long long startTime, long long endTime )
+{
+   TraceRecordHeader hdr;
+   std::map<int,int>::iterator it;
+   const void *extra= 0;
+
+   if ( !gRecorder )
+   {
+      return;
+   }
+   pthread_mutex_lock( &gRecorder->mutex );
+   it= gRecorder->sessions.find( fd );
+   if ( it != gRecorder->sessions.end() )
+   {
+      memset( &hdr, 0, sizeof(hdr) );
+      hdr.kind= TRACE_IOCTL;
+      hdr.session= it->second;
+      hdr.request= request;
+      hdr.rc= rc;
+      hdr.err= (rc < 0) ? err : 0;
+      hdr.startTime= startTime-gRecorder->baseTime;
+      hdr.duration= endTime-startTime;
+      hdr.argSize= (arg && (_IOC_DIR(request) != _IOC_NONE)) ? _IOC_SIZE(request) : 0;
+      if ( hdr.argSize > TRACE_MAX_ARG_SIZE )
+      {
+         hdr.argSize= 0;
+      }
+      if ( traceHasPlanes( request, arg ) )
+      {
+         struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
+         hdr.extraSize= buf->length*sizeof(struct v4l2_plane);
+         extra= buf->m.planes;
+      }
+      traceWriteRecord( &hdr, arg, extra );
+   }
+   pthread_mutex_unlock( &gRecorder->mutex );
+}
+
+void TraceRecordPoll( int fd, short events, short revents, int rc, long long startTime, long long endTime )
+{
+   TraceRecordHeader hdr;
+   std::map<int,int>::iterator it;
+   int16_t ev[2];
+
+   if ( !gRecorder )
+   {
+      return;
+   }
+   pthread_mutex_lock( &gRecorder->mutex );
+   it= gRecorder->sessions.find( fd );
+   if ( it != gRecorder->sessions.end() )
+   {
+      memset( &hdr, 0, sizeof(hdr) );
+      hdr.kind= TRACE_POLL;
+      hdr.session= it->second;
+      hdr.rc= rc;
+      hdr.startTime= startTime-gRecorder->baseTime;
+      hdr.duration= endTime-startTime;
+      hdr.argSize= sizeof(ev);
+      ev[0]= events;
+      ev[1]= revents;
+      traceWriteRecord( &hdr, ev, 0 );
+   }
+   pthread_mutex_unlock( &gRecorder->mutex );
+}
+
+bool TraceReplayStart( const char *filename )
+{
+   bool result= false;
+   TraceFileHeader fileHdr;
+   FILE *file= 0;
+   int count= 0;
+
+   gReplay= new TraceReplay();
+   pthread_mutex_init( &gReplay->mutex, 0 );
+   gReplay->nextSession= 0;
+
+   file= fopen( filename, "rb" );
+   if ( !file )
+   {
+      fprintf(stderr,"Error: TraceReplayStart: unable to open trace file (%s) errno %d\n", filename, errno);
+      goto exit;
+   }
+   if ( (fread( &fileHdr, sizeof(fileHdr), 1, file ) != 1) ||
+        (fileHdr.magic != TRACE_MAGIC) || (fileHdr.version != TRACE_VERSION) )
+   {
+      fprintf(stderr,"Error: TraceReplayStart: (%s) is not a v4l2test trace\n", filename);
+      goto exit;
+   }
+
+   for( ; ; )
+   {
+      TraceRecord rec;
+      if ( fread( &rec.hdr, sizeof(TraceRecordHeader), 1, file ) != 1 )
+      {
+         break;
+      }
+      if ( (rec.hdr.argSize > TRACE_MAX_ARG_SIZE) || (rec.hdr.extraSize > TRACE_MAX_ARG_SIZE) )
+      {
+         fprintf(stderr,"Error: TraceReplayStart: corrupt record %d\n", count);
+         goto exit;
+      }
+      rec.arg.resize( rec.hdr.argSize );
+      rec.extra.resize( rec.hdr.extraSize );
+      if ( (rec.hdr.argSize && (fread( &rec.arg[0], rec.hdr.argSize, 1, file ) != 1)) ||
+           (rec.hdr.extraSize && (fread( &rec.extra[0], rec.hdr.extraSize, 1, file ) != 1)) )
+      {
+         fprintf(stderr,"Warning: TraceReplayStart: truncated trace after %d records\n", count);
+         break;
+      }
+      if ( rec.hdr.session < 0 )
+      {
+         continue;
+      }
+      if ( rec.hdr.kind == TRACE_OPEN )
+      {
+         if ( gReplay->sessions.size() <= (size_t)rec.hdr.session )
+         {
+            gReplay->sessions.resize( rec.hdr.session+1 );
+         }
+         gReplay->sessions[rec.hdr.session].fd= -1;
+         gReplay->sessions[rec.hdr.session].openTime= rec.hdr.startTime;
+      }
+      else if ( (rec.hdr.kind == TRACE_IOCTL) || (rec.hdr.kind == TRACE_POLL) )
+      {
+         uint64_t key;
+         if ( (size_t)rec.hdr.session >= gReplay->sessions.size() )
+         {
+            continue;
+         }
+         key= ((uint64_t)rec.hdr.request << 32);
+         if ( rec.hdr.kind == TRACE_IOCTL )
+         {
+            key |= (rec.hdr.argSize ? traceQueueType( rec.hdr.request, &rec.arg[0] ) : 0);
+         }
+         gReplay->sessions[rec.hdr.session].pending[key].push_back( gReplay->records.size() );
+      }
+      gReplay->records.push_back( rec );
+      ++count;
+   }
+
+   if ( gVerbose )
+   {
+      fprintf(stderr,"TraceReplayStart: loaded %d records in %d sessions from (%s)\n", count, (int)gReplay->sessions.size(), filename);
+   }
+
+   result= true;
+
+exit:
+   if ( file )
+   {
+      fclose( file );
+   }
+   if ( !result )
+   {
+      TraceReplayStop();
+   }
+   return result;
+}
+
+void TraceReplayStop( void )
+{
+   if ( gReplay )
+   {
+      for( size_t i= 0; i < gReplay->sessions.size(); ++i )
+      {
+         if ( gReplay->sessions[i].fd >= 0 )
+         {
+            close( gReplay->sessions[i].fd );
+         }
+      }
+      pthread_mutex_destroy( &gReplay->mutex );
+      delete gReplay;
+      gReplay= 0;
+   }
+}
+
+static TraceSession *traceReplaySession( int fd )
+{
+   for( size_t i= 0; i < gReplay->sessions.size(); ++i )
+   {
+      if ( gReplay->sessions[i].fd == fd )
+      {
+         return &gReplay->sessions[i];
+      }
+   }
+   return 0;
+}
+
+int TraceReplayOpen( void )
+{
+   TraceSession *session;
+   int fd= -1;
+
+   if ( !gReplay )
+   {
+      errno= ENODEV;
+      return -1;
+   }
+   pthread_mutex_lock( &gReplay->mutex );
+   if ( (size_t)gReplay->nextSession >= gReplay->sessions.size() )
+   {
+      fprintf(stderr,"Error: TraceReplayOpen: trace has only %d sessions\n", (int)gReplay->sessions.size());
+      errno= ENODEV;
+      goto exit;
+   }
+   session= &gReplay->sessions[gReplay->nextSession++];
+   /* The eventfd only provides a unique descriptor for the replayed session */
+   fd= eventfd( 0, EFD_CLOEXEC );
+   if ( fd >= 0 )
+   {
+      session->fd= fd;
+      session->replayOpenTime= traceTimeMicros();
+   }
+
+exit:
+   pthread_mutex_unlock( &gReplay->mutex );
+   return fd;
+}
+
+int TraceReplayClose( int fd )
+{
+   TraceSession *session;
+
+   pthread_mutex_lock( &gReplay->mutex );
+   session= traceReplaySession( fd );
+   if ( session )
+   {
+      session->fd= -1;
+   }
+   pthread_mutex_unlock( &gReplay->mutex );
+
+   return close( fd );
+}
+
+bool TraceReplayIsDevice( int fd )
+{
+   bool result;
+
+   if ( !gReplay )
+   {
+      return false;
+   }
+   pthread_mutex_lock( &gReplay->mutex );
+   result= (traceReplaySession( fd ) != 0);
+   pthread_mutex_unlock( &gReplay->mutex );
+
+   return result;
+}
+
+static TraceRecord *traceReplayNext( TraceSession *session, uint64_t key )
+{
+   std::map<uint64_t, std::deque<int> >::iterator it;
+   TraceRecord *rec= 0;
+
+   it= session->pending.find( key );
+   if ( (it != session->pending.end()) && !it->second.empty() )
+   {
+      rec= &gReplay->records[it->second.front()];
+      it->second.pop_front();
+   }
+
+   return rec;
+}
+
+static void traceReplayWait( TraceSession *session, TraceRecord *rec, long long callTime, bool blocking )
+{
+   long long deadline, now;
+
+   /* Every call takes at least as long as it did; blocking calls also keep the device's schedule */
+   deadline= callTime + rec->hdr.duration;
+   if ( blocking )
+   {
+      long long scheduled= session->replayOpenTime + (rec->hdr.startTime + rec->hdr.duration - session->openTime);
+      if ( scheduled > deadline )
+      {
+         deadline= scheduled;
+      }
+   }
+   now= traceTimeMicros();
+   if ( deadline > now )
+   {
+      usleep( deadline-now );
+   }
+}
+
+int TraceReplayIoctl( int fd, unsigned int request, void *arg )
+{
+   TraceSession *session;
+   TraceRecord *rec;
+   TraceRecord copy;
+   long long callTime= traceTimeMicros();
+   uint64_t key;
+
+   pthread_mutex_lock( &gReplay->mutex );
+   session= traceReplaySession( fd );
+   if ( !session )
+   {
+      pthread_mutex_unlock( &gReplay->mutex );
+      errno= EBADF;
+      return -1;
+   }
+   key= ((uint64_t)request << 32) | (arg ? traceQueueType( request, arg ) : 0);
+   rec= traceReplayNext( session, key );
+   if ( rec )
+   {
+      copy= *rec;
+   }
+   else if ( !session->warned && gVerbose )
+   {
+      session->warned= true;
+      fprintf(stderr,"TraceReplayIoctl: trace exhausted for request %x\n", request);
+   }
+   pthread_mutex_unlock( &gReplay->mutex );
+
+   if ( !rec )
+   {
+      /* Past the end of the trace the capture queue behaves as if it had been drained */
+      errno= ((request == VIDIOC_DQBUF) && V4L2_TYPE_IS_CAPTURE(traceQueueType( request, arg ))) ? EPIPE : EINVAL;
+      return -1;
+   }
+
+   traceReplayWait( session, &copy, callTime, traceBlocking( request ) );
+
+   if ( copy.hdr.argSize == _IOC_SIZE(request) )
+   {
+      if ( traceHasPlanes( request, arg ) )
+      {
+         struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
+         struct v4l2_plane *planes= buf->m.planes;
+         uint32_t length= buf->length;
+         memcpy( arg, &copy.arg[0], copy.hdr.argSize );
+         buf->m.planes= planes;
+         if ( copy.hdr.extraSize && (buf->length <= length) )
+         {
+            memcpy( planes, &copy.extra[0], buf->length*sizeof(struct v4l2_plane) );
+         }
+         if ( request == VIDIOC_QUERYBUF )
+         {
+            pthread_mutex_lock( &gReplay->mutex );
+            for( uint32_t j= 0; j < buf->length; ++j )
+            {
+               session->planeLength[((uint64_t)buf->type << 32)|(buf->index << 8)|j]= planes[j].length;
+            }
+            pthread_mutex_unlock( &gReplay->mutex );
+         }
+      }
+      else if ( request == VIDIOC_EXPBUF )
+      {
+         struct v4l2_exportbuffer *eb= (struct v4l2_exportbuffer*)arg;
+         uint32_t length;
+         memcpy( arg, &copy.arg[0], copy.hdr.argSize );
+         eb->fd= -1;
+         if ( copy.hdr.rc == 0 )
+         {
+            /* Stand in for the exported buffer with a memfd of the size the device reported */
+            pthread_mutex_lock( &gReplay->mutex );
+            length= session->planeLength[((uint64_t)eb->type << 32)|(eb->index << 8)|eb->plane];
+            pthread_mutex_unlock( &gReplay->mutex );
+            eb->fd= memfd_create( "v4l2test-replay", MFD_CLOEXEC );
+            if ( (eb->fd >= 0) && (ftruncate( eb->fd, length ? length : 4096 ) < 0) )
+            {
+               close( eb->fd );
+               eb->fd= -1;
+            }
+            if ( eb->fd < 0 )
+            {
+               fprintf(stderr,"TraceReplayIoctl: failed to create replay buffer: errno %d\n", errno);
+               copy.hdr.rc= -1;
+               copy.hdr.err= errno;
+            }
+         }
+      }
+      else if ( (request == VIDIOC_G_EXT_CTRLS) || (request == VIDIOC_S_EXT_CTRLS) || (request == VIDIOC_TRY_EXT_CTRLS) )
+      {
+         /* Only the header is recorded, so keep the caller's controls pointer and values */
+         struct v4l2_ext_controls *recorded= (struct v4l2_ext_controls*)&copy.arg[0];
+         ((struct v4l2_ext_controls*)arg)->error_idx= recorded->error_idx;
+      }
+      else if ( _IOC_DIR(request) & _IOC_READ )
+      {
+         memcpy( arg, &copy.arg[0], copy.hdr.argSize );
+      }
+   }
+
+   if ( copy.hdr.rc < 0 )
+   {
+      errno= copy.hdr.err;
+   }
+   return copy.hdr.rc;
+}
+
+void *TraceReplayMmap( int fd, size_t length, int prot, int flags, off_t offset )
+{
+   /* Input data written by the test is discarded so anonymous memory will do */
+   return mmap( NULL, length, prot, MAP_SHARED|MAP_ANONYMOUS, -1, 0 );
+}
+
+int TraceReplayPoll( int fd, short events, short *revents, int timeout )
+{
+   TraceSession *session;
+   TraceRecord *rec;
+   TraceRecord copy;
+   long long callTime= traceTimeMicros();
+   int16_t ev[2];
+
+   pthread_mutex_lock( &gReplay->mutex );
+   session= traceReplaySession( fd );
+   rec= session ? traceReplayNext( session, 0 ) : 0;
+   if ( rec )
+   {
+      copy= *rec;
+   }
+   pthread_mutex_unlock( &gReplay->mutex );
+
+   if ( !rec || (copy.hdr.argSize != sizeof(ev)) )
+   {
+      /* Let the caller discover the end of the trace through DQBUF */
+      *revents= (events & (POLLIN | POLLRDNORM));
+      return 1;
+   }
+
+   traceReplayWait( session, &copy, callTime, true );
+
+   memcpy( ev, &copy.arg[0], sizeof(ev) );
+   *revents= ev[1];
+
+   return copy.hdr.rc;
+}
+
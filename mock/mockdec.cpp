@@ -0,0 +1,1103 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <memory.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+#include <linux/udmabuf.h>
+
+#include "mockdec.h"
+
+#define MOCK_MAX_BUFFERS (32)
+#define MOCK_MAX_PLANES (2)
+#define MOCK_MAX_EVENTS (8)
+#define MOCK_MIN_CAPTURE_BUFFERS (4)
+#define MOCK_INPUT_SIZE (1024*1024)
+#define MOCK_OFFSET_STRIDE (0x1000000)
+
+#define MOCK_DEFAULT_LATENCY (8)
+#define MOCK_DEFAULT_FPS (240)
+
+typedef struct _MockBuffer
+{
+   int planeCount;
+   int memFd[MOCK_MAX_PLANES];
+   int dmabufFd[MOCK_MAX_PLANES];
+   int importFd[MOCK_MAX_PLANES];
+   void *map[MOCK_MAX_PLANES];
+   uint32_t length[MOCK_MAX_PLANES];
+   uint32_t bytesUsed[MOCK_MAX_PLANES];
+   uint32_t flags;
+   struct timeval timestamp;
+   bool queued;
+   bool done;
+   uint32_t queueSeq;
+   uint32_t doneSeq;
+   long long queueTime;
+} MockBuffer;
+
+typedef struct _MockQueue
+{
+   struct v4l2_format fmt;
+   uint32_t memory;
+   int count;
+   bool streaming;
+   MockBuffer buffers[MOCK_MAX_BUFFERS];
+} MockQueue;
+
+typedef struct _MockDev
+{
+   struct _MockDev *next;
+   int fd;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   pthread_t workerThreadId;
+   bool workerStarted;
+   bool workerStopRequested;
+   int latency;
+   int fps;
+   bool pattern;
+   bool haveUdmabuf;
+   MockQueue in;
+   MockQueue out;
+   uint32_t seq;
+   uint32_t frameCount;
+   long long lastReadyTime;
+   bool subscribedEOS;
+   bool subscribedSourceChange;
+   int eventCount;
+   struct v4l2_event events[MOCK_MAX_EVENTS];
+   bool drainPending;
+   bool lastQueued;
+   bool lastDequeued;
+} MockDev;
+
+static pthread_mutex_t gMockMutex= PTHREAD_MUTEX_INITIALIZER;
+static MockDev *gMockDevs= 0;
+
+extern bool gVerbose;
+
+static long long mockTimeMicros( void )
+{
+   struct timespec tm;
+
+   clock_gettime( CLOCK_MONOTONIC, &tm );
+
+   return tm.tv_sec*1000000LL + tm.tv_nsec/1000LL;
+}
+
+static MockDev *mockFind( int fd )
+{
+   MockDev *dev;
+
+   pthread_mutex_lock( &gMockMutex );
+   for( dev= gMockDevs; dev; dev= dev->next )
+   {
+      if ( dev->fd == fd )
+      {
+         break;
+      }
+   }
+   pthread_mutex_unlock( &gMockMutex );
+
+   return dev;
+}
+
+static void mockParseOptions( MockDev *dev, const char *name )
+{
+   const char *s;
+   int value;
+
+   dev->latency= MOCK_DEFAULT_LATENCY;
+   dev->fps= MOCK_DEFAULT_FPS;
+   dev->pattern= true;
+
+   s= strchr( name, ':' );
+   while( s && *s )
+   {
+      ++s;
+      if ( sscanf( s, "latency=%d", &value ) == 1 )
+      {
+         dev->latency= (value >= 0) ? value : 0;
+      }
+      else if ( sscanf( s, "fps=%d", &value ) == 1 )
+      {
+         dev->fps= value;
+      }
+      else if ( sscanf( s, "pattern=%d", &value ) == 1 )
+      {
+         dev->pattern= (value != 0);
+      }
+      else
+      {
+         fprintf(stderr,"mockdec: ignoring unknown option (%s)\n", s);
+      }
+      s= strchr( s, ',' );
+   }
+}
+
+static bool mockAllocPlane( MockDev *dev, MockBuffer *buff, int plane, uint32_t size )
+{
+   bool result= false;
+   int rc;
+
+   size= (size + 4095) & ~4095;
+
+   buff->memFd[plane]= memfd_create( "v4l2test-mock", MFD_CLOEXEC|MFD_ALLOW_SEALING );
+   if ( buff->memFd[plane] < 0 )
+   {
+      fprintf(stderr,"mockdec: memfd_create failed: errno %d\n", errno);
+      goto exit;
+   }
+   rc= ftruncate( buff->memFd[plane], size );
+   if ( rc < 0 )
+   {
+      fprintf(stderr,"mockdec: ftruncate %u failed: errno %d\n", size, errno);
+      goto exit;
+   }
+   buff->map[plane]= mmap( NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, buff->memFd[plane], 0 );
+   if ( buff->map[plane] == MAP_FAILED )
+   {
+      buff->map[plane]= 0;
+      fprintf(stderr,"mockdec: mmap failed: errno %d\n", errno);
+      goto exit;
+   }
+   buff->length[plane]= size;
+
+   /* Wrap the memfd in a real dma-buf when udmabuf is available so EGL can import it */
+   if ( dev->haveUdmabuf )
+   {
+      struct udmabuf_create create;
+      int udmabufFd;
+
+      udmabufFd= open( "/dev/udmabuf", O_RDWR|O_CLOEXEC );
+      if ( udmabufFd >= 0 )
+      {
+         fcntl( buff->memFd[plane], F_ADD_SEALS, F_SEAL_SHRINK );
+         memset( &create, 0, sizeof(create) );
+         create.memfd= buff->memFd[plane];
+         create.flags= UDMABUF_FLAGS_CLOEXEC;
+         create.offset= 0;
+         create.size= size;
+         buff->dmabufFd[plane]= ioctl( udmabufFd, UDMABUF_CREATE, &create );
+         close( udmabufFd );
+      }
+      if ( buff->dmabufFd[plane] < 0 )
+      {
+         fprintf(stderr,"mockdec: udmabuf unavailable, exporting plain memfds\n");
+         buff->dmabufFd[plane]= -1;
+         dev->haveUdmabuf= false;
+      }
+   }
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static void mockFreeBuffers( MockQueue *queue )
+{
+   int i, j;
+
+   for( i= 0; i < queue->count; ++i )
+   {
+      MockBuffer *buff= &queue->buffers[i];
+      for( j= 0; j < buff->planeCount; ++j )
+      {
+         /* Imported dma-bufs are mapped but owned by the application */
+         if ( buff->map[j] )
+         {
+            munmap( buff->map[j], buff->length[j] );
+         }
+         if ( buff->dmabufFd[j] >= 0 )
+         {
+            close( buff->dmabufFd[j] );
+         }
+         if ( buff->memFd[j] >= 0 )
+         {
+            close( buff->memFd[j] );
+         }
+      }
+   }
+   memset( queue->buffers, 0, sizeof(queue->buffers) );
+   queue->count= 0;
+}
+
+static void mockPostEvent( MockDev *dev, uint32_t type )
+{
+   struct v4l2_event *event;
+
+   if ( dev->eventCount >= MOCK_MAX_EVENTS )
+   {
+      return;
+   }
+   event= &dev->events[dev->eventCount++];
+   memset( event, 0, sizeof(*event) );
+   event->type= type;
+   event->sequence= dev->seq++;
+   if ( type == V4L2_EVENT_SOURCE_CHANGE )
+   {
+      event->u.src_change.changes= V4L2_EVENT_SRC_CH_RESOLUTION;
+   }
+   pthread_cond_broadcast( &dev->cond );
+}
+
+static MockBuffer *mockOldest( MockQueue *queue, bool done )
+{
+   MockBuffer *oldest= 0;
+   int i;
+
+   for( i= 0; i < queue->count; ++i )
+   {
+      MockBuffer *buff= &queue->buffers[i];
+      if ( buff->queued && (buff->done == done) )
+      {
+         if ( !oldest ||
+              (done && ((int32_t)(buff->doneSeq-oldest->doneSeq) < 0)) ||
+              (!done && ((int32_t)(buff->queueSeq-oldest->queueSeq) < 0)) )
+         {
+            oldest= buff;
+         }
+      }
+   }
+
+   return oldest;
+}
+
+static void mockGenerateFrame( MockDev *dev, MockBuffer *buff )
+{
+   int width= dev->out.fmt.fmt.pix_mp.width;
+   int height= dev->out.fmt.fmt.pix_mp.height;
+   int stride= dev->out.fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+   unsigned char *luma= (unsigned char*)buff->map[0];
+   unsigned char *chroma= (unsigned char*)buff->map[1];
+   int barX, row;
+
+   if ( !luma || !chroma )
+   {
+      return;
+   }
+
+   /* Scrolling luma ramp with a moving vertical bar so motion and tearing are visible */
+   barX= (dev->frameCount*8) % (width > 32 ? width-32 : 1);
+   for( row= 0; row < height; ++row )
+   {
+      unsigned char *line= luma+row*stride;
+      memset( line, (row+dev->frameCount*4) & 0xFF, width );
+      if ( width > 32 )
+      {
+         memset( line+barX, 235, 32 );
+      }
+   }
+   memset( chroma, 128, stride*height/2 );
+}
+
+static void *mockWorkerThread( void *arg )
+{
+   MockDev *dev= (MockDev*)arg;
+   MockBuffer *in, *out;
+   long long now, readyTime, period;
+   struct timespec ts;
+
+   period= (dev->fps > 0) ? 1000000LL/dev->fps : 0;
+
+   pthread_mutex_lock( &dev->mutex );
+   while( !dev->workerStopRequested )
+   {
+      in= dev->in.streaming ? mockOldest( &dev->in, false ) : 0;
+      out= dev->out.streaming ? mockOldest( &dev->out, false ) : 0;
+
+      if ( dev->drainPending && !in && out )
+      {
+         /* All input decoded: complete the drain with an empty buffer flagged last */
+         out->bytesUsed[0]= out->bytesUsed[1]= 0;
+         out->flags= V4L2_BUF_FLAG_LAST;
+         out->done= true;
+         out->doneSeq= dev->seq++;
+         dev->drainPending= false;
+         dev->lastQueued= true;
+         if ( dev->subscribedEOS )
+         {
+            mockPostEvent( dev, V4L2_EVENT_EOS );
+         }
+         pthread_cond_broadcast( &dev->cond );
+         continue;
+      }
+
+      if ( !in || !out )
+      {
+         pthread_cond_wait( &dev->cond, &dev->mutex );
+         continue;
+      }
+
+      /* A frame is ready after the decode latency, but no sooner than the throughput limit allows */
+      readyTime= in->queueTime + dev->latency*1000LL;
+      if ( dev->lastReadyTime && (readyTime < dev->lastReadyTime+period) )
+      {
+         readyTime= dev->lastReadyTime+period;
+      }
+      now= mockTimeMicros();
+      if ( now < readyTime )
+      {
+         ts.tv_sec= readyTime/1000000LL;
+         ts.tv_nsec= (readyTime%1000000LL)*1000LL;
+         pthread_cond_timedwait( &dev->cond, &dev->mutex, &ts );
+         continue;
+      }
+
+      if ( dev->pattern )
+      {
+         mockGenerateFrame( dev, out );
+      }
+      out->bytesUsed[0]= dev->out.fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+      out->bytesUsed[1]= dev->out.fmt.fmt.pix_mp.plane_fmt[1].sizeimage;
+      out->timestamp= in->timestamp;
+      out->flags= 0;
+      out->done= true;
+      out->doneSeq= dev->seq++;
+      in->done= true;
+      in->doneSeq= dev->seq++;
+      dev->lastReadyTime= readyTime;
+      ++dev->frameCount;
+      pthread_cond_broadcast( &dev->cond );
+   }
+   pthread_mutex_unlock( &dev->mutex );
+
+   return 0;
+}
+
+bool MockDecIsName( const char *name )
+{
+   return name && !strncmp( name, MOCKDEC_DEVICE_PREFIX, strlen(MOCKDEC_DEVICE_PREFIX) );
+}
+
+int MockDecOpen( const char *name )
+{
+   MockDev *dev= 0;
+   pthread_condattr_t attr;
+   int rc;
+
+   dev= (MockDev*)calloc( 1, sizeof(MockDev) );
+   if ( !dev )
+   {
+      errno= ENOMEM;
+      goto error;
+   }
+
+   /* The eventfd only provides a unique descriptor: it is never signalled */
+   dev->fd= eventfd( 0, EFD_CLOEXEC );
+   if ( dev->fd < 0 )
+   {
+      goto error;
+   }
+
+   mockParseOptions( dev, name );
+   dev->haveUdmabuf= (access( "/dev/udmabuf", R_OK|W_OK ) == 0);
+
+   pthread_mutex_init( &dev->mutex, 0 );
+   pthread_condattr_init( &attr );
+   pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+   pthread_cond_init( &dev->cond, &attr );
+   pthread_condattr_destroy( &attr );
+
+   dev->in.fmt.type= V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+   dev->in.fmt.fmt.pix_mp.pixelformat= V4L2_PIX_FMT_H264;
+   dev->in.fmt.fmt.pix_mp.num_planes= 1;
+   dev->in.fmt.fmt.pix_mp.plane_fmt[0].sizeimage= MOCK_INPUT_SIZE;
+   dev->out.fmt.type= V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+   dev->out.fmt.fmt.pix_mp.pixelformat= V4L2_PIX_FMT_NV12M;
+   dev->out.fmt.fmt.pix_mp.num_planes= 2;
+
+   rc= pthread_create( &dev->workerThreadId, NULL, mockWorkerThread, dev );
+   if ( rc )
+   {
+      errno= rc;
+      goto error;
+   }
+   dev->workerStarted= true;
+
+   if ( gVerbose )
+   {
+      fprintf(stderr,"mockdec: open fd %d latency %d ms fps %d pattern %d udmabuf %d\n",
+              dev->fd, dev->latency, dev->fps, dev->pattern, dev->haveUdmabuf);
+   }
+
+   pthread_mutex_lock( &gMockMutex );
+   dev->next= gMockDevs;
+   gMockDevs= dev;
+   pthread_mutex_unlock( &gMockMutex );
+
+   return dev->fd;
+
+error:
+   if ( dev )
+   {
+      if ( dev->fd >= 0 )
+      {
+         close( dev->fd );
+      }
+      free( dev );
+   }
+   return -1;
+}
+
+int MockDecClose( int fd )
+{
+   MockDev *dev, *prev= 0;
+
+   pthread_mutex_lock( &gMockMutex );
+   for( dev= gMockDevs; dev; prev= dev, dev= dev->next )
+   {
+      if ( dev->fd == fd )
+      {
+         if ( prev )
+            prev->next= dev->next;
+         else
+            gMockDevs= dev->next;
+         break;
+      }
+   }
+   pthread_mutex_unlock( &gMockMutex );
+
+   if ( !dev )
+   {
+      errno= EBADF;
+      return -1;
+   }
+
+   if ( dev->workerStarted )
+   {
+      pthread_mutex_lock( &dev->mutex );
+      dev->workerStopRequested= true;
+      pthread_cond_broadcast( &dev->cond );
+      pthread_mutex_unlock( &dev->mutex );
+      pthread_join( dev->workerThreadId, NULL );
+   }
+
+   mockFreeBuffers( &dev->in );
+   mockFreeBuffers( &dev->out );
+   pthread_cond_destroy( &dev->cond );
+   pthread_mutex_destroy( &dev->mutex );
+   close( dev->fd );
+   free( dev );
+
+   return 0;
+}
+
+bool MockDecIsDevice( int fd )
+{
+   return (mockFind( fd ) != 0);
+}
+
+static MockQueue *mockQueue( MockDev *dev, uint32_t type )
+{
+   if ( type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE )
+   {
+      return &dev->in;
+   }
+   if ( type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE )
+   {
+      return &dev->out;
+   }
+   return 0;
+}
+
+static void mockSetCaptureSize( MockDev *dev, int width, int height )
+{
+   struct v4l2_pix_format_mplane *pix= &dev->out.fmt.fmt.pix_mp;
+
+   pix->width= width;
+   pix->height= height;
+   pix->field= V4L2_FIELD_NONE;
+   pix->plane_fmt[0].bytesperline= (width+15) & ~15;
+   pix->plane_fmt[0].sizeimage= pix->plane_fmt[0].bytesperline*((height+15) & ~15);
+   pix->plane_fmt[1].bytesperline= pix->plane_fmt[0].bytesperline;
+   pix->plane_fmt[1].sizeimage= pix->plane_fmt[0].sizeimage/2;
+}
+
+static void mockFillBuffer( MockDev *dev, MockQueue *queue, int index, struct v4l2_buffer *buf )
+{
+   MockBuffer *buff= &queue->buffers[index];
+   int j;
+
+   buf->index= index;
+   buf->flags= buff->flags;
+   if ( buff->queued ) buf->flags |= (buff->done ? V4L2_BUF_FLAG_DONE : V4L2_BUF_FLAG_QUEUED);
+   buf->field= V4L2_FIELD_NONE;
+   buf->timestamp= buff->timestamp;
+   buf->sequence= buff->doneSeq;
+   buf->length= buff->planeCount;
+   buf->memory= queue->memory;
+   for( j= 0; (j < buff->planeCount) && buf->m.planes; ++j )
+   {
+      buf->m.planes[j].length= buff->length[j];
+      buf->m.planes[j].bytesused= buff->bytesUsed[j];
+      if ( queue->memory == V4L2_MEMORY_DMABUF )
+      {
+         buf->m.planes[j].m.fd= buff->importFd[j];
+      }
+      else
+      {
+         buf->m.planes[j].m.mem_offset= index*MOCK_OFFSET_STRIDE;
+      }
+      buf->m.planes[j].data_offset= 0;
+   }
+}
+
+static int mockReqBufs( MockDev *dev, struct v4l2_requestbuffers *rb )
+{
+   MockQueue *queue= mockQueue( dev, rb->type );
+   int i, j, count;
+
+   if ( !queue )
+   {
+      return EINVAL;
+   }
+   if ( (rb->memory != V4L2_MEMORY_MMAP) &&
+        !((rb->memory == V4L2_MEMORY_DMABUF) && (queue == &dev->out)) )
+   {
+      return EINVAL;
+   }
+   if ( queue->streaming && rb->count )
+   {
+      return EBUSY;
+   }
+
+   mockFreeBuffers( queue );
+   queue->memory= rb->memory;
+   if ( rb->count == 0 )
+   {
+      return 0;
+   }
+
+   count= rb->count;
+   if ( (queue == &dev->out) && (count < MOCK_MIN_CAPTURE_BUFFERS) )
+   {
+      count= MOCK_MIN_CAPTURE_BUFFERS;
+   }
+   if ( count > MOCK_MAX_BUFFERS )
+   {
+      count= MOCK_MAX_BUFFERS;
+   }
+   for( i= 0; i < count; ++i )
+   {
+      MockBuffer *buff= &queue->buffers[i];
+      buff->planeCount= queue->fmt.fmt.pix_mp.num_planes;
+      for( j= 0; j < MOCK_MAX_PLANES; ++j )
+      {
+         buff->memFd[j]= -1;
+         buff->dmabufFd[j]= -1;
+         buff->importFd[j]= -1;
+      }
+      queue->count= i+1;
+      if ( queue->memory == V4L2_MEMORY_DMABUF )
+      {
+         /* Memory is attached when the application queues its dma-bufs */
+         continue;
+      }
+      for( j= 0; j < buff->planeCount; ++j )
+      {
+         if ( !mockAllocPlane( dev, buff, j, queue->fmt.fmt.pix_mp.plane_fmt[j].sizeimage ) )
+         {
+            mockFreeBuffers( queue );
+            return ENOMEM;
+         }
+      }
+   }
+   rb->count= count;
+   rb->capabilities= V4L2_BUF_CAP_SUPPORTS_MMAP;
+   if ( queue == &dev->out )
+   {
+      rb->capabilities |= V4L2_BUF_CAP_SUPPORTS_DMABUF;
+   }
+
+   return 0;
+}
+
+static int mockStream( MockDev *dev, uint32_t type, bool on )
+{
+   MockQueue *queue= mockQueue( dev, type );
+   int i;
+
+   if ( !queue )
+   {
+      return EINVAL;
+   }
+
+   queue->streaming= on;
+   if ( !on )
+   {
+      /* Stopping a queue returns all of its buffers to the application */
+      for( i= 0; i < queue->count; ++i )
+      {
+         queue->buffers[i].queued= false;
+         queue->buffers[i].done= false;
+         queue->buffers[i].flags= 0;
+      }
+      if ( queue == &dev->out )
+      {
+         dev->lastQueued= false;
+         dev->lastDequeued= false;
+      }
+      else
+      {
+         dev->lastReadyTime= 0;
+      }
+   }
+   pthread_cond_broadcast( &dev->cond );
+
+   return 0;
+}
+
+static bool mockImportPlanes( MockDev *dev, MockQueue *queue, MockBuffer *buff, struct v4l2_buffer *buf )
+{
+   uint32_t length;
+   int j, fd;
+
+   for( j= 0; j < buff->planeCount; ++j )
+   {
+      fd= buf->m.planes[j].m.fd;
+      length= buf->m.planes[j].length;
+      if ( length < queue->fmt.fmt.pix_mp.plane_fmt[j].sizeimage )
+      {
+         return false;
+      }
+      if ( (fd == buff->importFd[j]) && buff->map[j] )
+      {
+         continue;
+      }
+      if ( buff->map[j] )
+      {
+         munmap( buff->map[j], buff->length[j] );
+         buff->map[j]= 0;
+      }
+
+      /* A buffer that can not be mapped is still decoded into, just without a pattern */
+      buff->map[j]= mmap( NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+      if ( buff->map[j] == MAP_FAILED )
+      {
+         buff->map[j]= 0;
+      }
+      buff->importFd[j]= fd;
+      buff->length[j]= length;
+   }
+
+   return true;
+}
+
+static int mockQBuf( MockDev *dev, struct v4l2_buffer *buf )
+{
+   MockQueue *queue= mockQueue( dev, buf->type );
+   MockBuffer *buff;
+
+   if ( !queue || (buf->index >= (uint32_t)queue->count) )
+   {
+      return EINVAL;
+   }
+   buff= &queue->buffers[buf->index];
+   if ( buff->queued )
+   {
+      return EINVAL;
+   }
+   if ( queue == &dev->in )
+   {
+      buff->bytesUsed[0]= buf->m.planes ? buf->m.planes[0].bytesused : 0;
+      buff->timestamp= buf->timestamp;
+   }
+   if ( queue->memory == V4L2_MEMORY_DMABUF )
+   {
+      if ( !buf->m.planes || (buf->length < (uint32_t)buff->planeCount) )
+      {
+         return EINVAL;
+      }
+      if ( !mockImportPlanes( dev, queue, buff, buf ) )
+      {
+         return EINVAL;
+      }
+   }
+   if ( (queue == &dev->out) && dev->lastDequeued )
+   {
+      /* Queuing a capture buffer after the last one restarts the decoder */
+      dev->lastDequeued= false;
+      dev->lastQueued= false;
+   }
+   buff->flags= 0;
+   buff->queued= true;
+   buff->done= false;
+   buff->queueSeq= dev->seq++;
+   buff->queueTime= mockTimeMicros();
+   mockFillBuffer( dev, queue, buf->index, buf );
+   pthread_cond_broadcast( &dev->cond );
+
+   return 0;
+}
+
+static int mockDQBuf( MockDev *dev, struct v4l2_buffer *buf )
+{
+   MockQueue *queue= mockQueue( dev, buf->type );
+   MockBuffer *buff;
+   int index;
+
+   if ( !queue )
+   {
+      return EINVAL;
+   }
+   for( ; ; )
+   {
+      if ( !queue->streaming )
+      {
+         return EINVAL;
+      }
+      if ( (queue == &dev->out) && dev->lastDequeued )
+      {
+         return EPIPE;
+      }
+      buff= mockOldest( queue, true );
+      if ( buff )
+      {
+         break;
+      }
+      pthread_cond_wait( &dev->cond, &dev->mutex );
+   }
+
+   index= buff-queue->buffers;
+   buff->queued= false;
+   buff->done= false;
+   if ( buff->flags & V4L2_BUF_FLAG_LAST )
+   {
+      dev->lastDequeued= true;
+   }
+   mockFillBuffer( dev, queue, index, buf );
+
+   return 0;
+}
+
+static int mockIoctl( MockDev *dev, unsigned int request, void *arg )
+{
+   switch( request )
+   {
+      case VIDIOC_QUERYCAP:
+         {
+            struct v4l2_capability *caps= (struct v4l2_capability*)arg;
+            memset( caps, 0, sizeof(*caps) );
+            strncpy( (char*)caps->driver, "v4l2test-mock", sizeof(caps->driver)-1 );
+            strncpy( (char*)caps->card, "mock decoder", sizeof(caps->card)-1 );
+            strncpy( (char*)caps->bus_info, "platform:mock", sizeof(caps->bus_info)-1 );
+            caps->device_caps= V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
+            caps->capabilities= caps->device_caps | V4L2_CAP_DEVICE_CAPS;
+         }
+         return 0;
+      case VIDIOC_ENUM_FMT:
+         {
+            struct v4l2_fmtdesc *desc= (struct v4l2_fmtdesc*)arg;
+            MockQueue *queue= mockQueue( dev, desc->type );
+            if ( !queue || (desc->index != 0) )
+            {
+               return EINVAL;
+            }
+            desc->flags= (queue == &dev->in) ? V4L2_FMT_FLAG_COMPRESSED : 0;
+            desc->pixelformat= queue->fmt.fmt.pix_mp.pixelformat;
+            snprintf( (char*)desc->description, sizeof(desc->description), "%s",
+                      (queue == &dev->in) ? "H.264" : "Y/CbCr 4:2:0 (N-C)" );
+         }
+         return 0;
+      case VIDIOC_G_FMT:
+      case VIDIOC_S_FMT:
+      case VIDIOC_TRY_FMT:
+         {
+            struct v4l2_format *fmt= (struct v4l2_format*)arg;
+            MockQueue *queue= mockQueue( dev, fmt->type );
+            if ( !queue )
+            {
+               return EINVAL;
+            }
+            if ( (request == VIDIOC_S_FMT) && (queue == &dev->in) )
+            {
+               /* Without parsing the stream the coded size comes from the output format */
+               if ( queue->count )
+               {
+                  return EBUSY;
+               }
+               if ( fmt->fmt.pix_mp.plane_fmt[0].sizeimage )
+               {
+                  queue->fmt.fmt.pix_mp.plane_fmt[0].sizeimage= fmt->fmt.pix_mp.plane_fmt[0].sizeimage;
+               }
+               queue->fmt.fmt.pix_mp.width= fmt->fmt.pix_mp.width;
+               queue->fmt.fmt.pix_mp.height= fmt->fmt.pix_mp.height;
+               mockSetCaptureSize( dev, fmt->fmt.pix_mp.width, fmt->fmt.pix_mp.height );
+            }
+            else if ( (request == VIDIOC_S_FMT) && dev->out.count )
+            {
+               return EBUSY;
+            }
+            *fmt= queue->fmt;
+         }
+         return 0;
+      case VIDIOC_REQBUFS:
+         return mockReqBufs( dev, (struct v4l2_requestbuffers*)arg );
+      case VIDIOC_QUERYBUF:
+         {
+            struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
+            MockQueue *queue= mockQueue( dev, buf->type );
+            if ( !queue || (buf->index >= (uint32_t)queue->count) )
+            {
+               return EINVAL;
+            }
+            mockFillBuffer( dev, queue, buf->index, buf );
+         }
+         return 0;
+      case VIDIOC_EXPBUF:
+         {
+            struct v4l2_exportbuffer *eb= (struct v4l2_exportbuffer*)arg;
+            MockQueue *queue= mockQueue( dev, eb->type );
+            MockBuffer *buff;
+            if ( !queue || (eb->index >= (uint32_t)queue->count) )
+            {
+               return EINVAL;
+            }
+            buff= &queue->buffers[eb->index];
+            if ( eb->plane >= (uint32_t)buff->planeCount )
+            {
+               return EINVAL;
+            }
+            eb->fd= fcntl( (buff->dmabufFd[eb->plane] >= 0) ? buff->dmabufFd[eb->plane] : buff->memFd[eb->plane],
+                           F_DUPFD_CLOEXEC, 0 );
+            if ( eb->fd < 0 )
+            {
+               return errno;
+            }
+         }
+         return 0;
+      case VIDIOC_QBUF:
+         return mockQBuf( dev, (struct v4l2_buffer*)arg );
+      case VIDIOC_DQBUF:
+         return mockDQBuf( dev, (struct v4l2_buffer*)arg );
+      case VIDIOC_STREAMON:
+      case VIDIOC_STREAMOFF:
+         return mockStream( dev, *(uint32_t*)arg, (request == VIDIOC_STREAMON) );
+      case VIDIOC_G_CTRL:
+         {
+            struct v4l2_control *ctl= (struct v4l2_control*)arg;
+            if ( ctl->id == V4L2_CID_MIN_BUFFERS_FOR_CAPTURE )
+            {
+               ctl->value= MOCK_MIN_CAPTURE_BUFFERS;
+               return 0;
+            }
+            if ( ctl->id == V4L2_CID_MIN_BUFFERS_FOR_OUTPUT )
+            {
+               ctl->value= 1;
+               return 0;
+            }
+         }
+         return EINVAL;
+      case VIDIOC_G_SELECTION:
+         {
+            struct v4l2_selection *sel= (struct v4l2_selection*)arg;
+            if ( (sel->type != V4L2_BUF_TYPE_VIDEO_CAPTURE) && (sel->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) )
+            {
+               return EINVAL;
+            }
+            sel->r.left= 0;
+            sel->r.top= 0;
+            sel->r.width= dev->out.fmt.fmt.pix_mp.width;
+            sel->r.height= dev->out.fmt.fmt.pix_mp.height;
+         }
+         return 0;
+      case VIDIOC_SUBSCRIBE_EVENT:
+         {
+            struct v4l2_event_subscription *sub= (struct v4l2_event_subscription*)arg;
+            if ( sub->type == V4L2_EVENT_EOS )
+               dev->subscribedEOS= true;
+            else if ( sub->type == V4L2_EVENT_SOURCE_CHANGE )
+               dev->subscribedSourceChange= true;
+            else
+               return EINVAL;
+         }
+         return 0;
+      case VIDIOC_DQEVENT:
+         {
+            struct v4l2_event *event= (struct v4l2_event*)arg;
+            if ( dev->eventCount == 0 )
+            {
+               return ENOENT;
+            }
+            *event= dev->events[0];
+            --dev->eventCount;
+            memmove( &dev->events[0], &dev->events[1], dev->eventCount*sizeof(struct v4l2_event) );
+            event->pending= dev->eventCount;
+         }
+         return 0;
+      case VIDIOC_TRY_DECODER_CMD:
+      case VIDIOC_DECODER_CMD:
+         {
+            struct v4l2_decoder_cmd *cmd= (struct v4l2_decoder_cmd*)arg;
+            if ( (cmd->cmd != V4L2_DEC_CMD_STOP) && (cmd->cmd != V4L2_DEC_CMD_START) )
+            {
+               return EINVAL;
+            }
+            if ( request == VIDIOC_DECODER_CMD )
+            {
+               if ( cmd->cmd == V4L2_DEC_CMD_STOP )
+                  dev->drainPending= true;
+               else
+                  dev->lastDequeued= dev->lastQueued= false;
+               pthread_cond_broadcast( &dev->cond );
+            }
+         }
+         return 0;
+      default:
+         break;
+   }
+
+   return ENOTTY;
+}
+
+int MockDecIoctl( int fd, unsigned int request, void *arg )
+{
+   MockDev *dev;
+   int err;
+
+   dev= mockFind( fd );
+   if ( !dev )
+   {
+      errno= EBADF;
+      return -1;
+   }
+
+   pthread_mutex_lock( &dev->mutex );
+   err= mockIoctl( dev, request, arg );
+   pthread_mutex_unlock( &dev->mutex );
+
+   if ( err )
+   {
+      errno= err;
+      return -1;
+   }
+
+   return 0;
+}
+
+void *MockDecMmap( int fd, size_t length, int prot, int flags, off_t offset )
+{
+   MockDev *dev;
+   MockBuffer *buff;
+   void *addr= MAP_FAILED;
+   int index;
+
+   dev= mockFind( fd );
+   if ( !dev )
+   {
+      errno= EBADF;
+      return MAP_FAILED;
+   }
+
+   pthread_mutex_lock( &dev->mutex );
+   index= offset/MOCK_OFFSET_STRIDE;
+   if ( (offset % MOCK_OFFSET_STRIDE) || (index >= dev->in.count) )
+   {
+      errno= EINVAL;
+   }
+   else
+   {
+      buff= &dev->in.buffers[index];
+      addr= mmap( NULL, length, prot, flags, buff->memFd[0], 0 );
+   }
+   pthread_mutex_unlock( &dev->mutex );
+
+   return addr;
+}
+
+int MockDecPoll( int fd, short events, short *revents, int timeout )
+{
+   MockDev *dev;
+   struct timespec ts;
+   long long deadline= 0;
+   int rc= 0;
+
+   dev= mockFind( fd );
+   if ( !dev )
+   {
+      *revents= POLLNVAL;
+      return 1;
+   }
+
+   if ( timeout > 0 )
+   {
+      deadline= mockTimeMicros() + timeout*1000LL;
+      ts.tv_sec= deadline/1000000LL;
+      ts.tv_nsec= (deadline%1000000LL)*1000LL;
+   }
+
+   pthread_mutex_lock( &dev->mutex );
+   for( ; ; )
+   {
+      *revents= 0;
+      if ( dev->eventCount )
+      {
+         *revents |= POLLPRI;
+      }
+      if ( dev->out.streaming && dev->lastDequeued )
+      {
+         *revents |= (POLLIN | POLLRDNORM);
+      }
+      else if ( !dev->out.streaming || (!mockOldest( &dev->out, false ) && !mockOldest( &dev->out, true )) )
+      {
+         /* Matches the kernel: no capture buffers queued is an error condition */
+         *revents |= POLLERR;
+      }
+      else if ( mockOldest( &dev->out, true ) )
+      {
+         *revents |= (POLLIN | POLLRDNORM);
+      }
+      if ( dev->in.streaming && mockOldest( &dev->in, true ) )
+      {
+         *revents |= (POLLOUT | POLLWRNORM);
+      }
+      *revents &= (events | POLLERR | POLLHUP | POLLNVAL);
+      if ( *revents || (timeout == 0) )
+      {
+         break;
+      }
+      if ( timeout < 0 )
+      {
+         pthread_cond_wait( &dev->cond, &dev->mutex );
+      }
+      else if ( pthread_cond_timedwait( &dev->cond, &dev->mutex, &ts ) == ETIMEDOUT )
+      {
+         break;
+      }
+   }
+   rc= (*revents ? 1 : 0);
+   pthread_mutex_unlock( &dev->mutex );
+
+   return rc;
+}
+
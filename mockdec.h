@@ -0,0 +1,41 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _V4L2TEST_MOCKDEC_H
+#define _V4L2TEST_MOCKDEC_H
+
+#include <sys/types.h>
+
+#define MOCKDEC_DEVICE_PREFIX "mock"
+
+/*
+ * In-process stand-in for a stateful V4L2 M2M H264 decoder.  The device
+ * name has the form mock[:latency=<ms>,fps=<n>,pattern=<0|1>] where latency
+ * is the per frame decode latency, fps caps decoder throughput and pattern
+ * enables generation of frame content.
+ */
+bool MockDecIsName( const char *name );
+int MockDecOpen( const char *name );
+int MockDecClose( int fd );
+bool MockDecIsDevice( int fd );
+int MockDecIoctl( int fd, unsigned int request, void *arg );
+void *MockDecMmap( int fd, size_t length, int prot, int flags, off_t offset );
+int MockDecPoll( int fd, short events, short *revents, int timeout );
+
+#endif
+
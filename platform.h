@@ -21,13 +21,68 @@
 
 typedef struct _PlatformCtx PlatformCtx;
 
-PlatformCtx* PlatfromInit( void );
+#define PLATFORM_MAX_OUTPUTS (4)
+#define PLATFORM_MAX_VIDEO_LAYERS (4)
+
+/*
+ * device is a card path or index (default card 0).  outputs is a comma
+ * separated list of connector names (eg HDMI-A-1) or indices, or "all" for
+ * every connected connector, and defaults to the first connected one.  With
+ * mirror set every output shows output 0's window, otherwise each output
+ * has its own window.
+ */
+void PlatformListOutputs( const char *device );
+PlatformCtx* PlatfromInit( const char *device, const char *outputs, bool mirror );
 void PlatformTerm( PlatformCtx *ctx );
 NativeDisplayType PlatformGetEGLDisplayType( PlatformCtx *ctx );
 EGLDisplay PlatformGetEGLDisplay( PlatformCtx *ctx, NativeDisplayType type );
 EGLDisplay PlatformGetEGLDisplayWayland( PlatformCtx *ctx, struct wl_display *display );
 void *PlatformCreateNativeWindow( PlatformCtx *ctx, int width, int height );
+int PlatformGetWindowCount( PlatformCtx *ctx );
+void *PlatformCreateOutputWindow( PlatformCtx *ctx, int index, int width, int height );
 void PlatformDestroyNativeWindow( PlatformCtx *ctx, void *nativeWindow );
+int PlatformCreateDmaBuf( PlatformCtx *ctx, int width, int height );
+void PlatformSetFlipQueueDepth( PlatformCtx *ctx, int depth );
+void PlatformSetUseModifiers( PlatformCtx *ctx, bool useModifiers );
+void PlatformSetFrameRate( PlatformCtx *ctx, int frameRate );
+long long PlatformGetRefreshRate( PlatformCtx *ctx );
+unsigned int PlatformGetSwapSequence( PlatformCtx *ctx );
+long long PlatformGetFlipTime( PlatformCtx *ctx, unsigned int sequence );
+
+/*
+ * Video layers are decoded NV12 frames that may be scanned out by hardware
+ * planes of output 0 instead of being composed with GL.  PlatformAssignPlanes
+ * validates assignments with TEST_ONLY commits when layers have changed and
+ * returns the mask of layers given a plane; the rest must be drawn with GL.
+ * Assignments and frames take effect with the next swap.  generation must
+ * change whenever the layer's buffers are reallocated.  modifier is the DRM
+ * format modifier of the decoder's buffer layout.
+ */
+void PlatformSetVideoLayer( PlatformCtx *ctx, int layer, int generation, int fd0, int fd1, int offset1, unsigned long long modifier,
+                            int width, int height, int stride, int x, int y, int w, int h );
+void PlatformClearVideoLayer( PlatformCtx *ctx, int layer );
+unsigned int PlatformAssignPlanes( PlatformCtx *ctx );
+
+/*
+ * Writeback captures output 0's composed frame, planes included, with a
+ * writeback connector every interval swaps.  It must be enabled before the
+ * first frame.  PlatformGetCapture returns the newest completed capture as
+ * XRGB8888 pixels, valid until PlatformReleaseCapture.  sequence is the swap
+ * sequence captured, whose flip time gives the vblank it was displayed at.
+ */
+typedef struct _PlatformCapture
+{
+   unsigned int sequence;
+   int width;
+   int height;
+   int stride;
+   const unsigned char *pixels;
+   unsigned int checksum;
+} PlatformCapture;
+
+bool PlatformEnableWriteback( PlatformCtx *ctx, int interval );
+bool PlatformGetCapture( PlatformCtx *ctx, PlatformCapture *capture );
+void PlatformReleaseCapture( PlatformCtx *ctx );
 
 #endif
 
@@ -0,0 +1,72 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+
+#include "cadence.h"
+
+static int gFailures= 0;
+
+static void check( const char *name, long long duration, long long nominal, long long refreshPeriod, bool expected )
+{
+   bool result= CadenceIsError( duration, nominal, refreshPeriod );
+   if ( result != expected )
+   {
+      printf("FAIL: %s: duration %lld nominal %lld refresh period %lld: got %d expected %d\n",
+             name, duration, nominal, refreshPeriod, result, expected);
+      ++gFailures;
+   }
+}
+
+int main( int argc, char **argv )
+{
+   long long nominal24= 1000000LL/24;
+   long long period60= 1000000000LL/60000;
+   long long period24= 1000000000LL/24000;
+   long long period48= 1000000000LL/48000;
+   int i;
+
+   /* 24 on 60: 3:2 pulldown, both the 2 and 3 vblank frames judder, with or without jitter */
+   for( i= -500; i <= 500; i += 250 )
+   {
+      check( "24 on 60 two vblanks", 2*period60+i, nominal24, period60, true );
+      check( "24 on 60 three vblanks", 3*period60+i, nominal24, period60, true );
+   }
+
+   /* 24 on 24 and 48: steady cadence, a repeated or dropped frame is an error */
+   for( i= -500; i <= 500; i += 250 )
+   {
+      check( "24 on 24", period24+i, nominal24, period24, false );
+      check( "24 on 48", 2*period48+i, nominal24, period48, false );
+   }
+   check( "24 on 24 repeat", 2*period24, nominal24, period24, true );
+   check( "24 on 48 short", period48, nominal24, period48, true );
+
+   /* Unknown refresh rate */
+   check( "no refresh", 50000, nominal24, 0, false );
+
+   if ( gFailures )
+   {
+      printf("cadencetest: %d failures\n", gFailures);
+      return 1;
+   }
+   printf("cadencetest: pass\n");
+
+   return 0;
+}
+
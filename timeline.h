@@ -0,0 +1,38 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _V4L2TEST_TIMELINE_H
+#define _V4L2TEST_TIMELINE_H
+
+/*
+ * Timeline of pipeline activity for viewing in a Chrome trace event viewer
+ * (chrome://tracing or ui.perfetto.dev).  Spans are kept in per thread ring
+ * buffers and written as trace event JSON when the timeline is stopped.
+ * Times are CLOCK_MONOTONIC microseconds.  Names must be string literals as
+ * only the pointer is kept.  A negative id is omitted from the output.
+ */
+bool TimelineStart( const char *filename );
+void TimelineStop( void );
+bool TimelineEnabled( void );
+long long TimelineNow( void );
+void TimelineNameThread( const char *fmt, ... );
+void TimelineSpan( const char *name, int id, long long startTime, long long endTime );
+void TimelineInstant( const char *name, int id );
+
+#endif
+
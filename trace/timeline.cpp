@@ -0,0 +1,293 @@
+/*
+ * If not stated otherwise in this file or this component's Licenses.txt file the
+ * following copyright and licenses apply:
+ *
+ * Copyright 2019 RDK Management
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <memory.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "timeline.h"
+
+#include <vector>
+
+#define TIMELINE_RING_SIZE (16384)
+#define TIMELINE_INSTANT (-1LL)
+
+typedef struct _TimelineEvent
+{
+   const char *name;
+   int tid;
+   int id;
+   long long startTime;
+   long long duration;
+} TimelineEvent;
+
+typedef struct _TimelineRing
+{
+   bool inUse;
+   unsigned int head;
+   TimelineEvent events[TIMELINE_RING_SIZE];
+} TimelineRing;
+
+typedef struct _TimelineThreadName
+{
+   int tid;
+   char name[32];
+} TimelineThreadName;
+
+static pthread_mutex_t gMutex= PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t gRingKey;
+static bool gEnabled= false;
+static char *gFilename= 0;
+static std::vector<TimelineRing*> gRings;
+static std::vector<TimelineThreadName> gThreadNames;
+static __thread TimelineRing *tRing= 0;
+static __thread int tTid= 0;
+
+static void timelineReleaseRing( void *arg )
+{
+   TimelineRing *ring= (TimelineRing*)arg;
+
+   /* The events stay in the ring, only ownership is given up */
+   pthread_mutex_lock( &gMutex );
+   ring->inUse= false;
+   pthread_mutex_unlock( &gMutex );
+}
+
+static TimelineRing *timelineGetRing( void )
+{
+   TimelineRing *ring= tRing;
+   int i;
+
+   if ( !ring )
+   {
+      tTid= (int)syscall( SYS_gettid );
+
+      /* Reuse the ring of an exited thread so repeated thread creation does not grow memory */
+      pthread_mutex_lock( &gMutex );
+      for( i= 0; i < (int)gRings.size(); ++i )
+      {
+         if ( !gRings[i]->inUse )
+         {
+            ring= gRings[i];
+            break;
+         }
+      }
+      if ( !ring )
+      {
+         ring= (TimelineRing*)calloc( 1, sizeof(TimelineRing) );
+         if ( ring )
+         {
+            gRings.push_back( ring );
+         }
+      }
+      if ( ring )
+      {
+         ring->inUse= true;
+         pthread_setspecific( gRingKey, ring );
+      }
+      pthread_mutex_unlock( &gMutex );
+      tRing= ring;
+   }
+
+   return ring;
+}
+
+static void timelineAddEvent( const char *name, int id, long long startTime, long long duration )
+{
+   TimelineRing *ring;
+   TimelineEvent *event;
+   unsigned int head;
+
+   ring= timelineGetRing();
+   if ( ring )
+   {
+      head= ring->head;
+      event= &ring->events[head % TIMELINE_RING_SIZE];
+      event->name= name;
+      event->tid= tTid;
+      event->id= id;
+      event->startTime= startTime;
+      event->duration= duration;
+      __atomic_store_n( &ring->head, head+1, __ATOMIC_RELEASE );
+   }
+}
+
+bool TimelineStart( const char *filename )
+{
+   bool result= false;
+
+   if ( gEnabled )
+   {
+      goto exit;
+   }
+
+   gFilename= strdup( filename );
+   if ( !gFilename )
+   {
+      fprintf(stderr,"Error: TimelineStart: no memory for filename\n");
+      goto exit;
+   }
+
+   if ( pthread_key_create( &gRingKey, timelineReleaseRing ) )
+   {
+      fprintf(stderr,"Error: TimelineStart: unable to create thread key\n");
+      free( gFilename );
+      gFilename= 0;
+      goto exit;
+   }
+
+   __atomic_store_n( &gEnabled, true, __ATOMIC_RELEASE );
+
+   result= true;
+
+exit:
+   return result;
+}
+
+void TimelineStop( void )
+{
+   FILE *pFile= 0;
+   TimelineRing *ring;
+   TimelineEvent *event;
+   unsigned int head, start, i, j;
+   int pid= (int)getpid();
+
+   if ( !gEnabled )
+   {
+      return;
+   }
+   __atomic_store_n( &gEnabled, false, __ATOMIC_RELEASE );
+
+   pFile= fopen( gFilename, "wt" );
+   if ( !pFile )
+   {
+      fprintf(stderr,"Error: TimelineStop: unable to create (%s)\n", gFilename);
+      goto exit;
+   }
+
+   fprintf( pFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+   fprintf( pFile, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"v4l2test\"}}", pid, pid );
+
+   pthread_mutex_lock( &gMutex );
+   for( i= 0; i < gThreadNames.size(); ++i )
+   {
+      fprintf( pFile, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+               pid, gThreadNames[i].tid, gThreadNames[i].name );
+   }
+   for( i= 0; i < gRings.size(); ++i )
+   {
+      ring= gRings[i];
+      head= __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE );
+      start= (head > TIMELINE_RING_SIZE) ? head-TIMELINE_RING_SIZE : 0;
+      for( j= start; j < head; ++j )
+      {
+         event= &ring->events[j % TIMELINE_RING_SIZE];
+         if ( event->duration == TIMELINE_INSTANT )
+         {
+            fprintf( pFile, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%lld",
+                     event->name, pid, event->tid, event->startTime );
+         }
+         else
+         {
+            fprintf( pFile, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"dur\":%lld",
+                     event->name, pid, event->tid, event->startTime, event->duration );
+         }
+         if ( event->id >= 0 )
+         {
+            fprintf( pFile, ",\"args\":{\"id\":%d}", event->id );
+         }
+         fprintf( pFile, "}" );
+      }
+   }
+   pthread_mutex_unlock( &gMutex );
+
+   fprintf( pFile, "\n]}\n" );
+   fclose( pFile );
+
+exit:
+   /* Rings are left in place as threads may still hold them */
+   free( gFilename );
+   gFilename= 0;
+}
+
+bool TimelineEnabled( void )
+{
+   return __atomic_load_n( &gEnabled, __ATOMIC_RELAXED );
+}
+
+long long TimelineNow( void )
+{
+   struct timespec tm;
+
+   clock_gettime( CLOCK_MONOTONIC, &tm );
+
+   return tm.tv_sec*1000000LL+(tm.tv_nsec/1000LL);
+}
+
+void TimelineNameThread( const char *fmt, ... )
+{
+   TimelineThreadName threadName;
+   va_list argptr;
+   unsigned int i;
+
+   if ( !TimelineEnabled() )
+   {
+      return;
+   }
+
+   va_start( argptr, fmt );
+   vsnprintf( threadName.name, sizeof(threadName.name), fmt, argptr );
+   va_end( argptr );
+   threadName.tid= (int)syscall( SYS_gettid );
+
+   pthread_mutex_lock( &gMutex );
+   for( i= 0; i < gThreadNames.size(); ++i )
+   {
+      if ( gThreadNames[i].tid == threadName.tid )
+      {
+         gThreadNames[i]= threadName;
+         break;
+      }
+   }
+   if ( i == gThreadNames.size() )
+   {
+      gThreadNames.push_back( threadName );
+   }
+   pthread_mutex_unlock( &gMutex );
+}
+
+void TimelineSpan( const char *name, int id, long long startTime, long long endTime )
+{
+   if ( TimelineEnabled() )
+   {
+      timelineAddEvent( name, id, startTime, endTime-startTime );
+   }
+}
+
+void TimelineInstant( const char *name, int id )
+{
+   if ( TimelineEnabled() )
+   {
+      timelineAddEvent( name, id, TimelineNow(), TIMELINE_INSTANT );
+   }
+}
@@ -24,17 +24,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <math.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/poll.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
+#include <time.h>
 #include <dirent.h>
 #include <unistd.h>
 
 #include <linux/videodev2.h>
+#include <linux/media.h>
+#include <linux/dma-heap.h>
 
 #include <drm/drm_fourcc.h>
 
@@ -48,6 +54,11 @@
 #include <GLES2/gl2ext.h> 
 
 #include "platform.h"
+#include "mockdec.h"
+#include "ioctltrace.h"
+#include "timeline.h"
+#include "cadence.h"
+#include "asynclog.h"
 
 #define DEFAULT_WIDTH (1920)
 #define DEFAULT_HEIGHT (1080)
@@ -57,15 +68,131 @@
 
 #define NUM_INPUT_BUFFERS (2)
 #define MIN_INPUT_BUFFERS (1)
+#define DEFAULT_INPUT_BUFFER_SIZE (1024*1024)
+#define MIN_INPUT_BUFFER_SIZE (64*1024)
+#define INPUT_BUFFER_HEADROOM (4)
+#define MAX_PACKED_FRAMES (4)
 #define NUM_OUTPUT_BUFFERS (6)
 #define MIN_OUTPUT_BUFFERS (3)
+#define EXTRA_POOL_BUFFERS (2)
+#define MAX_POOL_BUFFERS (256)
 
 #define MAX_TEXTURES (2)
 
+#define NUM_DECODE (4)
+
+#define DAMAGE_HISTORY (4)
+
+#define FRAME_FENCE_TIMEOUT_NS (100*1000*1000LL)
+
+#define DISPLAY_PENDING (8)
+
+#define PLANE_SEQ_PENDING (0xFFFFFFFFU)
+
+#define STAMP_BITS (16)
+#define STAMP_CELL (8)
+#define FRAME_TIME_HISTORY (64)
+#define CAPTURE_HISTORY (64)
+#define MAX_PRESENT_SAMPLES (1024)
+
+#define MAX_DMABUF_MODIFIERS (64)
+
+#define DRAIN_TIMEOUT_MS (2000)
+#define DECODE_STALL_TIMEOUT_MS (5000)
+
 typedef struct _AppCtx AppCtx;
 typedef struct _DecCtx DecCtx;
+typedef struct _H264Ctx H264Ctx;
 
 #define IOCTL ioctl_wrapper
+#define MMAP mmap_wrapper
+#define POLL poll_wrapper
+
+/* Requests with names for logging and per request statistics */
+#define IOCTL_LIST(X) \
+   X(VIDIOC_QUERYCAP) \
+   X(VIDIOC_ENUM_FMT) \
+   X(VIDIOC_G_FMT) \
+   X(VIDIOC_S_FMT) \
+   X(VIDIOC_REQBUFS) \
+   X(VIDIOC_QUERYBUF) \
+   X(VIDIOC_G_FBUF) \
+   X(VIDIOC_S_FBUF) \
+   X(VIDIOC_OVERLAY) \
+   X(VIDIOC_QBUF) \
+   X(VIDIOC_EXPBUF) \
+   X(VIDIOC_DQBUF) \
+   X(VIDIOC_STREAMON) \
+   X(VIDIOC_STREAMOFF) \
+   X(VIDIOC_G_PARM) \
+   X(VIDIOC_S_PARM) \
+   X(VIDIOC_G_STD) \
+   X(VIDIOC_S_STD) \
+   X(VIDIOC_ENUMSTD) \
+   X(VIDIOC_ENUMINPUT) \
+   X(VIDIOC_G_CTRL) \
+   X(VIDIOC_S_CTRL) \
+   X(VIDIOC_QUERYCTRL) \
+   X(VIDIOC_ENUM_FRAMESIZES) \
+   X(VIDIOC_TRY_FMT) \
+   X(VIDIOC_CROPCAP) \
+   X(VIDIOC_CREATE_BUFS) \
+   X(VIDIOC_G_SELECTION) \
+   X(VIDIOC_DECODER_CMD) \
+   X(VIDIOC_TRY_DECODER_CMD) \
+   X(VIDIOC_SUBSCRIBE_EVENT) \
+   X(VIDIOC_DQEVENT) \
+   X(VIDIOC_S_EXT_CTRLS) \
+   X(VIDIOC_QUERY_EXT_CTRL) \
+   X(MEDIA_IOC_G_TOPOLOGY) \
+   X(MEDIA_IOC_REQUEST_ALLOC) \
+   X(MEDIA_REQUEST_IOC_QUEUE) \
+   X(MEDIA_REQUEST_IOC_REINIT)
+
+#define IOCTL_ENUM_ENTRY(r) IOCTL_INDEX_##r,
+#define IOCTL_NAME_ENTRY(r) #r,
+#define IOCTL_INDEX_CASE(r) case r: return IOCTL_INDEX_##r;
+
+enum
+{
+   IOCTL_LIST(IOCTL_ENUM_ENTRY)
+   IOCTL_INDEX_OTHER,
+   IOCTL_INDEX_COUNT
+};
+
+#define IOCTL_HISTOGRAM_BUCKETS (22)
+
+/* Texture programs, all built once by initGL and selected per surface */
+enum
+{
+   TEXTURE_PROGRAM_EXTERNAL= 0,
+   TEXTURE_PROGRAM_YUV,
+   TEXTURE_PROGRAM_COUNT
+};
+
+#define PROGRAM_CACHE_MAGIC (0x42503456)
+
+typedef struct _TextureProgram
+{
+   GLuint frag;
+   GLuint vert;
+   GLuint prog;
+   GLint locPos;
+   GLint locTC;
+   GLint locTCUV;
+   GLint locRes;
+   GLint locMatrix;
+   GLint locTexture;
+   GLint locTextureUV;
+} TextureProgram;
+
+typedef struct _ProgramCacheHeader
+{
+   uint32_t magic;
+   uint32_t key;
+   uint32_t format;
+   uint32_t length;
+} ProgramCacheHeader;
 
 typedef struct _EGLCtx
 {
@@ -81,6 +208,15 @@ typedef struct _EGLCtx
    EGLint majorVersion;
    EGLint minorVersion;
    void *nativeWindow;
+   int outputCount;
+   void *outputWindow[PLATFORM_MAX_OUTPUTS];
+   EGLSurface outputSurface[PLATFORM_MAX_OUTPUTS];
+   bool haveBufferAge;
+   bool haveSwapWithDamage;
+   PFNEGLSETDAMAGEREGIONKHRPROC eglSetDamageRegionKHR;
+   PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
+   PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
+   PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
 } EGLCtx;
 
 typedef struct _GLCtx
@@ -100,18 +236,22 @@ typedef struct _GLCtx
    GLint locOffsetColor;
    GLint locMatrixColor;
 
-   bool haveYUVTextures;
-   bool haveYUVShaders;
-   GLuint fragTex;
-   GLuint vertTex;
-   GLuint progTex;
-   GLint locPosTex;
-   GLint locTC;
-   GLint locTCUV;
-   GLint locResTex;
-   GLint locMatrixTex;
-   GLint locTexture;
-   GLint locTextureUV;
+   TextureProgram texProg[TEXTURE_PROGRAM_COUNT];
+   PFNGLGETPROGRAMBINARYOESPROC glGetProgramBinaryOES;
+   PFNGLPROGRAMBINARYOESPROC glProgramBinaryOES;
+   int programCacheHits;
+
+   GLuint mosaicVbo;
+   bool mosaicValid;
+   int mosaicRect[NUM_DECODE][4];
+   int mosaicRebuildCount;
+
+   int damageHistory[DAMAGE_HISTORY][4];
+   int damageHistoryCount;
+   int composeCount;
+   int composeIdleCount;
+   int composePartialCount;
+   double composeDamagedFraction;
 
    GLuint fragFill;
    GLuint vertFill;
@@ -131,6 +271,8 @@ typedef struct _Surface
    bool dirty;
    bool haveYUVTextures;
    bool externalImage;
+   bool onPlane;
+   int frameStamp;
    int textureCount;
    GLuint textureId[MAX_TEXTURES];
    EGLImageKHR eglImage[MAX_TEXTURES];
@@ -154,6 +296,8 @@ typedef struct _BufferInfo
    void *start;
    int capacity;
    bool queued;
+   bool held;
+   int requestFd;
 } BufferInfo;
 
 typedef struct _V4l2Ctx
@@ -171,12 +315,21 @@ typedef struct _V4l2Ctx
    struct v4l2_format fmtOut;
    uint32_t minBuffersIn;
    uint32_t minBuffersOut;
+   uint32_t memoryOut;
    int numBuffersIn;
    BufferInfo *inBuffers;
    int numBuffersOut;
    BufferInfo *outBuffers;
+   int bufferGeneration;
+   uint64_t outputModifier;
    uint32_t inputFormat;
    bool outputStarted;
+   bool canDrain;
+   bool lastBufferDequeued;
+   bool isStateless;
+   bool canPackInput;
+   int mediaFd;
+   H264Ctx *h264;
 } V4l2Ctx;
 
 typedef struct _Async
@@ -186,8 +339,40 @@ typedef struct _Async
    bool done;
 } Async;
 
+typedef struct _PoolBuffer
+{
+   int fd;
+   int size;
+   bool inUse;
+} PoolBuffer;
+
+typedef struct _CapturePool
+{
+   pthread_mutex_t mutex;
+   PlatformCtx *platformCtx;
+   int heapFd;
+   const char *heapName;
+   int count;
+   PoolBuffer buffers[MAX_POOL_BUFFERS];
+   long long totalBytes;
+   long long peakTotalBytes;
+   long long inUseBytes;
+   long long peakInUseBytes;
+   int allocCount;
+   int reuseCount;
+   int freeCount;
+} CapturePool;
+
 #define MAX_STREAM_LEN (40000000)
 #define MAX_STREAM_FRAMES (2000)
+
+#define FRAME_FLAG_IDR (0x01)
+#define FRAME_FLAG_PARAMS (0x02)
+
+#define FRAME_TYPE_I (0)
+#define FRAME_TYPE_P (1)
+#define FRAME_TYPE_B (2)
+
 typedef struct _Stream
 {
    char *inputFilename;
@@ -196,11 +381,97 @@ typedef struct _Stream
    int streamFrameCount;
    int streamFrameOffset[MAX_STREAM_FRAMES];
    int streamFrameLength[MAX_STREAM_FRAMES];
+   int streamMaxFrameLength;
+   unsigned char streamFrameFlags[MAX_STREAM_FRAMES];
+   unsigned char streamFrameType[MAX_STREAM_FRAMES];
+   int streamHeaderLength;
+   int streamIDRCount;
+   int streamIDRIndex[MAX_STREAM_FRAMES];
+   int streamIntraCount;
+   int streamIntraIndex[MAX_STREAM_FRAMES];
    int videoWidth;
    int videoHeight;
    int videoRate;
 } Stream;
 
+#define H264_MAX_SPS (32)
+#define H264_MAX_PPS (256)
+#define H264_MAX_MMCO (66)
+
+typedef struct _H264ScalingLists
+{
+   bool present;
+   unsigned char list4x4[6][16];
+   unsigned char list8x8[6][64];
+} H264ScalingLists;
+
+typedef struct _H264Ref
+{
+   bool used;
+   bool longTerm;
+   uint64_t ts;
+   int frameNum;
+   int longTermFrameIdx;
+   int topPoc;
+   int bottomPoc;
+} H264Ref;
+
+typedef struct _H264Mmco
+{
+   int op;
+   int differenceOfPicNumsMinus1;
+   int longTermPicNum;
+   int longTermFrameIdx;
+   int maxLongTermFrameIdxPlus1;
+} H264Mmco;
+
+struct _H264Ctx
+{
+   bool haveSps[H264_MAX_SPS];
+   struct v4l2_ctrl_h264_sps sps[H264_MAX_SPS];
+   H264ScalingLists spsScaling[H264_MAX_SPS];
+   bool havePps[H264_MAX_PPS];
+   struct v4l2_ctrl_h264_pps pps[H264_MAX_PPS];
+   H264ScalingLists ppsScaling[H264_MAX_PPS];
+   bool haveScalingMatrixCtrl;
+   int activeSps;
+   struct v4l2_ctrl_h264_scaling_matrix scalingMatrix;
+   struct v4l2_ctrl_h264_decode_params decode;
+   bool longTermReference;
+   bool adaptiveRefPicMarking;
+   int mmcoCount;
+   H264Mmco mmco[H264_MAX_MMCO];
+   H264Ref refs[V4L2_H264_NUM_DPB_ENTRIES];
+   int maxLongTermFrameIdx;
+   int prevPocMsb;
+   int prevPocLsb;
+   int prevFrameNumOffset;
+   int prevFrameNum;
+   bool prevHadMmco5;
+   int epoch;
+   int outputPoc[MAX_STREAM_FRAMES];
+   int outputEpoch[MAX_STREAM_FRAMES];
+   int reorderDepth;
+   int reorderCount;
+   int reorderIndex[V4L2_H264_NUM_DPB_ENTRIES+1];
+   int neededBuffersOut;
+};
+
+#define MAX_SEEKS (256)
+#define MAX_RES_CHANGES (64)
+#define MAX_ABR_SWITCHES (256)
+
+typedef struct _BitReader
+{
+   const unsigned char *data;
+   int length;
+   int offset;
+   int bit;
+   int zeroCount;
+   int epbCount;
+   bool overrun;
+} BitReader;
+
 typedef struct _DecCtx
 {
    AppCtx *appCtx;
@@ -217,6 +488,34 @@ typedef struct _DecCtx
    int currFrameFd;
    int nextFrameFd;
    int nextFrameFd1;
+   EGLSyncKHR prevFrameSync;
+   EGLSyncKHR currFrameSync;
+   int heldCaptureFd[MAX_PLANES];
+   int heldCaptureCount;
+   bool heldCaptureReplaced;
+   int fenceWaitCount;
+   int fenceTimeoutCount;
+   long long fenceWaitTotal;
+   long long fenceWaitMax;
+   bool currOnPlane;
+   unsigned int prevPlaneSeq;
+   int planeWaitCount;
+   int planeTimeoutCount;
+   long long planeWaitTotal;
+   long long planeWaitMax;
+   long long nextFrameTime;
+   long long frameReadyTime[FRAME_TIME_HISTORY];
+   int lastSeenFrame;
+   int presentCount;
+   int presentDropCount;
+   long long presentLatency[MAX_PRESENT_SAMPLES];
+   unsigned int displayPendingSeq[DISPLAY_PENDING];
+   int displayPendingCount;
+   long long lastDisplayTime;
+   int displayDurationCount;
+   double displayDurationSum;
+   double displayDurationSumSq;
+   int cadenceErrorCount;
 
    V4l2Ctx v4l2;
    bool playing;
@@ -227,6 +526,43 @@ typedef struct _DecCtx
    long long stopTime;
    int numFramesToDecode;
    int decodeIndex;
+   int startFrameIndex;
+
+   long long openTime;
+   long long initDoneTime;
+   long long readyTime;
+   long long firstDecodeTime;
+   long long firstDisplayTime;
+
+   int seekRequestCount;
+   int seekInterval;
+   int seekCount;
+   int seekGeneration;
+   bool seekPending;
+   long long seekStartTime;
+   int seekDroppedFrames;
+   int seekFrameCount;
+   long long seekFlushLatency[MAX_SEEKS];
+   long long seekFrameLatency[MAX_SEEKS];
+
+   int trickSpeed;
+   int trickIntraIndex;
+   int trickStartFrame;
+   long long trickStartTime;
+   int trickFramesFed;
+   int trickFramesSkipped;
+   long long trickContentFrames;
+
+   int abrSwitchRequestCount;
+   int abrSwitchInterval;
+   int abrSwitchCount;
+   int abrRendition;
+   bool abrPending;
+   long long abrSwitchStartTime;
+   int abrSwitchFrom[MAX_ABR_SWITCHES];
+   int abrSwitchTo[MAX_ABR_SWITCHES];
+   long long abrGlitch[MAX_ABR_SWITCHES];
+   long long abrDroppedFrames[MAX_ABR_SWITCHES];
 
    Surface *surface;
    Async *async;
@@ -240,16 +576,40 @@ typedef struct _DecCtx
    bool videoOutThreadStarted;
    bool videoOutThreadStopRequested;
 
-   pthread_t videoEOSThreadId;
-   bool videoEOSThreadStarted;
-   bool videoEOSThreadStopRequested;
+   bool drainRequested;
+   bool drainDone;
+   bool eosEventReceived;
+   long long drainStartTime;
+   long long drainTime;
+   int drainFrameCount;
+
+   int captureFrameCount;
+   bool resChangePending;
+   bool resChangeAwaitFrame;
+   long long resChangeStartTime;
+   int resChangeCount;
+   int resChangeFrameCount;
+   long long resChangeRealloc[MAX_RES_CHANGES];
+   long long resChangeFirstFrame[MAX_RES_CHANGES];
 
    pthread_t videoDecodeThreadId;
    bool videoDecodeThreadStarted;
    bool videoDecodeThreadStopRequested;
-} DecCtx;
 
-#define NUM_DECODE (4)
+   int buffersIn;
+   int buffersOut;
+   long long bytesIn;
+   long long bytesOut;
+   long long frameQueueTime[MAX_STREAM_FRAMES];
+   long long inputBytesFed;
+   long long inputCapacityFed;
+   int inputBuffersFed;
+   int inputFramesFed;
+   int inputOverflowCount;
+   int decodeLatencyCount;
+   long long decodeLatencyTotal;
+   long long decodeLatencyMax;
+} DecCtx;
 
 typedef struct _AppCtx
 {
@@ -258,6 +618,10 @@ typedef struct _AppCtx
    GLCtx gl;
    bool haveDmaBufImport;
    bool haveExternalImage;
+   bool haveDmaBufModifiers;
+   bool noModifiers;
+   int dmaBufModifierCount;
+   uint64_t dmaBufModifiers[MAX_DMABUF_MODIFIERS];
 
    int windowWidth;
    int windowHeight;
@@ -267,10 +631,40 @@ typedef struct _AppCtx
    int videoRate;
 
    int numFramesToDecode;
+   int channelChangeCount;
+   int seekCount;
+   int trickSpeed;
+   int abrSwitchCount;
+   bool abrRandom;
+   int abrLadderCount;
+   Stream *abrLadder[NUM_DECODE];
+   int inputBufferCount;
+   bool packInput;
+   const char *programCacheDir;
+   int flipQueueDepth;
+   bool matchRefresh;
+   const char *drmDevice;
+   const char *drmOutputs;
+   bool mirrorOutputs;
+   bool videoPlanes;
+   int writebackInterval;
+   bool writebackActive;
+   unsigned int expectedSeq[CAPTURE_HISTORY];
+   int expectedFrame[CAPTURE_HISTORY][NUM_DECODE];
+   unsigned int lastCaptureSeq;
+   unsigned int lastChecksum;
+   int captureCount;
+   int captureChecksumChanges;
+   int captureMismatchCount;
+   int captureUnreadableCount;
+   int captureBufferCount;
+   int bufferSweepMax;
+   int bufferSweepLatency;
 
    DecCtx decode[NUM_DECODE];
    Surface surface[NUM_DECODE];
    Async async[NUM_DECODE];
+   int numStreams;
    Stream stream[NUM_DECODE];
 
 } AppCtx;
@@ -278,42 +672,171 @@ typedef struct _AppCtx
 bool gVerbose= false;
 static int gLogLevel= 0;
 static char *gDeviceName= 0;
+static bool gMockDecoder= false;
+static bool gIoctlRecord= false;
+static bool gIoctlReplay= false;
+static bool gCaptureDmaBuf= false;
+static CapturePool gCapturePool;
+
+typedef struct _IoctlStats
+{
+   long long count;
+   long long errors;
+   long long totalTime;
+   long long maxTime;
+   long long histogram[IOCTL_HISTOGRAM_BUCKETS];
+} IoctlStats;
+
+static const char *gIoctlNames[IOCTL_INDEX_COUNT]=
+{
+   IOCTL_LIST(IOCTL_NAME_ENTRY)
+   "NA"
+};
+static int gIoctlStatsFd[NUM_DECODE];
+static int gBufferGeneration= 0;
+
+/* Decoder output layouts with a DRM format modifier, preferred in this order over linear NV12 */
+typedef struct _TiledFormat
+{
+   uint32_t pixelFormat;
+   int numPlanes;
+   uint64_t modifier;
+} TiledFormat;
+
+static const TiledFormat gTiledFormats[]=
+{
+   #if defined(V4L2_PIX_FMT_NV12_32L32) && defined(DRM_FORMAT_MOD_ALLWINNER_TILED)
+   { V4L2_PIX_FMT_NV12_32L32, 1, DRM_FORMAT_MOD_ALLWINNER_TILED },
+   #endif
+   #if defined(V4L2_PIX_FMT_NV12MT_16X16) && defined(DRM_FORMAT_MOD_SAMSUNG_16_16_TILE)
+   { V4L2_PIX_FMT_NV12MT_16X16, 2, DRM_FORMAT_MOD_SAMSUNG_16_16_TILE },
+   #endif
+   #if defined(V4L2_PIX_FMT_NV12MT) && defined(DRM_FORMAT_MOD_SAMSUNG_64_32_TILE)
+   { V4L2_PIX_FMT_NV12MT, 2, DRM_FORMAT_MOD_SAMSUNG_64_32_TILE },
+   #endif
+   { 0, 0, DRM_FORMAT_MOD_LINEAR }
+};
+static IoctlStats gIoctlStats[NUM_DECODE+1][IOCTL_INDEX_COUNT];
 static FILE *gReport= 0;
 
 static void iprintf( int level, const char *fmt, ... );
+static void eprintf( const char *fmt, ... );
 static long long getCurrentTimeMillis(void);
+static long long getMonotonicTimeMicros(void);
 static double getCpuIdle();
 static void emitLoadAverage();
+static void emitLatencyStats( const char *name, const char *units, long long *values, int count );
 static bool initEGL( EGLCtx *eglCtx );
 static void termEGL( EGLCtx *eglCtx );
+static GLuint compileShader( GLenum type, const char *src, const char *desc );
+static uint32_t programCacheKey( int index );
+static bool loadProgramBinary( GLCtx *ctx, int index );
+static void saveProgramBinary( GLCtx *ctx, int index );
+static bool initTextureProgram( GLCtx *ctx, int index );
 static bool initGL( GLCtx *ctx );
 static void termGL( GLCtx *ctx );
+static void updateSurfaceTextures( GLCtx *glCtx, Surface *surface );
 static void drawSurface( GLCtx *glCtx, Surface *surface );
+static void updateMosaicGeometry( GLCtx *glCtx );
+static void drawMosaic( GLCtx *glCtx, Surface **surfaces, int count );
+static void unionRect( int *rect, const int *other );
+static void fenceSurfaceFrame( AppCtx *appCtx, Surface *surface );
+static void waitFrameSync( DecCtx *decCtx, EGLSyncKHR sync );
+static void waitPlaneRelease( DecCtx *decCtx );
+static void assignVideoPlanes( AppCtx *appCtx, const bool *locked, int *damage, int *dirtyCount );
+static bool composeFrame( AppCtx *appCtx, Surface **surfaces, int count, const int *damage, EGLint *eglRect );
+static void drawFrameStamp( AppCtx *appCtx, Surface *surface );
+static int readFrameStamp( AppCtx *appCtx, PlatformCapture *capture, Surface *surface );
+static void checkCapture( AppCtx *appCtx );
+static void presentFrame( AppCtx *appCtx, bool partial, const EGLint *eglRect );
+static void composeOutputs( AppCtx *appCtx, Surface **surfaces, int count );
+static void presentOutputs( AppCtx *appCtx );
+static void updateDisplayTimes( AppCtx *appCtx, DecCtx *decCtx );
+static int ioctlIndex( unsigned int request );
+static const char *ioctlName( unsigned int request );
+static void ioctlStatsSetDecoderFd( int decodeIndex, int fd );
+static void ioctlStatsUpdate( int fd, unsigned int request, int rc, long long duration );
+static void emitIoctlStats( void );
 static int ioctl_wrapper( int fd, int request, void* arg );
+static void *mmap_wrapper( void *addr, size_t length, int prot, int flags, int fd, off_t offset );
+static int poll_wrapper( struct pollfd *fds, nfds_t nfds, int timeout );
 static bool getInputFormats( V4l2Ctx *v4l2 );
 static bool getOutputFormats( V4l2Ctx *v4l2 );
+static int inputBufferSize( DecCtx *decCtx );
 static bool setInputFormat( V4l2Ctx *v4l2 );
 static bool setOutputFormat( V4l2Ctx *v4l2 );
+static long long bufferBytes( BufferInfo *buffers, int count );
 static bool setupInputBuffers( V4l2Ctx *v4l2 );
 static void tearDownInputBuffers( V4l2Ctx *v4l2 );
+static void initCapturePool( PlatformCtx *platformCtx );
+static void termCapturePool( void );
+static int capturePoolAcquire( int size );
+static void capturePoolRelease( int fd );
+static void holdCaptureBuffer( DecCtx *decCtx, int buffIndex );
+static void releaseHeldCapture( DecCtx *decCtx );
+static void emitCapturePoolStats( void );
+static bool setupOutputBuffersDmaBuf( V4l2Ctx *v4l2, int neededBuffers );
 static bool setupOutputBuffers( V4l2Ctx *v4l2 );
+static const TiledFormat *selectTiledFormat( V4l2Ctx *v4l2, bool multiPlane );
+static void queryDmaBufModifiers( AppCtx *appCtx );
 static void tearDownOutputBuffers( V4l2Ctx *v4l2 );
 static void stopDecoder( V4l2Ctx *v4l2 );
+static bool flushInput( V4l2Ctx *v4l2 );
 static bool initV4l2( V4l2Ctx *v4l2 );
 static void termV4l2( V4l2Ctx *v4l2 );
 static int getInputBuffer( V4l2Ctx *v4l2 );
 static int getOutputBuffer( V4l2Ctx *v4l2 );
 static int findOutputBuffer( V4l2Ctx *v4l2, int fd );
-static void *videoEOSThread( void *arg );
+static bool drainDecoder( V4l2Ctx *v4l2 );
+static bool waitOutputReady( V4l2Ctx *v4l2 );
+static bool startOutput( DecCtx *decCtx );
+static bool handleResolutionChange( DecCtx *decCtx );
 static void *videoOutputThread( void *arg );
 static void *videoInputThread( void *arg );
 static void *videoDecodeThread( void *arg );
+static int nextNal( const unsigned char *data, int length, int offset, int *nalStart, int *nalLength );
+static void h264ParseScalingList( BitReader *br, unsigned char *list, int size, bool *useDefault );
+static void h264ParseScalingLists( BitReader *br, H264ScalingLists *lists, int count, H264ScalingLists *fallback );
+static bool h264ParseSps( H264Ctx *h264, const unsigned char *data, int length );
+static bool h264ParsePps( H264Ctx *h264, const unsigned char *data, int length );
+static bool h264ParseRefPicListModification( BitReader *br );
+static void h264SkipPredWeightTable( BitReader *br, struct v4l2_ctrl_h264_sps *sps, int numL0, int numL1, bool isB );
+static bool h264ParseSliceHeader( H264Ctx *h264, const unsigned char *data, int length, int *ppsId );
+static void h264ComputePoc( H264Ctx *h264, struct v4l2_ctrl_h264_sps *sps );
+static int h264PicNum( H264Ref *ref, int currFrameNum, int maxFrameNum );
+static void h264BuildDpb( H264Ctx *h264, struct v4l2_ctrl_h264_sps *sps );
+static void h264MarkReferences( H264Ctx *h264, struct v4l2_ctrl_h264_sps *sps, uint64_t ts );
+static bool findMediaDevice( V4l2Ctx *v4l2 );
+static bool setStatelessControl( V4l2Ctx *v4l2, uint32_t id, int32_t value );
+static bool initStateless( V4l2Ctx *v4l2 );
+static void termStateless( V4l2Ctx *v4l2 );
+static bool recycleRequest( V4l2Ctx *v4l2, int buffIndex );
+static void loadScalingMatrix( H264Ctx *h264, int ppsId );
+static bool isReferencedCaptureBuffer( V4l2Ctx *v4l2, int buffIndex );
+static bool requeueCaptureBuffer( DecCtx *decCtx, int buffIndex );
+static void requeueReleasedCaptureBuffers( DecCtx *decCtx );
+static int reorderOutput( V4l2Ctx *v4l2, int buffIndex, bool flush );
+static int prepareStatelessFrame( DecCtx *decCtx, int buffIndex, int frameIndex, const unsigned char *header, int headerLength );
+static int nextTrickPlayFrame( DecCtx *decCtx );
+static int findNextIDR( Stream *stream, int frameIndex );
+static int nextRendition( DecCtx *decCtx );
 static bool playFile( DecCtx *decCtx );
 static bool parseStreamDescriptor( AppCtx *appCtx, Stream *stream, const char *descriptorFilename );
+static void bitReaderInit( BitReader *br, const unsigned char *data, int length );
+static unsigned int bitReaderGetBits( BitReader *br, int numBits );
+static unsigned int bitReaderGetUE( BitReader *br );
+static int bitReaderGetSE( BitReader *br );
+static int bitReaderBitPos( BitReader *br );
+static bool bitReaderMoreData( BitReader *br );
 static bool prepareStream( AppCtx *appCtx, Stream *stream );
 static bool updateFrame( DecCtx *decCtx, Surface *surface );
-static void testDecode( AppCtx *appCtx, int decodeIndex, int numFramesToDecode, Surface *surface, Async *async, Stream *stream );
+static void testDecode( AppCtx *appCtx, int decodeIndex, int numFramesToDecode, Surface *surface, Async *async, Stream *stream, int startFrameIndex );
 static bool runUntilDone( AppCtx *appCtx );
+static bool testChannelChange( AppCtx *appCtx, int iterations );
+static bool testSeek( AppCtx *appCtx, int seekCount );
+static bool testTrickPlay( AppCtx *appCtx, int speed );
+static bool testAbr( AppCtx *appCtx, int switchCount );
+static bool testBufferSweep( AppCtx *appCtx, int maxBuffers );
 static void discoverVideoDecoder( void );
 static void showUsage( void );
 
@@ -324,15 +847,21 @@ void iprintf( int level, const char *fmt, ... )
    if ( level <= gLogLevel )
    {
       va_start( argptr, fmt );
-      if ( gReport )
-      {
-         vfprintf( gReport, fmt, argptr );
-      }
-      vfprintf( stderr, fmt, argptr );
+      LogVPrintf( level, true, fmt, argptr );
       va_end( argptr );
    }
 }
 
+/* Verbose diagnostics that go to stderr only */
+static void eprintf( const char *fmt, ... )
+{
+   va_list argptr;
+
+   va_start( argptr, fmt );
+   LogVPrintf( 6, false, fmt, argptr );
+   va_end( argptr );
+}
+
 static long long getCurrentTimeMillis(void)
 {
    struct timeval tv;
@@ -344,6 +873,17 @@ static long long getCurrentTimeMillis(void)
    return utcCurrentTimeMillis;
 }
 
+static long long getMonotonicTimeMicros(void)
+{
+   struct timespec tm;
+   long long timeMicros;
+
+   clock_gettime( CLOCK_MONOTONIC, &tm );
+   timeMicros= tm.tv_sec*1000000LL+(tm.tv_nsec/1000LL);
+
+   return timeMicros;
+}
+
 static double getCpuIdle()
 {
    double idle= 0.0;
@@ -395,6 +935,52 @@ static void emitLoadAverage()
    }
 }
 
+static int compareLongLong( const void *a, const void *b )
+{
+   long long va= *(const long long*)a;
+   long long vb= *(const long long*)b;
+   return (va < vb) ? -1 : ((va > vb) ? 1 : 0);
+}
+
+static void emitLatencyStats( const char *name, const char *units, long long *values, int count )
+{
+   long long *sorted= 0;
+   long long total= 0;
+   int i;
+
+   if ( count <= 0 )
+   {
+      iprintf(0,"%s: no samples\n", name);
+      return;
+   }
+
+   sorted= (long long*)malloc( count*sizeof(long long) );
+   if ( !sorted )
+   {
+      iprintf(0,"Error: emitLatencyStats: no memory for %d samples\n", count);
+      return;
+   }
+   memcpy( sorted, values, count*sizeof(long long) );
+   qsort( sorted, count, sizeof(long long), compareLongLong );
+
+   for( i= 0; i < count; ++i )
+   {
+      total += sorted[i];
+   }
+
+   iprintf(0,"%s: samples %d min %lld p50 %lld p90 %lld p99 %lld max %lld mean %.2f %s\n",
+           name, count,
+           sorted[0],
+           sorted[((count-1)*50)/100],
+           sorted[((count-1)*90)/100],
+           sorted[((count-1)*99)/100],
+           sorted[count-1],
+           (double)total/(double)count,
+           units );
+
+   free( sorted );
+}
+
 #define MAX_ATTRIBS (24)
 #define RED_SIZE (8)
 #define GREEN_SIZE (8)
@@ -413,6 +999,7 @@ static bool initEGL( EGLCtx *eglCtx )
    EGLint attrs[MAX_ATTRIBS];
    EGLint redSize, greenSize, blueSize;
    EGLint alphaSize, depthSize;
+   const char *eglExtensions;
 
    eglCtx->eglDisplay= EGL_NO_DISPLAY;
    eglCtx->eglContext= EGL_NO_CONTEXT;
@@ -533,10 +1120,56 @@ static bool initEGL( EGLCtx *eglCtx )
       goto exit;
    }
 
+   /* Outputs 1 and up, when composed independently, get windows drawn with the same context */
+   eglCtx->outputCount= PlatformGetWindowCount( ctx->platformCtx );
+   for( i= 1; i < eglCtx->outputCount; ++i )
+   {
+      eglCtx->outputWindow[i]= PlatformCreateOutputWindow( ctx->platformCtx, i, ctx->windowWidth, ctx->windowHeight );
+      if ( !eglCtx->outputWindow[i] )
+      {
+         iprintf(0, "Error: initEGL: PlatformCreateOutputWindow %d failed\n", i);
+         goto exit;
+      }
+      eglCtx->outputSurface[i]= eglCreateWindowSurface( eglCtx->eglDisplay,
+                                                        eglCtx->eglConfig,
+                                                        (EGLNativeWindowType)eglCtx->outputWindow[i],
+                                                        NULL );
+      if ( eglCtx->outputSurface[i] == EGL_NO_SURFACE )
+      {
+         iprintf(0, "Error: initEGL: eglCreateWindowSurface for output %d failed: %X\n", i, eglGetError());
+         goto exit;
+      }
+      eglMakeCurrent( eglCtx->eglDisplay, eglCtx->outputSurface[i], eglCtx->outputSurface[i], eglCtx->eglContext );
+      eglSwapInterval( eglCtx->eglDisplay, 1 );
+   }
+
    eglMakeCurrent( eglCtx->eglDisplay, eglCtx->eglSurface, eglCtx->eglSurface, eglCtx->eglContext );
 
    eglSwapInterval( eglCtx->eglDisplay, 1 );
 
+   eglExtensions= eglQueryString( eglCtx->eglDisplay, EGL_EXTENSIONS );
+   if ( eglExtensions )
+   {
+      eglCtx->haveBufferAge= (strstr( eglExtensions, "EGL_EXT_buffer_age" ) || strstr( eglExtensions, "EGL_KHR_partial_update" ));
+      eglCtx->haveSwapWithDamage= (strstr( eglExtensions, "EGL_KHR_swap_buffers_with_damage" ) != 0);
+      if ( strstr( eglExtensions, "EGL_KHR_partial_update" ) )
+      {
+         eglCtx->eglSetDamageRegionKHR= (PFNEGLSETDAMAGEREGIONKHRPROC)eglGetProcAddress("eglSetDamageRegionKHR");
+      }
+      if ( strstr( eglExtensions, "EGL_KHR_fence_sync" ) )
+      {
+         eglCtx->eglCreateSyncKHR= (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+         eglCtx->eglDestroySyncKHR= (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+         eglCtx->eglClientWaitSyncKHR= (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
+         if ( !eglCtx->eglCreateSyncKHR || !eglCtx->eglDestroySyncKHR || !eglCtx->eglClientWaitSyncKHR )
+         {
+            eglCtx->eglCreateSyncKHR= 0;
+         }
+      }
+   }
+   iprintf(1,"initEGL: buffer age %d swap with damage %d partial update %d fence sync %d\n",
+           eglCtx->haveBufferAge, eglCtx->haveSwapWithDamage, (eglCtx->eglSetDamageRegionKHR != 0), (eglCtx->eglCreateSyncKHR != 0));
+
    eglCtx->initialized= true;
 
    result= true;
@@ -554,12 +1187,27 @@ exit:
 static void termEGL( EGLCtx *eglCtx )
 {
    AppCtx *ctx= eglCtx->appCtx;
+   int i;
 
    if ( eglCtx->eglDisplay != EGL_NO_DISPLAY )
    {
       eglMakeCurrent( eglCtx->eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
    }
 
+   for( i= 1; i < PLATFORM_MAX_OUTPUTS; ++i )
+   {
+      if ( eglCtx->outputSurface[i] != EGL_NO_SURFACE )
+      {
+         eglDestroySurface( eglCtx->eglDisplay, eglCtx->outputSurface[i] );
+         eglCtx->outputSurface[i]= EGL_NO_SURFACE;
+      }
+      if ( eglCtx->outputWindow[i] )
+      {
+         PlatformDestroyNativeWindow( ctx->platformCtx, eglCtx->outputWindow[i] );
+         eglCtx->outputWindow[i]= 0;
+      }
+   }
+
    if ( eglCtx->eglSurface != EGL_NO_SURFACE )
    {
       eglDestroySurface( eglCtx->eglDisplay, eglCtx->eglSurface );
@@ -675,13 +1323,271 @@ static const char *fragTextureYUV=
   "   gl_FragColor= vec4( dot(cc_r,temp_vec.xyw), dot(cc_g,temp_vec), dot(cc_b,temp_vec.xyz), 1 );\n"
   "}\n";
 
+static const struct
+{
+   const char *name;
+   const char **vertSrc;
+   const char **fragSrc;
+   int planeCount;
+} gTextureProgramSources[TEXTURE_PROGRAM_COUNT]=
+{
+   { "external", &vertTexture, &fragTexture, 1 },
+   { "yuv", &vertTextureYUV, &fragTextureYUV, 2 }
+};
+
+static GLuint compileShader( GLenum type, const char *src, const char *desc )
+{
+   GLuint shader;
+   GLint status;
+   GLsizei length;
+   char infoLog[512];
+
+   shader= glCreateShader( type );
+   if ( !shader )
+   {
+      iprintf(0,"Error: compileShader: failed to create %s shader\n", desc);
+      goto exit;
+   }
+
+   glShaderSource( shader, 1, (const char **)&src, NULL );
+   glCompileShader( shader );
+   glGetShaderiv( shader, GL_COMPILE_STATUS, &status );
+   if ( !status )
+   {
+      glGetShaderInfoLog( shader, sizeof(infoLog), &length, infoLog );
+      iprintf(0,"Error: compileShader: compiling %s shader: \n%*s\n", desc, length, infoLog );
+      glDeleteShader( shader );
+      shader= 0;
+   }
+
+exit:
+
+   return shader;
+}
+
+static uint32_t programCacheKey( int index )
+{
+   const char *parts[4];
+   const unsigned char *p;
+   uint32_t key= 2166136261U;
+
+   /* A binary is only valid for the same driver and the same sources */
+   parts[0]= (const char *)glGetString( GL_RENDERER );
+   parts[1]= (const char *)glGetString( GL_VERSION );
+   parts[2]= *gTextureProgramSources[index].vertSrc;
+   parts[3]= *gTextureProgramSources[index].fragSrc;
+   for( int i= 0; i < 4; ++i )
+   {
+      p= (const unsigned char *)parts[i];
+      while ( p && *p )
+      {
+         key= (key ^ *p++) * 16777619U;
+      }
+   }
+
+   return key;
+}
+
+static bool loadProgramBinary( GLCtx *ctx, int index )
+{
+   bool result= false;
+   AppCtx *appCtx= ctx->appCtx;
+   TextureProgram *tp= &ctx->texProg[index];
+   ProgramCacheHeader header;
+   char path[PATH_MAX];
+   void *binary= 0;
+   FILE *pFile= 0;
+   GLint status;
+
+   if ( !appCtx->programCacheDir || !ctx->glProgramBinaryOES )
+   {
+      goto exit;
+   }
+
+   snprintf( path, sizeof(path), "%s/v4l2test-%s.bin", appCtx->programCacheDir, gTextureProgramSources[index].name );
+   pFile= fopen( path, "rb" );
+   if ( !pFile )
+   {
+      goto exit;
+   }
+
+   if ( (fread( &header, sizeof(header), 1, pFile ) != 1) ||
+        (header.magic != PROGRAM_CACHE_MAGIC) ||
+        (header.key != programCacheKey( index )) ||
+        (header.length == 0) )
+   {
+      iprintf(1,"loadProgramBinary: stale or invalid cache entry %s\n", path);
+      goto exit;
+   }
+
+   binary= malloc( header.length );
+   if ( !binary || (fread( binary, header.length, 1, pFile ) != 1) )
+   {
+      goto exit;
+   }
+
+   tp->prog= glCreateProgram();
+   ctx->glProgramBinaryOES( tp->prog, header.format, binary, header.length );
+   glGetProgramiv( tp->prog, GL_LINK_STATUS, &status );
+   if ( !status )
+   {
+      iprintf(1,"loadProgramBinary: driver rejected cache entry %s\n", path);
+      glDeleteProgram( tp->prog );
+      tp->prog= 0;
+      goto exit;
+   }
+
+   ++ctx->programCacheHits;
+   result= true;
+
+exit:
+   if ( binary )
+   {
+      free( binary );
+   }
+   if ( pFile )
+   {
+      fclose( pFile );
+   }
+
+   return result;
+}
+
+static void saveProgramBinary( GLCtx *ctx, int index )
+{
+   AppCtx *appCtx= ctx->appCtx;
+   TextureProgram *tp= &ctx->texProg[index];
+   ProgramCacheHeader header;
+   char path[PATH_MAX];
+   void *binary= 0;
+   FILE *pFile= 0;
+   GLint length= 0;
+   GLsizei actualLength= 0;
+   GLenum format= 0;
+
+   if ( !appCtx->programCacheDir || !ctx->glGetProgramBinaryOES )
+   {
+      goto exit;
+   }
+
+   glGetProgramiv( tp->prog, GL_PROGRAM_BINARY_LENGTH_OES, &length );
+   if ( length <= 0 )
+   {
+      goto exit;
+   }
+
+   binary= malloc( length );
+   if ( !binary )
+   {
+      goto exit;
+   }
+
+   ctx->glGetProgramBinaryOES( tp->prog, length, &actualLength, &format, binary );
+   if ( actualLength <= 0 )
+   {
+      goto exit;
+   }
+
+   snprintf( path, sizeof(path), "%s/v4l2test-%s.bin", appCtx->programCacheDir, gTextureProgramSources[index].name );
+   pFile= fopen( path, "wb" );
+   if ( !pFile )
+   {
+      iprintf(0,"Warning: saveProgramBinary: unable to create %s: errno %d\n", path, errno);
+      goto exit;
+   }
+
+   header.magic= PROGRAM_CACHE_MAGIC;
+   header.key= programCacheKey( index );
+   header.format= format;
+   header.length= actualLength;
+   if ( (fwrite( &header, sizeof(header), 1, pFile ) != 1) ||
+        (fwrite( binary, actualLength, 1, pFile ) != 1) )
+   {
+      iprintf(0,"Warning: saveProgramBinary: error writing %s\n", path);
+   }
+
+exit:
+   if ( pFile )
+   {
+      fclose( pFile );
+   }
+   if ( binary )
+   {
+      free( binary );
+   }
+}
+
+static bool initTextureProgram( GLCtx *ctx, int index )
+{
+   bool result= false;
+   TextureProgram *tp= &ctx->texProg[index];
+   GLint status;
+   GLsizei length;
+   char infoLog[512];
+   long long startTime= getMonotonicTimeMicros();
+
+   tp->locPos= 0;
+   tp->locTC= 1;
+   tp->locTCUV= (gTextureProgramSources[index].planeCount > 1) ? 2 : -1;
+
+   if ( !loadProgramBinary( ctx, index ) )
+   {
+      tp->frag= compileShader( GL_FRAGMENT_SHADER, *gTextureProgramSources[index].fragSrc, "texture fragment" );
+      if ( !tp->frag )
+      {
+         goto exit;
+      }
+
+      tp->vert= compileShader( GL_VERTEX_SHADER, *gTextureProgramSources[index].vertSrc, "texture vertex" );
+      if ( !tp->vert )
+      {
+         goto exit;
+      }
+
+      tp->prog= glCreateProgram();
+      glAttachShader(tp->prog, tp->frag);
+      glAttachShader(tp->prog, tp->vert);
+
+      glBindAttribLocation(tp->prog, tp->locPos, "pos");
+      glBindAttribLocation(tp->prog, tp->locTC, "texcoord");
+      if ( tp->locTCUV >= 0 )
+      {
+         glBindAttribLocation(tp->prog, tp->locTCUV, "texcoorduv");
+      }
+
+      glLinkProgram(tp->prog);
+      glGetProgramiv(tp->prog, GL_LINK_STATUS, &status);
+      if (!status)
+      {
+         glGetProgramInfoLog(tp->prog, sizeof(infoLog), &length, infoLog);
+         iprintf(0,"Error: initTextureProgram: linking %s:\n%*s\n", gTextureProgramSources[index].name, length, infoLog);
+         goto exit;
+      }
+
+      saveProgramBinary( ctx, index );
+   }
+
+   tp->locRes= glGetUniformLocation(tp->prog,"u_resolution");
+   tp->locMatrix= glGetUniformLocation(tp->prog,"u_matrix");
+   tp->locTexture= glGetUniformLocation(tp->prog,"texture");
+   tp->locTextureUV= (tp->locTCUV >= 0) ? glGetUniformLocation(tp->prog,"textureuv") : -1;
+
+   iprintf(1,"initTextureProgram: %s program ready in %lld us\n", gTextureProgramSources[index].name, getMonotonicTimeMicros()-startTime);
+
+   result= true;
+
+exit:
+
+   return result;
+}
+
 static bool initGL( GLCtx *ctx )
 {
    bool result= false;
    GLint status;
    GLsizei length;
    char infoLog[512];
-   const char *fragSrc, *vertSrc;
+   long long startTime;
 
    ctx->eglCreateImageKHR= (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
    if ( !ctx->eglCreateImageKHR )
@@ -762,81 +1668,32 @@ static bool initGL( GLCtx *ctx )
 
 
 
-   if ( ctx->haveYUVShaders )
-   {
-      fragSrc= fragTextureYUV;
-      vertSrc= vertTextureYUV;
-   }
-   else
+   if ( ctx->appCtx->programCacheDir )
    {
-      fragSrc= fragTexture;
-      vertSrc= vertTexture;
-   }
-
-   ctx->fragTex= glCreateShader( GL_FRAGMENT_SHADER );
-   if ( !ctx->fragTex )
-   {
-      iprintf(0,"Error: initGL: failed to create texture fragment shader\n");
-      goto exit;
-   }
-
-   glShaderSource( ctx->fragTex, 1, (const char **)&fragSrc, NULL );
-   glCompileShader( ctx->fragTex );
-   glGetShaderiv( ctx->fragTex, GL_COMPILE_STATUS, &status );
-   if ( !status )
-   {
-      glGetShaderInfoLog( ctx->fragTex, sizeof(infoLog), &length, infoLog );
-      iprintf(0,"Error: initGL: compiling texture fragment shader: %*s\n", length, infoLog );
-      goto exit;
-   }
-
-   ctx->vertTex= glCreateShader( GL_VERTEX_SHADER );
-   if ( !ctx->vertTex )
-   {
-      iprintf(0,"Error: initGL: failed to create texture vertex shader\n");
-      goto exit;
-   }
-
-   glShaderSource( ctx->vertTex, 1, (const char **)&vertSrc, NULL );
-   glCompileShader( ctx->vertTex );
-   glGetShaderiv( ctx->vertTex, GL_COMPILE_STATUS, &status );
-   if ( !status )
-   {
-      glGetShaderInfoLog( ctx->vertTex, sizeof(infoLog), &length, infoLog );
-      iprintf(0,"Error: initGL: compiling texture vertex shader: \n%*s\n", length, infoLog );
-      goto exit;
-   }
-
-   ctx->progTex= glCreateProgram();
-   glAttachShader(ctx->progTex, ctx->fragTex);
-   glAttachShader(ctx->progTex, ctx->vertTex);
-
-   ctx->locPosTex= 0;
-   ctx->locTC= 1;
-   glBindAttribLocation(ctx->progTex, ctx->locPosTex, "pos");
-   glBindAttribLocation(ctx->progTex, ctx->locTC, "texcoord");
-   if ( ctx->haveYUVShaders )
-   {
-      ctx->locTCUV= 2;
-      glBindAttribLocation(ctx->progTex, ctx->locTCUV, "texcoorduv");
-   }
-
-   glLinkProgram(ctx->progTex);
-   glGetProgramiv(ctx->progTex, GL_LINK_STATUS, &status);
-   if (!status)
-   {
-      glGetProgramInfoLog(ctx->progTex, sizeof(infoLog), &length, infoLog);
-      iprintf(0,"Error: initGL: linking:\n%*s\n", length, infoLog);
-      goto exit;
+      const char *glExtensions= (const char *)glGetString(GL_EXTENSIONS);
+      if ( glExtensions && strstr( glExtensions, "GL_OES_get_program_binary" ) )
+      {
+         ctx->glGetProgramBinaryOES= (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinaryOES");
+         ctx->glProgramBinaryOES= (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinaryOES");
+      }
+      if ( !ctx->glGetProgramBinaryOES || !ctx->glProgramBinaryOES )
+      {
+         iprintf(0,"Warning: initGL: no GL_OES_get_program_binary: program cache disabled\n");
+         ctx->glGetProgramBinaryOES= 0;
+         ctx->glProgramBinaryOES= 0;
+      }
    }
 
-   ctx->locResTex= glGetUniformLocation(ctx->progTex,"u_resolution");
-   ctx->locMatrixTex= glGetUniformLocation(ctx->progTex,"u_matrix");
-   ctx->locTexture= glGetUniformLocation(ctx->progTex,"texture");
-   if ( ctx->haveYUVShaders )
+   startTime= getMonotonicTimeMicros();
+   for( int i= 0; i < TEXTURE_PROGRAM_COUNT; ++i )
    {
-      ctx->locTextureUV= glGetUniformLocation(ctx->progTex,"textureuv");
+      if ( !initTextureProgram( ctx, i ) )
+      {
+         goto exit;
+      }
    }
+   iprintf(0,"initGL: %d texture programs ready in %lld us (%d from cache)\n",
+           TEXTURE_PROGRAM_COUNT, getMonotonicTimeMicros()-startTime, ctx->programCacheHits);
 
    result= true;
 
@@ -847,28 +1704,74 @@ exit:
 
 static void termGL( GLCtx *glCtx )
 {
-   if ( glCtx->fragTex )
+   if ( glCtx->mosaicVbo )
    {
-      glDeleteShader( glCtx->fragTex );
-      glCtx->fragTex= 0;
+      glDeleteBuffers( 1, &glCtx->mosaicVbo );
+      glCtx->mosaicVbo= 0;
+      glCtx->mosaicValid= false;
    }
-   if ( glCtx->vertTex )
+   for( int i= 0; i < TEXTURE_PROGRAM_COUNT; ++i )
    {
-      glDeleteShader( glCtx->vertTex );
-      glCtx->vertTex= 0;
+      TextureProgram *tp= &glCtx->texProg[i];
+      if ( tp->frag )
+      {
+         glDeleteShader( tp->frag );
+         tp->frag= 0;
+      }
+      if ( tp->vert )
+      {
+         glDeleteShader( tp->vert );
+         tp->vert= 0;
+      }
+      if ( tp->prog )
+      {
+         glDeleteProgram( tp->prog );
+         tp->prog= 0;
+      }
    }
-   if ( glCtx->progTex )
+}
+
+static void updateSurfaceTextures( GLCtx *glCtx, Surface *surface )
+{
+   if ( (surface->textureId[0] == GL_NONE) || surface->externalImage )
    {
-      glDeleteProgram( glCtx->progTex );
-      glCtx->progTex= 0;
+      for( int i= 0; i < surface->textureCount; ++i )
+      {
+         if ( surface->textureId[i] == GL_NONE )
+         {
+            glGenTextures(1, &surface->textureId[i] );
+            iprintf(6,"updateSurfaceTextures: surface %p texture[%d] %d\n", surface, i, surface->textureId[i]);
+         }
+       
+         glActiveTexture(GL_TEXTURE0+i);
+         glBindTexture(GL_TEXTURE_2D, surface->textureId[i] );
+         iprintf(6,"updateSurfaceTextures: surface %p eglImage[%d] %p\n", surface, i, surface->eglImage[i]);
+         if ( surface->eglImage[i] )
+         {
+            if ( surface->externalImage )
+            {
+               glCtx->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, surface->eglImage[i]);
+            }
+            else
+            {
+               glCtx->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, surface->eglImage[i]);
+            }
+         }
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+         glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+         glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      }
    }
 }
 
 static void drawSurface( GLCtx *glCtx, Surface *surface )
 {
    AppCtx *appCtx= glCtx->appCtx;
+   TextureProgram *tp;
    int x, y, w, h;
    GLenum glerr;
+   long long startTime= getMonotonicTimeMicros();
 
    x= surface->x;
    y= surface->y;
@@ -902,72 +1805,35 @@ static void drawSurface( GLCtx *glCtx, Surface *surface )
       {0, 0, 0, 1}
    };
 
-   if ( glCtx->haveYUVShaders != surface->haveYUVTextures )
-   {
-      termGL( glCtx );
-      glCtx->haveYUVShaders= surface->haveYUVTextures;
-      if ( !initGL( glCtx ) )
-      {
-         iprintf(0,"Error: drawSurface: initGL failed while changing shaders\n");
-      }
-   }
+   tp= &glCtx->texProg[surface->haveYUVTextures ? TEXTURE_PROGRAM_YUV : TEXTURE_PROGRAM_EXTERNAL];
 
-   if ( (surface->textureId[0] == GL_NONE) || surface->externalImage )
-   {
-      for( int i= 0; i < surface->textureCount; ++i )
-      {
-         if ( surface->textureId[i] == GL_NONE )
-         {
-            glGenTextures(1, &surface->textureId[i] );
-            iprintf(6,"drawSurface: surface %p texture[%d] %d\n", surface, i, surface->textureId[i]);
-         }
-       
-         glActiveTexture(GL_TEXTURE0+i);
-         glBindTexture(GL_TEXTURE_2D, surface->textureId[i] );
-         iprintf(6,"drawSurface: surface %p eglImage[%d] %p\n", surface, i, surface->eglImage[i]);
-         if ( surface->eglImage[i] )
-         {
-            if ( surface->externalImage )
-            {
-               glCtx->glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, surface->eglImage[i]);
-            }
-            else
-            {
-               glCtx->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, surface->eglImage[i]);
-            }
-         }
-         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-         glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-         glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-      }
-   }
+   updateSurfaceTextures( glCtx, surface );
 
-   glUseProgram(glCtx->progTex);
-   glUniform2f(glCtx->locResTex, appCtx->windowWidth, appCtx->windowHeight);
-   glUniformMatrix4fv(glCtx->locMatrixTex, 1, GL_FALSE, (GLfloat*)identityMatrix);
+   glUseProgram(tp->prog);
+   glUniform2f(tp->locRes, appCtx->windowWidth, appCtx->windowHeight);
+   glUniformMatrix4fv(tp->locMatrix, 1, GL_FALSE, (GLfloat*)identityMatrix);
 
    glActiveTexture(GL_TEXTURE0); 
    glBindTexture(GL_TEXTURE_2D, surface->textureId[0]);
-   glUniform1i(glCtx->locTexture, 0);
-   glVertexAttribPointer(glCtx->locPosTex, 2, GL_FLOAT, GL_FALSE, 0, verts);
-   glVertexAttribPointer(glCtx->locTC, 2, GL_FLOAT, GL_FALSE, 0, uv);
-   glEnableVertexAttribArray(glCtx->locPosTex);
-   glEnableVertexAttribArray(glCtx->locTC);
+   glUniform1i(tp->locTexture, 0);
+   glVertexAttribPointer(tp->locPos, 2, GL_FLOAT, GL_FALSE, 0, verts);
+   glVertexAttribPointer(tp->locTC, 2, GL_FLOAT, GL_FALSE, 0, uv);
+   glEnableVertexAttribArray(tp->locPos);
+   glEnableVertexAttribArray(tp->locTC);
    if ( surface->haveYUVTextures )
    {
       glActiveTexture(GL_TEXTURE1); 
       glBindTexture(GL_TEXTURE_2D, surface->textureId[1]);
-      glUniform1i(glCtx->locTextureUV, 1);
-      glVertexAttribPointer(glCtx->locTCUV, 2, GL_FLOAT, GL_FALSE, 0, uv);
-      glEnableVertexAttribArray(glCtx->locTCUV);
+      glUniform1i(tp->locTextureUV, 1);
+      glVertexAttribPointer(tp->locTCUV, 2, GL_FLOAT, GL_FALSE, 0, uv);
+      glEnableVertexAttribArray(tp->locTCUV);
    }
    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-   glDisableVertexAttribArray(glCtx->locPosTex);
-   glDisableVertexAttribArray(glCtx->locTC);
+   glDisableVertexAttribArray(tp->locPos);
+   glDisableVertexAttribArray(tp->locTC);
    if ( surface->haveYUVTextures )
    {
-      glDisableVertexAttribArray(glCtx->locTCUV);
+      glDisableVertexAttribArray(tp->locTCUV);
    }
 
    glerr= glGetError();
@@ -975,1938 +1841,6413 @@ static void drawSurface( GLCtx *glCtx, Surface *surface )
    {
       iprintf(0,"Warning: drawSurface: glGetError: %X\n", glerr);
    }
+
+   fenceSurfaceFrame( appCtx, surface );
+
+   TimelineSpan( "draw", (int)(surface-appCtx->surface), startTime, getMonotonicTimeMicros() );
 }
 
-static int ioctl_wrapper( int fd, int request, void* arg )
+static void updateMosaicGeometry( GLCtx *glCtx )
 {
-   const char *req= 0;
-   int rc;
+   AppCtx *appCtx= glCtx->appCtx;
+   Surface *surface;
+   float verts[NUM_DECODE][4][4];
+   int i, x, y, w, h;
+   bool changed;
 
-   if ( gVerbose )
+   changed= !glCtx->mosaicValid;
+   for( i= 0; i < NUM_DECODE; ++i )
    {
-      switch( request )
-      {
-         case VIDIOC_QUERYCAP: req= "VIDIOC_QUERYCAP"; break;
-         case VIDIOC_ENUM_FMT: req= "VIDIOC_ENUM_FMT"; break;
-         case VIDIOC_G_FMT: req= "VIDIOC_G_FMT"; break;
-         case VIDIOC_S_FMT: req= "VIDIOC_S_FMT"; break;
-         case VIDIOC_REQBUFS: req= "VIDIOC_REQBUFS"; break;
-         case VIDIOC_QUERYBUF: req= "VIDIOC_QUERYBUFS"; break;
-         case VIDIOC_G_FBUF: req= "VIDIOC_G_FBUF"; break;
-         case VIDIOC_S_FBUF: req= "VIDIOC_S_FBUF"; break;
-         case VIDIOC_OVERLAY: req= "VIDIOC_OVERLAY"; break;
-         case VIDIOC_QBUF: req= "VIDIOC_QBUF"; break;
-         case VIDIOC_EXPBUF: req= "VIDIOC_EXPBUF"; break;
-         case VIDIOC_DQBUF: req= "VIDIOC_DQBUF"; break;
-         case VIDIOC_STREAMON: req= "VIDIOC_STREAMON"; break;
-         case VIDIOC_STREAMOFF: req= "VIDIOC_STREAMOFF"; break;
-         case VIDIOC_G_PARM: req= "VIDIOC_G_PARM"; break;
-         case VIDIOC_S_PARM: req= "VIDIOC_S_PARM"; break;
-         case VIDIOC_G_STD: req= "VIDIOC_G_STD"; break;
-         case VIDIOC_S_STD: req= "VIDIOC_S_STD"; break;
-         case VIDIOC_ENUMSTD: req= "VIDIOC_ENUMSTD"; break;
-         case VIDIOC_ENUMINPUT: req= "VIDIOC_ENUMINPUT"; break;
-         case VIDIOC_G_CTRL: req= "VIDIOC_G_CTRL"; break;
-         case VIDIOC_S_CTRL: req= "VIDIOC_S_CTRL"; break;
-         case VIDIOC_QUERYCTRL: req= "VIDIOC_QUERYCTRL"; break;
-         case VIDIOC_ENUM_FRAMESIZES: req= "VIDIOC_ENUM_FRAMESIZES"; break;
-         case VIDIOC_TRY_FMT: req= "VIDIOC_TRY_FMT"; break;
-         case VIDIOC_CROPCAP: req= "VIDIOC_CROPCAP"; break;
-         case VIDIOC_CREATE_BUFS: req= "VIDIOC_CREATE_BUFS"; break;
-         case VIDIOC_G_SELECTION: req= "VIDIOC_G_SELECTION"; break;
-         default: req= "NA"; break;
-      }
-      fprintf(stderr,"ioct( %d, %x ( %s ) )\n", fd, request, req );
-      if ( request == VIDIOC_S_FMT )
-      {
-         struct v4l2_format *format= (struct v4l2_format*)arg;
-         fprintf(stderr,": type %d\n", format->type);
-         if ( (format->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
-              (format->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) )
-         {
-            fprintf(stderr,"pix_mp: pixelFormat %X w %d h %d field %d cs %d flg %x num_planes %d p0: sz %d bpl %d p1: sz %d bpl %d\n",
-                    format->fmt.pix_mp.pixelformat,
-                    format->fmt.pix_mp.width,
-                    format->fmt.pix_mp.height,
-                    format->fmt.pix_mp.field,
-                    format->fmt.pix_mp.colorspace,
-                    format->fmt.pix_mp.flags,
-                    format->fmt.pix_mp.num_planes,
-                    format->fmt.pix_mp.plane_fmt[0].sizeimage,
-                    format->fmt.pix_mp.plane_fmt[0].bytesperline,
-                    format->fmt.pix_mp.plane_fmt[1].sizeimage,
-                    format->fmt.pix_mp.plane_fmt[1].bytesperline
-                  );
-         }
-      }
-      else if ( request == VIDIOC_REQBUFS )
-      {
-         struct v4l2_requestbuffers *rb= (struct v4l2_requestbuffers*)arg;
-         fprintf(stderr,"count %d type %d mem %d\n", rb->count, rb->type, rb->memory);
-      }
-      else if ( request == VIDIOC_CREATE_BUFS )
+      surface= &appCtx->surface[i];
+      if ( (glCtx->mosaicRect[i][0] != surface->x) || (glCtx->mosaicRect[i][1] != surface->y) ||
+           (glCtx->mosaicRect[i][2] != surface->w) || (glCtx->mosaicRect[i][3] != surface->h) )
       {
-         struct v4l2_create_buffers *cb= (struct v4l2_create_buffers*)arg;
-         struct v4l2_format *format= &cb->format;
-         fprintf(stderr,"count %d mem %d\n", cb->count, cb->memory);
-         fprintf(stderr,"pix_mp: pixelFormat %X w %d h %d num_planes %d p0: sz %d bpl %d p1: sz %d bpl %d\n",
-                 format->fmt.pix_mp.pixelformat,
-                 format->fmt.pix_mp.width,
-                 format->fmt.pix_mp.height,
-                 format->fmt.pix_mp.num_planes,
-                 format->fmt.pix_mp.plane_fmt[0].sizeimage,
-                 format->fmt.pix_mp.plane_fmt[0].bytesperline,
-                 format->fmt.pix_mp.plane_fmt[1].sizeimage,
-                 format->fmt.pix_mp.plane_fmt[1].bytesperline
-               );
+         changed= true;
       }
-      else if ( request == VIDIOC_QBUF )
+   }
+   if ( !changed )
+   {
+      return;
+   }
+
+   /* One interleaved quad (x, y, u, v) per surface, drawn as a strip starting at 4*index */
+   for( i= 0; i < NUM_DECODE; ++i )
+   {
+      surface= &appCtx->surface[i];
+      x= surface->x;
+      y= surface->y;
+      w= surface->w;
+      h= surface->h;
+      glCtx->mosaicRect[i][0]= x;
+      glCtx->mosaicRect[i][1]= y;
+      glCtx->mosaicRect[i][2]= w;
+      glCtx->mosaicRect[i][3]= h;
+
+      const float quad[4][4]=
       {
-         struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
-         fprintf(stderr,"buff: index %d q: type %d bytesused %d flags %X field %d mem %x length %d timestamp sec %ld usec %ld\n",
-                buf->index, buf->type, buf->bytesused, buf->flags, buf->field, buf->memory, buf->length, buf->timestamp.tv_sec, buf->timestamp.tv_usec);
-         if ( buf->m.planes &&
-              ( (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
-                (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) ) )
-         {
-            fprintf(stderr,"buff: p0: bu %d len %d moff %d doff %d p1: bu %d len %d moff %d doff %d\n",
-                   buf->m.planes[0].bytesused, buf->m.planes[0].length, buf->m.planes[0].m.mem_offset, buf->m.planes[0].data_offset,
-                   buf->m.planes[1].bytesused, buf->m.planes[1].length, buf->m.planes[1].m.mem_offset, buf->m.planes[1].data_offset );
-         }
-      }
-      else if ( request == VIDIOC_DQBUF )
+         { float(x), float(y), 0, 0 },
+         { float(x+w), float(y), 1, 0 },
+         { float(x), float(y+h), 0, 1 },
+         { float(x+w), float(y+h), 1, 1 }
+      };
+      memcpy( verts[i], quad, sizeof(quad) );
+   }
+
+   if ( !glCtx->mosaicVbo )
+   {
+      glGenBuffers( 1, &glCtx->mosaicVbo );
+   }
+   glBindBuffer( GL_ARRAY_BUFFER, glCtx->mosaicVbo );
+   glBufferData( GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW );
+   glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+   glCtx->mosaicValid= true;
+   ++glCtx->mosaicRebuildCount;
+   iprintf(3,"updateMosaicGeometry: layout changed: rebuild %d\n", glCtx->mosaicRebuildCount);
+}
+
+static void drawMosaic( GLCtx *glCtx, Surface **surfaces, int count )
+{
+   AppCtx *appCtx= glCtx->appCtx;
+   Surface *surface, *temp;
+   TextureProgram *tp, *tpCurrent;
+   GLuint boundTexture[MAX_TEXTURES];
+   GLenum glerr;
+   int i, j, index, progIndex, progIndexOther;
+   long long startTime= getMonotonicTimeMicros();
+
+   const float identityMatrix[4][4]=
+   {
+      {1, 0, 0, 0},
+      {0, 1, 0, 0},
+      {0, 0, 1, 0},
+      {0, 0, 0, 1}
+   };
+
+   if ( count <= 0 )
+   {
+      return;
+   }
+
+   updateMosaicGeometry( glCtx );
+
+   /* Order by program then texture so each program is set up once per frame */
+   for( i= 1; i < count; ++i )
+   {
+      temp= surfaces[i];
+      progIndex= (temp->haveYUVTextures ? TEXTURE_PROGRAM_YUV : TEXTURE_PROGRAM_EXTERNAL);
+      for( j= i-1; j >= 0; --j )
       {
-         struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
-         fprintf(stderr,"buff: index %d s dq: type %d bytesused %d flags %X field %d mem %x length %d timestamp sec %ld usec %ld\n",
-                buf->index, buf->type, buf->bytesused, buf->flags, buf->field, buf->memory, buf->length, buf->timestamp.tv_sec, buf->timestamp.tv_usec);
-         if ( buf->m.planes &&
-              ( (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
-                (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) ) )
+         progIndexOther= (surfaces[j]->haveYUVTextures ? TEXTURE_PROGRAM_YUV : TEXTURE_PROGRAM_EXTERNAL);
+         if ( (progIndexOther < progIndex) ||
+              ((progIndexOther == progIndex) && (surfaces[j]->textureId[0] <= temp->textureId[0])) )
          {
-            fprintf(stderr,"buff: p0: bu %d len %d moff %d doff %d p1: bu %d len %d moff %d doff %d\n",
-                   buf->m.planes[0].bytesused, buf->m.planes[0].length, buf->m.planes[0].m.mem_offset, buf->m.planes[0].data_offset,
-                   buf->m.planes[1].bytesused, buf->m.planes[1].length, buf->m.planes[1].m.mem_offset, buf->m.planes[1].data_offset );
+            break;
          }
+         surfaces[j+1]= surfaces[j];
       }
-      else if ( (request == VIDIOC_STREAMON) || (request == VIDIOC_STREAMOFF) )
-      {
-         int *type= (int*)arg;
-         fprintf(stderr,": type %d\n", *type);
-      }
+      surfaces[j+1]= temp;
    }
 
-   rc= ioctl( fd, request, arg );
-
+   glBindBuffer( GL_ARRAY_BUFFER, glCtx->mosaicVbo );
 
-   if ( gVerbose )
+   tpCurrent= 0;
+   for( i= 0; i < MAX_TEXTURES; ++i )
    {
-      if ( rc < 0 )
-      {
-         fprintf(stderr,"ioct( %d, %x ) rc %d errno %d\n", fd, request, rc, errno );
-      }
-      else
+      boundTexture[i]= GL_NONE;
+   }
+   for( i= 0; i < count; ++i )
+   {
+      surface= surfaces[i];
+      index= (int)(surface-appCtx->surface);
+      tp= &glCtx->texProg[surface->haveYUVTextures ? TEXTURE_PROGRAM_YUV : TEXTURE_PROGRAM_EXTERNAL];
+
+      if ( tp != tpCurrent )
       {
-         fprintf(stderr,"ioct( %d, %x ) rc %d\n", fd, request, rc );
-         if ( (request == VIDIOC_S_FMT) || (request == VIDIOC_G_FMT) )
-         {
-            struct v4l2_format *format= (struct v4l2_format*)arg;
-            if ( (format->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
-                 (format->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) )
-            {
-               fprintf(stderr,"pix_mp: pixelFormat %X w %d h %d num_planes %d p0: sz %d bpl %d p1: sz %d bpl %d\n",
-                       format->fmt.pix_mp.pixelformat,
-                       format->fmt.pix_mp.width,
-                       format->fmt.pix_mp.height,
-                       format->fmt.pix_mp.num_planes,
-                       format->fmt.pix_mp.plane_fmt[0].sizeimage,
-                       format->fmt.pix_mp.plane_fmt[0].bytesperline,
-                       format->fmt.pix_mp.plane_fmt[1].sizeimage,
-                       format->fmt.pix_mp.plane_fmt[1].bytesperline
-                     );
-            }
-         }
-         else if ( request == VIDIOC_CREATE_BUFS )
+         if ( tpCurrent && (tpCurrent->locTCUV >= 0) )
          {
-            struct v4l2_create_buffers *cb= (struct v4l2_create_buffers*)arg;
-            fprintf(stderr,"index %d count %d mem %d\n", cb->index, cb->count, cb->memory);
+            glDisableVertexAttribArray(tpCurrent->locTCUV);
          }
-         else if ( request == VIDIOC_G_CTRL )
+         glUseProgram(tp->prog);
+         glUniform2f(tp->locRes, appCtx->windowWidth, appCtx->windowHeight);
+         glUniformMatrix4fv(tp->locMatrix, 1, GL_FALSE, (GLfloat*)identityMatrix);
+         glUniform1i(tp->locTexture, 0);
+         glVertexAttribPointer(tp->locPos, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float), (void*)0);
+         glVertexAttribPointer(tp->locTC, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float), (void*)(2*sizeof(float)));
+         glEnableVertexAttribArray(tp->locPos);
+         glEnableVertexAttribArray(tp->locTC);
+         if ( tp->locTCUV >= 0 )
          {
-            struct v4l2_control *ctrl= (struct v4l2_control*)arg;
-            fprintf(stderr,"id %d value %d\n", ctrl->id, ctrl->value);
+            glUniform1i(tp->locTextureUV, 1);
+            glVertexAttribPointer(tp->locTCUV, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float), (void*)(2*sizeof(float)));
+            glEnableVertexAttribArray(tp->locTCUV);
          }
-         else if ( request == VIDIOC_DQBUF )
+         tpCurrent= tp;
+      }
+
+      for( j= 0; j < (surface->haveYUVTextures ? 2 : 1); ++j )
+      {
+         if ( boundTexture[j] != surface->textureId[j] )
          {
-            struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
-            fprintf(stderr,"buff: index %d f dq: type %d bytesused %d flags %X field %d mem %x length %d seq %d timestamp sec %ld usec %ld\n",
-                   buf->index, buf->type, buf->bytesused, buf->flags, buf->field, buf->memory, buf->length, buf->sequence, buf->timestamp.tv_sec, buf->timestamp.tv_usec);
-            if ( buf->m.planes &&
-                 ( (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
-                   (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) ) )
-            {
-               fprintf(stderr,"buff: p0: bu %d len %d moff %d doff %d p1: bu %d len %d moff %d doff %d\n",
-                      buf->m.planes[0].bytesused, buf->m.planes[0].length, buf->m.planes[0].m.mem_offset, buf->m.planes[0].data_offset,
-                      buf->m.planes[1].bytesused, buf->m.planes[1].length, buf->m.planes[1].m.mem_offset, buf->m.planes[1].data_offset );
-            }
+            glActiveTexture(GL_TEXTURE0+j);
+            glBindTexture(GL_TEXTURE_2D, surface->textureId[j]);
+            boundTexture[j]= surface->textureId[j];
          }
       }
+
+      glDrawArrays(GL_TRIANGLE_STRIP, index*4, 4);
    }
 
-   return rc;
+   glDisableVertexAttribArray(tpCurrent->locPos);
+   glDisableVertexAttribArray(tpCurrent->locTC);
+   if ( tpCurrent->locTCUV >= 0 )
+   {
+      glDisableVertexAttribArray(tpCurrent->locTCUV);
+   }
+   glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+   glerr= glGetError();
+   if ( glerr != GL_NO_ERROR )
+   {
+      iprintf(0,"Warning: drawMosaic: glGetError: %X\n", glerr);
+   }
+
+   TimelineSpan( "draw", -1, startTime, getMonotonicTimeMicros() );
 }
 
-static bool getInputFormats( V4l2Ctx *v4l2 )
+static void unionRect( int *rect, const int *other )
 {
-   bool result= false;
-   struct v4l2_fmtdesc format;
-   int i, rc;
-   int32_t bufferType;
+   int x1, y1, x2, y2;
 
-   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT);
+   if ( (other[2] <= 0) || (other[3] <= 0) )
+   {
+      return;
+   }
+   if ( (rect[2] <= 0) || (rect[3] <= 0) )
+   {
+      memcpy( rect, other, 4*sizeof(int) );
+      return;
+   }
+   x1= (rect[0] < other[0]) ? rect[0] : other[0];
+   y1= (rect[1] < other[1]) ? rect[1] : other[1];
+   x2= (rect[0]+rect[2] > other[0]+other[2]) ? rect[0]+rect[2] : other[0]+other[2];
+   y2= (rect[1]+rect[3] > other[1]+other[3]) ? rect[1]+rect[3] : other[1]+other[3];
+   rect[0]= x1;
+   rect[1]= y1;
+   rect[2]= x2-x1;
+   rect[3]= y2-y1;
+}
 
-   i= 0;
-   for( ; ; )
+static void fenceSurfaceFrame( AppCtx *appCtx, Surface *surface )
+{
+   EGLCtx *egl= &appCtx->egl;
+   DecCtx *decCtx= 0;
+   EGLSyncKHR sync;
+
+   /* Called with the decoder locked, after the draw that samples its current frame */
+   if ( !egl->eglCreateSyncKHR )
    {
-      format.index= i;
-      format.type= bufferType;
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_ENUM_FMT, &format);
-      if ( rc < 0 )
+      return;
+   }
+   for( int i= 0; i < NUM_DECODE; ++i )
+   {
+      if ( appCtx->decode[i].surface == surface )
       {
-         if ( errno == EINVAL )
-         {
-            iprintf(1,"Found %d input formats\n", i);
-            v4l2->numInputFormats= i;
-            break;
-         }
-         goto exit;
+         decCtx= &appCtx->decode[i];
+         break;
       }
-      ++i;
+   }
+   if ( !decCtx || ((decCtx->currFrameFd < 0) && !decCtx->heldCaptureCount) )
+   {
+      return;
    }
 
-   v4l2->inputFormats= (struct v4l2_fmtdesc*)calloc( v4l2->numInputFormats, sizeof(struct v4l2_format) );
-   if ( !v4l2->inputFormats )
+   sync= egl->eglCreateSyncKHR( egl->eglDisplay, EGL_SYNC_FENCE_KHR, NULL );
+   if ( sync == EGL_NO_SYNC_KHR )
    {
-      iprintf(0,"Error: getInputFormats: no memory for inputFormats\n");
-      v4l2->numInputFormats= 0;
-      goto exit;
+      iprintf(0,"Warning: fenceSurfaceFrame: eglCreateSyncKHR failed: %X\n", eglGetError());
+      return;
    }
+   /* Waits happen on other threads without EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, so submit the fence now */
+   glFlush();
 
-   for( i= 0; i < v4l2->numInputFormats; ++i)
+   /* Fences signal in order so the newest one covers every earlier draw of this frame */
+   if ( decCtx->currFrameSync != EGL_NO_SYNC_KHR )
    {
-      v4l2->inputFormats[i].index= i;
-      v4l2->inputFormats[i].type= bufferType;
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_ENUM_FMT, &v4l2->inputFormats[i]);
-      if ( rc < 0 )
-      {
-         goto exit;
-      }
-      iprintf(1, "input format %d: flags %08x pixelFormat: %x desc: %s\n", 
-             i, v4l2->inputFormats[i].flags, v4l2->inputFormats[i].pixelformat, v4l2->inputFormats[i].description );
+      egl->eglDestroySyncKHR( egl->eglDisplay, decCtx->currFrameSync );
+   }
+   decCtx->currFrameSync= sync;
+}
+
+static void waitFrameSync( DecCtx *decCtx, EGLSyncKHR sync )
+{
+   EGLCtx *egl= &decCtx->appCtx->egl;
+   long long startTime, waitTime;
+   EGLint rc;
+
+   if ( sync == EGL_NO_SYNC_KHR )
+   {
+      return;
    }
 
-   result= true;
+   startTime= getMonotonicTimeMicros();
+   rc= egl->eglClientWaitSyncKHR( egl->eglDisplay, sync, 0, FRAME_FENCE_TIMEOUT_NS );
+   waitTime= getMonotonicTimeMicros()-startTime;
+   if ( rc == EGL_TIMEOUT_EXPIRED_KHR )
+   {
+      iprintf(0,"Warning: decoder %d: render fence not signalled after %lld us\n", decCtx->decodeIndex, waitTime);
+      ++decCtx->fenceTimeoutCount;
+   }
+   else if ( rc == EGL_FALSE )
+   {
+      iprintf(0,"Warning: decoder %d: eglClientWaitSyncKHR failed: %X\n", decCtx->decodeIndex, eglGetError());
+   }
+   ++decCtx->fenceWaitCount;
+   decCtx->fenceWaitTotal += waitTime;
+   if ( waitTime > decCtx->fenceWaitMax )
+   {
+      decCtx->fenceWaitMax= waitTime;
+   }
 
-exit:
-   return result;
+   egl->eglDestroySyncKHR( egl->eglDisplay, sync );
 }
 
-static bool getOutputFormats( V4l2Ctx *v4l2 )
+static void waitPlaneRelease( DecCtx *decCtx )
 {
-   bool result= false;
-   struct v4l2_fmtdesc format;
-   int i, rc;
-   int32_t bufferType;
-   bool haveNV12= false;
-
-   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
+   AppCtx *appCtx= decCtx->appCtx;
+   long long startTime, waitTime;
+   unsigned int sequence;
 
-   i= 0;
+   /* A frame on a plane is released by the flip of the first swap that no longer shows it */
+   startTime= getMonotonicTimeMicros();
    for( ; ; )
    {
-      format.index= i;
-      format.type= bufferType;
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_ENUM_FMT, &format);
-      if ( rc < 0 )
+      pthread_mutex_lock( &decCtx->mutex );
+      sequence= decCtx->prevPlaneSeq;
+      pthread_mutex_unlock( &decCtx->mutex );
+      if ( (sequence == 0) ||
+           ((sequence != PLANE_SEQ_PENDING) && (PlatformGetFlipTime( appCtx->platformCtx, sequence ) != 0)) )
       {
-         if ( errno == EINVAL )
-         {
-            iprintf(1,"Found %d output formats\n", i);
-            v4l2->numOutputFormats= i;
-            break;
-         }
-         goto exit;
+         break;
       }
-      ++i;
+      waitTime= getMonotonicTimeMicros()-startTime;
+      if ( (waitTime > FRAME_FENCE_TIMEOUT_NS/1000) || decCtx->videoOutThreadStopRequested )
+      {
+         iprintf(0,"Warning: decoder %d: plane not released after %lld us\n", decCtx->decodeIndex, waitTime);
+         ++decCtx->planeTimeoutCount;
+         break;
+      }
+      usleep( 1000 );
    }
-
-   v4l2->outputFormats= (struct v4l2_fmtdesc*)calloc( v4l2->numOutputFormats, sizeof(struct v4l2_format) );
-   if ( !v4l2->outputFormats )
+   if ( sequence )
    {
-      iprintf(0,"Error: getOutputFormats: no memory for outputFormats\n");
-      v4l2->numOutputFormats= 0;
-      goto exit;
+      waitTime= getMonotonicTimeMicros()-startTime;
+      ++decCtx->planeWaitCount;
+      decCtx->planeWaitTotal += waitTime;
+      if ( waitTime > decCtx->planeWaitMax )
+      {
+         decCtx->planeWaitMax= waitTime;
+      }
    }
+}
 
-   for( i= 0; i < v4l2->numOutputFormats; ++i)
+static void assignVideoPlanes( AppCtx *appCtx, const bool *locked, int *damage, int *dirtyCount )
+{
+   unsigned int mask;
+   int i, buffIndex, fd0, fd1;
+
+   /* Called with the decoders locked, before composing */
+   for( i= 0; i < NUM_DECODE; ++i )
    {
-      v4l2->outputFormats[i].index= i;
-      v4l2->outputFormats[i].type= bufferType;
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_ENUM_FMT, &v4l2->outputFormats[i]);
-      if ( rc < 0 )
+      DecCtx *decCtx= &appCtx->decode[i];
+      V4l2Ctx *v4l2= &decCtx->v4l2;
+      Surface *surface= &appCtx->surface[i];
+
+      buffIndex= -1;
+      if ( locked[i] && surface->eglImage[0] && (decCtx->currFrameFd >= 0) )
       {
-         goto exit;
+         buffIndex= findOutputBuffer( v4l2, decCtx->currFrameFd );
       }
-      if ( (v4l2->outputFormats[i].pixelformat == V4L2_PIX_FMT_NV12) ||
-           (v4l2->outputFormats[i].pixelformat == V4L2_PIX_FMT_NV12M) )
+      if ( buffIndex >= 0 )
       {
-         haveNV12= true;
+         if ( v4l2->isMultiPlane )
+         {
+            fd0= v4l2->outBuffers[buffIndex].planeInfo[0].fd;
+            fd1= v4l2->outBuffers[buffIndex].planeInfo[1].fd;
+            if ( fd1 == -1 )
+            {
+               fd1= fd0;
+            }
+         }
+         else
+         {
+            fd0= v4l2->outBuffers[buffIndex].fd;
+            fd1= fd0;
+         }
+         PlatformSetVideoLayer( appCtx->platformCtx, i, v4l2->bufferGeneration, fd0, fd1,
+                                (fd0 != fd1 ? 0 : decCtx->videoBufferWidth*decCtx->videoBufferHeight),
+                                v4l2->outputModifier, decCtx->videoWidth, decCtx->videoHeight, decCtx->videoBufferWidth,
+                                surface->x, surface->y, surface->w, surface->h );
+      }
+      else
+      {
+         PlatformClearVideoLayer( appCtx->platformCtx, i );
       }
-      iprintf(1,"output format %d: flags %08x pixelFormat: %x desc: %s\n", 
-             i, v4l2->outputFormats[i].flags, v4l2->outputFormats[i].pixelformat, v4l2->outputFormats[i].description );
    }
 
-   if ( !haveNV12 )
-   {
-      iprintf(0,"no suport for NV12/NV12M output detected\n");
-   }
+   mask= PlatformAssignPlanes( appCtx->platformCtx );
 
-   result= true;
+   for( i= 0; i < NUM_DECODE; ++i )
+   {
+      DecCtx *decCtx= &appCtx->decode[i];
+      Surface *surface= &appCtx->surface[i];
+      bool onPlane= (locked[i] && (mask & (1<<i)));
 
-exit:
-   return result;
+      if ( surface->onPlane != onPlane )
+      {
+         /* Moving between GL and a plane changes the composed frame under the surface */
+         int rect[4]= { surface->x, surface->y, surface->w, surface->h };
+         surface->onPlane= onPlane;
+         unionRect( damage, rect );
+         ++(*dirtyCount);
+      }
+      if ( locked[i] )
+      {
+         /* Stays set until updateFrame replaces the frame, it may still be on screen */
+         decCtx->currOnPlane= (decCtx->currOnPlane || onPlane);
+         if ( decCtx->prevPlaneSeq == PLANE_SEQ_PENDING )
+         {
+            decCtx->prevPlaneSeq= PlatformGetSwapSequence( appCtx->platformCtx )+1;
+         }
+      }
+   }
 }
 
-static bool setInputFormat( V4l2Ctx *v4l2 )
+static void updateDisplayTimes( AppCtx *appCtx, DecCtx *decCtx )
 {
-   bool result= false;
-   int rc;
-   int32_t bufferType;
+   long long flipTime, duration, nominal, refresh, refreshPeriod;
 
-   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT);
+   nominal= 1000000LL/decCtx->videoRate;
+   refresh= PlatformGetRefreshRate( appCtx->platformCtx );
+   refreshPeriod= (refresh ? 1000000000LL/refresh : 0);
 
-   memset( &v4l2->fmtIn, 0, sizeof(struct v4l2_format) );
-   v4l2->fmtIn.type= bufferType;
-   if ( v4l2->isMultiPlane )
+   /* Each new frame is on screen from the flip of the swap that first drew it until the next one */
+   while ( decCtx->displayPendingCount )
    {
-      v4l2->fmtIn.fmt.pix_mp.pixelformat= v4l2->inputFormat;
-      v4l2->fmtIn.fmt.pix_mp.width= v4l2->decCtx->videoWidth;
-      v4l2->fmtIn.fmt.pix_mp.height= v4l2->decCtx->videoHeight;
-      v4l2->fmtIn.fmt.pix_mp.num_planes= 1;
-      v4l2->fmtIn.fmt.pix_mp.plane_fmt[0].sizeimage= 1024*1024;
-      v4l2->fmtIn.fmt.pix_mp.plane_fmt[0].bytesperline= 0;
-      v4l2->fmtIn.fmt.pix_mp.field= V4L2_FIELD_NONE;
+      flipTime= PlatformGetFlipTime( appCtx->platformCtx, decCtx->displayPendingSeq[0] );
+      if ( flipTime == 0 )
+      {
+         break;
+      }
+      --decCtx->displayPendingCount;
+      memmove( &decCtx->displayPendingSeq[0], &decCtx->displayPendingSeq[1], decCtx->displayPendingCount*sizeof(unsigned int) );
+      if ( flipTime < 0 )
+      {
+         decCtx->lastDisplayTime= 0;
+         continue;
+      }
+      if ( decCtx->lastDisplayTime )
+      {
+         duration= flipTime-decCtx->lastDisplayTime;
+         ++decCtx->displayDurationCount;
+         decCtx->displayDurationSum += (double)duration;
+         decCtx->displayDurationSumSq += (double)duration*(double)duration;
+         if ( CadenceIsError( duration, nominal, refreshPeriod ) )
+         {
+            ++decCtx->cadenceErrorCount;
+         }
+      }
+      decCtx->lastDisplayTime= flipTime;
    }
-   else
+}
+
+static bool composeFrame( AppCtx *appCtx, Surface **surfaces, int count, const int *damage, EGLint *eglRect )
+{
+   EGLCtx *egl= &appCtx->egl;
+   GLCtx *gl= &appCtx->gl;
+   Surface *drawList[NUM_DECODE];
+   int drawCount;
+   int rect[4];
+   EGLint age= 0;
+   bool partial= false;
+   int i;
+
+   /*
+    * With a known buffer age only the area damaged since that buffer was
+    * last shown needs repainting: this frame's damage plus the damage of
+    * the age-1 frames in between.
+    */
+   memcpy( rect, damage, sizeof(rect) );
+   if ( egl->haveBufferAge && (egl->haveSwapWithDamage || egl->eglSetDamageRegionKHR) )
    {
-      v4l2->fmtIn.fmt.pix.pixelformat= v4l2->inputFormat;
-      v4l2->fmtIn.fmt.pix.width= v4l2->decCtx->videoWidth;
-      v4l2->fmtIn.fmt.pix.height= v4l2->decCtx->videoHeight;
-      v4l2->fmtIn.fmt.pix.sizeimage= 1024*1024;
-      v4l2->fmtIn.fmt.pix.field= V4L2_FIELD_NONE;
+      if ( eglQuerySurface( egl->eglDisplay, egl->eglSurface, EGL_BUFFER_AGE_KHR, &age ) &&
+           (age > 0) && (age-1 <= gl->damageHistoryCount) )
+      {
+         for( i= 0; i < age-1; ++i )
+         {
+            unionRect( rect, gl->damageHistory[i] );
+         }
+         partial= true;
+      }
    }
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_S_FMT, &v4l2->fmtIn );
-   if ( rc < 0 )
+   if ( !partial )
    {
-      iprintf(0,"setInputFormat: decoder %d failed to set format for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
-      goto exit;
+      rect[0]= 0;
+      rect[1]= 0;
+      rect[2]= appCtx->windowWidth;
+      rect[3]= appCtx->windowHeight;
    }
 
-   result= true;
-
-exit:
-   return result;
-}
-
-
-static bool setOutputFormat( V4l2Ctx *v4l2 )
-{
-   bool result= false;
-   int rc;
-   int32_t bufferType;
-
-   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
+   memmove( &gl->damageHistory[1], &gl->damageHistory[0], (DAMAGE_HISTORY-1)*sizeof(gl->damageHistory[0]) );
+   memcpy( gl->damageHistory[0], (partial ? damage : rect), sizeof(gl->damageHistory[0]) );
+   if ( gl->damageHistoryCount < DAMAGE_HISTORY )
+   {
+      ++gl->damageHistoryCount;
+   }
 
-   memset( &v4l2->fmtOut, 0, sizeof(struct v4l2_format) );
-   v4l2->fmtOut.type= bufferType;
+   /* EGL and GL rectangles have a bottom left origin */
+   eglRect[0]= rect[0];
+   eglRect[1]= appCtx->windowHeight-(rect[1]+rect[3]);
+   eglRect[2]= rect[2];
+   eglRect[3]= rect[3];
 
-   /* Get current settings from driver */
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_FMT, &v4l2->fmtOut );
-   if ( rc < 0 )
+   if ( partial )
    {
-      iprintf(0,"setOutputFormat: failed get format for output: rc %d errno %d\n", rc, errno);
+      if ( egl->eglSetDamageRegionKHR )
+      {
+         egl->eglSetDamageRegionKHR( egl->eglDisplay, egl->eglSurface, eglRect, 1 );
+      }
+      glEnable( GL_SCISSOR_TEST );
+      glScissor( eglRect[0], eglRect[1], eglRect[2], eglRect[3] );
    }
 
-   if ( v4l2->isMultiPlane )
+   glClearColor( 0, 0, 0, 1 );
+   glClear( GL_COLOR_BUFFER_BIT );
+
+   drawCount= 0;
+   for( i= 0; i < count; ++i )
    {
-      int i;
-      uint32_t pixelFormat= V4L2_PIX_FMT_NV12;
-      for( i= 0; i < v4l2->numOutputFormats; ++i)
+      if ( (surfaces[i]->x < rect[0]+rect[2]) && (surfaces[i]->x+surfaces[i]->w > rect[0]) &&
+           (surfaces[i]->y < rect[1]+rect[3]) && (surfaces[i]->y+surfaces[i]->h > rect[1]) )
       {
-         if ( v4l2->outputFormats[i].pixelformat == V4L2_PIX_FMT_NV12M )
+         if ( surfaces[i]->onPlane )
          {
-            pixelFormat= V4L2_PIX_FMT_NV12M;
-            break;
+            /* Scanned out by a plane: leave a transparent hole in case the plane is below the window */
+            int hole[4]= { surfaces[i]->x, surfaces[i]->y, surfaces[i]->w, surfaces[i]->h };
+            int x0= (hole[0] > rect[0] ? hole[0] : rect[0]);
+            int y0= (hole[1] > rect[1] ? hole[1] : rect[1]);
+            int x1= (hole[0]+hole[2] < rect[0]+rect[2] ? hole[0]+hole[2] : rect[0]+rect[2]);
+            int y1= (hole[1]+hole[3] < rect[1]+rect[3] ? hole[1]+hole[3] : rect[1]+rect[3]);
+            glEnable( GL_SCISSOR_TEST );
+            glScissor( x0, appCtx->windowHeight-y1, x1-x0, y1-y0 );
+            glClearColor( 0, 0, 0, 0 );
+            glClear( GL_COLOR_BUFFER_BIT );
+            if ( partial )
+            {
+               glScissor( eglRect[0], eglRect[1], eglRect[2], eglRect[3] );
+            }
+            else
+            {
+               glDisable( GL_SCISSOR_TEST );
+            }
+            continue;
          }
+         drawList[drawCount++]= surfaces[i];
       }
-      if ( pixelFormat == V4L2_PIX_FMT_NV12 )
-      {
-         v4l2->fmtOut.fmt.pix_mp.num_planes= 1;
-      }
-      else
+   }
+   drawMosaic( gl, drawList, drawCount );
+   for( i= 0; i < drawCount; ++i )
+   {
+      fenceSurfaceFrame( appCtx, drawList[i] );
+   }
+   if ( appCtx->writebackActive )
+   {
+      for( i= 0; i < drawCount; ++i )
       {
-         v4l2->fmtOut.fmt.pix_mp.num_planes= 2;
+         drawFrameStamp( appCtx, drawList[i] );
       }
-      v4l2->fmtOut.fmt.pix_mp.pixelformat= pixelFormat;
-      v4l2->fmtOut.fmt.pix_mp.width= v4l2->decCtx->videoWidth;
-      v4l2->fmtOut.fmt.pix_mp.height= v4l2->decCtx->videoHeight;
-      v4l2->fmtOut.fmt.pix_mp.plane_fmt[0].sizeimage= v4l2->decCtx->videoWidth*v4l2->decCtx->videoHeight;
-      v4l2->fmtOut.fmt.pix_mp.plane_fmt[0].bytesperline= v4l2->decCtx->videoWidth;
-      v4l2->fmtOut.fmt.pix_mp.plane_fmt[1].sizeimage= v4l2->decCtx->videoWidth*v4l2->decCtx->videoHeight/2;
-      v4l2->fmtOut.fmt.pix_mp.plane_fmt[1].bytesperline= v4l2->decCtx->videoWidth;
-      v4l2->fmtOut.fmt.pix_mp.field= V4L2_FIELD_NONE;
    }
-   else
+
+   if ( partial )
    {
-      v4l2->fmtOut.fmt.pix.pixelformat= V4L2_PIX_FMT_NV12;
-      v4l2->fmtOut.fmt.pix.width= v4l2->decCtx->videoWidth;
-      v4l2->fmtOut.fmt.pix.height= v4l2->decCtx->videoHeight;
-      v4l2->fmtOut.fmt.pix.sizeimage= (v4l2->fmtOut.fmt.pix.width*v4l2->fmtOut.fmt.pix.height*3)/2;
-      v4l2->fmtOut.fmt.pix.field= V4L2_FIELD_NONE;
+      glDisable( GL_SCISSOR_TEST );
    }
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_S_FMT, &v4l2->fmtOut );
-   if ( rc < 0 )
+
+   ++gl->composeCount;
+   if ( partial )
    {
-      iprintf(0,"setOutputFormat: decoder %d failed to set format for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
-      goto exit;
+      ++gl->composePartialCount;
+      gl->composeDamagedFraction += ((double)rect[2]*rect[3])/((double)appCtx->windowWidth*appCtx->windowHeight);
    }
 
-   result= true;
-
-exit:
-   return result;
+   return partial;
 }
 
-static bool setupInputBuffers( V4l2Ctx *v4l2 )
+static void drawFrameStamp( AppCtx *appCtx, Surface *surface )
 {
-   bool result= false;
-   int rc, neededBuffers;
-   struct v4l2_control ctl;
-   struct v4l2_requestbuffers reqbuf;
-   struct v4l2_buffer *bufIn;
-   void *bufStart;
-   int32_t bufferType;
-   uint32_t memOffset, memLength, memBytesUsed;
-
-   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT);
-
-   neededBuffers= NUM_INPUT_BUFFERS;
+   int i, bit;
 
-   memset( &ctl, 0, sizeof(ctl));
-   ctl.id= V4L2_CID_MIN_BUFFERS_FOR_OUTPUT;
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_CTRL, &ctl );
-   if ( rc == 0 )
+   /*
+    * A row of cells at the surface's top left: white, black, then the frame
+    * number's low bits, most significant first, as white for one.
+    */
+   if ( surface->w < (STAMP_BITS+2)*STAMP_CELL )
    {
-      v4l2->minBuffersIn= ctl.value;
-      if ( v4l2->minBuffersIn != 0 )
+      return;
+   }
+   glEnable( GL_SCISSOR_TEST );
+   for( i= 0; i < STAMP_BITS+2; ++i )
+   {
+      if ( i < 2 )
       {
-         neededBuffers= v4l2->minBuffersIn;
+         bit= (i == 0);
+      }
+      else
+      {
+         bit= (surface->frameStamp >> (STAMP_BITS-1-(i-2))) & 1;
       }
+      glScissor( surface->x+i*STAMP_CELL, appCtx->windowHeight-(surface->y+STAMP_CELL), STAMP_CELL, STAMP_CELL );
+      glClearColor( bit, bit, bit, 1 );
+      glClear( GL_COLOR_BUFFER_BIT );
    }
+   glDisable( GL_SCISSOR_TEST );
+}
 
-   if ( v4l2->minBuffersIn == 0 )
+static int readFrameStamp( AppCtx *appCtx, PlatformCapture *capture, Surface *surface )
+{
+   int frame= 0;
+   int i, x, y, bit;
+   uint32_t pixel;
+
+   /* Sample each cell's centre, scaled from window to mode coordinates */
+   y= ((surface->y+STAMP_CELL/2)*capture->height)/appCtx->windowHeight;
+   for( i= 0; i < STAMP_BITS+2; ++i )
    {
-      v4l2->minBuffersIn= MIN_INPUT_BUFFERS;
+      x= ((surface->x+i*STAMP_CELL+STAMP_CELL/2)*capture->width)/appCtx->windowWidth;
+      if ( (x >= capture->width) || (y >= capture->height) )
+      {
+         return -1;
+      }
+      pixel= *((const uint32_t*)(capture->pixels+y*capture->stride)+x);
+      bit= (((pixel >> 8) & 0xFF) >= 128);
+      if ( i < 2 )
+      {
+         if ( bit != (i == 0) )
+         {
+            return -1;
+         }
+      }
+      else
+      {
+         frame= (frame << 1) | bit;
+      }
    }
 
-   memset( &reqbuf, 0, sizeof(reqbuf) );
-   reqbuf.count= neededBuffers;
-   reqbuf.type= bufferType;
-   reqbuf.memory= V4L2_MEMORY_MMAP;
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_REQBUFS, &reqbuf );
-   if ( rc < 0 )
+   return frame;
+}
+
+static void checkCapture( AppCtx *appCtx )
+{
+   PlatformCapture capture;
+   long long flipTime, readyTime;
+   bool consecutive;
+   int slot, i, frame, expected, skipped;
+
+   if ( !PlatformGetCapture( appCtx->platformCtx, &capture ) )
    {
-      iprintf(0,"Error: setupInputBuffers: decoder %d failed to request %d mmap buffers for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, neededBuffers, rc, errno);
-      goto exit;
+      return;
    }
-   v4l2->numBuffersIn= reqbuf.count;
-
-   if ( reqbuf.count < v4l2->minBuffersIn )
+   /* Wait for the flip event so the capture can be tied to its vblank */
+   flipTime= PlatformGetFlipTime( appCtx->platformCtx, capture.sequence );
+   if ( flipTime == 0 )
    {
-      iprintf(0,"Error: setupInputBuffers: decoder %d insufficient buffers: (%d versus %d)\n", v4l2->decCtx->decodeIndex, reqbuf.count, neededBuffers );
-      goto exit;
+      return;
    }
 
-   v4l2->inBuffers= (BufferInfo*)calloc( reqbuf.count, sizeof(BufferInfo) );
-   if ( !v4l2->inBuffers )
+   ++appCtx->captureCount;
+   if ( (appCtx->captureCount == 1) || (capture.checksum != appCtx->lastChecksum) )
    {
-      iprintf(0,"Error: setupInputBuffers: decoder %d no memory for BufferInfo\n", v4l2->decCtx->decodeIndex );
-      goto exit;
+      ++appCtx->captureChecksumChanges;
+      appCtx->lastChecksum= capture.checksum;
    }
+   iprintf(2,"writeback: swap %u checksum %08x flip %lld\n", capture.sequence, capture.checksum, flipTime);
 
-   for( int i= 0; i < reqbuf.count; ++i )
+   slot= capture.sequence % CAPTURE_HISTORY;
+   if ( appCtx->expectedSeq[slot] == capture.sequence )
    {
-      bufIn= &v4l2->inBuffers[i].buf;
-      bufIn->type= bufferType;
-      bufIn->index= i;
-      bufIn->memory= V4L2_MEMORY_MMAP;
-      if ( v4l2->isMultiPlane )
-      {
-         memset( v4l2->inBuffers[i].planes, 0, sizeof(struct v4l2_plane)*MAX_PLANES);
-         bufIn->m.planes= v4l2->inBuffers[i].planes;
-         bufIn->length= 3;
-      }
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QUERYBUF, bufIn );
-      if ( rc < 0 )
-      {
-         iprintf(0,"Error: setupInputBuffers: decoder %d failed to query input buffer %d: rc %d errno %d\n", v4l2->decCtx->decodeIndex, i, rc, errno);
-         goto exit;
-      }
-      if ( v4l2->isMultiPlane )
+      /* Frames missing between captures of consecutive swaps never reached the screen */
+      consecutive= (appCtx->captureCount > 1) && (capture.sequence == appCtx->lastCaptureSeq+1);
+      for( i= 0; i < NUM_DECODE; ++i )
       {
-         if ( bufIn->length != 1 )
+         DecCtx *decCtx= &appCtx->decode[i];
+
+         expected= appCtx->expectedFrame[slot][i];
+         if ( expected < 0 )
          {
-            iprintf(0,"setupInputBuffers: decoder %d num planes expected to be 1 for compressed input but is %d\n", v4l2->decCtx->decodeIndex, bufIn->length);
-            goto exit;
+            continue;
+         }
+         frame= readFrameStamp( appCtx, &capture, &appCtx->surface[i] );
+         if ( frame < 0 )
+         {
+            ++appCtx->captureUnreadableCount;
+            continue;
+         }
+         if ( frame != (expected & ((1<<STAMP_BITS)-1)) )
+         {
+            iprintf(1,"writeback: swap %u decoder %d shows frame %d expected %d\n", capture.sequence, i, frame, expected);
+            ++appCtx->captureMismatchCount;
+            continue;
+         }
+         if ( expected == decCtx->lastSeenFrame )
+         {
+            continue;
+         }
+         if ( consecutive && (decCtx->lastSeenFrame >= 0) && (expected > decCtx->lastSeenFrame+1) )
+         {
+            skipped= expected-decCtx->lastSeenFrame-1;
+            decCtx->presentDropCount += skipped;
+         }
+         decCtx->lastSeenFrame= expected;
+         readyTime= decCtx->frameReadyTime[expected % FRAME_TIME_HISTORY];
+         if ( (flipTime > 0) && readyTime && (decCtx->presentCount < MAX_PRESENT_SAMPLES) )
+         {
+            decCtx->presentLatency[decCtx->presentCount++]= flipTime-readyTime;
          }
-         v4l2->inBuffers[i].planeCount= 0;
-         memOffset= bufIn->m.planes[0].m.mem_offset;
-         memLength= bufIn->m.planes[0].length;
-         memBytesUsed= bufIn->m.planes[0].bytesused;
-      }
-      else
-      {
-         memOffset= bufIn->m.offset;
-         memLength= bufIn->length;
-         memBytesUsed= bufIn->bytesused;
-      }
-
-      bufStart= mmap( NULL,
-                      memLength,
-                      PROT_READ | PROT_WRITE,
-                      MAP_SHARED,
-                      v4l2->v4l2Fd,
-                      memOffset );
-      if ( bufStart == MAP_FAILED )
-      {
-         iprintf(0,"Error: setupInputBuffers: decoder %d failed to mmap input buffer %d: errno %d\n", v4l2->decCtx->decodeIndex, i, errno);
-         goto exit;
       }
-
-      iprintf(2,"Input buffer: %d\n", i);
-      iprintf(2,"  index: %d start: %p bytesUsed %d  offset %d length %d flags %08x\n", 
-              bufIn->index, bufStart, memBytesUsed, memOffset, memLength, bufIn->flags );
-
-      v4l2->inBuffers[i].fd= -1;
-      v4l2->inBuffers[i].start= bufStart;
-      v4l2->inBuffers[i].capacity= memLength;
    }
+   appCtx->lastCaptureSeq= capture.sequence;
 
-   result= true;
+   PlatformReleaseCapture( appCtx->platformCtx );
+}
 
-exit:
+static void presentFrame( AppCtx *appCtx, bool partial, const EGLint *eglRect )
+{
+   EGLCtx *egl= &appCtx->egl;
+   long long swapTime;
 
-   if ( !result )
+   swapTime= getMonotonicTimeMicros();
+   if ( partial && egl->haveSwapWithDamage )
    {
-      tearDownInputBuffers( v4l2 );
+      eglSwapBuffersWithDamageKHR( egl->eglDisplay, egl->eglSurface, (EGLint*)eglRect, 1 );
    }
-
-   return result;
+   else
+   {
+      eglSwapBuffers( egl->eglDisplay, egl->eglSurface );
+   }
+   TimelineSpan( "swap", -1, swapTime, getMonotonicTimeMicros() );
 }
 
-static void tearDownInputBuffers( V4l2Ctx *v4l2 )
+static void composeOutputs( AppCtx *appCtx, Surface **surfaces, int count )
 {
-   int rc;
-   struct v4l2_requestbuffers reqbuf;
-   int32_t bufferType;
-
-   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT);
+   EGLCtx *egl= &appCtx->egl;
+   int i, j;
 
-   if ( v4l2->inBuffers )
+   /* Called with the decoders locked: each independent output redraws the whole frame */
+   for( i= 1; i < egl->outputCount; ++i )
    {
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMOFF, &v4l2->fmtIn.type );
-      if ( rc < 0 )
-      {
-         iprintf(0,"Error: tearDownInputBuffers: decder %d streamoff failed for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
-      }
-
-      for( int i= 0; i < v4l2->numBuffersIn; ++i )
+      eglMakeCurrent( egl->eglDisplay, egl->outputSurface[i], egl->outputSurface[i], egl->eglContext );
+      glClearColor( 0, 0, 0, 1 );
+      glClear( GL_COLOR_BUFFER_BIT );
+      drawMosaic( &appCtx->gl, surfaces, count );
+      for( j= 0; j < count; ++j )
       {
-         if ( v4l2->inBuffers[i].start )
-         {
-            munmap( v4l2->inBuffers[i].start, v4l2->inBuffers[i].capacity );
-         }
+         fenceSurfaceFrame( appCtx, surfaces[j] );
       }
-      free( v4l2->inBuffers );
-      v4l2->inBuffers= 0;
    }
-
-   if ( v4l2->numBuffersIn )
+   if ( egl->outputCount > 1 )
    {
-      memset( &reqbuf, 0, sizeof(reqbuf) );
-      reqbuf.count= 0;
-      reqbuf.type= bufferType;
-      reqbuf.memory= V4L2_MEMORY_MMAP;
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_REQBUFS, &reqbuf );
-      if ( rc < 0 )
-      {
-         iprintf(0,"Error: tearDownInputBuffers: decoder %d failed to release v4l2 buffers for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
-      }
-      v4l2->numBuffersIn= 0;
+      eglMakeCurrent( egl->eglDisplay, egl->eglSurface, egl->eglSurface, egl->eglContext );
    }
 }
 
-static bool setupOutputBuffers( V4l2Ctx *v4l2 )
+static void presentOutputs( AppCtx *appCtx )
 {
-   bool result= false;
-   int rc, neededBuffers;
-   struct v4l2_control ctl;
-   struct v4l2_requestbuffers reqbuf;
-   struct v4l2_buffer *bufOut;
-   struct v4l2_exportbuffer expbuf;
-   void *bufStart;
-   int32_t bufferType;
+   EGLCtx *egl= &appCtx->egl;
+   long long swapTime;
+   int i;
 
-   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
+   for( i= 1; i < egl->outputCount; ++i )
+   {
+      swapTime= getMonotonicTimeMicros();
+      eglMakeCurrent( egl->eglDisplay, egl->outputSurface[i], egl->outputSurface[i], egl->eglContext );
+      eglSwapBuffers( egl->eglDisplay, egl->outputSurface[i] );
+      TimelineSpan( "output swap", -1, swapTime, getMonotonicTimeMicros() );
+   }
+   if ( egl->outputCount > 1 )
+   {
+      eglMakeCurrent( egl->eglDisplay, egl->eglSurface, egl->eglSurface, egl->eglContext );
+   }
+}
 
-   neededBuffers= NUM_OUTPUT_BUFFERS;
-   
-   memset( &ctl, 0, sizeof(ctl));
-   ctl.id= V4L2_CID_MIN_BUFFERS_FOR_CAPTURE;
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_CTRL, &ctl );
-   if ( rc == 0 )
+static int ioctlIndex( unsigned int request )
+{
+   switch( request )
    {
-      v4l2->minBuffersOut= ctl.value;
-      if ( (v4l2->minBuffersOut != 0) && (v4l2->minBuffersOut > NUM_OUTPUT_BUFFERS) )
-      {
-         neededBuffers= v4l2->minBuffersOut;
-      }
+      IOCTL_LIST(IOCTL_INDEX_CASE)
+      default: return IOCTL_INDEX_OTHER;
    }
+}
 
-   if ( v4l2->minBuffersOut == 0 )
+static const char *ioctlName( unsigned int request )
+{
+   return gIoctlNames[ioctlIndex( request )];
+}
+
+static void ioctlStatsSetDecoderFd( int decodeIndex, int fd )
+{
+   if ( (decodeIndex >= 0) && (decodeIndex < NUM_DECODE) )
    {
-      v4l2->minBuffersOut= MIN_OUTPUT_BUFFERS;
+      /* Stored as fd+1 so the zero initialized table matches nothing */
+      __atomic_store_n( &gIoctlStatsFd[decodeIndex], fd+1, __ATOMIC_RELAXED );
    }
+}
 
-   memset( &reqbuf, 0, sizeof(reqbuf) );
-   reqbuf.count= neededBuffers;
-   reqbuf.type= bufferType;
-   reqbuf.memory= V4L2_MEMORY_MMAP;
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_REQBUFS, &reqbuf );
-   if ( rc < 0 )
+static void ioctlStatsUpdate( int fd, unsigned int request, int rc, long long duration )
+{
+   IoctlStats *stats;
+   long long maxTime;
+   int i, decodeIndex, bucket;
+
+   decodeIndex= NUM_DECODE;
+   for( i= 0; i < NUM_DECODE; ++i )
    {
-      iprintf(0,"Error: setupOutputBuffers: decoder %d failed to request %d mmap buffers for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, neededBuffers, rc, errno);
-      goto exit;
+      if ( __atomic_load_n( &gIoctlStatsFd[i], __ATOMIC_RELAXED ) == fd+1 )
+      {
+         decodeIndex= i;
+         break;
+      }
    }
-   v4l2->numBuffersOut= reqbuf.count;
+   stats= &gIoctlStats[decodeIndex][ioctlIndex( request )];
 
-   if ( reqbuf.count < v4l2->minBuffersOut )
+   /* Bucket 0 is under 1us, bucket n covers [2^(n-1),2^n) us */
+   bucket= 0;
+   while( (duration >> bucket) && (bucket < IOCTL_HISTOGRAM_BUCKETS-1) )
    {
-      iprintf(0,"Error: setupOutputBuffers: decoder %d insufficient buffers: (%d versus %d)\n", v4l2->decCtx->decodeIndex, reqbuf.count, neededBuffers );
-      goto exit;
+      ++bucket;
    }
 
-   v4l2->outBuffers= (BufferInfo*)calloc( reqbuf.count, sizeof(BufferInfo) );
-   if ( !v4l2->outBuffers )
+   __atomic_fetch_add( &stats->count, 1, __ATOMIC_RELAXED );
+   if ( rc < 0 )
    {
-      iprintf(0,"Error: setupOutputBuffers: decoder %d no memory for BufferInfo\n", v4l2->decCtx->decodeIndex );
-      goto exit;
+      __atomic_fetch_add( &stats->errors, 1, __ATOMIC_RELAXED );
    }
+   __atomic_fetch_add( &stats->totalTime, duration, __ATOMIC_RELAXED );
+   __atomic_fetch_add( &stats->histogram[bucket], 1, __ATOMIC_RELAXED );
+   maxTime= __atomic_load_n( &stats->maxTime, __ATOMIC_RELAXED );
+   while( (duration > maxTime) &&
+          !__atomic_compare_exchange_n( &stats->maxTime, &maxTime, duration, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+}
 
-   for( int i= 0; i < reqbuf.count; ++i )
+static void emitIoctlStats( void )
+{
+   IoctlStats *stats;
+   char line[512];
+   int i, j, b, len;
+   long long acc, p50, p99;
+
+   iprintf(0,"ioctl statistics:\n");
+   for( i= 0; i <= NUM_DECODE; ++i )
    {
-      v4l2->outBuffers[i].fd= -1;
-      for( int j= 0; j < 3; ++j )
+      for( j= 0; j < IOCTL_INDEX_COUNT; ++j )
       {
-         v4l2->outBuffers[i].planeInfo[j].fd= -1;
+         stats= &gIoctlStats[i][j];
+         if ( !stats->count )
+         {
+            continue;
+         }
+
+         /* Percentiles are reported as the upper bound of the bucket that contains them */
+         p50= p99= 0;
+         acc= 0;
+         for( b= 0; b < IOCTL_HISTOGRAM_BUCKETS; ++b )
+         {
+            acc += stats->histogram[b];
+            if ( !p50 && (acc*2 >= stats->count) ) p50= (1LL << b);
+            if ( !p99 && (acc*100 >= stats->count*99) ) p99= (1LL << b);
+         }
+
+         if ( i < NUM_DECODE )
+            iprintf(0,"  decoder %d %-24s", i, gIoctlNames[j]);
+         else
+            iprintf(0,"  other     %-24s", gIoctlNames[j]);
+         iprintf(0," calls %6lld errors %5lld mean %8.1f us p50 <%lld us p99 <%lld us max %lld us\n",
+                 stats->count, stats->errors, (double)stats->totalTime/stats->count, p50, p99, stats->maxTime);
+
+         len= 0;
+         for( b= 0; b < IOCTL_HISTOGRAM_BUCKETS; ++b )
+         {
+            if ( stats->histogram[b] )
+            {
+               len += snprintf( line+len, sizeof(line)-len, " <%lldus:%lld", (1LL << b), stats->histogram[b] );
+               if ( len >= (int)sizeof(line) ) break;
+            }
+         }
+         iprintf(0,"    histogram:%s\n", line);
       }
    }
+}
 
-   for( int i= 0; i < reqbuf.count; ++i )
-   {
-      bufOut= &v4l2->outBuffers[i].buf;
-      bufOut->type= bufferType;
-      bufOut->index= i;
-      bufOut->memory= V4L2_MEMORY_MMAP;
-      if ( v4l2->isMultiPlane )
+static int ioctl_wrapper( int fd, int request, void* arg )
+{
+   const char *req= 0;
+   int rc, err;
+   long long startTime, endTime;
+
+   if ( gVerbose )
+   {
+      req= ioctlName( request );
+      eprintf("ioct( %d, %x ( %s ) )\n", fd, request, req );
+      if ( request == VIDIOC_S_FMT )
       {
-         memset( v4l2->outBuffers[i].planes, 0, sizeof(struct v4l2_plane)*MAX_PLANES);
-         bufOut->m.planes= v4l2->outBuffers[i].planes;
-         bufOut->length= v4l2->fmtOut.fmt.pix_mp.num_planes;
+         struct v4l2_format *format= (struct v4l2_format*)arg;
+         eprintf(": type %d\n", format->type);
+         if ( (format->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
+              (format->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) )
+         {
+            eprintf("pix_mp: pixelFormat %X w %d h %d field %d cs %d flg %x num_planes %d p0: sz %d bpl %d p1: sz %d bpl %d\n",
+                    format->fmt.pix_mp.pixelformat,
+                    format->fmt.pix_mp.width,
+                    format->fmt.pix_mp.height,
+                    format->fmt.pix_mp.field,
+                    format->fmt.pix_mp.colorspace,
+                    format->fmt.pix_mp.flags,
+                    format->fmt.pix_mp.num_planes,
+                    format->fmt.pix_mp.plane_fmt[0].sizeimage,
+                    format->fmt.pix_mp.plane_fmt[0].bytesperline,
+                    format->fmt.pix_mp.plane_fmt[1].sizeimage,
+                    format->fmt.pix_mp.plane_fmt[1].bytesperline
+                  );
+         }
       }
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QUERYBUF, bufOut );
-      if ( rc < 0 )
+      else if ( request == VIDIOC_REQBUFS )
       {
-         iprintf(0,"Error: setupOutputBuffers: decoder %d failed to query input buffer %d: rc %d errno %d\n", v4l2->decCtx->decodeIndex, i, rc, errno);
-         goto exit;
+         struct v4l2_requestbuffers *rb= (struct v4l2_requestbuffers*)arg;
+         eprintf("count %d type %d mem %d\n", rb->count, rb->type, rb->memory);
       }
-      if ( v4l2->isMultiPlane )
+      else if ( request == VIDIOC_CREATE_BUFS )
       {
-         v4l2->outBuffers[i].planeCount= bufOut->length;
-         for( int j= 0; j < v4l2->outBuffers[i].planeCount; ++j )
+         struct v4l2_create_buffers *cb= (struct v4l2_create_buffers*)arg;
+         struct v4l2_format *format= &cb->format;
+         eprintf("count %d mem %d\n", cb->count, cb->memory);
+         eprintf("pix_mp: pixelFormat %X w %d h %d num_planes %d p0: sz %d bpl %d p1: sz %d bpl %d\n",
+                 format->fmt.pix_mp.pixelformat,
+                 format->fmt.pix_mp.width,
+                 format->fmt.pix_mp.height,
+                 format->fmt.pix_mp.num_planes,
+                 format->fmt.pix_mp.plane_fmt[0].sizeimage,
+                 format->fmt.pix_mp.plane_fmt[0].bytesperline,
+                 format->fmt.pix_mp.plane_fmt[1].sizeimage,
+                 format->fmt.pix_mp.plane_fmt[1].bytesperline
+               );
+      }
+      else if ( request == VIDIOC_QBUF )
+      {
+         struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
+         eprintf("buff: index %d q: type %d bytesused %d flags %X field %d mem %x length %d timestamp sec %ld usec %ld\n",
+                buf->index, buf->type, buf->bytesused, buf->flags, buf->field, buf->memory, buf->length, buf->timestamp.tv_sec, buf->timestamp.tv_usec);
+         if ( buf->m.planes &&
+              ( (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
+                (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) ) )
          {
-            iprintf(2,"Output buffer: %d\n", i);
-            iprintf(2,"  index: %d bytesUsed %d length %d flags %08x\n",
-                   bufOut->index, bufOut->m.planes[j].bytesused, bufOut->m.planes[j].length, bufOut->flags );
-
-            memset( &expbuf, 0, sizeof(expbuf) );
-            expbuf.type= bufOut->type;
-            expbuf.index= i;
-            expbuf.plane= j;
-            expbuf.flags= O_CLOEXEC;
-            rc= IOCTL( v4l2->v4l2Fd, VIDIOC_EXPBUF, &expbuf );
-            if ( rc < 0 )
-            {
-               iprintf(0,"setupOutputBuffers: decoder %d failed to export v4l2 output buffer %d: plane: %d rc %d errno %d\n", v4l2->decCtx->decodeIndex, i, j, rc, errno);
-            }
-            iprintf(2,"  plane %d index %d export fd %d\n", j, expbuf.index, expbuf.fd );
-
-            v4l2->outBuffers[i].planeInfo[j].fd= expbuf.fd;
-            v4l2->outBuffers[i].planeInfo[j].capacity= bufOut->m.planes[j].length;
+            eprintf("buff: p0: bu %d len %d moff %d doff %d p1: bu %d len %d moff %d doff %d\n",
+                   buf->m.planes[0].bytesused, buf->m.planes[0].length, buf->m.planes[0].m.mem_offset, buf->m.planes[0].data_offset,
+                   buf->m.planes[1].bytesused, buf->m.planes[1].length, buf->m.planes[1].m.mem_offset, buf->m.planes[1].data_offset );
          }
-
-         /* Use fd of first plane to identify buffer */
-         v4l2->outBuffers[i].fd= v4l2->outBuffers[i].planeInfo[0].fd;
       }
-      else
+      else if ( request == VIDIOC_DQBUF )
       {
-         iprintf(2,"Output buffer: %d\n", i);
-         iprintf(2,"  index: %d bytesUsed %d length %d flags %08x\n",
-                bufOut->index, bufOut->bytesused, bufOut->length, bufOut->flags );
-
-         memset( &expbuf, 0, sizeof(expbuf) );
-         expbuf.type= bufOut->type;
-         expbuf.index= i;
-         expbuf.flags= O_CLOEXEC;
-         rc= IOCTL( v4l2->v4l2Fd, VIDIOC_EXPBUF, &expbuf );
-         if ( rc < 0 )
+         struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
+         eprintf("buff: index %d s dq: type %d bytesused %d flags %X field %d mem %x length %d timestamp sec %ld usec %ld\n",
+                buf->index, buf->type, buf->bytesused, buf->flags, buf->field, buf->memory, buf->length, buf->timestamp.tv_sec, buf->timestamp.tv_usec);
+         if ( buf->m.planes &&
+              ( (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
+                (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) ) )
          {
-            iprintf(0,"setupOutputBuffers: decoder %d failed to export v4l2 output buffer %d: rc %d errno %d\n", v4l2->decCtx->decodeIndex, i, rc, errno);
+            eprintf("buff: p0: bu %d len %d moff %d doff %d p1: bu %d len %d moff %d doff %d\n",
+                   buf->m.planes[0].bytesused, buf->m.planes[0].length, buf->m.planes[0].m.mem_offset, buf->m.planes[0].data_offset,
+                   buf->m.planes[1].bytesused, buf->m.planes[1].length, buf->m.planes[1].m.mem_offset, buf->m.planes[1].data_offset );
          }
-         iprintf(2,"  index %d export fd %d\n", expbuf.index, expbuf.fd );
-
-         v4l2->outBuffers[i].fd= expbuf.fd;
-         v4l2->outBuffers[i].capacity= bufOut->length;
+      }
+      else if ( (request == VIDIOC_STREAMON) || (request == VIDIOC_STREAMOFF) )
+      {
+         int *type= (int*)arg;
+         eprintf(": type %d\n", *type);
       }
    }
 
-   result= true;
-
-exit:
+   startTime= getMonotonicTimeMicros();
 
-   if ( !result )
+   if ( gIoctlReplay && TraceReplayIsDevice( fd ) )
    {
-      tearDownOutputBuffers( v4l2 );
+      rc= TraceReplayIoctl( fd, request, arg );
+   }
+   else if ( gMockDecoder && MockDecIsDevice( fd ) )
+   {
+      rc= MockDecIoctl( fd, request, arg );
+   }
+   else
+   {
+      rc= ioctl( fd, request, arg );
    }
 
-   return result;
-}
-
-static void tearDownOutputBuffers( V4l2Ctx *v4l2 )
-{
-   int rc;
-   struct v4l2_requestbuffers reqbuf;
-   int32_t bufferType;
+   err= errno;
+   endTime= getMonotonicTimeMicros();
+   ioctlStatsUpdate( fd, request, rc, endTime-startTime );
+   if ( gIoctlRecord )
+   {
+      TraceRecordIoctl( fd, request, arg, rc, err, startTime, endTime );
+   }
+   if ( ((request == VIDIOC_QBUF) || (request == VIDIOC_DQBUF)) && TimelineEnabled() )
+   {
+      struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
+      bool output= ((buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT) || (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE));
+      if ( request == VIDIOC_QBUF )
+      {
+         TimelineSpan( output ? "QBUF output" : "QBUF capture", buf->index, startTime, endTime );
+      }
+      else
+      {
+         TimelineSpan( output ? "DQBUF output" : "DQBUF capture", (rc < 0) ? -1 : (int)buf->index, startTime, endTime );
+      }
+   }
+   errno= err;
 
-   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
 
-   if ( v4l2->outBuffers )
+   if ( gVerbose )
    {
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMOFF, &v4l2->fmtOut.type );
       if ( rc < 0 )
       {
-         iprintf(0,"Error: tearDownOutputBuffers: decoder %d streamoff failed for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
+         eprintf("ioct( %d, %x ) rc %d errno %d\n", fd, request, rc, errno );
       }
-
-      for( int i= 0; i < v4l2->numBuffersOut; ++i )
+      else
       {
-         if ( v4l2->outBuffers[i].planeCount )
+         eprintf("ioct( %d, %x ) rc %d\n", fd, request, rc );
+         if ( (request == VIDIOC_S_FMT) || (request == VIDIOC_G_FMT) )
          {
-            for( int j= 0; j < v4l2->outBuffers[i].planeCount; ++j )
+            struct v4l2_format *format= (struct v4l2_format*)arg;
+            if ( (format->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
+                 (format->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) )
             {
-               if ( v4l2->outBuffers[i].planeInfo[j].fd >= 0 )
-               {
-                  close( v4l2->outBuffers[i].planeInfo[j].fd );
-                  v4l2->outBuffers[i].planeInfo[j].fd= -1;
-               }
+               eprintf("pix_mp: pixelFormat %X w %d h %d num_planes %d p0: sz %d bpl %d p1: sz %d bpl %d\n",
+                       format->fmt.pix_mp.pixelformat,
+                       format->fmt.pix_mp.width,
+                       format->fmt.pix_mp.height,
+                       format->fmt.pix_mp.num_planes,
+                       format->fmt.pix_mp.plane_fmt[0].sizeimage,
+                       format->fmt.pix_mp.plane_fmt[0].bytesperline,
+                       format->fmt.pix_mp.plane_fmt[1].sizeimage,
+                       format->fmt.pix_mp.plane_fmt[1].bytesperline
+                     );
             }
-            v4l2->outBuffers[i].fd= -1;
-            v4l2->outBuffers[i].planeCount= 0;
          }
-         if ( v4l2->outBuffers[i].fd >= 0 )
+         else if ( request == VIDIOC_CREATE_BUFS )
          {
-            close( v4l2->outBuffers[i].fd );
-            v4l2->outBuffers[i].fd= -1;
+            struct v4l2_create_buffers *cb= (struct v4l2_create_buffers*)arg;
+            eprintf("index %d count %d mem %d\n", cb->index, cb->count, cb->memory);
+         }
+         else if ( request == VIDIOC_G_CTRL )
+         {
+            struct v4l2_control *ctrl= (struct v4l2_control*)arg;
+            eprintf("id %d value %d\n", ctrl->id, ctrl->value);
+         }
+         else if ( request == VIDIOC_DQBUF )
+         {
+            struct v4l2_buffer *buf= (struct v4l2_buffer*)arg;
+            eprintf("buff: index %d f dq: type %d bytesused %d flags %X field %d mem %x length %d seq %d timestamp sec %ld usec %ld\n",
+                   buf->index, buf->type, buf->bytesused, buf->flags, buf->field, buf->memory, buf->length, buf->sequence, buf->timestamp.tv_sec, buf->timestamp.tv_usec);
+            if ( buf->m.planes &&
+                 ( (buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ||
+                   (buf->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) ) )
+            {
+               eprintf("buff: p0: bu %d len %d moff %d doff %d p1: bu %d len %d moff %d doff %d\n",
+                      buf->m.planes[0].bytesused, buf->m.planes[0].length, buf->m.planes[0].m.mem_offset, buf->m.planes[0].data_offset,
+                      buf->m.planes[1].bytesused, buf->m.planes[1].length, buf->m.planes[1].m.mem_offset, buf->m.planes[1].data_offset );
+            }
          }
       }
-
-      free( v4l2->outBuffers );
-      v4l2->outBuffers= 0;
    }
 
-   if ( v4l2->numBuffersOut )
-   {
-      memset( &reqbuf, 0, sizeof(reqbuf) );
-      reqbuf.count= 0;
-      reqbuf.type= bufferType;
-      reqbuf.memory= V4L2_MEMORY_MMAP;
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_REQBUFS, &reqbuf );
-      if ( rc < 0 )
-      {
-         iprintf(0,"Error: tearDownOutputBuffers: decoder %d failed to release v4l2 buffers for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
-      }
-      v4l2->numBuffersOut= 0;
-   }
+   return rc;
 }
 
-static void stopDecoder( V4l2Ctx *v4l2 )
+static void *mmap_wrapper( void *addr, size_t length, int prot, int flags, int fd, off_t offset )
 {
-   int rc;
-
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMOFF, &v4l2->fmtIn.type );
-   if ( rc < 0 )
+   if ( gIoctlReplay && TraceReplayIsDevice( fd ) )
    {
-      iprintf(0,"Error: stopDecoder: decder %d streamoff failed for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
+      return TraceReplayMmap( fd, length, prot, flags, offset );
    }
-
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMOFF, &v4l2->fmtOut.type );
-   if ( rc < 0 )
+   if ( gMockDecoder && MockDecIsDevice( fd ) )
    {
-      iprintf(0,"Error: stopDecoder: decder %d streamoff failed for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
+      return MockDecMmap( fd, length, prot, flags, offset );
    }
+
+   return mmap( addr, length, prot, flags, fd, offset );
 }
 
-static bool initV4l2( V4l2Ctx *v4l2 )
+static int poll_wrapper( struct pollfd *fds, nfds_t nfds, int timeout )
 {
-   bool result= false;
-   int rc;
-   struct v4l2_exportbuffer eb;
+   int rc, err;
+   long long startTime= 0;
 
-   v4l2->v4l2Fd= open( gDeviceName, O_RDWR );
-   iprintf(2,"v4l2Fd %d\n", v4l2->v4l2Fd);
-   if ( v4l2->v4l2Fd < 0 )
+   if ( gIoctlRecord )
    {
-      iprintf(0,"Error: initV4l2: failed to open device (%s)\n", gDeviceName );
-      goto exit;
+      startTime= getMonotonicTimeMicros();
    }
 
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QUERYCAP, &v4l2->caps );
-   if ( rc < 0 )
+   if ( gIoctlReplay && (nfds == 1) && TraceReplayIsDevice( fds[0].fd ) )
    {
-      iprintf(0,"Error: initV4l2: failed query caps: %d errno %d\n", rc, errno);
-      goto exit;
+      rc= TraceReplayPoll( fds[0].fd, fds[0].events, &fds[0].revents, timeout );
    }
-
-   iprintf(2,"driver (%s) card(%s) bus_info(%s) version %d capabilities %X device_caps %X\n", 
-           v4l2->caps.driver, v4l2->caps.card, v4l2->caps.bus_info, v4l2->caps.version, v4l2->caps.capabilities, v4l2->caps.device_caps );
-
-   v4l2->deviceCaps= (v4l2->caps.capabilities & V4L2_CAP_DEVICE_CAPS ) ? v4l2->caps.device_caps : v4l2->caps.capabilities;
-
-   if ( !(v4l2->deviceCaps & (V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE) ))
+   else if ( gMockDecoder && (nfds == 1) && MockDecIsDevice( fds[0].fd ) )
    {
-      iprintf(0,"Error: initV4l2: device (%s) is not a M2M device\n", gDeviceName );
-      goto exit;
+      rc= MockDecPoll( fds[0].fd, fds[0].events, &fds[0].revents, timeout );
    }
-
-   if ( !(v4l2->deviceCaps & V4L2_CAP_STREAMING) )
+   else
    {
-      iprintf(0,"Error: initV4l2: device (%s) does not support dmabuf: no V4L2_CAP_STREAMING\n", gDeviceName );
-      goto exit;
+      rc= poll( fds, nfds, timeout );
    }
 
-   if ( (v4l2->deviceCaps & V4L2_CAP_VIDEO_M2M_MPLANE) && !(v4l2->deviceCaps & V4L2_CAP_VIDEO_M2M) )
+   if ( gIoctlRecord && (nfds == 1) )
    {
-      iprintf(2,"device is multiplane\n");
-      v4l2->isMultiPlane= true;
+      err= errno;
+      TraceRecordPoll( fds[0].fd, fds[0].events, fds[0].revents, rc, startTime, getMonotonicTimeMicros() );
+      errno= err;
    }
 
-   eb.type= V4L2_BUF_TYPE_VIDEO_CAPTURE;
-   eb.index= -1;
-   eb.plane= -1;
-   eb.flags= (O_RDWR|O_CLOEXEC);
-   IOCTL( v4l2->v4l2Fd, VIDIOC_EXPBUF, &eb );
-   if ( errno == ENOTTY )
-   {
-      iprintf(0,"Error: initV4l2: device (%s) does not support dmabuf: no VIDIOC_EXPBUF\n", gDeviceName );
-      goto exit;
-   }
+   return rc;
+}
 
-   v4l2->inputFormat= V4L2_PIX_FMT_H264;
+static bool getInputFormats( V4l2Ctx *v4l2 )
+{
+   bool result= false;
+   struct v4l2_fmtdesc format;
+   int i, rc;
+   int32_t bufferType;
 
-   getInputFormats( v4l2 );
+   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT);
 
-   getOutputFormats( v4l2 );
+   i= 0;
+   for( ; ; )
+   {
+      format.index= i;
+      format.type= bufferType;
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_ENUM_FMT, &format);
+      if ( rc < 0 )
+      {
+         if ( errno == EINVAL )
+         {
+            iprintf(1,"Found %d input formats\n", i);
+            v4l2->numInputFormats= i;
+            break;
+         }
+         goto exit;
+      }
+      ++i;
+   }
 
-   setInputFormat( v4l2 );
+   v4l2->inputFormats= (struct v4l2_fmtdesc*)calloc( v4l2->numInputFormats, sizeof(struct v4l2_format) );
+   if ( !v4l2->inputFormats )
+   {
+      iprintf(0,"Error: getInputFormats: no memory for inputFormats\n");
+      v4l2->numInputFormats= 0;
+      goto exit;
+   }
 
-   setupInputBuffers( v4l2 );
+   for( i= 0; i < v4l2->numInputFormats; ++i)
+   {
+      v4l2->inputFormats[i].index= i;
+      v4l2->inputFormats[i].type= bufferType;
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_ENUM_FMT, &v4l2->inputFormats[i]);
+      if ( rc < 0 )
+      {
+         goto exit;
+      }
+      iprintf(1, "input format %d: flags %08x pixelFormat: %x desc: %s\n", 
+             i, v4l2->inputFormats[i].flags, v4l2->inputFormats[i].pixelformat, v4l2->inputFormats[i].description );
+   }
 
    result= true;
 
 exit:
-   return result;   
+   return result;
 }
 
-static void termV4l2( V4l2Ctx *v4l2 )
+static bool getOutputFormats( V4l2Ctx *v4l2 )
 {
-   if ( v4l2 )
-   {
-      tearDownInputBuffers( v4l2 );
+   bool result= false;
+   struct v4l2_fmtdesc format;
+   int i, rc;
+   int32_t bufferType;
+   bool haveNV12= false;
 
-      tearDownOutputBuffers( v4l2 );
+   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
 
-      if ( v4l2->inputFormats )
+   i= 0;
+   for( ; ; )
+   {
+      format.index= i;
+      format.type= bufferType;
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_ENUM_FMT, &format);
+      if ( rc < 0 )
       {
-         free( v4l2->inputFormats );
+         if ( errno == EINVAL )
+         {
+            iprintf(1,"Found %d output formats\n", i);
+            v4l2->numOutputFormats= i;
+            break;
+         }
+         goto exit;
       }
-      if ( v4l2->outputFormats )
+      ++i;
+   }
+
+   v4l2->outputFormats= (struct v4l2_fmtdesc*)calloc( v4l2->numOutputFormats, sizeof(struct v4l2_format) );
+   if ( !v4l2->outputFormats )
+   {
+      iprintf(0,"Error: getOutputFormats: no memory for outputFormats\n");
+      v4l2->numOutputFormats= 0;
+      goto exit;
+   }
+
+   for( i= 0; i < v4l2->numOutputFormats; ++i)
+   {
+      v4l2->outputFormats[i].index= i;
+      v4l2->outputFormats[i].type= bufferType;
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_ENUM_FMT, &v4l2->outputFormats[i]);
+      if ( rc < 0 )
       {
-         free( v4l2->outputFormats );
+         goto exit;
       }
-      if ( v4l2->v4l2Fd >= 0 )
+      if ( (v4l2->outputFormats[i].pixelformat == V4L2_PIX_FMT_NV12) ||
+           (v4l2->outputFormats[i].pixelformat == V4L2_PIX_FMT_NV12M) )
       {
-         close( v4l2->v4l2Fd );
-         v4l2->v4l2Fd= -1;
+         haveNV12= true;
       }
+      iprintf(1,"output format %d: flags %08x pixelFormat: %x desc: %s\n", 
+             i, v4l2->outputFormats[i].flags, v4l2->outputFormats[i].pixelformat, v4l2->outputFormats[i].description );
+   }
+
+   if ( !haveNV12 )
+   {
+      iprintf(0,"no suport for NV12/NV12M output detected\n");
    }
+
+   result= true;
+
+exit:
+   return result;
 }
 
-static int getInputBuffer( V4l2Ctx *v4l2 )
+static int inputBufferSize( DecCtx *decCtx )
 {
-   int bufferIndex= -1;
-   int i;
-   for( i= 0; i < v4l2->numBuffersIn; ++i )
+   AppCtx *appCtx= decCtx->appCtx;
+   Stream *stream;
+   int i, length, maxLength, size;
+
+   /* An ABR session can switch to any rendition so size for the largest */
+   maxLength= 0;
+   for( i= 0; i < (decCtx->abrSwitchRequestCount ? appCtx->abrLadderCount : 1); ++i )
    {
-      if ( !v4l2->inBuffers[i].queued )
+      stream= (decCtx->abrSwitchRequestCount ? appCtx->abrLadder[i] : decCtx->stream);
+      length= stream->streamHeaderLength+stream->streamMaxFrameLength;
+      if ( length > maxLength )
       {
-         bufferIndex= i;
-         break;
+         maxLength= length;
       }
    }
+   if ( maxLength == 0 )
+   {
+      return DEFAULT_INPUT_BUFFER_SIZE;
+   }
 
-   if ( bufferIndex < 0 )
+   size= maxLength + maxLength/INPUT_BUFFER_HEADROOM;
+   if ( size < MIN_INPUT_BUFFER_SIZE )
    {
-      int rc;
-      struct v4l2_buffer buf;
-      struct v4l2_plane planes[MAX_PLANES];
-      memset( &buf, 0, sizeof(buf));
-      buf.type= v4l2->fmtIn.type;
-      buf.memory= V4L2_MEMORY_MMAP;
-      if ( v4l2->isMultiPlane )
-      {
-         memset( planes, 0, sizeof(planes));
-         buf.length= 1;
-         buf.m.planes= planes;
-      }
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_DQBUF, &buf );
-      if ( rc == 0 )
-      {
-         bufferIndex= buf.index;
-         if ( v4l2->isMultiPlane )
-         {
-            memcpy( v4l2->inBuffers[bufferIndex].buf.m.planes, buf.m.planes, sizeof(struct v4l2_plane)*MAX_PLANES);
-            buf.m.planes= v4l2->inBuffers[bufferIndex].buf.m.planes;
-         }
-         v4l2->inBuffers[bufferIndex].buf= buf;
-         v4l2->inBuffers[bufferIndex].queued= false;
-      }
-      else if ( !v4l2->decCtx->videoInThreadStopRequested )
-      {
-         iprintf(0,"Error: getInputBuffer: decoder %d VIDIOC_DQBUF rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno); 
-      }
+      size= MIN_INPUT_BUFFER_SIZE;
    }
+   size= (size + 4095) & ~4095;
 
-   return bufferIndex;
+   return size;
 }
 
-static int getOutputBuffer( V4l2Ctx *v4l2 )
+static bool setInputFormat( V4l2Ctx *v4l2 )
 {
-   int bufferIndex= -1;
-   int rc;
-   struct v4l2_buffer buf;
-   struct v4l2_plane planes[MAX_PLANES];
+   bool result= false;
+   int rc, size, actualSize;
+   int32_t bufferType;
 
-   memset( &buf, 0, sizeof(buf));
-   buf.type= v4l2->fmtOut.type;
-   buf.memory= V4L2_MEMORY_MMAP;
+   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT);
+
+   size= inputBufferSize( v4l2->decCtx );
+
+   memset( &v4l2->fmtIn, 0, sizeof(struct v4l2_format) );
+   v4l2->fmtIn.type= bufferType;
    if ( v4l2->isMultiPlane )
    {
-      memset( planes, 0, sizeof(planes));
-      buf.length= v4l2->outBuffers[0].planeCount;
-      buf.m.planes= planes;
+      v4l2->fmtIn.fmt.pix_mp.pixelformat= v4l2->inputFormat;
+      v4l2->fmtIn.fmt.pix_mp.width= v4l2->decCtx->videoWidth;
+      v4l2->fmtIn.fmt.pix_mp.height= v4l2->decCtx->videoHeight;
+      v4l2->fmtIn.fmt.pix_mp.num_planes= 1;
+      v4l2->fmtIn.fmt.pix_mp.plane_fmt[0].sizeimage= size;
+      v4l2->fmtIn.fmt.pix_mp.plane_fmt[0].bytesperline= 0;
+      v4l2->fmtIn.fmt.pix_mp.field= V4L2_FIELD_NONE;
    }
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_DQBUF, &buf );
-   if ( rc == 0 )
+   else
    {
-      bufferIndex= buf.index;
-      if ( v4l2->isMultiPlane )
-      {
-         memcpy( v4l2->outBuffers[bufferIndex].buf.m.planes, buf.m.planes, sizeof(struct v4l2_plane)*MAX_PLANES);
-         buf.m.planes= v4l2->outBuffers[bufferIndex].buf.m.planes;
-      }
-      v4l2->outBuffers[bufferIndex].buf= buf;
+      v4l2->fmtIn.fmt.pix.pixelformat= v4l2->inputFormat;
+      v4l2->fmtIn.fmt.pix.width= v4l2->decCtx->videoWidth;
+      v4l2->fmtIn.fmt.pix.height= v4l2->decCtx->videoHeight;
+      v4l2->fmtIn.fmt.pix.sizeimage= size;
+      v4l2->fmtIn.fmt.pix.field= V4L2_FIELD_NONE;
+   }
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_S_FMT, &v4l2->fmtIn );
+   if ( rc < 0 )
+   {
+      iprintf(0,"setInputFormat: decoder %d failed to set format for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
+      goto exit;
    }
 
-   return bufferIndex;
+   actualSize= (v4l2->isMultiPlane ? v4l2->fmtIn.fmt.pix_mp.plane_fmt[0].sizeimage : v4l2->fmtIn.fmt.pix.sizeimage);
+   iprintf(1,"decoder %d: input buffer size requested %d got %d\n", v4l2->decCtx->decodeIndex, size, actualSize);
+   if ( actualSize < size )
+   {
+      iprintf(0,"Warning: setInputFormat: decoder %d input buffer size %d is less than the %d needed for the largest frame\n", v4l2->decCtx->decodeIndex, actualSize, size);
+   }
+
+   result= true;
+
+exit:
+   return result;
 }
 
-static int findOutputBuffer( V4l2Ctx *v4l2, int fd )
+
+static const TiledFormat *selectTiledFormat( V4l2Ctx *v4l2, bool multiPlane )
 {
-   int bufferIndex= -1;
-   int i;
+   AppCtx *appCtx= v4l2->decCtx->appCtx;
+   int i, j, k;
 
-   for( i= 0; i < v4l2->numBuffersOut; ++i )
+   /* A tiled layout is only usable when EGL can import it with its modifier, and only as an external image */
+   if ( appCtx->noModifiers || !appCtx->haveDmaBufModifiers || !appCtx->haveExternalImage )
    {
-      if ( v4l2->outBuffers[i].fd == fd )
+      return 0;
+   }
+   for( i= 0; gTiledFormats[i].pixelFormat; ++i )
+   {
+      if ( !multiPlane && (gTiledFormats[i].numPlanes > 1) )
       {
-         bufferIndex= i;
-         break;
+         continue;
+      }
+      for( j= 0; j < v4l2->numOutputFormats; ++j )
+      {
+         if ( v4l2->outputFormats[j].pixelformat == gTiledFormats[i].pixelFormat )
+         {
+            for( k= 0; k < appCtx->dmaBufModifierCount; ++k )
+            {
+               if ( appCtx->dmaBufModifiers[k] == gTiledFormats[i].modifier )
+               {
+                  return &gTiledFormats[i];
+               }
+            }
+         }
       }
    }
 
-   return bufferIndex;
+   return 0;
 }
 
-static void *videoEOSThread( void *arg )
+static bool setOutputFormat( V4l2Ctx *v4l2 )
 {
-   DecCtx *decCtx= (DecCtx*)arg;
-   V4l2Ctx *v4l2= &decCtx->v4l2;
-   int outputFrameCount, count, eosCountDown;
+   bool result= false;
+   const TiledFormat *tiled;
+   int rc;
+   int32_t bufferType;
+
+   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+   memset( &v4l2->fmtOut, 0, sizeof(struct v4l2_format) );
+   v4l2->fmtOut.type= bufferType;
 
-   iprintf(3,"videoEOSThread: enter\n");
-   decCtx->videoEOSThreadStarted= true;
+   /* Get current settings from driver */
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_FMT, &v4l2->fmtOut );
+   if ( rc < 0 )
+   {
+      iprintf(0,"setOutputFormat: failed get format for output: rc %d errno %d\n", rc, errno);
+   }
 
-   eosCountDown= 1000;
-   outputFrameCount= decCtx->outputFrameCount;
-   while( !decCtx->videoEOSThreadStopRequested )
+   tiled= selectTiledFormat( v4l2, v4l2->isMultiPlane );
+   if ( tiled )
    {
-      usleep( 1000000/decCtx->videoRate );
+      iprintf(0,"decoder %d: using tiled output format %.4s modifier %llx\n", v4l2->decCtx->decodeIndex, (char*)&tiled->pixelFormat, (unsigned long long)tiled->modifier);
+   }
 
-      count= decCtx->outputFrameCount;
-      if ( outputFrameCount == count )
+   if ( v4l2->isMultiPlane )
+   {
+      int i;
+      uint32_t pixelFormat= V4L2_PIX_FMT_NV12;
+      for( i= 0; i < v4l2->numOutputFormats; ++i)
       {
-         --eosCountDown;
-         if ( eosCountDown == 0 )
+         if ( v4l2->outputFormats[i].pixelformat == V4L2_PIX_FMT_NV12M )
          {
-            iprintf(0,"EOS detected decoder %d\n", decCtx->decodeIndex);
+            pixelFormat= V4L2_PIX_FMT_NV12M;
             break;
          }
       }
-      else
+      if ( tiled )
       {
-         outputFrameCount= count;
-         eosCountDown= 1000;
+         v4l2->fmtOut.fmt.pix_mp.num_planes= tiled->numPlanes;
+         pixelFormat= tiled->pixelFormat;
       }
+      else if ( pixelFormat == V4L2_PIX_FMT_NV12 )
+      {
+         v4l2->fmtOut.fmt.pix_mp.num_planes= 1;
+      }
+      else
+      {
+         v4l2->fmtOut.fmt.pix_mp.num_planes= 2;
+      }
+      v4l2->fmtOut.fmt.pix_mp.pixelformat= pixelFormat;
+      v4l2->fmtOut.fmt.pix_mp.width= v4l2->decCtx->videoWidth;
+      v4l2->fmtOut.fmt.pix_mp.height= v4l2->decCtx->videoHeight;
+      v4l2->fmtOut.fmt.pix_mp.plane_fmt[0].sizeimage= v4l2->decCtx->videoWidth*v4l2->decCtx->videoHeight;
+      v4l2->fmtOut.fmt.pix_mp.plane_fmt[0].bytesperline= v4l2->decCtx->videoWidth;
+      v4l2->fmtOut.fmt.pix_mp.plane_fmt[1].sizeimage= v4l2->decCtx->videoWidth*v4l2->decCtx->videoHeight/2;
+      v4l2->fmtOut.fmt.pix_mp.plane_fmt[1].bytesperline= v4l2->decCtx->videoWidth;
+      v4l2->fmtOut.fmt.pix_mp.field= V4L2_FIELD_NONE;
+   }
+   else
+   {
+      v4l2->fmtOut.fmt.pix.pixelformat= (tiled ? tiled->pixelFormat : V4L2_PIX_FMT_NV12);
+      v4l2->fmtOut.fmt.pix.width= v4l2->decCtx->videoWidth;
+      v4l2->fmtOut.fmt.pix.height= v4l2->decCtx->videoHeight;
+      v4l2->fmtOut.fmt.pix.sizeimage= (v4l2->fmtOut.fmt.pix.width*v4l2->fmtOut.fmt.pix.height*3)/2;
+      v4l2->fmtOut.fmt.pix.field= V4L2_FIELD_NONE;
+   }
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_S_FMT, &v4l2->fmtOut );
+   if ( rc < 0 )
+   {
+      iprintf(0,"setOutputFormat: decoder %d failed to set format for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
+      goto exit;
    }
 
-   decCtx->playing= false;
+   /* The driver may have picked another layout than the one asked for */
+   v4l2->outputModifier= DRM_FORMAT_MOD_LINEAR;
+   {
+      uint32_t pixelFormat= (v4l2->isMultiPlane ? v4l2->fmtOut.fmt.pix_mp.pixelformat : v4l2->fmtOut.fmt.pix.pixelformat);
+      for( int i= 0; gTiledFormats[i].pixelFormat; ++i )
+      {
+         if ( gTiledFormats[i].pixelFormat == pixelFormat )
+         {
+            v4l2->outputModifier= gTiledFormats[i].modifier;
+            break;
+         }
+      }
+   }
 
-   decCtx->videoEOSThreadStarted= false;
-   iprintf(3,"videoEOSThread: exit\n");
+   result= true;
 
-   return 0;
+exit:
+   return result;
 }
 
-static void *videoOutputThread( void *arg )
+static long long bufferBytes( BufferInfo *buffers, int count )
 {
-   DecCtx *decCtx= (DecCtx*)arg;
-   V4l2Ctx *v4l2= &decCtx->v4l2;
-   struct v4l2_selection selection;
-   int i, j, buffIndex, rc;
-   int32_t bufferType;
-   int frameNumber= 0;
-   long long prevFrameTime= 0, currFrameTime;
-
-   iprintf(3,"videoOutputThread: enter\n");
-   decCtx->videoOutThreadStarted= true;
+   long long bytes= 0;
+   int i, j;
 
-   for( i= 0; i < v4l2->numBuffersOut; ++i )
+   for( i= 0; i < count; ++i )
    {
-      if ( v4l2->isMultiPlane )
+      if ( buffers[i].planeCount )
       {
-         for( j= 0; j < v4l2->outBuffers[i].planeCount; ++j )
+         for( j= 0; j < buffers[i].planeCount; ++j )
          {
-            v4l2->outBuffers[i].buf.m.planes[j].bytesused= v4l2->outBuffers[i].buf.m.planes[j].length;
+            bytes += buffers[i].planeInfo[j].capacity;
          }
       }
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QBUF, &v4l2->outBuffers[i].buf );
-      if ( rc < 0 )
+      else
       {
-         iprintf(0,"Error: videoOutputThread: decoder %d failed to queue output buffer: rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
-         decCtx->async->error= true;
-         goto exit;
+         bytes += buffers[i].capacity;
       }
-      v4l2->outBuffers[i].queued= true;
    }
 
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMON, &v4l2->fmtOut.type );
-   if ( rc < 0 )
+   return bytes;
+}
+
+static bool setupInputBuffers( V4l2Ctx *v4l2 )
+{
+   bool result= false;
+   int rc, neededBuffers;
+   struct v4l2_control ctl;
+   struct v4l2_requestbuffers reqbuf;
+   struct v4l2_buffer *bufIn;
+   void *bufStart;
+   int32_t bufferType;
+   uint32_t memOffset, memLength, memBytesUsed;
+
+   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT);
+
+   neededBuffers= NUM_INPUT_BUFFERS;
+   if ( v4l2->decCtx->appCtx->inputBufferCount )
    {
-      iprintf(0,"Error: videoOutputThread: decoder %d streamon failed for output: rc %d errno %d\n", decCtx->decodeIndex, rc, errno );
-      decCtx->async->error= true;
-      goto exit;
+      neededBuffers= v4l2->decCtx->appCtx->inputBufferCount;
    }
 
-   bufferType= v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE :V4L2_BUF_TYPE_VIDEO_CAPTURE;
-   memset( &selection, 0, sizeof(selection) );
-   selection.type= bufferType;
-   selection.target= V4L2_SEL_TGT_COMPOSE_DEFAULT;
-   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_SELECTION, &selection );
-   if ( rc < 0 )
+   memset( &ctl, 0, sizeof(ctl));
+   ctl.id= V4L2_CID_MIN_BUFFERS_FOR_OUTPUT;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_CTRL, &ctl );
+   if ( rc == 0 )
    {
-      bufferType= V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      memset( &selection, 0, sizeof(selection) );
-      selection.type= bufferType;
-      selection.target= V4L2_SEL_TGT_COMPOSE_DEFAULT;
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_SELECTION, &selection );
-      if ( rc < 0 )
+      v4l2->minBuffersIn= ctl.value;
+      if ( (v4l2->minBuffersIn != 0) &&
+           (!v4l2->decCtx->appCtx->inputBufferCount || (v4l2->minBuffersIn > neededBuffers)) )
       {
-         iprintf(0,"Warning: videoOutputThread: decoder %d failed to get compose rect: rc %d errno %d\n", decCtx->decodeIndex, rc, errno );
+         neededBuffers= v4l2->minBuffersIn;
       }
    }
-   iprintf(2,"Out rect: (%d, %d, %d, %d)\n", selection.r.left, selection.r.top, selection.r.width, selection.r.height );
 
-   pthread_mutex_lock( &decCtx->mutex );
-   if ( rc == 0 )
+   if ( v4l2->minBuffersIn == 0 )
    {
-      decCtx->videoWidth= selection.r.width;
-      decCtx->videoHeight= selection.r.height;
+      v4l2->minBuffersIn= MIN_INPUT_BUFFERS;
    }
-   decCtx->videoBufferHeight= decCtx->videoHeight;
-   if (decCtx->videoHeight != v4l2->fmtOut.fmt.pix.height)
+
+   memset( &reqbuf, 0, sizeof(reqbuf) );
+   reqbuf.count= neededBuffers;
+   reqbuf.type= bufferType;
+   reqbuf.memory= V4L2_MEMORY_MMAP;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_REQBUFS, &reqbuf );
+   if ( rc < 0 )
    {
-      decCtx->videoBufferHeight= v4l2->fmtOut.fmt.pix.height;
+      iprintf(0,"Error: setupInputBuffers: decoder %d failed to request %d mmap buffers for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, neededBuffers, rc, errno);
+      goto exit;
    }
-   if ( v4l2->isMultiPlane )
+   v4l2->numBuffersIn= reqbuf.count;
+
+   if ( reqbuf.count < v4l2->minBuffersIn )
    {
-      decCtx->videoBufferWidth= v4l2->fmtOut.fmt.pix_mp.plane_fmt[0].bytesperline;
+      iprintf(0,"Error: setupInputBuffers: decoder %d insufficient buffers: (%d versus %d)\n", v4l2->decCtx->decodeIndex, reqbuf.count, neededBuffers );
+      goto exit;
    }
-   else
+
+   v4l2->inBuffers= (BufferInfo*)calloc( reqbuf.count, sizeof(BufferInfo) );
+   if ( !v4l2->inBuffers )
    {
-      decCtx->videoBufferWidth= v4l2->fmtOut.fmt.pix.bytesperline;
+      iprintf(0,"Error: setupInputBuffers: decoder %d no memory for BufferInfo\n", v4l2->decCtx->decodeIndex );
+      goto exit;
    }
-   iprintf(0,"%lld: decoder %d frame size: %dx%d capture buffer count %d\n", getCurrentTimeMillis(), decCtx->decodeIndex, decCtx->videoWidth, decCtx->videoHeight, decCtx->v4l2.numBuffersOut );
-   pthread_mutex_unlock( &decCtx->mutex );
 
-   for( ; ; )
+   for( int i= 0; i < reqbuf.count; ++i )
    {
-      if ( decCtx->videoOutThreadStopRequested )
+      bufIn= &v4l2->inBuffers[i].buf;
+      bufIn->type= bufferType;
+      bufIn->index= i;
+      bufIn->memory= V4L2_MEMORY_MMAP;
+      if ( v4l2->isMultiPlane )
       {
-         break;
+         memset( v4l2->inBuffers[i].planes, 0, sizeof(struct v4l2_plane)*MAX_PLANES);
+         bufIn->m.planes= v4l2->inBuffers[i].planes;
+         bufIn->length= 3;
       }
-      else
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QUERYBUF, bufIn );
+      if ( rc < 0 )
       {
-         buffIndex= getOutputBuffer( v4l2 );
-
-         if ( buffIndex >= 0 )
-         {
-            currFrameTime= getCurrentTimeMillis();
-            if ( prevFrameTime )
-            {
-               long long framePeriod= currFrameTime-prevFrameTime;
-               long long nominalFramePeriod= 1000/decCtx->videoRate;
-               long long delay= nominalFramePeriod-framePeriod;
-               if ( (delay > 2) && (delay <= nominalFramePeriod) )
-               {
-                  usleep( (delay-1)*1000 );
-                  currFrameTime= getCurrentTimeMillis();
-               }
-            }
-            prevFrameTime= currFrameTime;
-
-            if ( decCtx->videoOutThreadStopRequested )
-            {
-               break;
-            }
-
-            pthread_mutex_lock( &decCtx->mutex );
-            decCtx->nextFrameFd= v4l2->outBuffers[buffIndex].fd;
-            ++frameNumber;
-            pthread_mutex_unlock( &decCtx->mutex );
-         }
-
-         pthread_mutex_lock( &decCtx->mutex );
-         buffIndex= -1;
-         if ( decCtx->prevFrameFd >= 0 )
-         {
-            buffIndex= findOutputBuffer( v4l2, decCtx->prevFrameFd );
-            decCtx->prevFrameFd= -1;
-         }
-         pthread_mutex_unlock( &decCtx->mutex );
+         iprintf(0,"Error: setupInputBuffers: decoder %d failed to query input buffer %d: rc %d errno %d\n", v4l2->decCtx->decodeIndex, i, rc, errno);
+         goto exit;
       }
-
-      if ( decCtx->videoOutThreadStopRequested ) break;
-
-      if ( buffIndex >= 0 )
+      if ( v4l2->isMultiPlane )
       {
-         rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QBUF, &v4l2->outBuffers[buffIndex].buf );
-         if ( rc < 0 )
+         if ( bufIn->length != 1 )
          {
-            iprintf(0,"Error: decoder %d failed to re-queue output buffer: rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
-            decCtx->async->error= true;
+            iprintf(0,"setupInputBuffers: decoder %d num planes expected to be 1 for compressed input but is %d\n", v4l2->decCtx->decodeIndex, bufIn->length);
             goto exit;
          }
-         v4l2->outBuffers[buffIndex].queued= true;
+         v4l2->inBuffers[i].planeCount= 0;
+         memOffset= bufIn->m.planes[0].m.mem_offset;
+         memLength= bufIn->m.planes[0].length;
+         memBytesUsed= bufIn->m.planes[0].bytesused;
+      }
+      else
+      {
+         memOffset= bufIn->m.offset;
+         memLength= bufIn->length;
+         memBytesUsed= bufIn->bytesused;
       }
-   }
 
-exit:
+      bufStart= MMAP( NULL,
+                      memLength,
+                      PROT_READ | PROT_WRITE,
+                      MAP_SHARED,
+                      v4l2->v4l2Fd,
+                      memOffset );
+      if ( bufStart == MAP_FAILED )
+      {
+         iprintf(0,"Error: setupInputBuffers: decoder %d failed to mmap input buffer %d: errno %d\n", v4l2->decCtx->decodeIndex, i, errno);
+         goto exit;
+      }
 
-   decCtx->videoOutThreadStarted= false;
-   iprintf(3,"videoOutputThread: exit\n");
+      iprintf(2,"Input buffer: %d\n", i);
+      iprintf(2,"  index: %d start: %p bytesUsed %d  offset %d length %d flags %08x\n", 
+              bufIn->index, bufStart, memBytesUsed, memOffset, memLength, bufIn->flags );
 
-   return 0;
-}
+      v4l2->inBuffers[i].fd= -1;
+      v4l2->inBuffers[i].start= bufStart;
+      v4l2->inBuffers[i].capacity= memLength;
+   }
 
-static void *videoInputThread( void *arg )
-{
-   DecCtx *decCtx= (DecCtx*)arg;
-   V4l2Ctx *v4l2= &decCtx->v4l2;
+   v4l2->decCtx->buffersIn= v4l2->numBuffersIn;
+   v4l2->decCtx->bytesIn= bufferBytes( v4l2->inBuffers, v4l2->numBuffersIn );
+   iprintf(1,"decoder %d: %d input buffers %lld bytes\n", v4l2->decCtx->decodeIndex, v4l2->decCtx->buffersIn, v4l2->decCtx->bytesIn);
 
-   iprintf(3,"videoInputThread: enter\n");
-   decCtx->videoInThreadStarted= true;
+   result= true;
 
-   playFile( decCtx );
+exit:
 
-   decCtx->videoInThreadStarted= false;
-   iprintf(3,"videoInputThread: exit\n");
+   if ( !result )
+   {
+      tearDownInputBuffers( v4l2 );
+   }
 
-   return 0;
+   return result;
 }
 
-static void *videoDecodeThread( void *arg )
+static void tearDownInputBuffers( V4l2Ctx *v4l2 )
 {
-   DecCtx *decCtx= (DecCtx*)arg;
-   AppCtx *appCtx= decCtx->appCtx;
-   EGLCtx *egl= &appCtx->egl;
-   GLCtx *gl= &appCtx->gl;
-   Surface *surface= decCtx->surface;
-   Async *async= decCtx->async;
+   int rc;
+   struct v4l2_requestbuffers reqbuf;
+   int32_t bufferType;
 
-   iprintf(3,"videoDecodeThread: enter\n");
-   decCtx->videoDecodeThreadStarted= true;
+   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT);
 
-   while ( decCtx->playing )
+   if ( v4l2->inBuffers )
    {
-      usleep( 8000 );
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMOFF, &v4l2->fmtIn.type );
+      if ( rc < 0 )
+      {
+         iprintf(0,"Error: tearDownInputBuffers: decder %d streamoff failed for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
+      }
 
-      if ( updateFrame( decCtx, surface ) )
+      for( int i= 0; i < v4l2->numBuffersIn; ++i )
       {
-         if ( surface )
+         if ( v4l2->inBuffers[i].start )
          {
-            surface->dirty= true;
+            munmap( v4l2->inBuffers[i].start, v4l2->inBuffers[i].capacity );
          }
       }
+      free( v4l2->inBuffers );
+      v4l2->inBuffers= 0;
+   }
 
-      if ( !decCtx->videoInThreadStopRequested && (decCtx->outputFrameCount == decCtx->numFramesToDecode) )
-      {
-         iprintf(0,"%lld: decoder %d decoded %d frames\n", getCurrentTimeMillis(), decCtx->decodeIndex, decCtx->outputFrameCount );
-         decCtx->videoInThreadStopRequested= true;
-      }
-      if ( decCtx->videoInThreadStopRequested && !decCtx->videoInThreadStarted )
-      {
-         pthread_join( decCtx->videoInThreadId, NULL );
-         decCtx->videoOutThreadStopRequested= true;
-      }
-      if ( decCtx->videoOutThreadStopRequested && !decCtx->videoOutThreadStarted )
+   if ( v4l2->numBuffersIn )
+   {
+      memset( &reqbuf, 0, sizeof(reqbuf) );
+      reqbuf.count= 0;
+      reqbuf.type= bufferType;
+      reqbuf.memory= V4L2_MEMORY_MMAP;
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_REQBUFS, &reqbuf );
+      if ( rc < 0 )
       {
-         if ( surface )
-         {
-            pthread_mutex_lock( &decCtx->mutex );
-            for( int i= 0; i < MAX_TEXTURES; ++i )
-            {
-               if ( surface->eglImage[i] )
-               {
-                  gl->eglDestroyImageKHR( egl->eglDisplay, surface->eglImage[i] );
-                  surface->eglImage[i]= 0;
-               }
-               if ( surface->textureId[i] != GL_NONE )
-               {
-                  glDeleteTextures( 1, &surface->textureId[i] );
-                  surface->textureId[i]= GL_NONE;
-               }
-            }
-            pthread_mutex_unlock( &decCtx->mutex );
-         }
-         break;
+         iprintf(0,"Error: tearDownInputBuffers: decoder %d failed to release v4l2 buffers for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
       }
+      v4l2->numBuffersIn= 0;
    }
+}
 
-   decCtx->videoInThreadStopRequested= true;
-   decCtx->videoOutThreadStopRequested= true;
-   decCtx->videoEOSThreadStopRequested= true;
+static void initCapturePool( PlatformCtx *platformCtx )
+{
+   static const char *heapNames[]= { "linux,cma", "reserved", "system" };
+   char path[64];
+   int i;
 
-   termV4l2( &decCtx->v4l2 );
+   memset( &gCapturePool, 0, sizeof(gCapturePool) );
+   pthread_mutex_init( &gCapturePool.mutex, 0 );
+   gCapturePool.platformCtx= platformCtx;
+   gCapturePool.heapFd= -1;
 
-   if ( decCtx->videoOutThreadStarted )
+   /* Prefer a dma-heap, contiguous first as most decoders need it, and fall back to GBM */
+   for( i= 0; i < (int)(sizeof(heapNames)/sizeof(heapNames[0])); ++i )
    {
-      pthread_join( decCtx->videoOutThreadId, NULL );
+      snprintf( path, sizeof(path), "/dev/dma_heap/%s", heapNames[i] );
+      gCapturePool.heapFd= open( path, O_RDONLY|O_CLOEXEC );
+      if ( gCapturePool.heapFd >= 0 )
+      {
+         gCapturePool.heapName= heapNames[i];
+         break;
+      }
    }
-
-   if ( decCtx->videoEOSThreadStarted )
+   if ( gCapturePool.heapFd >= 0 )
    {
-      pthread_join( decCtx->videoEOSThreadId, NULL );
+      iprintf(0,"capture pool: allocating from dma-heap %s\n", gCapturePool.heapName);
+   }
+   else
+   {
+      iprintf(0,"capture pool: no dma-heap, allocating GBM buffers\n");
    }
-
-   decCtx->videoDecodeThreadStarted= false;
-   iprintf(3,"videoDecodeThread: exit\n");
-
-   async->done= true;
-
-   return 0;
 }
 
-static bool playFile( DecCtx *decCtx )
+static void termCapturePool( void )
 {
-   bool result= false;
-   V4l2Ctx *v4l2= &decCtx->v4l2;
-   AppCtx *appCtx= decCtx->appCtx;
-   Stream *stream= decCtx->stream;
-   int frameIndex, frameOffset, frameLength;
-   int buffIndex, rc;
-
-   frameIndex= 0;
+   int i;
 
-   for( ; ; )
+   pthread_mutex_lock( &gCapturePool.mutex );
+   for( i= 0; i < gCapturePool.count; ++i )
    {
-      if ( decCtx->videoInThreadStopRequested )
+      if ( gCapturePool.buffers[i].inUse )
       {
-         break;
+         iprintf(0,"Warning: termCapturePool: buffer fd %d still in use\n", gCapturePool.buffers[i].fd);
       }
+      close( gCapturePool.buffers[i].fd );
+   }
+   gCapturePool.count= 0;
+   if ( gCapturePool.heapFd >= 0 )
+   {
+      close( gCapturePool.heapFd );
+      gCapturePool.heapFd= -1;
+   }
+   gCapturePool.platformCtx= 0;
+   pthread_mutex_unlock( &gCapturePool.mutex );
+   pthread_mutex_destroy( &gCapturePool.mutex );
+}
 
-      buffIndex= getInputBuffer( v4l2 );
+static int capturePoolAcquire( int size )
+{
+   PoolBuffer *buffer= 0;
+   int fd= -1;
+   int i;
 
-      if (decCtx->videoInThreadStopRequested )
-      {
-         break;
-      }
+   size= (size + 4095) & ~4095;
 
-      if ( buffIndex < 0 )
-      {
-         iprintf(0,"Error: playFile: decoder %d unable to get input buffer\n", decCtx->decodeIndex);
-         decCtx->async->error= true;
-         goto exit;
-      }
+   pthread_mutex_lock( &gCapturePool.mutex );
 
-      if ( frameIndex >= stream->streamFrameCount )
+   /* Reuse the smallest free buffer that fits */
+   for( i= 0; i < gCapturePool.count; ++i )
+   {
+      if ( !gCapturePool.buffers[i].inUse && (gCapturePool.buffers[i].size >= size) )
       {
-         frameIndex= 0;
+         if ( !buffer || (gCapturePool.buffers[i].size < buffer->size) )
+         {
+            buffer= &gCapturePool.buffers[i];
+         }
       }
-      frameOffset= stream->streamFrameOffset[frameIndex];
-      frameLength= stream->streamFrameLength[frameIndex];
+   }
 
-      memcpy( v4l2->inBuffers[buffIndex].start, &stream->streamData[frameOffset], frameLength );
-      
-      v4l2->inBuffers[buffIndex].buf.bytesused= frameLength;
-      if ( v4l2->isMultiPlane )
+   if ( buffer )
+   {
+      ++gCapturePool.reuseCount;
+   }
+   else
+   {
+      /* Free buffers too small for this size are left over from a lower resolution, so give them back */
+      for( i= gCapturePool.count-1; i >= 0; --i )
       {
-         v4l2->inBuffers[buffIndex].buf.m.planes[0].bytesused= frameLength;
+         if ( !gCapturePool.buffers[i].inUse && (gCapturePool.buffers[i].size < size) )
+         {
+            close( gCapturePool.buffers[i].fd );
+            gCapturePool.totalBytes -= gCapturePool.buffers[i].size;
+            gCapturePool.buffers[i]= gCapturePool.buffers[--gCapturePool.count];
+            ++gCapturePool.freeCount;
+         }
       }
-      v4l2->inBuffers[buffIndex].buf.timestamp = {0};
-      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QBUF, &v4l2->inBuffers[buffIndex].buf );
-      if ( rc < 0 )
+
+      if ( gCapturePool.count >= MAX_POOL_BUFFERS )
       {
-         iprintf(0,"Error: playFile: queuing input buffer failed: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno );
-         decCtx->async->error= true;
+         iprintf(0,"Error: capturePoolAcquire: pool full\n");
          goto exit;
       }
-      v4l2->inBuffers[buffIndex].queued= true;
 
-      if ( !v4l2->outputStarted )
+      if ( gCapturePool.heapFd >= 0 )
       {
-         v4l2->outputStarted= true;
+         struct dma_heap_allocation_data alloc;
+         int rc;
 
-         rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMON, &v4l2->fmtIn.type );
+         memset( &alloc, 0, sizeof(alloc) );
+         alloc.len= size;
+         alloc.fd_flags= O_RDWR|O_CLOEXEC;
+         rc= ioctl( gCapturePool.heapFd, DMA_HEAP_IOCTL_ALLOC, &alloc );
          if ( rc < 0 )
          {
-            iprintf(0,"Error: streamon failed for input: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno );
-            goto exit;
-         }
-
-         setOutputFormat( v4l2 );
-         setupOutputBuffers( v4l2 );
-
-         decCtx->ready= true;
-         for( ; ; )
-         {
-            if ( decCtx->paused == false ) break;
-            usleep( 1000 );
-         }
-
-         rc= pthread_create( &v4l2->decCtx->videoOutThreadId, NULL, videoOutputThread, v4l2->decCtx );
-         if ( rc )
-         {
-            iprintf(0,"Error: unable to start video output thread: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
-            decCtx->async->error= true;
+            iprintf(0,"Error: capturePoolAcquire: dma-heap alloc of %d bytes failed: errno %d\n", size, errno);
             goto exit;
          }
-
-         rc= pthread_create( &v4l2->decCtx->videoEOSThreadId, NULL, videoEOSThread, v4l2->decCtx );
-         if ( rc )
+         fd= alloc.fd;
+      }
+      else
+      {
+         fd= PlatformCreateDmaBuf( gCapturePool.platformCtx, 4096, size/4096 );
+         if ( fd < 0 )
          {
-            iprintf(0,"Error: unable to start video EOS thread: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
-            decCtx->async->error= true;
+            iprintf(0,"Error: capturePoolAcquire: GBM alloc of %d bytes failed\n", size);
             goto exit;
          }
       }
 
-      ++frameIndex;
+      buffer= &gCapturePool.buffers[gCapturePool.count++];
+      buffer->fd= fd;
+      buffer->size= size;
+      gCapturePool.totalBytes += size;
+      if ( gCapturePool.totalBytes > gCapturePool.peakTotalBytes )
+      {
+         gCapturePool.peakTotalBytes= gCapturePool.totalBytes;
+      }
+      ++gCapturePool.allocCount;
    }
 
-   result= true;
+   buffer->inUse= true;
+   gCapturePool.inUseBytes += buffer->size;
+   if ( gCapturePool.inUseBytes > gCapturePool.peakInUseBytes )
+   {
+      gCapturePool.peakInUseBytes= gCapturePool.inUseBytes;
+   }
+   fd= buffer->fd;
 
 exit:
+   pthread_mutex_unlock( &gCapturePool.mutex );
 
-   return result;
+   return fd;
 }
 
-static bool parseStreamDescriptor( AppCtx *appCtx, Stream *stream, const char *descriptorFilename )
+static void capturePoolRelease( int fd )
 {
-   bool result= false;
-   FILE *pFile;
-   char line[1024];
-   char field[1024];
-   char *s;
-   int foundValueCount= 0;
+   int i;
 
-   pFile= fopen( descriptorFilename, "rt" );
-   if ( pFile )
+   pthread_mutex_lock( &gCapturePool.mutex );
+   for( i= 0; i < gCapturePool.count; ++i )
    {
-      for( ; ; )
+      if ( gCapturePool.buffers[i].fd == fd )
       {
-         s= fgets( line, sizeof(line), pFile );
-         if ( s )
-         {
-            if ( sscanf( s, "file: %s", field ) == 1 )
-            {
-               stream->inputFilename= strdup(field);
-               ++foundValueCount;
-            }
-            else if ( sscanf( s, "frame-size: %s", field ) == 1 )
-            {
-               int w, h;
-               if ( sscanf( field, "%dx%d", &w, &h ) == 2 )
-               {
-                  stream->videoWidth= w;
-                  stream->videoHeight= h;
-                  ++foundValueCount;
-               }
-            }
-            else if ( sscanf( s, "frame-rate: %s", field ) == 1 )
-            {
-               int rate;
-               rate= atoi(field);
-               if ( rate )
-               {
-                  stream->videoRate= rate;
-                  ++foundValueCount;
-               }
-            }
-         }
-         else
+         if ( gCapturePool.buffers[i].inUse )
          {
-            break;
+            gCapturePool.buffers[i].inUse= false;
+            gCapturePool.inUseBytes -= gCapturePool.buffers[i].size;
          }
+         break;
       }
-      if ( foundValueCount == 3 )
+   }
+   pthread_mutex_unlock( &gCapturePool.mutex );
+}
+
+static void holdCaptureBuffer( DecCtx *decCtx, int buffIndex )
+{
+   BufferInfo *buffer= &decCtx->v4l2.outBuffers[buffIndex];
+
+   /* Take the buffer's pool fds so tearing down the capture queue leaves them in use */
+   pthread_mutex_lock( &decCtx->mutex );
+   decCtx->heldCaptureCount= 0;
+   decCtx->heldCaptureReplaced= false;
+   if ( buffer->planeCount )
+   {
+      for( int j= 0; j < buffer->planeCount; ++j )
       {
-         result= true;
+         if ( buffer->planeInfo[j].fd >= 0 )
+         {
+            decCtx->heldCaptureFd[decCtx->heldCaptureCount++]= buffer->planeInfo[j].fd;
+            buffer->planeInfo[j].fd= -1;
+         }
       }
-      fclose( pFile );
    }
-   else
+   else if ( buffer->fd >= 0 )
    {
-      printf("Error: parseStreamDescriptor: unable to open descriptor (%s)\n", descriptorFilename);
+      decCtx->heldCaptureFd[decCtx->heldCaptureCount++]= buffer->fd;
    }
+   buffer->fd= -1;
+   pthread_mutex_unlock( &decCtx->mutex );
+}
 
-return result;
+static void releaseHeldCapture( DecCtx *decCtx )
+{
+   pthread_mutex_lock( &decCtx->mutex );
+   for( int i= 0; i < decCtx->heldCaptureCount; ++i )
+   {
+      capturePoolRelease( decCtx->heldCaptureFd[i] );
+   }
+   decCtx->heldCaptureCount= 0;
+   decCtx->heldCaptureReplaced= false;
+   pthread_mutex_unlock( &decCtx->mutex );
 }
 
-static bool prepareStream( AppCtx *appCtx, Stream *stream )
+static void emitCapturePoolStats( void )
+{
+   iprintf(0,"Capture pool: %s: buffers %d allocated %d reused %d freed %d\n",
+           (gCapturePool.heapFd >= 0 ? gCapturePool.heapName : "gbm"),
+           gCapturePool.count, gCapturePool.allocCount, gCapturePool.reuseCount, gCapturePool.freeCount );
+   iprintf(0,"Capture pool: peak allocated %.1f MB peak in use %.1f MB\n",
+           (double)gCapturePool.peakTotalBytes/(1024.0*1024.0), (double)gCapturePool.peakInUseBytes/(1024.0*1024.0) );
+}
+
+static bool setupOutputBuffersDmaBuf( V4l2Ctx *v4l2, int neededBuffers )
 {
    bool result= false;
-   FILE *pFile;
-   int rc, streamDataLen, lenDidRead;
-   int frameNumber, frameStartOffset, i;
-   bool firstFrame;
-   char *p;
+   int rc, size;
+   struct v4l2_requestbuffers reqbuf;
+   struct v4l2_buffer *bufOut;
 
-   pFile= fopen( stream->inputFilename, "rb" );
-   if ( !pFile )
+   memset( &reqbuf, 0, sizeof(reqbuf) );
+   reqbuf.count= neededBuffers;
+   reqbuf.type= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
+   reqbuf.memory= V4L2_MEMORY_DMABUF;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_REQBUFS, &reqbuf );
+   if ( rc < 0 )
    {
-      iprintf(0,"Error: prepareStream: unable to open input file (%s)\n", stream->inputFilename );
+      iprintf(0,"Error: setupOutputBuffersDmaBuf: decoder %d failed to request %d dmabuf buffers for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, neededBuffers, rc, errno);
       goto exit;
    }
+   v4l2->memoryOut= V4L2_MEMORY_DMABUF;
+   v4l2->numBuffersOut= reqbuf.count;
 
-   rc= fseek( pFile, 0, SEEK_END );
-   if ( rc )
+   if ( reqbuf.count < v4l2->minBuffersOut )
    {
-      iprintf(0,"Error: prepareStream: unable to seek to end of input file (%s) : %d\n", stream->inputFilename, errno );
+      iprintf(0,"Error: setupOutputBuffersDmaBuf: decoder %d insufficient buffers: (%d versus %d)\n", v4l2->decCtx->decodeIndex, reqbuf.count, neededBuffers );
       goto exit;
    }
 
-   streamDataLen= ftell( pFile );
-   if ( streamDataLen > MAX_STREAM_LEN )
+   v4l2->outBuffers= (BufferInfo*)calloc( reqbuf.count, sizeof(BufferInfo) );
+   if ( !v4l2->outBuffers )
    {
-      streamDataLen= MAX_STREAM_LEN;
+      iprintf(0,"Error: setupOutputBuffersDmaBuf: decoder %d no memory for BufferInfo\n", v4l2->decCtx->decodeIndex );
+      goto exit;
    }
 
-   rc= fseek( pFile, 0, SEEK_SET );
-   if ( rc )
+   for( int i= 0; i < reqbuf.count; ++i )
    {
-      iprintf(0,"Error: prepareStream: unable to seek to start of input file (%s) : %d\n", stream->inputFilename, errno );
+      v4l2->outBuffers[i].fd= -1;
+      for( int j= 0; j < 3; ++j )
+      {
+         v4l2->outBuffers[i].planeInfo[j].fd= -1;
+      }
+   }
+
+   for( int i= 0; i < reqbuf.count; ++i )
+   {
+      bufOut= &v4l2->outBuffers[i].buf;
+      bufOut->type= reqbuf.type;
+      bufOut->index= i;
+      bufOut->memory= V4L2_MEMORY_DMABUF;
+      if ( v4l2->isMultiPlane )
+      {
+         memset( v4l2->outBuffers[i].planes, 0, sizeof(struct v4l2_plane)*MAX_PLANES);
+         bufOut->m.planes= v4l2->outBuffers[i].planes;
+         bufOut->length= v4l2->fmtOut.fmt.pix_mp.num_planes;
+         v4l2->outBuffers[i].planeCount= bufOut->length;
+         for( int j= 0; j < v4l2->outBuffers[i].planeCount; ++j )
+         {
+            size= v4l2->fmtOut.fmt.pix_mp.plane_fmt[j].sizeimage;
+            v4l2->outBuffers[i].planeInfo[j].fd= capturePoolAcquire( size );
+            if ( v4l2->outBuffers[i].planeInfo[j].fd < 0 )
+            {
+               iprintf(0,"Error: setupOutputBuffersDmaBuf: decoder %d no pool buffer for buffer %d plane %d size %d\n", v4l2->decCtx->decodeIndex, i, j, size);
+               goto exit;
+            }
+            v4l2->outBuffers[i].planeInfo[j].capacity= size;
+            bufOut->m.planes[j].m.fd= v4l2->outBuffers[i].planeInfo[j].fd;
+            bufOut->m.planes[j].length= size;
+            iprintf(2,"Output buffer: %d plane %d pool fd %d size %d\n", i, j, v4l2->outBuffers[i].planeInfo[j].fd, size);
+         }
+
+         /* Use fd of first plane to identify buffer */
+         v4l2->outBuffers[i].fd= v4l2->outBuffers[i].planeInfo[0].fd;
+      }
+      else
+      {
+         size= v4l2->fmtOut.fmt.pix.sizeimage;
+         v4l2->outBuffers[i].fd= capturePoolAcquire( size );
+         if ( v4l2->outBuffers[i].fd < 0 )
+         {
+            iprintf(0,"Error: setupOutputBuffersDmaBuf: decoder %d no pool buffer for buffer %d size %d\n", v4l2->decCtx->decodeIndex, i, size);
+            goto exit;
+         }
+         v4l2->outBuffers[i].capacity= size;
+         bufOut->m.fd= v4l2->outBuffers[i].fd;
+         bufOut->length= size;
+         iprintf(2,"Output buffer: %d pool fd %d size %d\n", i, v4l2->outBuffers[i].fd, size);
+      }
+   }
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static bool setupOutputBuffers( V4l2Ctx *v4l2 )
+{
+   bool result= false;
+   int rc, neededBuffers;
+   struct v4l2_control ctl;
+   struct v4l2_requestbuffers reqbuf;
+   struct v4l2_buffer *bufOut;
+   struct v4l2_exportbuffer expbuf;
+   void *bufStart;
+   int32_t bufferType;
+
+   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+   neededBuffers= NUM_OUTPUT_BUFFERS;
+   if ( v4l2->decCtx->appCtx->captureBufferCount )
+   {
+      neededBuffers= v4l2->decCtx->appCtx->captureBufferCount;
+   }
+   
+   memset( &ctl, 0, sizeof(ctl));
+   ctl.id= V4L2_CID_MIN_BUFFERS_FOR_CAPTURE;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_CTRL, &ctl );
+   if ( rc == 0 )
+   {
+      v4l2->minBuffersOut= ctl.value;
+      if ( (v4l2->minBuffersOut != 0) && (v4l2->minBuffersOut > neededBuffers) )
+      {
+         neededBuffers= v4l2->minBuffersOut;
+      }
+   }
+
+   if ( v4l2->minBuffersOut == 0 )
+   {
+      v4l2->minBuffersOut= MIN_OUTPUT_BUFFERS;
+   }
+
+   /* Stateless decoders leave reference frames and reordering to us */
+   if ( v4l2->isStateless && (v4l2->h264->neededBuffersOut > neededBuffers) )
+   {
+      neededBuffers= v4l2->h264->neededBuffersOut;
+   }
+
+   if ( gCaptureDmaBuf )
+   {
+      /* Pool buffers are sized to what is in flight: the decoder minimum plus one displayed and one pending */
+      if ( !v4l2->decCtx->appCtx->captureBufferCount )
+      {
+         neededBuffers= v4l2->minBuffersOut+EXTRA_POOL_BUFFERS;
+      }
+      if ( v4l2->isStateless && (v4l2->h264->neededBuffersOut > neededBuffers) )
+      {
+         neededBuffers= v4l2->h264->neededBuffersOut;
+      }
+      result= setupOutputBuffersDmaBuf( v4l2, neededBuffers );
       goto exit;
    }
 
-   stream->streamData= (char*)malloc( streamDataLen );
-   if ( !stream->streamData )
+   memset( &reqbuf, 0, sizeof(reqbuf) );
+   reqbuf.count= neededBuffers;
+   reqbuf.type= bufferType;
+   reqbuf.memory= V4L2_MEMORY_MMAP;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_REQBUFS, &reqbuf );
+   if ( rc < 0 )
    {
-      iprintf(0,"Error: prepareStream: unable to allocate %d bytes for stream data\n", streamDataLen );
+      iprintf(0,"Error: setupOutputBuffers: decoder %d failed to request %d mmap buffers for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, neededBuffers, rc, errno);
       goto exit;
    }
+   v4l2->memoryOut= V4L2_MEMORY_MMAP;
+   v4l2->numBuffersOut= reqbuf.count;
 
-   lenDidRead= fread( stream->streamData, 1, streamDataLen, pFile );
-   if ( lenDidRead != streamDataLen )
+   if ( reqbuf.count < v4l2->minBuffersOut )
    {
-      iprintf(0,"Error: prepareStream: unable to read %d bytes from stream\n", streamDataLen );
+      iprintf(0,"Error: setupOutputBuffers: decoder %d insufficient buffers: (%d versus %d)\n", v4l2->decCtx->decodeIndex, reqbuf.count, neededBuffers );
       goto exit;
    }
 
-   firstFrame= true;
-   frameNumber= 0;
-   frameStartOffset= 0;
-   p= stream->streamData;
-   for( i= 0; i < streamDataLen-4; ++i )
+   v4l2->outBuffers= (BufferInfo*)calloc( reqbuf.count, sizeof(BufferInfo) );
+   if ( !v4l2->outBuffers )
    {
-      if ( (p[i] == 0) && (p[i+1] == 0) && (p[i+2] == 0) && (p[i+3] == 1) )
+      iprintf(0,"Error: setupOutputBuffers: decoder %d no memory for BufferInfo\n", v4l2->decCtx->decodeIndex );
+      goto exit;
+   }
+
+   for( int i= 0; i < reqbuf.count; ++i )
+   {
+      v4l2->outBuffers[i].fd= -1;
+      for( int j= 0; j < 3; ++j )
       {
-         if ( p[i+4] == 0x67 || p[i+4] == 0x68 || p[i+4] == 0x06 || p[i+4] == 0x09 )
-         {
-            continue;
-         }
-         if ( firstFrame )
+         v4l2->outBuffers[i].planeInfo[j].fd= -1;
+      }
+   }
+
+   for( int i= 0; i < reqbuf.count; ++i )
+   {
+      bufOut= &v4l2->outBuffers[i].buf;
+      bufOut->type= bufferType;
+      bufOut->index= i;
+      bufOut->memory= V4L2_MEMORY_MMAP;
+      if ( v4l2->isMultiPlane )
+      {
+         memset( v4l2->outBuffers[i].planes, 0, sizeof(struct v4l2_plane)*MAX_PLANES);
+         bufOut->m.planes= v4l2->outBuffers[i].planes;
+         bufOut->length= v4l2->fmtOut.fmt.pix_mp.num_planes;
+      }
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QUERYBUF, bufOut );
+      if ( rc < 0 )
+      {
+         iprintf(0,"Error: setupOutputBuffers: decoder %d failed to query input buffer %d: rc %d errno %d\n", v4l2->decCtx->decodeIndex, i, rc, errno);
+         goto exit;
+      }
+      if ( v4l2->isMultiPlane )
+      {
+         v4l2->outBuffers[i].planeCount= bufOut->length;
+         for( int j= 0; j < v4l2->outBuffers[i].planeCount; ++j )
          {
-            firstFrame= false;
-            continue;
+            iprintf(2,"Output buffer: %d\n", i);
+            iprintf(2,"  index: %d bytesUsed %d length %d flags %08x\n",
+                   bufOut->index, bufOut->m.planes[j].bytesused, bufOut->m.planes[j].length, bufOut->flags );
+
+            memset( &expbuf, 0, sizeof(expbuf) );
+            expbuf.type= bufOut->type;
+            expbuf.index= i;
+            expbuf.plane= j;
+            expbuf.flags= O_CLOEXEC;
+            rc= IOCTL( v4l2->v4l2Fd, VIDIOC_EXPBUF, &expbuf );
+            if ( rc < 0 )
+            {
+               iprintf(0,"setupOutputBuffers: decoder %d failed to export v4l2 output buffer %d: plane: %d rc %d errno %d\n", v4l2->decCtx->decodeIndex, i, j, rc, errno);
+            }
+            iprintf(2,"  plane %d index %d export fd %d\n", j, expbuf.index, expbuf.fd );
+
+            v4l2->outBuffers[i].planeInfo[j].fd= expbuf.fd;
+            v4l2->outBuffers[i].planeInfo[j].capacity= bufOut->m.planes[j].length;
          }
-         stream->streamFrameOffset[frameNumber]= frameStartOffset;
-         stream->streamFrameLength[frameNumber]= (i - frameStartOffset);
-         ++frameNumber;
-         frameStartOffset= i;
-         if ( frameNumber >= MAX_STREAM_FRAMES )
+
+         /* Use fd of first plane to identify buffer */
+         v4l2->outBuffers[i].fd= v4l2->outBuffers[i].planeInfo[0].fd;
+      }
+      else
+      {
+         iprintf(2,"Output buffer: %d\n", i);
+         iprintf(2,"  index: %d bytesUsed %d length %d flags %08x\n",
+                bufOut->index, bufOut->bytesused, bufOut->length, bufOut->flags );
+
+         memset( &expbuf, 0, sizeof(expbuf) );
+         expbuf.type= bufOut->type;
+         expbuf.index= i;
+         expbuf.flags= O_CLOEXEC;
+         rc= IOCTL( v4l2->v4l2Fd, VIDIOC_EXPBUF, &expbuf );
+         if ( rc < 0 )
          {
-            break;
+            iprintf(0,"setupOutputBuffers: decoder %d failed to export v4l2 output buffer %d: rc %d errno %d\n", v4l2->decCtx->decodeIndex, i, rc, errno);
          }
+         iprintf(2,"  index %d export fd %d\n", expbuf.index, expbuf.fd );
+
+         v4l2->outBuffers[i].fd= expbuf.fd;
+         v4l2->outBuffers[i].capacity= bufOut->length;
       }
    }
 
-   stream->streamFrameCount= frameNumber;
-   stream->streamDataLen= streamDataLen;
-   iprintf(0,"Indexed %d input frames from (%s)\n", frameNumber, stream->inputFilename );
-
    result= true;
 
 exit:
 
-   if ( !result )
+   if ( result )
    {
-      if ( stream->streamData )
-      {
-         free( stream->streamData );
-         stream->streamData= 0;
-      }
+      /* Unique across decoders and tests: planes cache framebuffers per generation */
+      v4l2->bufferGeneration= __atomic_add_fetch( &gBufferGeneration, 1, __ATOMIC_RELAXED );
+      v4l2->decCtx->buffersOut= v4l2->numBuffersOut;
+      v4l2->decCtx->bytesOut= bufferBytes( v4l2->outBuffers, v4l2->numBuffersOut );
+      iprintf(1,"decoder %d: %d capture buffers %lld bytes\n", v4l2->decCtx->decodeIndex, v4l2->decCtx->buffersOut, v4l2->decCtx->bytesOut);
    }
-
-   if ( pFile )
+   else
    {
-      fclose( pFile );
+      tearDownOutputBuffers( v4l2 );
    }
 
    return result;
 }
 
-static bool updateFrame( DecCtx *decCtx, Surface *surface )
+static void tearDownOutputBuffers( V4l2Ctx *v4l2 )
 {
-   AppCtx *appCtx= decCtx->appCtx;
-   EGLCtx *egl= &appCtx->egl;
-   GLCtx *gl= &appCtx->gl;
-   V4l2Ctx *v4l2= &decCtx->v4l2;
-   EGLint attr[28];
-   int buffIndex;
-   bool dirty= false;
+   int rc;
+   struct v4l2_requestbuffers reqbuf;
+   int32_t bufferType;
 
-   pthread_mutex_lock( &decCtx->mutex );
-   if ( decCtx->nextFrameFd != decCtx->currFrameFd )
+   bufferType= (v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE);
+
+   if ( v4l2->outBuffers )
    {
-      dirty= true;
-      ++decCtx->outputFrameCount;
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMOFF, &v4l2->fmtOut.type );
+      if ( rc < 0 )
+      {
+         iprintf(0,"Error: tearDownOutputBuffers: decoder %d streamoff failed for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
+      }
 
-      if ( decCtx->nextFrameFd >= 0 )
+      for( int i= 0; i < v4l2->numBuffersOut; ++i )
       {
-         if ( surface )
+         if ( v4l2->outBuffers[i].planeCount )
          {
-            int fd0, fd1;
-
-            for( int i= 0; i < MAX_TEXTURES; ++i )
-            {
-               if ( surface->eglImage[i] )
-               {
-                  gl->eglDestroyImageKHR( egl->eglDisplay, surface->eglImage[i] );
-                  surface->eglImage[i]= 0;
-               }
-            }
-
-            buffIndex= findOutputBuffer( v4l2, decCtx->nextFrameFd );
-            iprintf(6,"updateFrame: found index %d for nextFrameFd %d\n", buffIndex, decCtx->nextFrameFd);
-            if ( buffIndex >= 0 )
+            for( int j= 0; j < v4l2->outBuffers[i].planeCount; ++j )
             {
-               if ( v4l2->isMultiPlane )
+               if ( v4l2->outBuffers[i].planeInfo[j].fd >= 0 )
                {
-                  fd0= v4l2->outBuffers[buffIndex].planeInfo[0].fd;
-                  fd1= v4l2->outBuffers[buffIndex].planeInfo[1].fd;
-                  if ( fd1 == -1 )
+                  if ( v4l2->memoryOut == V4L2_MEMORY_DMABUF )
                   {
-                     fd1= fd0;
+                     capturePoolRelease( v4l2->outBuffers[i].planeInfo[j].fd );
+                  }
+                  else
+                  {
+                     close( v4l2->outBuffers[i].planeInfo[j].fd );
                   }
+                  v4l2->outBuffers[i].planeInfo[j].fd= -1;
                }
-               else
-               {
-                  fd0= v4l2->outBuffers[buffIndex].fd;
-                  fd1= fd0;
+            }
+            v4l2->outBuffers[i].fd= -1;
+            v4l2->outBuffers[i].planeCount= 0;
+         }
+         if ( v4l2->outBuffers[i].fd >= 0 )
+         {
+            if ( v4l2->memoryOut == V4L2_MEMORY_DMABUF )
+            {
+               capturePoolRelease( v4l2->outBuffers[i].fd );
+            }
+            else
+            {
+               close( v4l2->outBuffers[i].fd );
+            }
+            v4l2->outBuffers[i].fd= -1;
+         }
+      }
+
+      free( v4l2->outBuffers );
+      v4l2->outBuffers= 0;
+   }
+
+   if ( v4l2->numBuffersOut )
+   {
+      memset( &reqbuf, 0, sizeof(reqbuf) );
+      reqbuf.count= 0;
+      reqbuf.type= bufferType;
+      reqbuf.memory= v4l2->memoryOut;
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_REQBUFS, &reqbuf );
+      if ( rc < 0 )
+      {
+         iprintf(0,"Error: tearDownOutputBuffers: decoder %d failed to release v4l2 buffers for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
+      }
+      v4l2->numBuffersOut= 0;
+   }
+}
+
+static void stopDecoder( V4l2Ctx *v4l2 )
+{
+   int rc;
+
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMOFF, &v4l2->fmtIn.type );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: stopDecoder: decder %d streamoff failed for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
+   }
+
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMOFF, &v4l2->fmtOut.type );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: stopDecoder: decder %d streamoff failed for output: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
+   }
+}
+
+static bool flushInput( V4l2Ctx *v4l2 )
+{
+   bool result= false;
+   int rc;
+
+   /* Streamoff on the input queue discards all pending compressed data and returns the buffers to us */
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMOFF, &v4l2->fmtIn.type );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: flushInput: decoder %d streamoff failed for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
+      goto exit;
+   }
+
+   for( int i= 0; i < v4l2->numBuffersIn; ++i )
+   {
+      v4l2->inBuffers[i].queued= false;
+   }
+
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMON, &v4l2->fmtIn.type );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: flushInput: decoder %d streamon failed for input: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno );
+      goto exit;
+   }
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static bool initV4l2( V4l2Ctx *v4l2 )
+{
+   bool result= false;
+   int i, rc;
+   struct v4l2_exportbuffer eb;
+   struct v4l2_event_subscription sub;
+   struct v4l2_decoder_cmd dc;
+
+   if ( gIoctlReplay )
+   {
+      v4l2->v4l2Fd= TraceReplayOpen();
+   }
+   else if ( gMockDecoder )
+   {
+      v4l2->v4l2Fd= MockDecOpen( gDeviceName );
+   }
+   else
+   {
+      v4l2->v4l2Fd= open( gDeviceName, O_RDWR );
+   }
+   if ( gIoctlRecord )
+   {
+      TraceRecordOpen( v4l2->v4l2Fd );
+   }
+   iprintf(2,"v4l2Fd %d\n", v4l2->v4l2Fd);
+   if ( v4l2->v4l2Fd < 0 )
+   {
+      iprintf(0,"Error: initV4l2: failed to open device (%s)\n", gDeviceName );
+      goto exit;
+   }
+   ioctlStatsSetDecoderFd( v4l2->decCtx->decodeIndex, v4l2->v4l2Fd );
+
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QUERYCAP, &v4l2->caps );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: initV4l2: failed query caps: %d errno %d\n", rc, errno);
+      goto exit;
+   }
+
+   iprintf(2,"driver (%s) card(%s) bus_info(%s) version %d capabilities %X device_caps %X\n", 
+           v4l2->caps.driver, v4l2->caps.card, v4l2->caps.bus_info, v4l2->caps.version, v4l2->caps.capabilities, v4l2->caps.device_caps );
+
+   v4l2->deviceCaps= (v4l2->caps.capabilities & V4L2_CAP_DEVICE_CAPS ) ? v4l2->caps.device_caps : v4l2->caps.capabilities;
+
+   if ( !(v4l2->deviceCaps & (V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE) ))
+   {
+      iprintf(0,"Error: initV4l2: device (%s) is not a M2M device\n", gDeviceName );
+      goto exit;
+   }
+
+   if ( !(v4l2->deviceCaps & V4L2_CAP_STREAMING) )
+   {
+      iprintf(0,"Error: initV4l2: device (%s) does not support dmabuf: no V4L2_CAP_STREAMING\n", gDeviceName );
+      goto exit;
+   }
+
+   if ( (v4l2->deviceCaps & V4L2_CAP_VIDEO_M2M_MPLANE) && !(v4l2->deviceCaps & V4L2_CAP_VIDEO_M2M) )
+   {
+      iprintf(2,"device is multiplane\n");
+      v4l2->isMultiPlane= true;
+   }
+
+   eb.type= V4L2_BUF_TYPE_VIDEO_CAPTURE;
+   eb.index= -1;
+   eb.plane= -1;
+   eb.flags= (O_RDWR|O_CLOEXEC);
+   IOCTL( v4l2->v4l2Fd, VIDIOC_EXPBUF, &eb );
+   if ( errno == ENOTTY )
+   {
+      iprintf(0,"Error: initV4l2: device (%s) does not support dmabuf: no VIDIOC_EXPBUF\n", gDeviceName );
+      goto exit;
+   }
+
+   v4l2->inputFormat= V4L2_PIX_FMT_H264;
+
+   getInputFormats( v4l2 );
+
+   /* Prefer a stateful decoder, fall back to a stateless one that takes H264 slices */
+   for( i= 0; i < v4l2->numInputFormats; ++i )
+   {
+      if ( v4l2->inputFormats[i].pixelformat == V4L2_PIX_FMT_H264 )
+      {
+         break;
+      }
+   }
+   if ( i >= v4l2->numInputFormats )
+   {
+      for( i= 0; i < v4l2->numInputFormats; ++i )
+      {
+         if ( v4l2->inputFormats[i].pixelformat == V4L2_PIX_FMT_H264_SLICE )
+         {
+            iprintf(0,"decoder %d: device is a stateless decoder\n", v4l2->decCtx->decodeIndex);
+            v4l2->inputFormat= V4L2_PIX_FMT_H264_SLICE;
+            v4l2->isStateless= true;
+            break;
+         }
+      }
+   }
+
+   /* Several frames may share a buffer only if the decoder parses the bytestream itself */
+   if ( (i < v4l2->numInputFormats) && !v4l2->isStateless &&
+        (v4l2->inputFormats[i].flags & V4L2_FMT_FLAG_CONTINUOUS_BYTESTREAM) )
+   {
+      v4l2->canPackInput= true;
+   }
+
+   getOutputFormats( v4l2 );
+
+   setInputFormat( v4l2 );
+
+   setupInputBuffers( v4l2 );
+
+   if ( v4l2->isStateless )
+   {
+      if ( !initStateless( v4l2 ) )
+      {
+         goto exit;
+      }
+   }
+
+   memset( &sub, 0, sizeof(sub) );
+   sub.type= V4L2_EVENT_EOS;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_SUBSCRIBE_EVENT, &sub );
+   if ( rc < 0 )
+   {
+      iprintf(1,"Warning: initV4l2: unable to subscribe for EOS event: rc %d errno %d\n", rc, errno);
+   }
+
+   memset( &sub, 0, sizeof(sub) );
+   sub.type= V4L2_EVENT_SOURCE_CHANGE;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_SUBSCRIBE_EVENT, &sub );
+   if ( rc < 0 )
+   {
+      iprintf(1,"Warning: initV4l2: unable to subscribe for source change event: rc %d errno %d\n", rc, errno);
+   }
+
+   memset( &dc, 0, sizeof(dc) );
+   dc.cmd= V4L2_DEC_CMD_STOP;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_TRY_DECODER_CMD, &dc );
+   v4l2->canDrain= (rc == 0);
+   if ( !v4l2->canDrain )
+   {
+      iprintf(1,"Warning: initV4l2: device does not support V4L2_DEC_CMD_STOP: rc %d errno %d\n", rc, errno);
+   }
+
+   result= true;
+
+exit:
+   return result;   
+}
+
+static void termV4l2( V4l2Ctx *v4l2 )
+{
+   if ( v4l2 )
+   {
+      if ( v4l2->isStateless )
+      {
+         termStateless( v4l2 );
+      }
+
+      tearDownInputBuffers( v4l2 );
+
+      tearDownOutputBuffers( v4l2 );
+
+      if ( v4l2->inputFormats )
+      {
+         free( v4l2->inputFormats );
+      }
+      if ( v4l2->outputFormats )
+      {
+         free( v4l2->outputFormats );
+      }
+      if ( v4l2->v4l2Fd >= 0 )
+      {
+         ioctlStatsSetDecoderFd( v4l2->decCtx->decodeIndex, -1 );
+         if ( gIoctlRecord )
+         {
+            TraceRecordClose( v4l2->v4l2Fd );
+         }
+         if ( gIoctlReplay )
+         {
+            TraceReplayClose( v4l2->v4l2Fd );
+         }
+         else if ( gMockDecoder )
+         {
+            MockDecClose( v4l2->v4l2Fd );
+         }
+         else
+         {
+            close( v4l2->v4l2Fd );
+         }
+         v4l2->v4l2Fd= -1;
+      }
+   }
+}
+
+static int getInputBuffer( V4l2Ctx *v4l2 )
+{
+   int bufferIndex= -1;
+   int i;
+   for( i= 0; i < v4l2->numBuffersIn; ++i )
+   {
+      if ( !v4l2->inBuffers[i].queued )
+      {
+         bufferIndex= i;
+         break;
+      }
+   }
+
+   if ( bufferIndex < 0 )
+   {
+      int rc;
+      struct v4l2_buffer buf;
+      struct v4l2_plane planes[MAX_PLANES];
+      memset( &buf, 0, sizeof(buf));
+      buf.type= v4l2->fmtIn.type;
+      buf.memory= V4L2_MEMORY_MMAP;
+      if ( v4l2->isMultiPlane )
+      {
+         memset( planes, 0, sizeof(planes));
+         buf.length= 1;
+         buf.m.planes= planes;
+      }
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_DQBUF, &buf );
+      if ( rc == 0 )
+      {
+         bufferIndex= buf.index;
+         if ( v4l2->isMultiPlane )
+         {
+            memcpy( v4l2->inBuffers[bufferIndex].buf.m.planes, buf.m.planes, sizeof(struct v4l2_plane)*MAX_PLANES);
+            buf.m.planes= v4l2->inBuffers[bufferIndex].buf.m.planes;
+         }
+         v4l2->inBuffers[bufferIndex].buf= buf;
+         v4l2->inBuffers[bufferIndex].queued= false;
+      }
+      else if ( !v4l2->decCtx->videoInThreadStopRequested )
+      {
+         iprintf(0,"Error: getInputBuffer: decoder %d VIDIOC_DQBUF rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno); 
+      }
+   }
+
+   return bufferIndex;
+}
+
+static int getOutputBuffer( V4l2Ctx *v4l2 )
+{
+   int bufferIndex= -1;
+   int rc;
+   struct v4l2_buffer buf;
+   struct v4l2_plane planes[MAX_PLANES];
+
+   memset( &buf, 0, sizeof(buf));
+   buf.type= v4l2->fmtOut.type;
+   buf.memory= v4l2->memoryOut;
+   if ( v4l2->isMultiPlane )
+   {
+      memset( planes, 0, sizeof(planes));
+      buf.length= v4l2->outBuffers[0].planeCount;
+      buf.m.planes= planes;
+   }
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_DQBUF, &buf );
+   if ( rc == 0 )
+   {
+      bufferIndex= buf.index;
+      if ( v4l2->isMultiPlane )
+      {
+         memcpy( v4l2->outBuffers[bufferIndex].buf.m.planes, buf.m.planes, sizeof(struct v4l2_plane)*MAX_PLANES);
+         buf.m.planes= v4l2->outBuffers[bufferIndex].buf.m.planes;
+      }
+      v4l2->outBuffers[bufferIndex].buf= buf;
+   }
+   else if ( errno == EPIPE )
+   {
+      /* The buffer flagged V4L2_BUF_FLAG_LAST has already been dequeued */
+      v4l2->lastBufferDequeued= true;
+   }
+
+   return bufferIndex;
+}
+
+static int findOutputBuffer( V4l2Ctx *v4l2, int fd )
+{
+   int bufferIndex= -1;
+   int i;
+
+   for( i= 0; i < v4l2->numBuffersOut; ++i )
+   {
+      if ( v4l2->outBuffers[i].fd == fd )
+      {
+         bufferIndex= i;
+         break;
+      }
+   }
+
+   return bufferIndex;
+}
+
+static bool drainDecoder( V4l2Ctx *v4l2 )
+{
+   bool result= false;
+   struct v4l2_decoder_cmd dc;
+   int rc;
+
+   memset( &dc, 0, sizeof(dc) );
+   dc.cmd= V4L2_DEC_CMD_STOP;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_DECODER_CMD, &dc );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: drainDecoder: decoder %d V4L2_DEC_CMD_STOP failed: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
+      goto exit;
+   }
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static bool waitOutputReady( V4l2Ctx *v4l2 )
+{
+   DecCtx *decCtx= v4l2->decCtx;
+   struct pollfd pfd;
+   struct v4l2_event event;
+   int rc;
+
+   pfd.fd= v4l2->v4l2Fd;
+   pfd.events= POLLIN | POLLRDNORM | POLLPRI;
+   pfd.revents= 0;
+
+   rc= POLL( &pfd, 1, 100 );
+   if ( rc <= 0 )
+   {
+      if ( (rc == 0) && decCtx->eosEventReceived )
+      {
+         /* Drivers that only signal V4L2_EVENT_EOS are done once the capture queue goes quiet */
+         decCtx->drainDone= true;
+      }
+      return false;
+   }
+
+   if ( pfd.revents & POLLPRI )
+   {
+      memset( &event, 0, sizeof(event) );
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_DQEVENT, &event );
+      if ( (rc == 0) && (event.type == V4L2_EVENT_EOS) )
+      {
+         iprintf(1,"decoder %d: V4L2_EVENT_EOS\n", decCtx->decodeIndex);
+         decCtx->eosEventReceived= true;
+      }
+      else if ( (rc == 0) && (event.type == V4L2_EVENT_SOURCE_CHANGE) &&
+                (event.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION) )
+      {
+         iprintf(1,"decoder %d: V4L2_EVENT_SOURCE_CHANGE\n", decCtx->decodeIndex);
+         decCtx->resChangeStartTime= getMonotonicTimeMicros();
+         decCtx->resChangePending= true;
+      }
+   }
+
+   if ( pfd.revents & (POLLIN | POLLRDNORM) )
+   {
+      return true;
+   }
+
+   if ( pfd.revents & POLLERR )
+   {
+      /* Every capture buffer is held by us: wait for one to be released */
+      usleep( 1000 );
+   }
+
+   return false;
+}
+
+static bool startOutput( DecCtx *decCtx )
+{
+   bool result= false;
+   V4l2Ctx *v4l2= &decCtx->v4l2;
+   struct v4l2_selection selection;
+   int i, j, rc;
+   int32_t bufferType;
+
+   for( i= 0; i < v4l2->numBuffersOut; ++i )
+   {
+      if ( v4l2->isMultiPlane )
+      {
+         for( j= 0; j < v4l2->outBuffers[i].planeCount; ++j )
+         {
+            v4l2->outBuffers[i].buf.m.planes[j].bytesused= v4l2->outBuffers[i].buf.m.planes[j].length;
+         }
+      }
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QBUF, &v4l2->outBuffers[i].buf );
+      if ( rc < 0 )
+      {
+         iprintf(0,"Error: startOutput: decoder %d failed to queue output buffer: rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
+         goto exit;
+      }
+      v4l2->outBuffers[i].queued= true;
+   }
+
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMON, &v4l2->fmtOut.type );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: startOutput: decoder %d streamon failed for output: rc %d errno %d\n", decCtx->decodeIndex, rc, errno );
+      goto exit;
+   }
+
+   bufferType= v4l2->isMultiPlane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE :V4L2_BUF_TYPE_VIDEO_CAPTURE;
+   memset( &selection, 0, sizeof(selection) );
+   selection.type= bufferType;
+   selection.target= V4L2_SEL_TGT_COMPOSE_DEFAULT;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_SELECTION, &selection );
+   if ( rc < 0 )
+   {
+      bufferType= V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      memset( &selection, 0, sizeof(selection) );
+      selection.type= bufferType;
+      selection.target= V4L2_SEL_TGT_COMPOSE_DEFAULT;
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_SELECTION, &selection );
+      if ( rc < 0 )
+      {
+         iprintf(0,"Warning: startOutput: decoder %d failed to get compose rect: rc %d errno %d\n", decCtx->decodeIndex, rc, errno );
+      }
+   }
+   iprintf(2,"Out rect: (%d, %d, %d, %d)\n", selection.r.left, selection.r.top, selection.r.width, selection.r.height );
+
+   pthread_mutex_lock( &decCtx->mutex );
+   if ( rc == 0 )
+   {
+      decCtx->videoWidth= selection.r.width;
+      decCtx->videoHeight= selection.r.height;
+   }
+   decCtx->videoBufferHeight= decCtx->videoHeight;
+   if (decCtx->videoHeight != v4l2->fmtOut.fmt.pix.height)
+   {
+      decCtx->videoBufferHeight= v4l2->fmtOut.fmt.pix.height;
+   }
+   if ( v4l2->isMultiPlane )
+   {
+      decCtx->videoBufferWidth= v4l2->fmtOut.fmt.pix_mp.plane_fmt[0].bytesperline;
+   }
+   else
+   {
+      decCtx->videoBufferWidth= v4l2->fmtOut.fmt.pix.bytesperline;
+   }
+   iprintf(0,"%lld: decoder %d frame size: %dx%d capture buffer count %d\n", getCurrentTimeMillis(), decCtx->decodeIndex, decCtx->videoWidth, decCtx->videoHeight, decCtx->v4l2.numBuffersOut );
+   pthread_mutex_unlock( &decCtx->mutex );
+
+   decCtx->captureFrameCount= 0;
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static bool handleResolutionChange( DecCtx *decCtx )
+{
+   bool result= false;
+   V4l2Ctx *v4l2= &decCtx->v4l2;
+   struct v4l2_format fmt;
+   int oldWidth, oldHeight, newWidth, newHeight;
+   long long reallocStartTime;
+   EGLSyncKHR prevFrameSync, currFrameSync;
+   int heldIndex= -1;
+   bool releaseHeld;
+   int rc;
+
+   decCtx->resChangePending= false;
+   v4l2->lastBufferDequeued= false;
+
+   memset( &fmt, 0, sizeof(fmt) );
+   fmt.type= v4l2->fmtOut.type;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_G_FMT, &fmt );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: handleResolutionChange: decoder %d failed to get capture format: rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
+      goto exit;
+   }
+
+   if ( v4l2->isMultiPlane )
+   {
+      oldWidth= v4l2->fmtOut.fmt.pix_mp.width;
+      oldHeight= v4l2->fmtOut.fmt.pix_mp.height;
+      newWidth= fmt.fmt.pix_mp.width;
+      newHeight= fmt.fmt.pix_mp.height;
+   }
+   else
+   {
+      oldWidth= v4l2->fmtOut.fmt.pix.width;
+      oldHeight= v4l2->fmtOut.fmt.pix.height;
+      newWidth= fmt.fmt.pix.width;
+      newHeight= fmt.fmt.pix.height;
+   }
+
+   if ( (newWidth == oldWidth) && (newHeight == oldHeight) && (decCtx->captureFrameCount == 0) )
+   {
+      /* Initial source change for a format we already configured */
+      iprintf(1,"decoder %d: source change with unchanged size %dx%d\n", decCtx->decodeIndex, newWidth, newHeight);
+      result= true;
+      goto exit;
+   }
+
+   iprintf(0,"%lld: decoder %d resolution change %dx%d -> %dx%d\n", getCurrentTimeMillis(), decCtx->decodeIndex, oldWidth, oldHeight, newWidth, newHeight);
+
+   reallocStartTime= getMonotonicTimeMicros();
+
+   /* The frame on screen keeps its EGLImage, but the fds that identify capture buffers are about to be closed */
+   pthread_mutex_lock( &decCtx->mutex );
+   prevFrameSync= decCtx->prevFrameSync;
+   currFrameSync= decCtx->currFrameSync;
+   decCtx->prevFrameSync= EGL_NO_SYNC_KHR;
+   decCtx->currFrameSync= EGL_NO_SYNC_KHR;
+   if ( (v4l2->memoryOut == V4L2_MEMORY_DMABUF) && (decCtx->currFrameFd >= 0) )
+   {
+      heldIndex= findOutputBuffer( v4l2, decCtx->currFrameFd );
+   }
+   decCtx->prevFrameFd= -1;
+   decCtx->currFrameFd= -1;
+   decCtx->nextFrameFd= -1;
+   decCtx->videoWidth= newWidth;
+   decCtx->videoHeight= newHeight;
+   pthread_mutex_unlock( &decCtx->mutex );
+
+   waitFrameSync( decCtx, prevFrameSync );
+   waitFrameSync( decCtx, currFrameSync );
+
+   /* A buffer held over an earlier change that has since been replaced had its fence waited above */
+   pthread_mutex_lock( &decCtx->mutex );
+   releaseHeld= decCtx->heldCaptureReplaced;
+   pthread_mutex_unlock( &decCtx->mutex );
+   if ( releaseHeld )
+   {
+      if ( decCtx->appCtx->videoPlanes )
+      {
+         waitPlaneRelease( decCtx );
+      }
+      releaseHeldCapture( decCtx );
+   }
+
+   /* Pool buffers are shared, so the frame on screen must not return to the pool until a new frame replaces it */
+   if ( heldIndex >= 0 )
+   {
+      holdCaptureBuffer( decCtx, heldIndex );
+   }
+
+   tearDownOutputBuffers( v4l2 );
+
+   if ( !setOutputFormat( v4l2 ) )
+   {
+      goto exit;
+   }
+
+   if ( !setupOutputBuffers( v4l2 ) )
+   {
+      goto exit;
+   }
+
+   if ( !startOutput( decCtx ) )
+   {
+      goto exit;
+   }
+
+   if ( decCtx->resChangeCount < MAX_RES_CHANGES )
+   {
+      decCtx->resChangeRealloc[decCtx->resChangeCount++]= getMonotonicTimeMicros()-reallocStartTime;
+   }
+   decCtx->resChangeAwaitFrame= true;
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static void *videoOutputThread( void *arg )
+{
+   DecCtx *decCtx= (DecCtx*)arg;
+   V4l2Ctx *v4l2= &decCtx->v4l2;
+   int buffIndex;
+   int frameNumber= 0;
+   long long prevFrameTime= 0, currFrameTime;
+   EGLSyncKHR prevFrameSync;
+   bool releaseHeld;
+
+   iprintf(3,"videoOutputThread: enter\n");
+   TimelineNameThread( "decoder %d output", decCtx->decodeIndex );
+   decCtx->videoOutThreadStarted= true;
+
+   if ( !startOutput( decCtx ) )
+   {
+      decCtx->async->error= true;
+      goto exit;
+   }
+
+   for( ; ; )
+   {
+      if ( decCtx->videoOutThreadStopRequested || decCtx->drainDone )
+      {
+         break;
+      }
+      else
+      {
+         buffIndex= -1;
+         if ( waitOutputReady( v4l2 ) )
+         {
+            buffIndex= getOutputBuffer( v4l2 );
+         }
+
+         if ( (buffIndex >= 0) && (v4l2->outBuffers[buffIndex].buf.flags & V4L2_BUF_FLAG_LAST) )
+         {
+            uint32_t bytesUsed;
+
+            bytesUsed= v4l2->isMultiPlane ? v4l2->outBuffers[buffIndex].buf.m.planes[0].bytesused : v4l2->outBuffers[buffIndex].buf.bytesused;
+            iprintf(1,"decoder %d: V4L2_BUF_FLAG_LAST bytesused %u\n", decCtx->decodeIndex, bytesUsed);
+            v4l2->lastBufferDequeued= true;
+            if ( (bytesUsed == 0) || decCtx->resChangePending )
+            {
+               /* Empty last buffer carries no picture, and buffers are reallocated on a resolution change */
+               buffIndex= -1;
+            }
+         }
+
+         if ( decCtx->resChangePending && (v4l2->lastBufferDequeued || (decCtx->captureFrameCount == 0)) )
+         {
+            if ( !handleResolutionChange( decCtx ) )
+            {
+               decCtx->async->error= true;
+               goto exit;
+            }
+            continue;
+         }
+
+         if ( v4l2->isStateless )
+         {
+            buffIndex= reorderOutput( v4l2, buffIndex, v4l2->lastBufferDequeued );
+         }
+
+         if ( v4l2->lastBufferDequeued && (!v4l2->isStateless || (v4l2->h264->reorderCount == 0)) )
+         {
+            decCtx->drainDone= true;
+            if ( buffIndex < 0 )
+            {
+               break;
+            }
+         }
+
+         if ( buffIndex >= 0 )
+         {
+            long long queueTime;
+
+            currFrameTime= getCurrentTimeMillis();
+            ++decCtx->captureFrameCount;
+            queueTime= decCtx->frameQueueTime[v4l2->outBuffers[buffIndex].buf.timestamp.tv_usec % MAX_STREAM_FRAMES];
+            if ( queueTime )
+            {
+               long long latency= getMonotonicTimeMicros()-queueTime;
+               ++decCtx->decodeLatencyCount;
+               decCtx->decodeLatencyTotal += latency;
+               if ( latency > decCtx->decodeLatencyMax ) decCtx->decodeLatencyMax= latency;
+            }
+            if ( decCtx->resChangeAwaitFrame )
+            {
+               decCtx->resChangeAwaitFrame= false;
+               if ( decCtx->resChangeFrameCount < MAX_RES_CHANGES )
+               {
+                  decCtx->resChangeFirstFrame[decCtx->resChangeFrameCount++]= getMonotonicTimeMicros()-decCtx->resChangeStartTime;
+               }
+            }
+            if ( decCtx->drainRequested )
+            {
+               ++decCtx->drainFrameCount;
+            }
+            if ( !decCtx->firstDecodeTime )
+            {
+               decCtx->firstDecodeTime= currFrameTime;
+            }
+
+            if ( decCtx->seekPending )
+            {
+               bool stale= false;
+
+               /* Input buffers are stamped with the seek generation, which the decoder copies to the output */
+               pthread_mutex_lock( &decCtx->mutex );
+               if ( v4l2->outBuffers[buffIndex].buf.timestamp.tv_sec != decCtx->seekGeneration )
+               {
+                  stale= true;
+                  ++decCtx->seekDroppedFrames;
+               }
+               else
+               {
+                  decCtx->seekPending= false;
+                  if ( decCtx->seekFrameCount < MAX_SEEKS )
+                  {
+                     decCtx->seekFrameLatency[decCtx->seekFrameCount++]= currFrameTime-decCtx->seekStartTime;
+                  }
+               }
+               pthread_mutex_unlock( &decCtx->mutex );
+
+               if ( stale )
+               {
+                  if ( !requeueCaptureBuffer( decCtx, buffIndex ) )
+                  {
+                     iprintf(0,"Error: decoder %d failed to re-queue stale output buffer: errno %d\n", decCtx->decodeIndex, errno);
+                     decCtx->async->error= true;
+                     goto exit;
+                  }
+                  continue;
+               }
+            }
+            if ( prevFrameTime && !decCtx->trickSpeed )
+            {
+               long long framePeriod= currFrameTime-prevFrameTime;
+               long long nominalFramePeriod= 1000/decCtx->videoRate;
+               long long delay= nominalFramePeriod-framePeriod;
+               if ( (delay > 2) && (delay <= nominalFramePeriod) )
+               {
+                  usleep( (delay-1)*1000 );
+                  currFrameTime= getCurrentTimeMillis();
+               }
+            }
+            if ( decCtx->abrPending && prevFrameTime &&
+                 (v4l2->outBuffers[buffIndex].buf.timestamp.tv_sec == decCtx->seekGeneration) )
+            {
+               long long nominalFramePeriod= 1000/decCtx->videoRate;
+               long long glitch= (currFrameTime-prevFrameTime)-nominalFramePeriod;
+               int switchIndex= decCtx->abrSwitchCount-1;
+
+               /* First frame of the new rendition: any time beyond one frame period was a visible stall */
+               if ( glitch < 0 )
+               {
+                  glitch= 0;
+               }
+               pthread_mutex_lock( &decCtx->mutex );
+               decCtx->abrPending= false;
+               decCtx->abrGlitch[switchIndex]= glitch;
+               decCtx->abrDroppedFrames[switchIndex]= glitch/nominalFramePeriod;
+               pthread_mutex_unlock( &decCtx->mutex );
+            }
+            prevFrameTime= currFrameTime;
+
+            if ( decCtx->videoOutThreadStopRequested )
+            {
+               break;
+            }
+
+            pthread_mutex_lock( &decCtx->mutex );
+            decCtx->nextFrameFd= v4l2->outBuffers[buffIndex].fd;
+            decCtx->nextFrameTime= getMonotonicTimeMicros();
+            ++frameNumber;
+            pthread_mutex_unlock( &decCtx->mutex );
+         }
+
+         pthread_mutex_lock( &decCtx->mutex );
+         buffIndex= -1;
+         releaseHeld= false;
+         prevFrameSync= EGL_NO_SYNC_KHR;
+         if ( decCtx->prevFrameFd >= 0 )
+         {
+            buffIndex= findOutputBuffer( v4l2, decCtx->prevFrameFd );
+            decCtx->prevFrameFd= -1;
+            prevFrameSync= decCtx->prevFrameSync;
+            decCtx->prevFrameSync= EGL_NO_SYNC_KHR;
+         }
+         else if ( decCtx->heldCaptureReplaced )
+         {
+            /* The frame held over a resolution change has been replaced, so it is the previous frame */
+            releaseHeld= true;
+            prevFrameSync= decCtx->prevFrameSync;
+            decCtx->prevFrameSync= EGL_NO_SYNC_KHR;
+         }
+         pthread_mutex_unlock( &decCtx->mutex );
+
+         /* The decoder may only write the buffer again once the GPU has finished sampling it */
+         waitFrameSync( decCtx, prevFrameSync );
+
+         /* ...and once no plane is scanning it out */
+         if ( ((buffIndex >= 0) || releaseHeld) && decCtx->appCtx->videoPlanes )
+         {
+            waitPlaneRelease( decCtx );
+         }
+
+         if ( releaseHeld )
+         {
+            releaseHeldCapture( decCtx );
+         }
+      }
+
+      if ( decCtx->videoOutThreadStopRequested ) break;
+
+      if ( buffIndex >= 0 )
+      {
+         if ( !requeueCaptureBuffer( decCtx, buffIndex ) )
+         {
+            iprintf(0,"Error: decoder %d failed to re-queue output buffer: errno %d\n", decCtx->decodeIndex, errno);
+            decCtx->async->error= true;
+            goto exit;
+         }
+      }
+   }
+
+exit:
+
+   if ( decCtx->drainDone && decCtx->drainStartTime )
+   {
+      decCtx->drainTime= getMonotonicTimeMicros()-decCtx->drainStartTime;
+   }
+
+   decCtx->videoOutThreadStarted= false;
+   iprintf(3,"videoOutputThread: exit\n");
+
+   return 0;
+}
+
+static void *videoInputThread( void *arg )
+{
+   DecCtx *decCtx= (DecCtx*)arg;
+   V4l2Ctx *v4l2= &decCtx->v4l2;
+
+   iprintf(3,"videoInputThread: enter\n");
+   TimelineNameThread( "decoder %d input", decCtx->decodeIndex );
+   decCtx->videoInThreadStarted= true;
+
+   playFile( decCtx );
+
+   decCtx->videoInThreadStarted= false;
+   iprintf(3,"videoInputThread: exit\n");
+
+   return 0;
+}
+
+static void *videoDecodeThread( void *arg )
+{
+   DecCtx *decCtx= (DecCtx*)arg;
+   AppCtx *appCtx= decCtx->appCtx;
+   EGLCtx *egl= &appCtx->egl;
+   GLCtx *gl= &appCtx->gl;
+   Surface *surface= decCtx->surface;
+   Async *async= decCtx->async;
+   int lastFrameCount= 0;
+   long long lastProgressTime= 0, now;
+   EGLSyncKHR prevFrameSync, currFrameSync;
+   bool inThreadJoined= false;
+   bool stalled= false;
+
+   iprintf(3,"videoDecodeThread: enter\n");
+   TimelineNameThread( "decoder %d frames", decCtx->decodeIndex );
+   decCtx->videoDecodeThreadStarted= true;
+
+   while ( decCtx->playing )
+   {
+      usleep( 8000 );
+
+      if ( updateFrame( decCtx, surface ) )
+      {
+         if ( surface )
+         {
+            surface->dirty= true;
+         }
+      }
+
+      now= getCurrentTimeMillis();
+      if ( !decCtx->videoOutThreadStarted || (decCtx->outputFrameCount != lastFrameCount) )
+      {
+         lastFrameCount= decCtx->outputFrameCount;
+         lastProgressTime= now;
+      }
+      else if ( !decCtx->videoInThreadStopRequested && (now-lastProgressTime > DECODE_STALL_TIMEOUT_MS) )
+      {
+         iprintf(0,"Error: decoder %d stalled: no output for %d ms after %d frames\n", decCtx->decodeIndex, DECODE_STALL_TIMEOUT_MS, decCtx->outputFrameCount);
+         stalled= true;
+         decCtx->playing= false;
+         break;
+      }
+
+      if ( !decCtx->videoInThreadStopRequested && !decCtx->drainRequested && (decCtx->outputFrameCount == decCtx->numFramesToDecode) )
+      {
+         iprintf(0,"%lld: decoder %d decoded %d frames\n", getCurrentTimeMillis(), decCtx->decodeIndex, decCtx->outputFrameCount );
+         if ( decCtx->v4l2.canDrain )
+         {
+            /* Input thread stops feeding and issues V4L2_DEC_CMD_STOP, output thread runs to the last buffer */
+            decCtx->drainRequested= true;
+         }
+         else
+         {
+            decCtx->videoInThreadStopRequested= true;
+         }
+      }
+      if ( decCtx->drainRequested && !decCtx->videoInThreadStopRequested )
+      {
+         if ( decCtx->drainDone && !decCtx->videoOutThreadStarted )
+         {
+            iprintf(1,"%lld: decoder %d drained\n", getCurrentTimeMillis(), decCtx->decodeIndex );
+            decCtx->videoInThreadStopRequested= true;
+         }
+         else if ( decCtx->drainStartTime && (getMonotonicTimeMicros()-decCtx->drainStartTime > DRAIN_TIMEOUT_MS*1000LL) )
+         {
+            iprintf(0,"Warning: decoder %d drain timed out after %d ms\n", decCtx->decodeIndex, DRAIN_TIMEOUT_MS );
+            decCtx->videoInThreadStopRequested= true;
+         }
+      }
+      if ( decCtx->videoInThreadStopRequested && !decCtx->videoInThreadStarted && !inThreadJoined )
+      {
+         pthread_join( decCtx->videoInThreadId, NULL );
+         inThreadJoined= true;
+         decCtx->videoOutThreadStopRequested= true;
+      }
+      if ( decCtx->videoOutThreadStopRequested && !decCtx->videoOutThreadStarted )
+      {
+         if ( surface )
+         {
+            pthread_mutex_lock( &decCtx->mutex );
+            for( int i= 0; i < MAX_TEXTURES; ++i )
+            {
+               if ( surface->eglImage[i] )
+               {
+                  gl->eglDestroyImageKHR( egl->eglDisplay, surface->eglImage[i] );
+                  surface->eglImage[i]= 0;
+               }
+               if ( surface->textureId[i] != GL_NONE )
+               {
+                  glDeleteTextures( 1, &surface->textureId[i] );
+                  surface->textureId[i]= GL_NONE;
+               }
+            }
+            pthread_mutex_unlock( &decCtx->mutex );
+         }
+         break;
+      }
+   }
+
+   /* Leaving early, as on a stall, the input thread may still be using the buffers about to be freed */
+   decCtx->videoInThreadStopRequested= true;
+   if ( !inThreadJoined )
+   {
+      while( decCtx->videoInThreadStarted )
+      {
+         usleep( 1000 );
+      }
+      pthread_join( decCtx->videoInThreadId, NULL );
+      inThreadJoined= true;
+   }
+   decCtx->videoOutThreadStopRequested= true;
+
+   /* The output thread polls with a timeout so it can be joined before its buffers are torn down */
+   if ( decCtx->videoOutThreadStarted )
+   {
+      pthread_join( decCtx->videoOutThreadId, NULL );
+   }
+
+   pthread_mutex_lock( &decCtx->mutex );
+   prevFrameSync= decCtx->prevFrameSync;
+   currFrameSync= decCtx->currFrameSync;
+   decCtx->prevFrameSync= EGL_NO_SYNC_KHR;
+   decCtx->currFrameSync= EGL_NO_SYNC_KHR;
+   pthread_mutex_unlock( &decCtx->mutex );
+   waitFrameSync( decCtx, prevFrameSync );
+   waitFrameSync( decCtx, currFrameSync );
+
+   releaseHeldCapture( decCtx );
+
+   termV4l2( &decCtx->v4l2 );
+
+   decCtx->videoDecodeThreadStarted= false;
+   iprintf(3,"videoDecodeThread: exit\n");
+
+   /* Only once torn down, as an error lets runUntilDone move on and destroy the decoder mutex */
+   if ( stalled )
+   {
+      async->error= true;
+   }
+   async->done= true;
+
+   return 0;
+}
+
+static const unsigned char gZigzag4x4[16]=
+{
+   0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15
+};
+
+static const unsigned char gZigzag8x8[64]=
+{
+   0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+   12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+   35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+   58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const unsigned char gDefault4x4Intra[16]=
+{
+   6, 13, 13, 20, 20, 20, 28, 28, 28, 28, 32, 32, 32, 37, 37, 42
+};
+
+static const unsigned char gDefault4x4Inter[16]=
+{
+   10, 14, 14, 20, 20, 20, 24, 24, 24, 24, 27, 27, 27, 30, 30, 34
+};
+
+static const unsigned char gDefault8x8Intra[64]=
+{
+   6, 10, 10, 13, 11, 13, 16, 16, 16, 16, 18, 18, 18, 18, 18, 23,
+   23, 23, 23, 23, 23, 25, 25, 25, 25, 25, 25, 25, 27, 27, 27, 27,
+   27, 27, 27, 27, 29, 29, 29, 29, 29, 29, 29, 31, 31, 31, 31, 31,
+   31, 33, 33, 33, 33, 33, 36, 36, 36, 36, 38, 38, 38, 40, 40, 42
+};
+
+static const unsigned char gDefault8x8Inter[64]=
+{
+   9, 13, 13, 15, 13, 15, 17, 17, 17, 17, 19, 19, 19, 19, 19, 21,
+   21, 21, 21, 21, 21, 22, 22, 22, 22, 22, 22, 22, 24, 24, 24, 24,
+   24, 24, 24, 24, 25, 25, 25, 25, 25, 25, 25, 27, 27, 27, 27, 27,
+   27, 28, 28, 28, 28, 28, 30, 30, 30, 30, 32, 32, 32, 33, 33, 35
+};
+
+static int nextNal( const unsigned char *data, int length, int offset, int *nalStart, int *nalLength )
+{
+   int i, start= -1;
+
+   for( i= offset; i+3 <= length; ++i )
+   {
+      if ( (data[i] == 0) && (data[i+1] == 0) && (data[i+2] == 1) )
+      {
+         start= i+3;
+         break;
+      }
+   }
+   if ( start < 0 )
+   {
+      return -1;
+   }
+
+   for( i= start; i+3 <= length; ++i )
+   {
+      if ( (data[i] == 0) && (data[i+1] == 0) && ((data[i+2] == 1) || ((data[i+2] == 0) && (i+3 < length) && (data[i+3] == 1))) )
+      {
+         break;
+      }
+   }
+   if ( i+3 > length )
+   {
+      i= length;
+   }
+
+   *nalStart= start;
+   *nalLength= i-start;
+
+   return i;
+}
+
+static void h264ParseScalingList( BitReader *br, unsigned char *list, int size, bool *useDefault )
+{
+   int j, lastScale= 8, nextScale= 8;
+
+   *useDefault= false;
+   for( j= 0; j < size; ++j )
+   {
+      if ( nextScale != 0 )
+      {
+         nextScale= (lastScale + bitReaderGetSE( br ) + 256) % 256;
+         *useDefault= ((j == 0) && (nextScale == 0));
+      }
+      list[j]= (nextScale == 0) ? lastScale : nextScale;
+      lastScale= list[j];
+   }
+}
+
+static void h264ParseScalingLists( BitReader *br, H264ScalingLists *lists, int count, H264ScalingLists *fallback )
+{
+   bool useDefault;
+   int i;
+
+   /* Lists are kept in bitstream (zigzag) order until they are loaded into the control */
+   lists->present= true;
+   for( i= 0; i < count; ++i )
+   {
+      bool listPresent= bitReaderGetBits( br, 1 );
+      if ( i < 6 )
+      {
+         if ( listPresent )
+         {
+            h264ParseScalingList( br, lists->list4x4[i], 16, &useDefault );
+            if ( useDefault )
+            {
+               memcpy( lists->list4x4[i], (i < 3) ? gDefault4x4Intra : gDefault4x4Inter, 16 );
+            }
+         }
+         else if ( (i == 0) || (i == 3) )
+         {
+            /* Fall-back rule A uses the defaults, rule B the sequence level lists */
+            if ( fallback )
+               memcpy( lists->list4x4[i], fallback->list4x4[i], 16 );
+            else
+               memcpy( lists->list4x4[i], (i == 0) ? gDefault4x4Intra : gDefault4x4Inter, 16 );
+         }
+         else
+         {
+            memcpy( lists->list4x4[i], lists->list4x4[i-1], 16 );
+         }
+      }
+      else
+      {
+         int j= i-6;
+         if ( listPresent )
+         {
+            h264ParseScalingList( br, lists->list8x8[j], 64, &useDefault );
+            if ( useDefault )
+            {
+               memcpy( lists->list8x8[j], (j % 2) ? gDefault8x8Inter : gDefault8x8Intra, 64 );
+            }
+         }
+         else if ( j < 2 )
+         {
+            if ( fallback )
+               memcpy( lists->list8x8[j], fallback->list8x8[j], 64 );
+            else
+               memcpy( lists->list8x8[j], (j == 0) ? gDefault8x8Intra : gDefault8x8Inter, 64 );
+         }
+         else
+         {
+            memcpy( lists->list8x8[j], lists->list8x8[j-2], 64 );
+         }
+      }
+   }
+   for( ; i < 12; ++i )
+   {
+      int j= i-6;
+      if ( j < 2 )
+      {
+         if ( fallback )
+            memcpy( lists->list8x8[j], fallback->list8x8[j], 64 );
+         else
+            memcpy( lists->list8x8[j], (j == 0) ? gDefault8x8Intra : gDefault8x8Inter, 64 );
+      }
+      else
+      {
+         memcpy( lists->list8x8[j], lists->list8x8[j-2], 64 );
+      }
+   }
+}
+
+static bool h264ParseSps( H264Ctx *h264, const unsigned char *data, int length )
+{
+   bool result= false;
+   BitReader br;
+   struct v4l2_ctrl_h264_sps sps;
+   H264ScalingLists scaling;
+   unsigned int constraints, value;
+   int i;
+
+   memset( &sps, 0, sizeof(sps) );
+   memset( &scaling, 0, sizeof(scaling) );
+
+   bitReaderInit( &br, data+1, length-1 );
+   sps.profile_idc= bitReaderGetBits( &br, 8 );
+   constraints= bitReaderGetBits( &br, 8 );
+   for( i= 0; i < 6; ++i )
+   {
+      if ( constraints & (0x80 >> i) )
+      {
+         sps.constraint_set_flags |= (1 << i);
+      }
+   }
+   sps.level_idc= bitReaderGetBits( &br, 8 );
+   value= bitReaderGetUE( &br );
+   if ( value >= H264_MAX_SPS )
+   {
+      iprintf(0,"Error: h264ParseSps: bad sps id %u\n", value);
+      goto exit;
+   }
+   sps.seq_parameter_set_id= value;
+
+   sps.chroma_format_idc= 1;
+   if ( V4L2_H264_SPS_HAS_CHROMA_FORMAT(&sps) )
+   {
+      sps.chroma_format_idc= bitReaderGetUE( &br );
+      if ( sps.chroma_format_idc == 3 )
+      {
+         if ( bitReaderGetBits( &br, 1 ) ) sps.flags |= V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE;
+      }
+      sps.bit_depth_luma_minus8= bitReaderGetUE( &br );
+      sps.bit_depth_chroma_minus8= bitReaderGetUE( &br );
+      if ( bitReaderGetBits( &br, 1 ) ) sps.flags |= V4L2_H264_SPS_FLAG_QPPRIME_Y_ZERO_TRANSFORM_BYPASS;
+      if ( bitReaderGetBits( &br, 1 ) )
+      {
+         h264ParseScalingLists( &br, &scaling, (sps.chroma_format_idc != 3) ? 8 : 12, 0 );
+      }
+   }
+
+   value= bitReaderGetUE( &br );
+   if ( value > 12 )
+   {
+      iprintf(0,"Error: h264ParseSps: bad log2_max_frame_num_minus4 %u\n", value);
+      goto exit;
+   }
+   sps.log2_max_frame_num_minus4= value;
+   value= bitReaderGetUE( &br );
+   if ( value > 2 )
+   {
+      iprintf(0,"Error: h264ParseSps: bad pic_order_cnt_type %u\n", value);
+      goto exit;
+   }
+   sps.pic_order_cnt_type= value;
+   if ( sps.pic_order_cnt_type == 0 )
+   {
+      value= bitReaderGetUE( &br );
+      if ( value > 12 )
+      {
+         iprintf(0,"Error: h264ParseSps: bad log2_max_pic_order_cnt_lsb_minus4 %u\n", value);
+         goto exit;
+      }
+      sps.log2_max_pic_order_cnt_lsb_minus4= value;
+   }
+   else if ( sps.pic_order_cnt_type == 1 )
+   {
+      if ( bitReaderGetBits( &br, 1 ) ) sps.flags |= V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO;
+      sps.offset_for_non_ref_pic= bitReaderGetSE( &br );
+      sps.offset_for_top_to_bottom_field= bitReaderGetSE( &br );
+      value= bitReaderGetUE( &br );
+      if ( value > 255 )
+      {
+         iprintf(0,"Error: h264ParseSps: bad num_ref_frames_in_pic_order_cnt_cycle %u\n", value);
+         goto exit;
+      }
+      sps.num_ref_frames_in_pic_order_cnt_cycle= value;
+      for( i= 0; i < sps.num_ref_frames_in_pic_order_cnt_cycle; ++i )
+      {
+         sps.offset_for_ref_frame[i]= bitReaderGetSE( &br );
+      }
+   }
+   value= bitReaderGetUE( &br );
+   if ( value > V4L2_H264_NUM_DPB_ENTRIES )
+   {
+      iprintf(0,"Error: h264ParseSps: bad max_num_ref_frames %u\n", value);
+      goto exit;
+   }
+   sps.max_num_ref_frames= value;
+   if ( bitReaderGetBits( &br, 1 ) ) sps.flags |= V4L2_H264_SPS_FLAG_GAPS_IN_FRAME_NUM_VALUE_ALLOWED;
+   sps.pic_width_in_mbs_minus1= bitReaderGetUE( &br );
+   sps.pic_height_in_map_units_minus1= bitReaderGetUE( &br );
+   if ( bitReaderGetBits( &br, 1 ) )
+   {
+      sps.flags |= V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY;
+   }
+   else
+   {
+      if ( bitReaderGetBits( &br, 1 ) ) sps.flags |= V4L2_H264_SPS_FLAG_MB_ADAPTIVE_FRAME_FIELD;
+   }
+   if ( bitReaderGetBits( &br, 1 ) ) sps.flags |= V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE;
+
+   if ( br.overrun )
+   {
+      iprintf(0,"Error: h264ParseSps: truncated sps\n");
+      goto exit;
+   }
+
+   h264->sps[sps.seq_parameter_set_id]= sps;
+   h264->spsScaling[sps.seq_parameter_set_id]= scaling;
+   h264->haveSps[sps.seq_parameter_set_id]= true;
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static bool h264ParsePps( H264Ctx *h264, const unsigned char *data, int length )
+{
+   bool result= false;
+   BitReader br;
+   struct v4l2_ctrl_h264_pps pps;
+   H264ScalingLists scaling;
+   struct v4l2_ctrl_h264_sps *sps;
+   unsigned int value;
+
+   memset( &pps, 0, sizeof(pps) );
+   memset( &scaling, 0, sizeof(scaling) );
+
+   bitReaderInit( &br, data+1, length-1 );
+   value= bitReaderGetUE( &br );
+   if ( value >= H264_MAX_PPS )
+   {
+      iprintf(0,"Error: h264ParsePps: bad pps id %u\n", value);
+      goto exit;
+   }
+   pps.pic_parameter_set_id= value;
+   value= bitReaderGetUE( &br );
+   if ( (value >= H264_MAX_SPS) || !h264->haveSps[value] )
+   {
+      iprintf(0,"Error: h264ParsePps: pps %d refers to unknown sps %u\n", pps.pic_parameter_set_id, value);
+      goto exit;
+   }
+   pps.seq_parameter_set_id= value;
+   sps= &h264->sps[pps.seq_parameter_set_id];
+
+   if ( bitReaderGetBits( &br, 1 ) ) pps.flags |= V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE;
+   if ( bitReaderGetBits( &br, 1 ) ) pps.flags |= V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT;
+   pps.num_slice_groups_minus1= bitReaderGetUE( &br );
+   if ( pps.num_slice_groups_minus1 )
+   {
+      iprintf(0,"Error: h264ParsePps: slice groups (FMO) are not supported\n");
+      goto exit;
+   }
+   pps.num_ref_idx_l0_default_active_minus1= bitReaderGetUE( &br );
+   pps.num_ref_idx_l1_default_active_minus1= bitReaderGetUE( &br );
+   if ( bitReaderGetBits( &br, 1 ) ) pps.flags |= V4L2_H264_PPS_FLAG_WEIGHTED_PRED;
+   pps.weighted_bipred_idc= bitReaderGetBits( &br, 2 );
+   pps.pic_init_qp_minus26= bitReaderGetSE( &br );
+   pps.pic_init_qs_minus26= bitReaderGetSE( &br );
+   pps.chroma_qp_index_offset= bitReaderGetSE( &br );
+   if ( bitReaderGetBits( &br, 1 ) ) pps.flags |= V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT;
+   if ( bitReaderGetBits( &br, 1 ) ) pps.flags |= V4L2_H264_PPS_FLAG_CONSTRAINED_INTRA_PRED;
+   if ( bitReaderGetBits( &br, 1 ) ) pps.flags |= V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT;
+   pps.second_chroma_qp_index_offset= pps.chroma_qp_index_offset;
+   if ( bitReaderMoreData( &br ) )
+   {
+      bool transform8x8= bitReaderGetBits( &br, 1 );
+      if ( transform8x8 ) pps.flags |= V4L2_H264_PPS_FLAG_TRANSFORM_8X8_MODE;
+      if ( bitReaderGetBits( &br, 1 ) )
+      {
+         H264ScalingLists *fallback= &h264->spsScaling[pps.seq_parameter_set_id];
+         pps.flags |= V4L2_H264_PPS_FLAG_SCALING_MATRIX_PRESENT;
+         h264ParseScalingLists( &br, &scaling,
+                                6 + (transform8x8 ? ((sps->chroma_format_idc != 3) ? 2 : 6) : 0),
+                                fallback->present ? fallback : 0 );
+      }
+      pps.second_chroma_qp_index_offset= bitReaderGetSE( &br );
+   }
+
+   if ( br.overrun )
+   {
+      iprintf(0,"Error: h264ParsePps: truncated pps\n");
+      goto exit;
+   }
+
+   h264->pps[pps.pic_parameter_set_id]= pps;
+   h264->ppsScaling[pps.pic_parameter_set_id]= scaling;
+   h264->havePps[pps.pic_parameter_set_id]= true;
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static bool h264ParseRefPicListModification( BitReader *br )
+{
+   unsigned int idc;
+
+   if ( bitReaderGetBits( br, 1 ) )
+   {
+      for( ; ; )
+      {
+         idc= bitReaderGetUE( br );
+         if ( (idc == 3) || br->overrun )
+         {
+            break;
+         }
+         bitReaderGetUE( br );
+      }
+   }
+
+   return !br->overrun;
+}
+
+static void h264SkipPredWeightTable( BitReader *br, struct v4l2_ctrl_h264_sps *sps, int numL0, int numL1, bool isB )
+{
+   int chromaArrayType, list, i;
+
+   chromaArrayType= (sps->flags & V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE) ? 0 : sps->chroma_format_idc;
+
+   bitReaderGetUE( br );
+   if ( chromaArrayType )
+   {
+      bitReaderGetUE( br );
+   }
+   for( list= 0; list < (isB ? 2 : 1); ++list )
+   {
+      int count= (list == 0) ? numL0 : numL1;
+      for( i= 0; i < count; ++i )
+      {
+         if ( bitReaderGetBits( br, 1 ) )
+         {
+            bitReaderGetSE( br );
+            bitReaderGetSE( br );
+         }
+         if ( chromaArrayType && bitReaderGetBits( br, 1 ) )
+         {
+            bitReaderGetSE( br );
+            bitReaderGetSE( br );
+            bitReaderGetSE( br );
+            bitReaderGetSE( br );
+         }
+      }
+   }
+}
+
+static bool h264ParseSliceHeader( H264Ctx *h264, const unsigned char *data, int length, int *ppsId )
+{
+   bool result= false;
+   struct v4l2_ctrl_h264_decode_params *dp= &h264->decode;
+   struct v4l2_ctrl_h264_sps *sps;
+   struct v4l2_ctrl_h264_pps *pps;
+   BitReader br;
+   int nalType, sliceType, pos;
+   int numL0, numL1;
+   unsigned int value;
+
+   nalType= data[0] & 0x1F;
+   dp->nal_ref_idc= (data[0] >> 5) & 0x3;
+   if ( nalType == 5 )
+   {
+      dp->flags |= V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC;
+   }
+
+   bitReaderInit( &br, data+1, length-1 );
+   bitReaderGetUE( &br );
+   sliceType= bitReaderGetUE( &br ) % 5;
+   value= bitReaderGetUE( &br );
+   if ( (value >= H264_MAX_PPS) || !h264->havePps[value] )
+   {
+      iprintf(0,"Error: h264ParseSliceHeader: slice refers to unknown pps %u\n", value);
+      goto exit;
+   }
+   *ppsId= value;
+   pps= &h264->pps[value];
+   sps= &h264->sps[pps->seq_parameter_set_id];
+
+   if ( sps->flags & V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE )
+   {
+      bitReaderGetBits( &br, 2 );
+   }
+   dp->frame_num= bitReaderGetBits( &br, sps->log2_max_frame_num_minus4+4 );
+   if ( !(sps->flags & V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY) )
+   {
+      if ( bitReaderGetBits( &br, 1 ) )
+      {
+         iprintf(0,"Error: h264ParseSliceHeader: field pictures are not supported\n");
+         goto exit;
+      }
+   }
+   if ( nalType == 5 )
+   {
+      dp->idr_pic_id= bitReaderGetUE( &br );
+   }
+
+   pos= bitReaderBitPos( &br );
+   if ( sps->pic_order_cnt_type == 0 )
+   {
+      dp->pic_order_cnt_lsb= bitReaderGetBits( &br, sps->log2_max_pic_order_cnt_lsb_minus4+4 );
+      if ( pps->flags & V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT )
+      {
+         dp->delta_pic_order_cnt_bottom= bitReaderGetSE( &br );
+      }
+   }
+   else if ( (sps->pic_order_cnt_type == 1) && !(sps->flags & V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO) )
+   {
+      dp->delta_pic_order_cnt0= bitReaderGetSE( &br );
+      if ( pps->flags & V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT )
+      {
+         dp->delta_pic_order_cnt1= bitReaderGetSE( &br );
+      }
+   }
+   dp->pic_order_cnt_bit_size= bitReaderBitPos( &br )-pos;
+
+   if ( pps->flags & V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT )
+   {
+      bitReaderGetUE( &br );
+   }
+   if ( sliceType == V4L2_H264_SLICE_TYPE_B )
+   {
+      bitReaderGetBits( &br, 1 );
+   }
+   numL0= pps->num_ref_idx_l0_default_active_minus1+1;
+   numL1= pps->num_ref_idx_l1_default_active_minus1+1;
+   if ( (sliceType == V4L2_H264_SLICE_TYPE_P) || (sliceType == V4L2_H264_SLICE_TYPE_SP) || (sliceType == V4L2_H264_SLICE_TYPE_B) )
+   {
+      if ( bitReaderGetBits( &br, 1 ) )
+      {
+         numL0= bitReaderGetUE( &br )+1;
+         if ( sliceType == V4L2_H264_SLICE_TYPE_B )
+         {
+            numL1= bitReaderGetUE( &br )+1;
+         }
+      }
+   }
+   if ( (sliceType != V4L2_H264_SLICE_TYPE_I) && (sliceType != V4L2_H264_SLICE_TYPE_SI) )
+   {
+      h264ParseRefPicListModification( &br );
+      if ( sliceType == V4L2_H264_SLICE_TYPE_B )
+      {
+         h264ParseRefPicListModification( &br );
+      }
+   }
+   if ( ((pps->flags & V4L2_H264_PPS_FLAG_WEIGHTED_PRED) && ((sliceType == V4L2_H264_SLICE_TYPE_P) || (sliceType == V4L2_H264_SLICE_TYPE_SP))) ||
+        ((pps->weighted_bipred_idc == 1) && (sliceType == V4L2_H264_SLICE_TYPE_B)) )
+   {
+      h264SkipPredWeightTable( &br, sps, numL0, numL1, (sliceType == V4L2_H264_SLICE_TYPE_B) );
+   }
+
+   h264->longTermReference= false;
+   h264->adaptiveRefPicMarking= false;
+   h264->mmcoCount= 0;
+   if ( dp->nal_ref_idc )
+   {
+      pos= bitReaderBitPos( &br );
+      if ( nalType == 5 )
+      {
+         bitReaderGetBits( &br, 1 );
+         h264->longTermReference= bitReaderGetBits( &br, 1 );
+      }
+      else
+      {
+         h264->adaptiveRefPicMarking= bitReaderGetBits( &br, 1 );
+         while( h264->adaptiveRefPicMarking && !br.overrun )
+         {
+            H264Mmco *mmco;
+            value= bitReaderGetUE( &br );
+            if ( value == 0 )
+            {
+               break;
+            }
+            if ( h264->mmcoCount >= H264_MAX_MMCO )
+            {
+               iprintf(0,"Error: h264ParseSliceHeader: too many memory management operations\n");
+               goto exit;
+            }
+            mmco= &h264->mmco[h264->mmcoCount++];
+            memset( mmco, 0, sizeof(H264Mmco) );
+            mmco->op= value;
+            if ( (value == 1) || (value == 3) )
+            {
+               mmco->differenceOfPicNumsMinus1= bitReaderGetUE( &br );
+            }
+            if ( value == 2 )
+            {
+               mmco->longTermPicNum= bitReaderGetUE( &br );
+            }
+            if ( (value == 3) || (value == 6) )
+            {
+               mmco->longTermFrameIdx= bitReaderGetUE( &br );
+            }
+            if ( value == 4 )
+            {
+               mmco->maxLongTermFrameIdxPlus1= bitReaderGetUE( &br );
+            }
+         }
+      }
+      dp->dec_ref_pic_marking_bit_size= bitReaderBitPos( &br )-pos;
+   }
+
+   if ( br.overrun )
+   {
+      iprintf(0,"Error: h264ParseSliceHeader: truncated slice header\n");
+      goto exit;
+   }
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static void h264ComputePoc( H264Ctx *h264, struct v4l2_ctrl_h264_sps *sps )
+{
+   struct v4l2_ctrl_h264_decode_params *dp= &h264->decode;
+   bool isIdr= (dp->flags & V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC);
+   int maxFrameNum= 1 << (sps->log2_max_frame_num_minus4+4);
+   int frameNumOffset= 0;
+   int i;
+
+   if ( !isIdr )
+   {
+      frameNumOffset= h264->prevHadMmco5 ? 0 : h264->prevFrameNumOffset;
+      if ( h264->prevFrameNum > dp->frame_num )
+      {
+         frameNumOffset += maxFrameNum;
+      }
+   }
+
+   if ( sps->pic_order_cnt_type == 0 )
+   {
+      int maxPocLsb= 1 << (sps->log2_max_pic_order_cnt_lsb_minus4+4);
+      int lsb= dp->pic_order_cnt_lsb;
+      int prevMsb= isIdr ? 0 : h264->prevPocMsb;
+      int prevLsb= isIdr ? 0 : h264->prevPocLsb;
+      int msb;
+
+      if ( (lsb < prevLsb) && ((prevLsb-lsb) >= maxPocLsb/2) )
+         msb= prevMsb+maxPocLsb;
+      else if ( (lsb > prevLsb) && ((lsb-prevLsb) > maxPocLsb/2) )
+         msb= prevMsb-maxPocLsb;
+      else
+         msb= prevMsb;
+
+      dp->top_field_order_cnt= msb+lsb;
+      dp->bottom_field_order_cnt= dp->top_field_order_cnt+dp->delta_pic_order_cnt_bottom;
+      if ( dp->nal_ref_idc )
+      {
+         h264->prevPocMsb= msb;
+         h264->prevPocLsb= lsb;
+      }
+   }
+   else if ( sps->pic_order_cnt_type == 1 )
+   {
+      int cycleLength= sps->num_ref_frames_in_pic_order_cnt_cycle;
+      int absFrameNum= 0, expectedPoc= 0, expectedDeltaPerCycle= 0;
+
+      if ( cycleLength )
+      {
+         absFrameNum= frameNumOffset+dp->frame_num;
+      }
+      if ( !dp->nal_ref_idc && (absFrameNum > 0) )
+      {
+         --absFrameNum;
+      }
+      for( i= 0; i < cycleLength; ++i )
+      {
+         expectedDeltaPerCycle += sps->offset_for_ref_frame[i];
+      }
+      if ( absFrameNum > 0 )
+      {
+         int cycleCount= (absFrameNum-1)/cycleLength;
+         int inCycle= (absFrameNum-1)%cycleLength;
+         expectedPoc= cycleCount*expectedDeltaPerCycle;
+         for( i= 0; i <= inCycle; ++i )
+         {
+            expectedPoc += sps->offset_for_ref_frame[i];
+         }
+      }
+      if ( !dp->nal_ref_idc )
+      {
+         expectedPoc += sps->offset_for_non_ref_pic;
+      }
+      dp->top_field_order_cnt= expectedPoc+dp->delta_pic_order_cnt0;
+      dp->bottom_field_order_cnt= dp->top_field_order_cnt+sps->offset_for_top_to_bottom_field+dp->delta_pic_order_cnt1;
+   }
+   else
+   {
+      int tempPoc= 0;
+      if ( !isIdr )
+      {
+         tempPoc= 2*(frameNumOffset+dp->frame_num);
+         if ( !dp->nal_ref_idc )
+         {
+            --tempPoc;
+         }
+      }
+      dp->top_field_order_cnt= tempPoc;
+      dp->bottom_field_order_cnt= tempPoc;
+   }
+
+   h264->prevFrameNumOffset= frameNumOffset;
+   h264->prevFrameNum= dp->frame_num;
+   h264->prevHadMmco5= false;
+}
+
+static int h264PicNum( H264Ref *ref, int currFrameNum, int maxFrameNum )
+{
+   if ( ref->longTerm )
+   {
+      return ref->longTermFrameIdx;
+   }
+
+   return (ref->frameNum > currFrameNum) ? ref->frameNum-maxFrameNum : ref->frameNum;
+}
+
+static void h264BuildDpb( H264Ctx *h264, struct v4l2_ctrl_h264_sps *sps )
+{
+   struct v4l2_ctrl_h264_decode_params *dp= &h264->decode;
+   int maxFrameNum= 1 << (sps->log2_max_frame_num_minus4+4);
+   int i, n= 0;
+
+   memset( dp->dpb, 0, sizeof(dp->dpb) );
+   for( i= 0; i < V4L2_H264_NUM_DPB_ENTRIES; ++i )
+   {
+      H264Ref *ref= &h264->refs[i];
+      if ( ref->used )
+      {
+         struct v4l2_h264_dpb_entry *entry= &dp->dpb[n++];
+         entry->reference_ts= ref->ts;
+         entry->frame_num= ref->frameNum;
+         entry->pic_num= h264PicNum( ref, dp->frame_num, maxFrameNum );
+         entry->fields= V4L2_H264_FRAME_REF;
+         entry->top_field_order_cnt= ref->topPoc;
+         entry->bottom_field_order_cnt= ref->bottomPoc;
+         entry->flags= V4L2_H264_DPB_ENTRY_FLAG_VALID | V4L2_H264_DPB_ENTRY_FLAG_ACTIVE;
+         if ( ref->longTerm )
+         {
+            entry->flags |= V4L2_H264_DPB_ENTRY_FLAG_LONG_TERM;
+         }
+      }
+   }
+}
+
+static void h264MarkReferences( H264Ctx *h264, struct v4l2_ctrl_h264_sps *sps, uint64_t ts )
+{
+   struct v4l2_ctrl_h264_decode_params *dp= &h264->decode;
+   int maxFrameNum= 1 << (sps->log2_max_frame_num_minus4+4);
+   bool currentIsLongTerm= false;
+   int currentLongTermFrameIdx= 0;
+   int i, k, slot;
+
+   if ( !dp->nal_ref_idc )
+   {
+      return;
+   }
+
+   if ( dp->flags & V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC )
+   {
+      for( i= 0; i < V4L2_H264_NUM_DPB_ENTRIES; ++i )
+      {
+         h264->refs[i].used= false;
+      }
+      if ( h264->longTermReference )
+      {
+         currentIsLongTerm= true;
+         currentLongTermFrameIdx= 0;
+         h264->maxLongTermFrameIdx= 0;
+      }
+      else
+      {
+         h264->maxLongTermFrameIdx= -1;
+      }
+   }
+   else if ( h264->adaptiveRefPicMarking )
+   {
+      for( k= 0; k < h264->mmcoCount; ++k )
+      {
+         H264Mmco *mmco= &h264->mmco[k];
+         int picNumX= dp->frame_num-(mmco->differenceOfPicNumsMinus1+1);
+         for( i= 0; i < V4L2_H264_NUM_DPB_ENTRIES; ++i )
+         {
+            H264Ref *ref= &h264->refs[i];
+            if ( !ref->used )
+            {
+               continue;
+            }
+            switch( mmco->op )
+            {
+               case 1:
+                  if ( !ref->longTerm && (h264PicNum( ref, dp->frame_num, maxFrameNum ) == picNumX) ) ref->used= false;
+                  break;
+               case 2:
+                  if ( ref->longTerm && (ref->longTermFrameIdx == mmco->longTermPicNum) ) ref->used= false;
+                  break;
+               case 3:
+                  if ( ref->longTerm && (ref->longTermFrameIdx == mmco->longTermFrameIdx) ) ref->used= false;
+                  break;
+               case 4:
+                  if ( ref->longTerm && (ref->longTermFrameIdx >= mmco->maxLongTermFrameIdxPlus1) ) ref->used= false;
+                  break;
+               case 5:
+                  ref->used= false;
+                  break;
+               case 6:
+                  if ( ref->longTerm && (ref->longTermFrameIdx == mmco->longTermFrameIdx) ) ref->used= false;
+                  break;
+            }
+         }
+         if ( mmco->op == 3 )
+         {
+            for( i= 0; i < V4L2_H264_NUM_DPB_ENTRIES; ++i )
+            {
+               H264Ref *ref= &h264->refs[i];
+               if ( ref->used && !ref->longTerm && (h264PicNum( ref, dp->frame_num, maxFrameNum ) == picNumX) )
+               {
+                  ref->longTerm= true;
+                  ref->longTermFrameIdx= mmco->longTermFrameIdx;
+               }
+            }
+         }
+         else if ( mmco->op == 4 )
+         {
+            h264->maxLongTermFrameIdx= mmco->maxLongTermFrameIdxPlus1-1;
+         }
+         else if ( mmco->op == 5 )
+         {
+            /* The current picture is treated as frame_num 0 with its POC rebased */
+            h264->maxLongTermFrameIdx= -1;
+            h264->prevHadMmco5= true;
+            h264->prevFrameNum= 0;
+            h264->prevPocMsb= 0;
+            h264->prevPocLsb= dp->top_field_order_cnt-((dp->top_field_order_cnt < dp->bottom_field_order_cnt) ? dp->top_field_order_cnt : dp->bottom_field_order_cnt);
+            ++h264->epoch;
+         }
+         else if ( mmco->op == 6 )
+         {
+            currentIsLongTerm= true;
+            currentLongTermFrameIdx= mmco->longTermFrameIdx;
+         }
+      }
+   }
+   else
+   {
+      int numShort= 0, numLong= 0, maxRefs;
+
+      /* Sliding window */
+      maxRefs= (sps->max_num_ref_frames > 0) ? sps->max_num_ref_frames : 1;
+      for( i= 0; i < V4L2_H264_NUM_DPB_ENTRIES; ++i )
+      {
+         if ( h264->refs[i].used )
+         {
+            if ( h264->refs[i].longTerm ) ++numLong; else ++numShort;
+         }
+      }
+      if ( (numShort+numLong >= maxRefs) && numShort )
+      {
+         int oldest= -1;
+         for( i= 0; i < V4L2_H264_NUM_DPB_ENTRIES; ++i )
+         {
+            H264Ref *ref= &h264->refs[i];
+            if ( ref->used && !ref->longTerm )
+            {
+               if ( (oldest < 0) ||
+                    (h264PicNum( ref, dp->frame_num, maxFrameNum ) < h264PicNum( &h264->refs[oldest], dp->frame_num, maxFrameNum )) )
+               {
+                  oldest= i;
+               }
+            }
+         }
+         h264->refs[oldest].used= false;
+      }
+   }
+
+   slot= -1;
+   for( i= 0; i < V4L2_H264_NUM_DPB_ENTRIES; ++i )
+   {
+      if ( !h264->refs[i].used )
+      {
+         slot= i;
+         break;
+      }
+   }
+   if ( slot < 0 )
+   {
+      iprintf(0,"Warning: h264MarkReferences: dpb full, dropping oldest reference\n");
+      slot= 0;
+   }
+   h264->refs[slot].used= true;
+   h264->refs[slot].longTerm= currentIsLongTerm;
+   h264->refs[slot].longTermFrameIdx= currentLongTermFrameIdx;
+   h264->refs[slot].ts= ts;
+   h264->refs[slot].frameNum= (h264->prevHadMmco5 ? 0 : dp->frame_num);
+   h264->refs[slot].topPoc= dp->top_field_order_cnt;
+   h264->refs[slot].bottomPoc= dp->bottom_field_order_cnt;
+   if ( h264->prevHadMmco5 )
+   {
+      int minPoc= (dp->top_field_order_cnt < dp->bottom_field_order_cnt) ? dp->top_field_order_cnt : dp->bottom_field_order_cnt;
+      h264->refs[slot].topPoc -= minPoc;
+      h264->refs[slot].bottomPoc -= minPoc;
+   }
+}
+
+static bool findMediaDevice( V4l2Ctx *v4l2 )
+{
+   bool result= false;
+   struct stat st;
+   struct dirent *dirent;
+   DIR *dir;
+   int len, fd, rc;
+   unsigned int i;
+
+   rc= fstat( v4l2->v4l2Fd, &st );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: findMediaDevice: fstat failed: errno %d\n", errno);
+      goto exit;
+   }
+
+   dir= opendir("/dev");
+   if ( !dir )
+   {
+      goto exit;
+   }
+   for( ; ; )
+   {
+      struct media_v2_topology topology;
+      struct media_v2_interface *interfaces= 0;
+      char name[256+10];
+
+      dirent= readdir( dir );
+      if ( dirent == 0 ) break;
+
+      len= strlen(dirent->d_name);
+      if ( (len <= 5) || strncmp( dirent->d_name, "media", 5 ) )
+      {
+         continue;
+      }
+
+      strcpy( name, "/dev/" );
+      strcat( name, dirent->d_name );
+      fd= open( name, O_RDWR|O_CLOEXEC );
+      if ( fd < 0 )
+      {
+         continue;
+      }
+
+      /* Match the media device whose topology contains our video node */
+      memset( &topology, 0, sizeof(topology) );
+      rc= IOCTL( fd, MEDIA_IOC_G_TOPOLOGY, &topology );
+      if ( (rc == 0) && topology.num_interfaces )
+      {
+         interfaces= (struct media_v2_interface*)calloc( topology.num_interfaces, sizeof(struct media_v2_interface) );
+         if ( interfaces )
+         {
+            topology.ptr_interfaces= (uintptr_t)interfaces;
+            rc= IOCTL( fd, MEDIA_IOC_G_TOPOLOGY, &topology );
+            for( i= 0; (rc == 0) && (i < topology.num_interfaces); ++i )
+            {
+               if ( (interfaces[i].devnode.major == major(st.st_rdev)) &&
+                    (interfaces[i].devnode.minor == minor(st.st_rdev)) )
+               {
+                  iprintf(0,"decoder %d: using media device %s\n", v4l2->decCtx->decodeIndex, name);
+                  v4l2->mediaFd= fd;
+                  result= true;
+                  break;
+               }
+            }
+            free( interfaces );
+         }
+      }
+      if ( result )
+      {
+         break;
+      }
+      close( fd );
+   }
+   closedir( dir );
+
+exit:
+   return result;
+}
+
+static bool setStatelessControl( V4l2Ctx *v4l2, uint32_t id, int32_t value )
+{
+   struct v4l2_ext_control ctrl;
+   struct v4l2_ext_controls ctrls;
+   int rc;
+
+   memset( &ctrl, 0, sizeof(ctrl) );
+   ctrl.id= id;
+   ctrl.value= value;
+   memset( &ctrls, 0, sizeof(ctrls) );
+   ctrls.which= V4L2_CTRL_WHICH_CUR_VAL;
+   ctrls.count= 1;
+   ctrls.controls= &ctrl;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_S_EXT_CTRLS, &ctrls );
+
+   return (rc == 0);
+}
+
+static bool initStateless( V4l2Ctx *v4l2 )
+{
+   bool result= false;
+   struct v4l2_query_ext_ctrl query;
+   int i, rc;
+
+   v4l2->mediaFd= -1;
+
+   v4l2->h264= (H264Ctx*)calloc( 1, sizeof(H264Ctx) );
+   if ( !v4l2->h264 )
+   {
+      iprintf(0,"Error: initStateless: no memory for H264Ctx\n");
+      goto exit;
+   }
+   v4l2->h264->activeSps= -1;
+   v4l2->h264->maxLongTermFrameIdx= -1;
+
+   if ( !findMediaDevice( v4l2 ) )
+   {
+      iprintf(0,"Error: initStateless: no media device found for decoder %d\n", v4l2->decCtx->decodeIndex);
+      goto exit;
+   }
+
+   /* Whole access units with Annex B start codes keep the input path the same as for stateful decoders */
+   if ( !setStatelessControl( v4l2, V4L2_CID_STATELESS_H264_DECODE_MODE, V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED ) )
+   {
+      iprintf(0,"Error: initStateless: decoder %d does not support frame based decoding: errno %d\n", v4l2->decCtx->decodeIndex, errno);
+      goto exit;
+   }
+   if ( !setStatelessControl( v4l2, V4L2_CID_STATELESS_H264_START_CODE, V4L2_STATELESS_H264_START_CODE_ANNEX_B ) )
+   {
+      iprintf(0,"Error: initStateless: decoder %d does not support Annex B start codes: errno %d\n", v4l2->decCtx->decodeIndex, errno);
+      goto exit;
+   }
+
+   memset( &query, 0, sizeof(query) );
+   query.id= V4L2_CID_STATELESS_H264_SCALING_MATRIX;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QUERY_EXT_CTRL, &query );
+   v4l2->h264->haveScalingMatrixCtrl= (rc == 0);
+
+   for( i= 0; i < v4l2->numBuffersIn; ++i )
+   {
+      v4l2->inBuffers[i].requestFd= -1;
+   }
+   for( i= 0; i < v4l2->numBuffersIn; ++i )
+   {
+      rc= IOCTL( v4l2->mediaFd, MEDIA_IOC_REQUEST_ALLOC, &v4l2->inBuffers[i].requestFd );
+      if ( rc < 0 )
+      {
+         iprintf(0,"Error: initStateless: decoder %d failed to allocate media request: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
+         goto exit;
+      }
+   }
+
+   result= true;
+
+exit:
+   return result;
+}
+
+static void termStateless( V4l2Ctx *v4l2 )
+{
+   int i;
+
+   if ( v4l2->inBuffers )
+   {
+      for( i= 0; i < v4l2->numBuffersIn; ++i )
+      {
+         if ( v4l2->inBuffers[i].requestFd >= 0 )
+         {
+            close( v4l2->inBuffers[i].requestFd );
+            v4l2->inBuffers[i].requestFd= -1;
+         }
+      }
+   }
+   if ( v4l2->mediaFd >= 0 )
+   {
+      close( v4l2->mediaFd );
+      v4l2->mediaFd= -1;
+   }
+   if ( v4l2->h264 )
+   {
+      free( v4l2->h264 );
+      v4l2->h264= 0;
+   }
+}
+
+static bool recycleRequest( V4l2Ctx *v4l2, int buffIndex )
+{
+   struct pollfd pfd;
+   int rc;
+
+   /* The request completes once both the bitstream and the decoded picture are done with */
+   pfd.fd= v4l2->inBuffers[buffIndex].requestFd;
+   pfd.events= POLLPRI;
+   pfd.revents= 0;
+   poll( &pfd, 1, 1000 );
+
+   rc= IOCTL( v4l2->inBuffers[buffIndex].requestFd, MEDIA_REQUEST_IOC_REINIT, NULL );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: recycleRequest: decoder %d MEDIA_REQUEST_IOC_REINIT failed: rc %d errno %d\n", v4l2->decCtx->decodeIndex, rc, errno);
+      return false;
+   }
+
+   return true;
+}
+
+static void loadScalingMatrix( H264Ctx *h264, int ppsId )
+{
+   struct v4l2_ctrl_h264_pps *pps= &h264->pps[ppsId];
+   H264ScalingLists *lists= 0;
+   int i, j;
+
+   if ( h264->ppsScaling[ppsId].present )
+   {
+      lists= &h264->ppsScaling[ppsId];
+   }
+   else if ( h264->spsScaling[pps->seq_parameter_set_id].present )
+   {
+      lists= &h264->spsScaling[pps->seq_parameter_set_id];
+   }
+
+   if ( !lists )
+   {
+      memset( &h264->scalingMatrix, 16, sizeof(h264->scalingMatrix) );
+      return;
+   }
+
+   /* The control expects raster scan order */
+   for( i= 0; i < 6; ++i )
+   {
+      for( j= 0; j < 16; ++j )
+      {
+         h264->scalingMatrix.scaling_list_4x4[i][gZigzag4x4[j]]= lists->list4x4[i][j];
+      }
+      for( j= 0; j < 64; ++j )
+      {
+         h264->scalingMatrix.scaling_list_8x8[i][gZigzag8x8[j]]= lists->list8x8[i][j];
+      }
+   }
+}
+
+static bool isReferencedCaptureBuffer( V4l2Ctx *v4l2, int buffIndex )
+{
+   struct timeval *tv= &v4l2->outBuffers[buffIndex].buf.timestamp;
+   uint64_t ts= (uint64_t)tv->tv_sec*1000000000ULL + (uint64_t)tv->tv_usec*1000ULL;
+   int i;
+
+   for( i= 0; i < V4L2_H264_NUM_DPB_ENTRIES; ++i )
+   {
+      if ( v4l2->h264->refs[i].used && (v4l2->h264->refs[i].ts == ts) )
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static bool requeueCaptureBuffer( DecCtx *decCtx, int buffIndex )
+{
+   V4l2Ctx *v4l2= &decCtx->v4l2;
+   int rc;
+
+   if ( v4l2->isStateless )
+   {
+      /* A picture still used for reference must not be overwritten */
+      pthread_mutex_lock( &decCtx->mutex );
+      if ( isReferencedCaptureBuffer( v4l2, buffIndex ) )
+      {
+         v4l2->outBuffers[buffIndex].held= true;
+         pthread_mutex_unlock( &decCtx->mutex );
+         return true;
+      }
+      pthread_mutex_unlock( &decCtx->mutex );
+   }
+
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QBUF, &v4l2->outBuffers[buffIndex].buf );
+   if ( rc < 0 )
+   {
+      return false;
+   }
+   v4l2->outBuffers[buffIndex].queued= true;
+
+   return true;
+}
+
+static void requeueReleasedCaptureBuffers( DecCtx *decCtx )
+{
+   V4l2Ctx *v4l2= &decCtx->v4l2;
+   int i, rc;
+
+   for( i= 0; i < v4l2->numBuffersOut; ++i )
+   {
+      if ( v4l2->outBuffers[i].held && !isReferencedCaptureBuffer( v4l2, i ) )
+      {
+         v4l2->outBuffers[i].held= false;
+         rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QBUF, &v4l2->outBuffers[i].buf );
+         if ( rc < 0 )
+         {
+            iprintf(0,"Error: requeueReleasedCaptureBuffers: decoder %d failed to queue buffer %d: rc %d errno %d\n", decCtx->decodeIndex, i, rc, errno);
+            continue;
+         }
+         v4l2->outBuffers[i].queued= true;
+      }
+   }
+}
+
+static int reorderOutput( V4l2Ctx *v4l2, int buffIndex, bool flush )
+{
+   H264Ctx *h264= v4l2->h264;
+   int i, best, frame, bestFrame;
+
+   if ( !h264->reorderDepth )
+   {
+      return buffIndex;
+   }
+
+   /* Stateless decoders return pictures in decode order: hold them back and release in POC order */
+   if ( buffIndex >= 0 )
+   {
+      h264->reorderIndex[h264->reorderCount++]= buffIndex;
+   }
+   if ( (h264->reorderCount == 0) || (!flush && (h264->reorderCount <= h264->reorderDepth)) )
+   {
+      return -1;
+   }
+
+   best= 0;
+   for( i= 1; i < h264->reorderCount; ++i )
+   {
+      frame= v4l2->outBuffers[h264->reorderIndex[i]].buf.timestamp.tv_usec % MAX_STREAM_FRAMES;
+      bestFrame= v4l2->outBuffers[h264->reorderIndex[best]].buf.timestamp.tv_usec % MAX_STREAM_FRAMES;
+      if ( (h264->outputEpoch[frame] < h264->outputEpoch[bestFrame]) ||
+           ((h264->outputEpoch[frame] == h264->outputEpoch[bestFrame]) && (h264->outputPoc[frame] < h264->outputPoc[bestFrame])) )
+      {
+         best= i;
+      }
+   }
+   buffIndex= h264->reorderIndex[best];
+   for( i= best; i < h264->reorderCount-1; ++i )
+   {
+      h264->reorderIndex[i]= h264->reorderIndex[i+1];
+   }
+   --h264->reorderCount;
+
+   return buffIndex;
+}
+
+static int prepareStatelessFrame( DecCtx *decCtx, int buffIndex, int frameIndex, const unsigned char *header, int headerLength )
+{
+   V4l2Ctx *v4l2= &decCtx->v4l2;
+   H264Ctx *h264= v4l2->h264;
+   Stream *stream= decCtx->stream;
+   const unsigned char *data= (const unsigned char*)&stream->streamData[stream->streamFrameOffset[frameIndex]];
+   int length= stream->streamFrameLength[frameIndex];
+   unsigned char *dest= (unsigned char*)v4l2->inBuffers[buffIndex].start;
+   struct v4l2_ctrl_h264_sps *sps;
+   struct v4l2_ext_control ctrl[4];
+   struct v4l2_ext_controls ctrls;
+   int offset, nalStart, nalLength, nalType, ppsId= -1;
+   int pass, count, copied= 0;
+   bool haveSlice= false;
+   uint64_t ts;
+   int rc;
+
+   memset( &h264->decode, 0, sizeof(h264->decode) );
+
+   for( pass= 0; pass < 2; ++pass )
+   {
+      const unsigned char *p= (pass == 0) ? header : data;
+      int len= (pass == 0) ? headerLength : length;
+
+      offset= 0;
+      while( p && (offset >= 0) )
+      {
+         offset= nextNal( p, len, offset, &nalStart, &nalLength );
+         if ( (offset < 0) || (nalLength < 1) )
+         {
+            break;
+         }
+         nalType= p[nalStart] & 0x1F;
+         if ( nalType == 7 )
+         {
+            if ( !h264ParseSps( h264, &p[nalStart], nalLength ) ) return -1;
+         }
+         else if ( nalType == 8 )
+         {
+            if ( !h264ParsePps( h264, &p[nalStart], nalLength ) ) return -1;
+         }
+         else if ( (nalType == 1) || (nalType == 5) )
+         {
+            if ( !haveSlice )
+            {
+               if ( !h264ParseSliceHeader( h264, &p[nalStart], nalLength, &ppsId ) ) return -1;
+               haveSlice= true;
+            }
+            if ( copied+3+nalLength > v4l2->inBuffers[buffIndex].capacity )
+            {
+               iprintf(0,"Error: prepareStatelessFrame: frame %d too large for input buffer\n", frameIndex);
+               return -1;
+            }
+            dest[copied++]= 0;
+            dest[copied++]= 0;
+            dest[copied++]= 1;
+            memcpy( &dest[copied], &p[nalStart], nalLength );
+            copied += nalLength;
+         }
+      }
+   }
+
+   if ( !haveSlice )
+   {
+      iprintf(0,"Error: prepareStatelessFrame: frame %d has no slices\n", frameIndex);
+      return -1;
+   }
+
+   sps= &h264->sps[h264->pps[ppsId].seq_parameter_set_id];
+   if ( h264->activeSps != h264->pps[ppsId].seq_parameter_set_id )
+   {
+      struct v4l2_ext_control spsCtrl;
+
+      /* Set the sequence on the device so the capture format reflects the stream */
+      h264->activeSps= h264->pps[ppsId].seq_parameter_set_id;
+      memset( &spsCtrl, 0, sizeof(spsCtrl) );
+      spsCtrl.id= V4L2_CID_STATELESS_H264_SPS;
+      spsCtrl.size= sizeof(struct v4l2_ctrl_h264_sps);
+      spsCtrl.ptr= sps;
+      memset( &ctrls, 0, sizeof(ctrls) );
+      ctrls.which= V4L2_CTRL_WHICH_CUR_VAL;
+      ctrls.count= 1;
+      ctrls.controls= &spsCtrl;
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_S_EXT_CTRLS, &ctrls );
+      if ( rc < 0 )
+      {
+         iprintf(0,"Warning: prepareStatelessFrame: decoder %d failed to set sps: rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
+      }
+
+      h264->reorderDepth= 0;
+      for( int i= 0; i < stream->streamFrameCount; ++i )
+      {
+         if ( stream->streamFrameType[i] == FRAME_TYPE_B )
+         {
+            h264->reorderDepth= (sps->max_num_ref_frames > 0) ? sps->max_num_ref_frames : 1;
+            if ( h264->reorderDepth > V4L2_H264_NUM_DPB_ENTRIES )
+            {
+               h264->reorderDepth= V4L2_H264_NUM_DPB_ENTRIES;
+            }
+            break;
+         }
+      }
+      h264->neededBuffersOut= sps->max_num_ref_frames + h264->reorderDepth + MIN_OUTPUT_BUFFERS + 1;
+   }
+
+   if ( stream->streamFrameType[frameIndex] == FRAME_TYPE_B )
+   {
+      h264->decode.flags |= V4L2_H264_DECODE_PARAM_FLAG_BFRAME;
+   }
+   else if ( stream->streamFrameType[frameIndex] == FRAME_TYPE_P )
+   {
+      h264->decode.flags |= V4L2_H264_DECODE_PARAM_FLAG_PFRAME;
+   }
+
+   ts= (uint64_t)decCtx->seekGeneration*1000000000ULL + (uint64_t)frameIndex*1000ULL;
+
+   pthread_mutex_lock( &decCtx->mutex );
+   if ( h264->decode.flags & V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC )
+   {
+      ++h264->epoch;
+   }
+   h264ComputePoc( h264, sps );
+   h264BuildDpb( h264, sps );
+   pthread_mutex_unlock( &decCtx->mutex );
+
+   loadScalingMatrix( h264, ppsId );
+
+   count= 0;
+   memset( ctrl, 0, sizeof(ctrl) );
+   ctrl[count].id= V4L2_CID_STATELESS_H264_SPS;
+   ctrl[count].size= sizeof(struct v4l2_ctrl_h264_sps);
+   ctrl[count].ptr= sps;
+   ++count;
+   ctrl[count].id= V4L2_CID_STATELESS_H264_PPS;
+   ctrl[count].size= sizeof(struct v4l2_ctrl_h264_pps);
+   ctrl[count].ptr= &h264->pps[ppsId];
+   ++count;
+   if ( h264->haveScalingMatrixCtrl )
+   {
+      ctrl[count].id= V4L2_CID_STATELESS_H264_SCALING_MATRIX;
+      ctrl[count].size= sizeof(struct v4l2_ctrl_h264_scaling_matrix);
+      ctrl[count].ptr= &h264->scalingMatrix;
+      ++count;
+   }
+   ctrl[count].id= V4L2_CID_STATELESS_H264_DECODE_PARAMS;
+   ctrl[count].size= sizeof(struct v4l2_ctrl_h264_decode_params);
+   ctrl[count].ptr= &h264->decode;
+   ++count;
+
+   memset( &ctrls, 0, sizeof(ctrls) );
+   ctrls.which= V4L2_CTRL_WHICH_REQUEST_VAL;
+   ctrls.request_fd= v4l2->inBuffers[buffIndex].requestFd;
+   ctrls.count= count;
+   ctrls.controls= ctrl;
+   rc= IOCTL( v4l2->v4l2Fd, VIDIOC_S_EXT_CTRLS, &ctrls );
+   if ( rc < 0 )
+   {
+      iprintf(0,"Error: prepareStatelessFrame: decoder %d failed to set controls: rc %d errno %d error_idx %d\n", decCtx->decodeIndex, rc, errno, ctrls.error_idx);
+      return -1;
+   }
+
+   pthread_mutex_lock( &decCtx->mutex );
+   h264->outputPoc[frameIndex % MAX_STREAM_FRAMES]= (h264->decode.top_field_order_cnt < h264->decode.bottom_field_order_cnt) ?
+                                                   h264->decode.top_field_order_cnt : h264->decode.bottom_field_order_cnt;
+   h264->outputEpoch[frameIndex % MAX_STREAM_FRAMES]= h264->epoch;
+   h264MarkReferences( h264, sps, ts );
+   requeueReleasedCaptureBuffers( decCtx );
+   pthread_mutex_unlock( &decCtx->mutex );
+
+   return copied;
+}
+
+static int nextTrickPlayFrame( DecCtx *decCtx )
+{
+   Stream *stream= decCtx->stream;
+   int step= (decCtx->trickSpeed > 0) ? 1 : -1;
+   int speed= (decCtx->trickSpeed > 0) ? decCtx->trickSpeed : -decCtx->trickSpeed;
+   int next, after, frameIndex;
+   long long now, due;
+
+   next= decCtx->trickIntraIndex+step;
+   if ( (next < 0) || (next >= stream->streamIntraCount) )
+   {
+      /* Wrap around and restart the pacing clock */
+      next= (step > 0) ? 0 : stream->streamIntraCount-1;
+      decCtx->trickStartTime= 0;
+   }
+
+   now= getCurrentTimeMillis();
+   if ( !decCtx->trickStartTime )
+   {
+      decCtx->trickStartTime= now;
+      decCtx->trickStartFrame= stream->streamIntraIndex[next];
+      decCtx->trickIntraIndex= next;
+      return stream->streamIntraIndex[next];
+   }
+
+   /* Drop intra frames whose presentation time has already passed */
+   for( ; ; )
+   {
+      after= next+step;
+      if ( (after < 0) || (after >= stream->streamIntraCount) )
+      {
+         break;
+      }
+      due= decCtx->trickStartTime + (abs(stream->streamIntraIndex[after]-decCtx->trickStartFrame)*1000LL)/(speed*decCtx->videoRate);
+      if ( due > now )
+      {
+         break;
+      }
+      next= after;
+      ++decCtx->trickFramesSkipped;
+   }
+
+   due= decCtx->trickStartTime + (abs(stream->streamIntraIndex[next]-decCtx->trickStartFrame)*1000LL)/(speed*decCtx->videoRate);
+   if ( due > now )
+   {
+      usleep( (due-now)*1000 );
+   }
+
+   frameIndex= stream->streamIntraIndex[next];
+   decCtx->trickContentFrames += abs(frameIndex-stream->streamIntraIndex[decCtx->trickIntraIndex]);
+   decCtx->trickIntraIndex= next;
+
+   return frameIndex;
+}
+
+static int findNextIDR( Stream *stream, int frameIndex )
+{
+   int i;
+
+   frameIndex= frameIndex % stream->streamFrameCount;
+   for( i= 0; i < stream->streamIDRCount; ++i )
+   {
+      if ( stream->streamIDRIndex[i] >= frameIndex )
+      {
+         return stream->streamIDRIndex[i];
+      }
+   }
+
+   return stream->streamIDRIndex[0];
+}
+
+static int nextRendition( DecCtx *decCtx )
+{
+   AppCtx *appCtx= decCtx->appCtx;
+   int count= appCtx->abrLadderCount;
+   int next;
+
+   if ( appCtx->abrRandom )
+   {
+      next= rand() % (count-1);
+      if ( next >= decCtx->abrRendition )
+      {
+         ++next;
+      }
+   }
+   else
+   {
+      /* Walk up the ladder then back down: 0,1,..,n-1,n-2,..,0,1,.. */
+      int step= decCtx->abrSwitchCount % (2*(count-1));
+      next= (step < count-1) ? step+1 : 2*(count-1)-(step+1);
+   }
+
+   return next;
+}
+
+static bool playFile( DecCtx *decCtx )
+{
+   bool result= false;
+   V4l2Ctx *v4l2= &decCtx->v4l2;
+   AppCtx *appCtx= decCtx->appCtx;
+   Stream *stream= decCtx->stream;
+   int frameIndex, firstFrameIndex, frameOffset, frameLength, headerLength;
+   int buffIndex, rc, packedCount;
+   int framesSinceSeek, framesSinceSwitch;
+   bool canPack;
+   long long flushStartTime;
+   bool needHeader;
+
+   frameIndex= decCtx->startFrameIndex;
+   if ( (frameIndex < 0) || (frameIndex >= stream->streamFrameCount) )
+   {
+      frameIndex= 0;
+   }
+
+   /* When starting mid-stream make sure the decoder sees parameter sets before the first slice */
+   needHeader= !(stream->streamFrameFlags[frameIndex] & FRAME_FLAG_PARAMS);
+   framesSinceSeek= 0;
+   framesSinceSwitch= 0;
+
+   /* Packing is limited to straight playback so seeks and switches always start a fresh buffer */
+   canPack= appCtx->packInput && v4l2->canPackInput &&
+            !decCtx->seekRequestCount && !decCtx->abrSwitchRequestCount && !decCtx->trickSpeed;
+
+   for( ; ; )
+   {
+      if ( decCtx->videoInThreadStopRequested )
+      {
+         break;
+      }
+
+      if ( decCtx->drainRequested )
+      {
+         decCtx->drainStartTime= getMonotonicTimeMicros();
+         if ( !drainDecoder( v4l2 ) )
+         {
+            decCtx->drainDone= true;
+         }
+         break;
+      }
+
+      if ( (decCtx->seekCount < decCtx->seekRequestCount) &&
+           (framesSinceSeek >= decCtx->seekInterval) &&
+           stream->streamIDRCount )
+      {
+         pthread_mutex_lock( &decCtx->mutex );
+         decCtx->seekStartTime= getCurrentTimeMillis();
+         ++decCtx->seekGeneration;
+         decCtx->seekPending= true;
+         pthread_mutex_unlock( &decCtx->mutex );
+
+         frameIndex= stream->streamIDRIndex[rand() % stream->streamIDRCount];
+         iprintf(1,"decoder %d seek %d to frame %d\n", decCtx->decodeIndex, decCtx->seekCount, frameIndex);
+
+         flushStartTime= getMonotonicTimeMicros();
+         if ( !flushInput( v4l2 ) )
+         {
+            decCtx->async->error= true;
+            goto exit;
+         }
+         decCtx->seekFlushLatency[decCtx->seekCount]= getMonotonicTimeMicros()-flushStartTime;
+         ++decCtx->seekCount;
+
+         needHeader= !(stream->streamFrameFlags[frameIndex] & FRAME_FLAG_PARAMS);
+         framesSinceSeek= 0;
+      }
+
+      if ( (decCtx->abrSwitchCount < decCtx->abrSwitchRequestCount) &&
+           (framesSinceSwitch >= decCtx->abrSwitchInterval) )
+      {
+         int next= nextRendition( decCtx );
+         Stream *nextStream= appCtx->abrLadder[next];
+
+         if ( nextStream->streamIDRCount )
+         {
+            /* Switch without a flush: the next rendition starts at an IDR so the decoder can continue seamlessly */
+            pthread_mutex_lock( &decCtx->mutex );
+            ++decCtx->seekGeneration;
+            decCtx->abrSwitchStartTime= getCurrentTimeMillis();
+            decCtx->abrPending= true;
+            decCtx->abrSwitchFrom[decCtx->abrSwitchCount]= decCtx->abrRendition;
+            decCtx->abrSwitchTo[decCtx->abrSwitchCount]= next;
+            decCtx->abrGlitch[decCtx->abrSwitchCount]= -1;
+            decCtx->abrDroppedFrames[decCtx->abrSwitchCount]= -1;
+            ++decCtx->abrSwitchCount;
+            pthread_mutex_unlock( &decCtx->mutex );
+
+            frameIndex= findNextIDR( nextStream, frameIndex );
+            iprintf(1,"decoder %d switch %d rendition %d -> %d (%dx%d) at frame %d\n",
+                    decCtx->decodeIndex, decCtx->abrSwitchCount, decCtx->abrRendition, next,
+                    nextStream->videoWidth, nextStream->videoHeight, frameIndex);
+
+            decCtx->abrRendition= next;
+            decCtx->stream= nextStream;
+            stream= nextStream;
+
+            needHeader= !(stream->streamFrameFlags[frameIndex] & FRAME_FLAG_PARAMS);
+         }
+         framesSinceSwitch= 0;
+      }
+
+      buffIndex= getInputBuffer( v4l2 );
+
+      if ( decCtx->videoInThreadStopRequested )
+      {
+         break;
+      }
+
+      if ( decCtx->drainRequested )
+      {
+         continue;
+      }
+
+      if ( buffIndex < 0 )
+      {
+         iprintf(0,"Error: playFile: decoder %d unable to get input buffer\n", decCtx->decodeIndex);
+         decCtx->async->error= true;
+         goto exit;
+      }
+
+      if ( decCtx->trickSpeed )
+      {
+         frameIndex= nextTrickPlayFrame( decCtx );
+         if ( decCtx->trickFramesFed == 0 )
+         {
+            needHeader= !(stream->streamFrameFlags[frameIndex] & FRAME_FLAG_PARAMS);
+         }
+         ++decCtx->trickFramesFed;
+      }
+
+      if ( frameIndex >= stream->streamFrameCount )
+      {
+         frameIndex= 0;
+      }
+      frameOffset= stream->streamFrameOffset[frameIndex];
+      frameLength= stream->streamFrameLength[frameIndex];
+      firstFrameIndex= frameIndex;
+      packedCount= 1;
+
+      if ( v4l2->isStateless )
+      {
+         if ( !recycleRequest( v4l2, buffIndex ) )
+         {
+            decCtx->async->error= true;
+            goto exit;
+         }
+         frameLength= prepareStatelessFrame( decCtx, buffIndex, frameIndex,
+                                             needHeader ? (const unsigned char*)stream->streamData : 0,
+                                             needHeader ? stream->streamHeaderLength : 0 );
+         needHeader= false;
+         if ( frameLength < 0 )
+         {
+            iprintf(0,"Error: playFile: decoder %d unable to prepare frame %d\n", decCtx->decodeIndex, frameIndex);
+            decCtx->async->error= true;
+            goto exit;
+         }
+      }
+      else
+      {
+         headerLength= needHeader ? stream->streamHeaderLength : 0;
+         if ( headerLength+frameLength > v4l2->inBuffers[buffIndex].capacity )
+         {
+            /* Never overrun the buffer: drop the frame and let the decoder conceal */
+            iprintf(0,"Error: playFile: decoder %d frame %d of %d bytes exceeds input buffer capacity %d\n",
+                    decCtx->decodeIndex, frameIndex, headerLength+frameLength, v4l2->inBuffers[buffIndex].capacity);
+            ++decCtx->inputOverflowCount;
+            ++frameIndex;
+            continue;
+         }
+         if ( needHeader )
+         {
+            memcpy( v4l2->inBuffers[buffIndex].start, stream->streamData, headerLength );
+            needHeader= false;
+         }
+         memcpy( (char*)v4l2->inBuffers[buffIndex].start+headerLength, &stream->streamData[frameOffset], frameLength );
+         frameLength += headerLength;
+
+         while ( canPack &&
+                 (packedCount < MAX_PACKED_FRAMES) &&
+                 (frameIndex+1 < stream->streamFrameCount) &&
+                 (frameLength+stream->streamFrameLength[frameIndex+1] <= v4l2->inBuffers[buffIndex].capacity) )
+         {
+            ++frameIndex;
+            memcpy( (char*)v4l2->inBuffers[buffIndex].start+frameLength,
+                    &stream->streamData[stream->streamFrameOffset[frameIndex]],
+                    stream->streamFrameLength[frameIndex] );
+            frameLength += stream->streamFrameLength[frameIndex];
+            decCtx->frameQueueTime[frameIndex % MAX_STREAM_FRAMES]= getMonotonicTimeMicros();
+            ++packedCount;
+         }
+      }
+
+      decCtx->inputBytesFed += frameLength;
+      decCtx->inputCapacityFed += v4l2->inBuffers[buffIndex].capacity;
+      ++decCtx->inputBuffersFed;
+      decCtx->inputFramesFed += packedCount;
+
+      v4l2->inBuffers[buffIndex].buf.bytesused= frameLength;
+      if ( v4l2->isMultiPlane )
+      {
+         v4l2->inBuffers[buffIndex].buf.m.planes[0].bytesused= frameLength;
+      }
+      v4l2->inBuffers[buffIndex].buf.timestamp.tv_sec= decCtx->seekGeneration;
+      v4l2->inBuffers[buffIndex].buf.timestamp.tv_usec= firstFrameIndex;
+      decCtx->frameQueueTime[firstFrameIndex % MAX_STREAM_FRAMES]= getMonotonicTimeMicros();
+      if ( v4l2->isStateless )
+      {
+         v4l2->inBuffers[buffIndex].buf.flags |= V4L2_BUF_FLAG_REQUEST_FD;
+         v4l2->inBuffers[buffIndex].buf.request_fd= v4l2->inBuffers[buffIndex].requestFd;
+      }
+      rc= IOCTL( v4l2->v4l2Fd, VIDIOC_QBUF, &v4l2->inBuffers[buffIndex].buf );
+      if ( rc < 0 )
+      {
+         iprintf(0,"Error: playFile: queuing input buffer failed: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno );
+         decCtx->async->error= true;
+         goto exit;
+      }
+      v4l2->inBuffers[buffIndex].queued= true;
+      if ( v4l2->isStateless )
+      {
+         rc= IOCTL( v4l2->inBuffers[buffIndex].requestFd, MEDIA_REQUEST_IOC_QUEUE, NULL );
+         if ( rc < 0 )
+         {
+            iprintf(0,"Error: playFile: queuing media request failed: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno );
+            decCtx->async->error= true;
+            goto exit;
+         }
+      }
+
+      if ( !v4l2->outputStarted )
+      {
+         v4l2->outputStarted= true;
+
+         rc= IOCTL( v4l2->v4l2Fd, VIDIOC_STREAMON, &v4l2->fmtIn.type );
+         if ( rc < 0 )
+         {
+            iprintf(0,"Error: streamon failed for input: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno );
+            goto exit;
+         }
+
+         setOutputFormat( v4l2 );
+         setupOutputBuffers( v4l2 );
+
+         decCtx->readyTime= getCurrentTimeMillis();
+         decCtx->ready= true;
+         for( ; ; )
+         {
+            if ( decCtx->paused == false ) break;
+            usleep( 1000 );
+         }
+
+         rc= pthread_create( &v4l2->decCtx->videoOutThreadId, NULL, videoOutputThread, v4l2->decCtx );
+         if ( rc )
+         {
+            iprintf(0,"Error: unable to start video output thread: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
+            decCtx->async->error= true;
+            goto exit;
+         }
+      }
+
+      ++frameIndex;
+      ++framesSinceSeek;
+      ++framesSinceSwitch;
+   }
+
+   result= true;
+
+exit:
+
+   return result;
+}
+
+static bool parseStreamDescriptor( AppCtx *appCtx, Stream *stream, const char *descriptorFilename )
+{
+   bool result= false;
+   FILE *pFile;
+   char line[1024];
+   char field[1024];
+   char *s;
+   int foundValueCount= 0;
+
+   pFile= fopen( descriptorFilename, "rt" );
+   if ( pFile )
+   {
+      for( ; ; )
+      {
+         s= fgets( line, sizeof(line), pFile );
+         if ( s )
+         {
+            if ( sscanf( s, "file: %s", field ) == 1 )
+            {
+               stream->inputFilename= strdup(field);
+               ++foundValueCount;
+            }
+            else if ( sscanf( s, "frame-size: %s", field ) == 1 )
+            {
+               int w, h;
+               if ( sscanf( field, "%dx%d", &w, &h ) == 2 )
+               {
+                  stream->videoWidth= w;
+                  stream->videoHeight= h;
+                  ++foundValueCount;
+               }
+            }
+            else if ( sscanf( s, "frame-rate: %s", field ) == 1 )
+            {
+               int rate;
+               rate= atoi(field);
+               if ( rate )
+               {
+                  stream->videoRate= rate;
+                  ++foundValueCount;
+               }
+            }
+         }
+         else
+         {
+            break;
+         }
+      }
+      if ( foundValueCount == 3 )
+      {
+         result= true;
+      }
+      fclose( pFile );
+   }
+   else
+   {
+      printf("Error: parseStreamDescriptor: unable to open descriptor (%s)\n", descriptorFilename);
+   }
+
+return result;
+}
+
+static void bitReaderInit( BitReader *br, const unsigned char *data, int length )
+{
+   br->data= data;
+   br->length= length;
+   br->offset= 0;
+   br->bit= 0;
+   br->zeroCount= 0;
+   br->epbCount= 0;
+   br->overrun= false;
+}
+
+static unsigned int bitReaderGetBits( BitReader *br, int numBits )
+{
+   unsigned int value= 0;
+   unsigned char byte;
+
+   while( numBits-- > 0 )
+   {
+      if ( br->offset >= br->length )
+      {
+         br->overrun= true;
+         value <<= 1;
+         continue;
+      }
+      byte= br->data[br->offset];
+      value= (value << 1) | ((byte >> (7-br->bit)) & 1);
+      if ( ++br->bit == 8 )
+      {
+         br->bit= 0;
+         br->zeroCount= (byte == 0) ? br->zeroCount+1 : 0;
+         ++br->offset;
+         /* Skip emulation prevention bytes */
+         if ( (br->zeroCount >= 2) && (br->offset < br->length) && (br->data[br->offset] == 3) )
+         {
+            ++br->offset;
+            ++br->epbCount;
+            br->zeroCount= 0;
+         }
+      }
+   }
+
+   return value;
+}
+
+static unsigned int bitReaderGetUE( BitReader *br )
+{
+   int leadingZeros= 0;
+
+   while( !bitReaderGetBits( br, 1 ) )
+   {
+      if ( br->overrun || (++leadingZeros > 31) )
+      {
+         br->overrun= true;
+         return 0;
+      }
+   }
+
+   return ((1U << leadingZeros)-1) + bitReaderGetBits( br, leadingZeros );
+}
+
+static int bitReaderGetSE( BitReader *br )
+{
+   unsigned int value= bitReaderGetUE( br );
+
+   return (value & 1) ? (int)((value+1)/2) : -(int)(value/2);
+}
+
+static int bitReaderBitPos( BitReader *br )
+{
+   /* Position in syntax bits, not counting emulation prevention bytes */
+   return (br->offset-br->epbCount)*8 + br->bit;
+}
+
+static bool bitReaderMoreData( BitReader *br )
+{
+   int last, stopBit;
+
+   /* More data is present if anything other than the rbsp stop bit and alignment follows */
+   last= br->length-1;
+   while( (last >= 0) && (br->data[last] == 0) )
+   {
+      --last;
+   }
+   if ( last < 0 )
+   {
+      return false;
+   }
+   for( stopBit= 7; stopBit > 0; --stopBit )
+   {
+      if ( br->data[last] & (1 << (7-stopBit)) )
+      {
+         break;
+      }
+   }
+
+   return (br->offset < last) || ((br->offset == last) && (br->bit < stopBit));
+}
+
+static bool prepareStream( AppCtx *appCtx, Stream *stream )
+{
+   bool result= false;
+   FILE *pFile;
+   int rc, streamDataLen, lenDidRead;
+   int frameNumber, frameStartOffset, paramsOffset, i;
+   int nalType, sliceType;
+   unsigned int firstMb;
+   unsigned char frameFlags, pendingFlags, frameType, sliceFrameType;
+   bool firstFrame;
+   unsigned char *p;
+   BitReader br;
+
+   pFile= fopen( stream->inputFilename, "rb" );
+   if ( !pFile )
+   {
+      iprintf(0,"Error: prepareStream: unable to open input file (%s)\n", stream->inputFilename );
+      goto exit;
+   }
+
+   rc= fseek( pFile, 0, SEEK_END );
+   if ( rc )
+   {
+      iprintf(0,"Error: prepareStream: unable to seek to end of input file (%s) : %d\n", stream->inputFilename, errno );
+      goto exit;
+   }
+
+   streamDataLen= ftell( pFile );
+   if ( streamDataLen > MAX_STREAM_LEN )
+   {
+      streamDataLen= MAX_STREAM_LEN;
+   }
+
+   rc= fseek( pFile, 0, SEEK_SET );
+   if ( rc )
+   {
+      iprintf(0,"Error: prepareStream: unable to seek to start of input file (%s) : %d\n", stream->inputFilename, errno );
+      goto exit;
+   }
+
+   stream->streamData= (char*)malloc( streamDataLen );
+   if ( !stream->streamData )
+   {
+      iprintf(0,"Error: prepareStream: unable to allocate %d bytes for stream data\n", streamDataLen );
+      goto exit;
+   }
+
+   lenDidRead= fread( stream->streamData, 1, streamDataLen, pFile );
+   if ( lenDidRead != streamDataLen )
+   {
+      iprintf(0,"Error: prepareStream: unable to read %d bytes from stream\n", streamDataLen );
+      goto exit;
+   }
+
+   /*
+    * Split the byte stream into frames.  SEI, SPS, PPS and AUD NAL units are
+    * attached to the slice that follows them so that any IDR frame which
+    * carries in-band parameter sets can be used as a random access point.
+    * Each frame is classified as I, P or B from its slice headers.
+    */
+   firstFrame= true;
+   frameNumber= 0;
+   frameStartOffset= 0;
+   paramsOffset= -1;
+   frameFlags= 0;
+   frameType= FRAME_TYPE_I;
+   pendingFlags= 0;
+   stream->streamHeaderLength= 0;
+   stream->streamIDRCount= 0;
+   stream->streamIntraCount= 0;
+   p= (unsigned char*)stream->streamData;
+   for( i= 0; i < streamDataLen-4; ++i )
+   {
+      if ( (p[i] == 0) && (p[i+1] == 0) && (p[i+2] == 0) && (p[i+3] == 1) )
+      {
+         nalType= (p[i+4] & 0x1F);
+         if ( (nalType == 6) || (nalType == 7) || (nalType == 8) || (nalType == 9) )
+         {
+            if ( paramsOffset < 0 )
+            {
+               paramsOffset= i;
+            }
+            if ( nalType == 7 )
+            {
+               pendingFlags |= FRAME_FLAG_PARAMS;
+            }
+            continue;
+         }
+         if ( (nalType < 1) || (nalType > 5) )
+         {
+            continue;
+         }
+
+         bitReaderInit( &br, &p[i+5], streamDataLen-(i+5) );
+         firstMb= bitReaderGetUE( &br );
+         sliceType= bitReaderGetUE( &br ) % 5;
+         if ( (sliceType == 2) || (sliceType == 4) )
+         {
+            sliceFrameType= FRAME_TYPE_I;
+         }
+         else if ( sliceType == 1 )
+         {
+            sliceFrameType= FRAME_TYPE_B;
+         }
+         else
+         {
+            sliceFrameType= FRAME_TYPE_P;
+         }
+
+         if ( !firstFrame && (firstMb != 0) )
+         {
+            /* Further slice of the current picture */
+            if ( sliceFrameType > frameType )
+            {
+               frameType= sliceFrameType;
+            }
+            pendingFlags= 0;
+            paramsOffset= -1;
+            continue;
+         }
+         if ( firstFrame )
+         {
+            firstFrame= false;
+            stream->streamHeaderLength= i;
+            frameFlags= pendingFlags | ((nalType == 5) ? FRAME_FLAG_IDR : 0);
+            frameType= sliceFrameType;
+            pendingFlags= 0;
+            paramsOffset= -1;
+            continue;
+         }
+         if ( paramsOffset < 0 )
+         {
+            paramsOffset= i;
+         }
+         stream->streamFrameOffset[frameNumber]= frameStartOffset;
+         stream->streamFrameLength[frameNumber]= (paramsOffset - frameStartOffset);
+         stream->streamFrameFlags[frameNumber]= frameFlags;
+         stream->streamFrameType[frameNumber]= frameType;
+         if ( frameFlags & FRAME_FLAG_IDR )
+         {
+            stream->streamIDRIndex[stream->streamIDRCount++]= frameNumber;
+         }
+         if ( frameType == FRAME_TYPE_I )
+         {
+            stream->streamIntraIndex[stream->streamIntraCount++]= frameNumber;
+         }
+         ++frameNumber;
+         frameStartOffset= paramsOffset;
+         frameFlags= pendingFlags | ((nalType == 5) ? FRAME_FLAG_IDR : 0);
+         frameType= sliceFrameType;
+         pendingFlags= 0;
+         paramsOffset= -1;
+         if ( frameNumber >= MAX_STREAM_FRAMES )
+         {
+            break;
+         }
+      }
+   }
+
+   stream->streamFrameCount= frameNumber;
+   stream->streamDataLen= streamDataLen;
+   stream->streamMaxFrameLength= 0;
+   for( i= 0; i < frameNumber; ++i )
+   {
+      if ( stream->streamFrameLength[i] > stream->streamMaxFrameLength )
+      {
+         stream->streamMaxFrameLength= stream->streamFrameLength[i];
+      }
+   }
+   iprintf(0,"Indexed %d input frames (%d IDR, %d I) from (%s)\n", frameNumber, stream->streamIDRCount, stream->streamIntraCount, stream->inputFilename );
+   iprintf(0,"Largest frame %d bytes, parameter sets %d bytes\n", stream->streamMaxFrameLength, stream->streamHeaderLength );
+
+   result= true;
+
+exit:
+
+   if ( !result )
+   {
+      if ( stream->streamData )
+      {
+         free( stream->streamData );
+         stream->streamData= 0;
+      }
+   }
+
+   if ( pFile )
+   {
+      fclose( pFile );
+   }
+
+   return result;
+}
+
+static void queryDmaBufModifiers( AppCtx *appCtx )
+{
+   PFNEGLQUERYDMABUFMODIFIERSEXTPROC eglQueryDmaBufModifiersEXT;
+   EGLuint64KHR modifiers[MAX_DMABUF_MODIFIERS];
+   EGLBoolean externalOnly[MAX_DMABUF_MODIFIERS];
+   EGLint count= 0;
+   int i;
+
+   eglQueryDmaBufModifiersEXT= (PFNEGLQUERYDMABUFMODIFIERSEXTPROC)eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+   if ( !eglQueryDmaBufModifiersEXT )
+   {
+      return;
+   }
+   if ( !eglQueryDmaBufModifiersEXT( appCtx->egl.eglDisplay, DRM_FORMAT_NV12, MAX_DMABUF_MODIFIERS, modifiers, externalOnly, &count ) )
+   {
+      iprintf(0,"Warning: eglQueryDmaBufModifiersEXT failed: %X\n", eglGetError());
+      return;
+   }
+   appCtx->haveDmaBufModifiers= true;
+   for( i= 0; i < count; ++i )
+   {
+      iprintf(1,"NV12 import modifier %d: %llx external only %d\n", i, (unsigned long long)modifiers[i], externalOnly[i]);
+      appCtx->dmaBufModifiers[i]= modifiers[i];
+   }
+   appCtx->dmaBufModifierCount= count;
+}
+
+static bool updateFrame( DecCtx *decCtx, Surface *surface )
+{
+   AppCtx *appCtx= decCtx->appCtx;
+   EGLCtx *egl= &appCtx->egl;
+   GLCtx *gl= &appCtx->gl;
+   V4l2Ctx *v4l2= &decCtx->v4l2;
+   EGLint attr[36];
+   int buffIndex;
+   bool dirty= false;
+
+   pthread_mutex_lock( &decCtx->mutex );
+   if ( decCtx->nextFrameFd != decCtx->currFrameFd )
+   {
+      dirty= true;
+      ++decCtx->outputFrameCount;
+      decCtx->frameReadyTime[decCtx->outputFrameCount % FRAME_TIME_HISTORY]= decCtx->nextFrameTime;
+
+      if ( decCtx->nextFrameFd >= 0 )
+      {
+         if ( surface )
+         {
+            int fd0, fd1;
+
+            for( int i= 0; i < MAX_TEXTURES; ++i )
+            {
+               if ( surface->eglImage[i] )
+               {
+                  gl->eglDestroyImageKHR( egl->eglDisplay, surface->eglImage[i] );
+                  surface->eglImage[i]= 0;
+               }
+            }
+
+            buffIndex= findOutputBuffer( v4l2, decCtx->nextFrameFd );
+            iprintf(6,"updateFrame: found index %d for nextFrameFd %d\n", buffIndex, decCtx->nextFrameFd);
+            if ( buffIndex >= 0 )
+            {
+               if ( v4l2->isMultiPlane )
+               {
+                  fd0= v4l2->outBuffers[buffIndex].planeInfo[0].fd;
+                  fd1= v4l2->outBuffers[buffIndex].planeInfo[1].fd;
+                  if ( fd1 == -1 )
+                  {
+                     fd1= fd0;
+                  }
+               }
+               else
+               {
+                  fd0= v4l2->outBuffers[buffIndex].fd;
+                  fd1= fd0;
+               }
+            }
+            if ( (fd0 >= 0) && (fd1 >= 0) )
+            {
+               long long importTime= getMonotonicTimeMicros();
+               #ifdef GL_OES_EGL_image_external
+               int i= 0;
+               attr[i++]= EGL_WIDTH;
+               attr[i++]= decCtx->videoWidth;
+               attr[i++]= EGL_HEIGHT;
+               attr[i++]= decCtx->videoHeight;
+               attr[i++]= EGL_LINUX_DRM_FOURCC_EXT;
+               attr[i++]= DRM_FORMAT_NV12;
+               attr[i++]= EGL_DMA_BUF_PLANE0_FD_EXT;
+               attr[i++]= fd0;
+               attr[i++]= EGL_DMA_BUF_PLANE0_OFFSET_EXT;
+               attr[i++]= 0;
+               attr[i++]= EGL_DMA_BUF_PLANE0_PITCH_EXT;
+               attr[i++]= decCtx->videoBufferWidth;
+               attr[i++]= EGL_DMA_BUF_PLANE1_FD_EXT;
+               attr[i++]= fd1;
+               attr[i++]= EGL_DMA_BUF_PLANE1_OFFSET_EXT;
+               attr[i++]= (fd0 != fd1 ? 0 : decCtx->videoBufferWidth*decCtx->videoBufferHeight);
+               attr[i++]= EGL_DMA_BUF_PLANE1_PITCH_EXT;
+               attr[i++]= decCtx->videoBufferWidth;
+               attr[i++]= EGL_YUV_COLOR_SPACE_HINT_EXT;
+               attr[i++]= EGL_ITU_REC709_EXT;
+               attr[i++]= EGL_SAMPLE_RANGE_HINT_EXT;
+               attr[i++]= EGL_YUV_FULL_RANGE_EXT;
+               if ( appCtx->haveDmaBufModifiers )
+               {
+                  /* An explicit modifier, so the driver does not have to guess the layout */
+                  attr[i++]= EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT;
+                  attr[i++]= (EGLint)(v4l2->outputModifier & 0xFFFFFFFF);
+                  attr[i++]= EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT;
+                  attr[i++]= (EGLint)(v4l2->outputModifier >> 32);
+                  attr[i++]= EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT;
+                  attr[i++]= (EGLint)(v4l2->outputModifier & 0xFFFFFFFF);
+                  attr[i++]= EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT;
+                  attr[i++]= (EGLint)(v4l2->outputModifier >> 32);
+               }
+               attr[i++]= EGL_NONE;
+               iprintf(6,"updateFrame: %dx%d: fd0 %d off %d pitch %d fd1 %d off %d pitch %d\n",
+                       attr[1], attr[3], attr[7], attr[9], attr[11], attr[13], attr[15], attr[17] );
+
+               surface->eglImage[0]= gl->eglCreateImageKHR( egl->eglDisplay,
+                                                       EGL_NO_CONTEXT,
+                                                       EGL_LINUX_DMA_BUF_EXT,
+                                                       (EGLClientBuffer)NULL,
+                                                       attr );
+               iprintf(6,"updateFrame: eglImage %p\n", surface->eglImage[0]);
+               if ( surface->eglImage[0] == 0 )
+               {
+                 iprintf(0,"Error: updateFrame: eglCreateImageKHR failed for decoder %d fd %d: errno %X\n", decCtx->decodeIndex, decCtx->currFrameFd, eglGetError());
+               }
+               if ( surface->textureId[0] != GL_NONE )
+               {
+                  glDeleteTextures( 1, &surface->textureId[0] );
+                  surface->textureId[0]= GL_NONE;
+               }
+
+               surface->textureCount= 1;
+               surface->haveYUVTextures= false;
+               surface->externalImage= true;
+               #else
+               attr[0]= EGL_WIDTH;
+               attr[1]= decCtx->videoWidth;
+               attr[2]= EGL_HEIGHT;
+               attr[3]= decCtx->videoHeight;
+               attr[4]= EGL_LINUX_DRM_FOURCC_EXT;
+               attr[5]= DRM_FORMAT_R8;
+               attr[6]= EGL_DMA_BUF_PLANE0_FD_EXT;
+               attr[7]= decCtx->currFrameFd;
+               attr[8]= EGL_DMA_BUF_PLANE0_OFFSET_EXT;
+               attr[9]= 0;
+               attr[10]= EGL_DMA_BUF_PLANE0_PITCH_EXT;
+               attr[11]= decCtx->videoBufferWidth;
+               attr[12]= EGL_NONE;
+
+               surface->eglImage[0]= gl->eglCreateImageKHR( egl->eglDisplay,
+                                                       EGL_NO_CONTEXT,
+                                                       EGL_LINUX_DMA_BUF_EXT,
+                                                       (EGLClientBuffer)NULL,
+                                                       attr );
+               if ( surface->eglImage[0] == 0 )
+               {
+                 iprintf(0,"Error: updateFrame: eglCreateImageKHR failed for decoder %d fd %d: errno %X\n", decCtx->decodeIndex, decCtx->currFrameFd, eglGetError());
+               }
+               if ( surface->textureId[0] != GL_NONE )
+               {
+                  glDeleteTextures( 1, &surface->textureId[0] );
+                  surface->textureId[0]= GL_NONE;
+               }
+
+               attr[0]= EGL_WIDTH;
+               attr[1]= decCtx->videoWidth/2;
+               attr[2]= EGL_HEIGHT;
+               attr[3]= decCtx->videoHeight/2;
+               attr[4]= EGL_LINUX_DRM_FOURCC_EXT;
+               attr[5]= DRM_FORMAT_GR88;
+               attr[6]= EGL_DMA_BUF_PLANE0_FD_EXT;
+               attr[7]= decCtx->currFrameFd;
+               attr[8]= EGL_DMA_BUF_PLANE0_OFFSET_EXT;
+               attr[9]= decCtx->videoWidth*decCtx->videoBufferHeight;
+               attr[10]= EGL_DMA_BUF_PLANE0_PITCH_EXT;
+               attr[11]= decCtx->videoBufferWidth;
+               attr[12]= EGL_NONE;
+
+               surface->eglImage[1]= gl->eglCreateImageKHR( egl->eglDisplay,
+                                                       EGL_NO_CONTEXT,
+                                                       EGL_LINUX_DMA_BUF_EXT,
+                                                       (EGLClientBuffer)NULL,
+                                                       attr );
+               if ( surface->eglImage[1] == 0 )
+               {
+                 iprintf(0,"Error: updateFrame: eglCreateImageKHR failed for decoder %d fd %d: errno %X\n", decCtx->decodeIndex, decCtx->currFrameFd, eglGetError());
+               }
+               if ( surface->textureId[1] != GL_NONE )
+               {
+                  glDeleteTextures( 1, &surface->textureId[1] );
+                  surface->textureId[1]= GL_NONE;
+               }
+               surface->textureCount= 2;
+               surface->haveYUVTextures= true;
+               surface->externalImage= false;
+               #endif
+               TimelineSpan( "EGLImage import", decCtx->decodeIndex, importTime, getMonotonicTimeMicros() );
+            }
+         }
+
+         if ( decCtx->prevFrameSync != EGL_NO_SYNC_KHR )
+         {
+            egl->eglDestroySyncKHR( egl->eglDisplay, decCtx->prevFrameSync );
+         }
+         decCtx->prevFrameSync= decCtx->currFrameSync;
+         decCtx->currFrameSync= EGL_NO_SYNC_KHR;
+         if ( decCtx->currOnPlane )
+         {
+            /* The compositor fills in the sequence of the swap that replaces it */
+            decCtx->prevPlaneSeq= PLANE_SEQ_PENDING;
+            decCtx->currOnPlane= false;
+         }
+         if ( decCtx->heldCaptureCount && (decCtx->currFrameFd < 0) )
+         {
+            decCtx->heldCaptureReplaced= true;
+         }
+         decCtx->prevFrameFd= decCtx->currFrameFd;
+         decCtx->currFrameFd= decCtx->nextFrameFd;
+      }
+   }
+   pthread_mutex_unlock( &decCtx->mutex );
+
+   return dirty;
+}
+
+static void testDecode( AppCtx *appCtx, int decodeIndex, int numFramesToDecode, Surface *surface, Async *async, Stream *stream, int startFrameIndex )
+{
+   int rc;
+   DecCtx *decCtx= 0;
+
+   async->started= true;
+
+   decCtx= &appCtx->decode[decodeIndex];
+
+   memset( decCtx, 0, sizeof(DecCtx));
+
+   decCtx->appCtx= appCtx;
+   decCtx->surface= surface;
+   decCtx->async= async;
+   decCtx->stream= stream;
+   decCtx->decodeIndex= decodeIndex;
+   decCtx->videoWidth= stream->videoWidth;
+   decCtx->videoHeight= stream->videoHeight;
+   decCtx->videoRate= stream->videoRate;
+   decCtx->numFramesToDecode= (numFramesToDecode*stream->videoRate/24);
+   decCtx->startFrameIndex= startFrameIndex;
+   if ( appCtx->trickSpeed )
+   {
+      /* Trick play counts intra frames shown rather than content frames */
+      decCtx->trickSpeed= appCtx->trickSpeed;
+      decCtx->trickIntraIndex= (appCtx->trickSpeed > 0) ? -1 : stream->streamIntraCount;
+      decCtx->numFramesToDecode= numFramesToDecode;
+   }
+   if ( appCtx->abrSwitchCount && (appCtx->abrLadderCount > 1) )
+   {
+      decCtx->abrSwitchRequestCount= appCtx->abrSwitchCount;
+      decCtx->abrSwitchInterval= decCtx->numFramesToDecode/(appCtx->abrSwitchCount+1);
+      if ( decCtx->abrSwitchInterval < 1 )
+      {
+         decCtx->abrSwitchInterval= 1;
+      }
+   }
+   if ( appCtx->seekCount )
+   {
+      decCtx->seekRequestCount= appCtx->seekCount;
+      decCtx->seekInterval= decCtx->numFramesToDecode/(appCtx->seekCount+1);
+      if ( decCtx->seekInterval < 1 )
+      {
+         decCtx->seekInterval= 1;
+      }
+   }
+   decCtx->prevFrameFd= -1;
+   decCtx->currFrameFd= -1;
+   decCtx->nextFrameFd= -1;
+   decCtx->nextFrameFd1= -1;
+   decCtx->lastSeenFrame= -1;
+   decCtx->prevFrameSync= EGL_NO_SYNC_KHR;
+   decCtx->currFrameSync= EGL_NO_SYNC_KHR;
+   decCtx->v4l2.decCtx= decCtx;
+   decCtx->paused= true;
+   pthread_mutex_init( &decCtx->mutex, 0 );
+
+   iprintf(0,"decoder %d to decode %d frames...\n", decodeIndex, decCtx->numFramesToDecode);
+
+   decCtx->openTime= getCurrentTimeMillis();
+   if ( !initV4l2( &decCtx->v4l2 ) )
+   {
+      iprintf(0,"Error: decoder %d failed to init v4l2\n", decCtx->decodeIndex);
+      async->error= true;
+      goto exit;
+   }
+   decCtx->initDoneTime= getCurrentTimeMillis();
+
+   decCtx->playing= true;
+   rc= pthread_create( &decCtx->videoInThreadId, NULL, videoInputThread, decCtx );
+   if ( rc )
+   {
+      iprintf(0,"Error: unable to start video input thread: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
+      async->error= true;
+      goto exit;
+   }
+
+   rc= pthread_create( &decCtx->videoDecodeThreadId, NULL, videoDecodeThread, decCtx );
+   if ( rc )
+   {
+      iprintf(0,"Error: unable to start video decode thread: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
+      async->error= true;
+      goto exit;
+   }
+
+   for( ; ; )
+   {
+      if ( decCtx->ready ) break;
+      usleep( 1000 );
+   }
+
+exit:
+
+   if ( async->error )
+   {
+      async->done= true;
+      iprintf(0,"decoder %d done with error\n", decodeIndex);
+
+      decCtx->videoOutThreadStopRequested= true;
+
+      if ( decCtx->videoOutThreadStarted )
+      {
+         pthread_join( decCtx->videoOutThreadId, NULL );
+      }
+
+      termV4l2( &decCtx->v4l2 );
+   }
+
+   return;
+}
+
+static bool runUntilDone( AppCtx *appCtx )
+{
+   bool result;
+   bool running;
+   int i, frameCount, minFrame, maxFrame, maxFrameGap;
+   Surface *drawList[NUM_DECODE];
+   int drawCount, dirtyCount;
+   int damage[4];
+   EGLint eglRect[4];
+   bool locked[NUM_DECODE];
+   bool newFrame[NUM_DECODE];
+   bool drawn[NUM_DECODE];
+   bool listed;
+   bool partial;
+   unsigned int swapSequence;
+   double idleTotal= 0.0;
+   int numIdleSamples= 0;
+
+   running= false;
+   while( !running )
+   {
+      running= true;
+      for( i= 0; i < NUM_DECODE; ++i )
+      {
+         if ( appCtx->async[i].started && !(appCtx->decode[i].ready || appCtx->async[i].error) )
+         {
+            running= false;
+         }
+      }
+      usleep( 1000 );
+   }
+
+   for( i= 0; i < NUM_DECODE; ++i )
+   {
+      if ( appCtx->async[i].started )
+      {
+         appCtx->decode[i].paused= false;
+         appCtx->decode[i].startTime= getCurrentTimeMillis();
+      }
+   }
+
+   /* Nothing on screen can be reused from the previous test */
+   appCtx->gl.damageHistoryCount= 0;
+   appCtx->gl.composeCount= 0;
+   appCtx->gl.composeIdleCount= 0;
+   appCtx->gl.composePartialCount= 0;
+   appCtx->gl.composeDamagedFraction= 0.0;
+   appCtx->captureCount= 0;
+   appCtx->captureChecksumChanges= 0;
+   appCtx->captureMismatchCount= 0;
+   appCtx->captureUnreadableCount= 0;
+   memset( appCtx->expectedSeq, 0, sizeof(appCtx->expectedSeq) );
+   PlatformReleaseCapture( appCtx->platformCtx );
+
+   memset( drawn, 0, sizeof(drawn) );
+   maxFrameGap= 0;
+   running= true;
+   while( running )
+   {
+      usleep( 16000 );
+
+      running= false;
+      drawCount= 0;
+      dirtyCount= 0;
+      memset( damage, 0, sizeof(damage) );
+      minFrame= INT_MAX;
+      maxFrame= 0;
+      for( i= 0; i < NUM_DECODE; ++i )
+      {
+         locked[i]= false;
+         newFrame[i]= false;
+         listed= false;
+         if ( appCtx->async[i].started && !appCtx->async[i].error )
+         {
+            /* Held in index order until the draw is fenced, so no frame is re-queued while being sampled */
+            pthread_mutex_lock( &appCtx->decode[i].mutex );
+            locked[i]= true;
+
+            frameCount= appCtx->decode[i].outputFrameCount*24/appCtx->stream[i].videoRate;
+            if ( frameCount < minFrame ) minFrame= frameCount;
+            if ( frameCount > maxFrame ) maxFrame= frameCount;
+
+            if ( appCtx->surface[i].eglImage[0] )
+            {
+               if ( appCtx->surface[i].dirty )
+               {
+                  int rect[4]= { appCtx->surface[i].x, appCtx->surface[i].y, appCtx->surface[i].w, appCtx->surface[i].h };
+                  updateSurfaceTextures( &appCtx->gl, &appCtx->surface[i] );
+                  appCtx->surface[i].dirty= false;
+                  appCtx->surface[i].frameStamp= appCtx->decode[i].outputFrameCount;
+                  unionRect( damage, rect );
+                  newFrame[i]= true;
+                  ++dirtyCount;
                }
+               drawList[drawCount++]= &appCtx->surface[i];
+               listed= true;
             }
-            if ( (fd0 >= 0) && (fd1 >= 0) )
+            if ( appCtx->async[i].done )
             {
-               #ifdef GL_OES_EGL_image_external
-               int i= 0;
-               attr[i++]= EGL_WIDTH;
-               attr[i++]= decCtx->videoWidth;
-               attr[i++]= EGL_HEIGHT;
-               attr[i++]= decCtx->videoHeight;
-               attr[i++]= EGL_LINUX_DRM_FOURCC_EXT;
-               attr[i++]= DRM_FORMAT_NV12;
-               attr[i++]= EGL_DMA_BUF_PLANE0_FD_EXT;
-               attr[i++]= fd0;
-               attr[i++]= EGL_DMA_BUF_PLANE0_OFFSET_EXT;
-               attr[i++]= 0;
-               attr[i++]= EGL_DMA_BUF_PLANE0_PITCH_EXT;
-               attr[i++]= decCtx->videoBufferWidth;
-               attr[i++]= EGL_DMA_BUF_PLANE1_FD_EXT;
-               attr[i++]= fd1;
-               attr[i++]= EGL_DMA_BUF_PLANE1_OFFSET_EXT;
-               attr[i++]= (fd0 != fd1 ? 0 : decCtx->videoBufferWidth*decCtx->videoBufferHeight);
-               attr[i++]= EGL_DMA_BUF_PLANE1_PITCH_EXT;
-               attr[i++]= decCtx->videoBufferWidth;
-               attr[i++]= EGL_YUV_COLOR_SPACE_HINT_EXT;
-               attr[i++]= EGL_ITU_REC709_EXT;
-               attr[i++]= EGL_SAMPLE_RANGE_HINT_EXT;
-               attr[i++]= EGL_YUV_FULL_RANGE_EXT;
-               attr[i++]= EGL_NONE;
-               iprintf(6,"updateFrame: %dx%d: fd0 %d off %d pitch %d fd1 %d off %d pitch %d\n",
-                       attr[1], attr[3], attr[7], attr[9], attr[11], attr[13], attr[15], attr[17] );
-
-               surface->eglImage[0]= gl->eglCreateImageKHR( egl->eglDisplay,
-                                                       EGL_NO_CONTEXT,
-                                                       EGL_LINUX_DMA_BUF_EXT,
-                                                       (EGLClientBuffer)NULL,
-                                                       attr );
-               iprintf(6,"updateFrame: eglImage %p\n", surface->eglImage[0]);
-               if ( surface->eglImage[0] == 0 )
+               if ( appCtx->decode[i].stopTime == 0 )
                {
-                 iprintf(0,"Error: updateFrame: eglCreateImageKHR failed for decoder %d fd %d: errno %X\n", decCtx->decodeIndex, decCtx->currFrameFd, eglGetError());
+                  appCtx->decode[i].stopTime= getCurrentTimeMillis();
                }
-               if ( surface->textureId[0] != GL_NONE )
+            }
+            else
+            {
+               running= true;
+            }
+         }
+         if ( drawn[i] && !listed )
+         {
+            /* A decoder that failed has left the draw list, so clear its tile */
+            int rect[4]= { appCtx->surface[i].x, appCtx->surface[i].y, appCtx->surface[i].w, appCtx->surface[i].h };
+            unionRect( damage, rect );
+            ++dirtyCount;
+         }
+         drawn[i]= listed;
+      }
+      if ( appCtx->videoPlanes )
+      {
+         assignVideoPlanes( appCtx, locked, damage, &dirtyCount );
+      }
+      partial= false;
+      if ( dirtyCount )
+      {
+         partial= composeFrame( appCtx, drawList, drawCount, damage, eglRect );
+         composeOutputs( appCtx, drawList, drawCount );
+      }
+      for( i= 0; i < NUM_DECODE; ++i )
+      {
+         if ( locked[i] )
+         {
+            pthread_mutex_unlock( &appCtx->decode[i].mutex );
+         }
+      }
+      if ( dirtyCount )
+      {
+         presentOutputs( appCtx );
+         presentFrame( appCtx, partial, eglRect );
+         swapSequence= PlatformGetSwapSequence( appCtx->platformCtx );
+         if ( appCtx->writebackActive )
+         {
+            /* What this swap should show, for checking its capture */
+            int slot= swapSequence % CAPTURE_HISTORY;
+            appCtx->expectedSeq[slot]= swapSequence;
+            for( i= 0; i < NUM_DECODE; ++i )
+            {
+               appCtx->expectedFrame[slot][i]= -1;
+            }
+            for( i= 0; i < drawCount; ++i )
+            {
+               if ( !drawList[i]->onPlane && (drawList[i]->w >= (STAMP_BITS+2)*STAMP_CELL) )
                {
-                  glDeleteTextures( 1, &surface->textureId[0] );
-                  surface->textureId[0]= GL_NONE;
+                  appCtx->expectedFrame[slot][drawList[i]-appCtx->surface]= drawList[i]->frameStamp;
                }
+            }
+         }
+      }
+      else
+      {
+         ++appCtx->gl.composeIdleCount;
+      }
+      for( i= 0; i < NUM_DECODE; ++i )
+      {
+         DecCtx *decCtx= &appCtx->decode[i];
+         if ( newFrame[i] )
+         {
+            if ( decCtx->displayPendingCount == DISPLAY_PENDING )
+            {
+               --decCtx->displayPendingCount;
+               memmove( &decCtx->displayPendingSeq[0], &decCtx->displayPendingSeq[1], decCtx->displayPendingCount*sizeof(unsigned int) );
+               decCtx->lastDisplayTime= 0;
+            }
+            decCtx->displayPendingSeq[decCtx->displayPendingCount++]= swapSequence;
+         }
+         if ( decCtx->displayPendingCount )
+         {
+            updateDisplayTimes( appCtx, decCtx );
+         }
+      }
+      if ( appCtx->writebackActive )
+      {
+         checkCapture( appCtx );
+      }
+      if ( (maxFrame-minFrame) > maxFrameGap ) maxFrameGap= maxFrame-minFrame;
 
-               surface->textureCount= 1;
-               surface->haveYUVTextures= false;
-               surface->externalImage= true;
-               #else
-               attr[0]= EGL_WIDTH;
-               attr[1]= decCtx->videoWidth;
-               attr[2]= EGL_HEIGHT;
-               attr[3]= decCtx->videoHeight;
-               attr[4]= EGL_LINUX_DRM_FOURCC_EXT;
-               attr[5]= DRM_FORMAT_R8;
-               attr[6]= EGL_DMA_BUF_PLANE0_FD_EXT;
-               attr[7]= decCtx->currFrameFd;
-               attr[8]= EGL_DMA_BUF_PLANE0_OFFSET_EXT;
-               attr[9]= 0;
-               attr[10]= EGL_DMA_BUF_PLANE0_PITCH_EXT;
-               attr[11]= decCtx->videoBufferWidth;
-               attr[12]= EGL_NONE;
+      idleTotal += getCpuIdle();
+      ++numIdleSamples;
+   }
 
-               surface->eglImage[0]= gl->eglCreateImageKHR( egl->eglDisplay,
-                                                       EGL_NO_CONTEXT,
-                                                       EGL_LINUX_DMA_BUF_EXT,
-                                                       (EGLClientBuffer)NULL,
-                                                       attr );
-               if ( surface->eglImage[0] == 0 )
-               {
-                 iprintf(0,"Error: updateFrame: eglCreateImageKHR failed for decoder %d fd %d: errno %X\n", decCtx->decodeIndex, decCtx->currFrameFd, eglGetError());
-               }
-               if ( surface->textureId[0] != GL_NONE )
-               {
-                  glDeleteTextures( 1, &surface->textureId[0] );
-                  surface->textureId[0]= GL_NONE;
-               }
+   if ( maxFrameGap > 8 )
+   {
+     iprintf(0,"Playback anomaly: gap between decoders: %d frames\n", maxFrameGap);
+   }
 
-               attr[0]= EGL_WIDTH;
-               attr[1]= decCtx->videoWidth/2;
-               attr[2]= EGL_HEIGHT;
-               attr[3]= decCtx->videoHeight/2;
-               attr[4]= EGL_LINUX_DRM_FOURCC_EXT;
-               attr[5]= DRM_FORMAT_GR88;
-               attr[6]= EGL_DMA_BUF_PLANE0_FD_EXT;
-               attr[7]= decCtx->currFrameFd;
-               attr[8]= EGL_DMA_BUF_PLANE0_OFFSET_EXT;
-               attr[9]= decCtx->videoWidth*decCtx->videoBufferHeight;
-               attr[10]= EGL_DMA_BUF_PLANE0_PITCH_EXT;
-               attr[11]= decCtx->videoBufferWidth;
-               attr[12]= EGL_NONE;
+   if ( numIdleSamples )
+   {
+     iprintf(0,"Cpu idle: %2.2f\n", (idleTotal/numIdleSamples));
+   }
 
-               surface->eglImage[1]= gl->eglCreateImageKHR( egl->eglDisplay,
-                                                       EGL_NO_CONTEXT,
-                                                       EGL_LINUX_DMA_BUF_EXT,
-                                                       (EGLClientBuffer)NULL,
-                                                       attr );
-               if ( surface->eglImage[1] == 0 )
-               {
-                 iprintf(0,"Error: updateFrame: eglCreateImageKHR failed for decoder %d fd %d: errno %X\n", decCtx->decodeIndex, decCtx->currFrameFd, eglGetError());
-               }
-               if ( surface->textureId[1] != GL_NONE )
-               {
-                  glDeleteTextures( 1, &surface->textureId[1] );
-                  surface->textureId[1]= GL_NONE;
-               }
-               surface->textureCount= 2;
-               surface->haveYUVTextures= true;
-               surface->externalImage= false;
-               #endif
-            }
+   iprintf(0,"Compositor: %d frames composed, %d idle ticks without a swap, %d partial redraws covering %.1f%% of the screen on average\n",
+           appCtx->gl.composeCount, appCtx->gl.composeIdleCount, appCtx->gl.composePartialCount,
+           appCtx->gl.composePartialCount ? appCtx->gl.composeDamagedFraction*100.0/appCtx->gl.composePartialCount : 0.0 );
+
+   if ( appCtx->writebackActive )
+   {
+      iprintf(0,"Writeback: %d captures checked, %d checksum changes, %d tiles showing the wrong frame, %d tiles unreadable\n",
+              appCtx->captureCount, appCtx->captureChecksumChanges, appCtx->captureMismatchCount, appCtx->captureUnreadableCount );
+   }
+
+   emitLoadAverage();
+
+   result= true;
+   for( i= 0; i < NUM_DECODE; ++i )
+   {
+      double decodeRate= 0.0;
+      if ( appCtx->async[i].started )
+      {
+         if ( appCtx->async[i].error )
+         {
+            result= false;
+         }
+         if ( appCtx->decode[i].stopTime == 0 )
+         {
+            appCtx->decode[i].stopTime= getCurrentTimeMillis();
+         }
+         if ( appCtx->decode[i].stopTime > appCtx->decode[i].startTime )
+         {
+            decodeRate= (double)(appCtx->decode[i].outputFrameCount*1000)/(double)(appCtx->decode[i].stopTime-appCtx->decode[i].startTime);
+         }
+         iprintf(0,"Decoder %d: target fps: %d mean fps: %f\n", i, appCtx->stream[i].videoRate, decodeRate );
+         iprintf(0,"Decoder %d: buffers: input %d (%.2f MB) capture %d (%.2f MB) total %.2f MB\n", i,
+                 appCtx->decode[i].buffersIn, (double)appCtx->decode[i].bytesIn/(1024.0*1024.0),
+                 appCtx->decode[i].buffersOut, (double)appCtx->decode[i].bytesOut/(1024.0*1024.0),
+                 (double)(appCtx->decode[i].bytesIn+appCtx->decode[i].bytesOut)/(1024.0*1024.0) );
+         if ( appCtx->decode[i].inputBuffersFed )
+         {
+            iprintf(0,"Decoder %d: input: %.1f kB/s fed, %d frames in %d buffers, mean fill %.1f%%, overflows %d\n", i,
+                    (appCtx->decode[i].stopTime > appCtx->decode[i].startTime) ?
+                       (double)appCtx->decode[i].inputBytesFed/(double)(appCtx->decode[i].stopTime-appCtx->decode[i].startTime) : 0.0,
+                    appCtx->decode[i].inputFramesFed, appCtx->decode[i].inputBuffersFed,
+                    (double)appCtx->decode[i].inputBytesFed*100.0/(double)appCtx->decode[i].inputCapacityFed,
+                    appCtx->decode[i].inputOverflowCount );
+         }
+         if ( appCtx->decode[i].decodeLatencyCount )
+         {
+            iprintf(0,"Decoder %d: decode latency: mean %.2f ms max %.2f ms\n", i,
+                    (double)appCtx->decode[i].decodeLatencyTotal/(1000.0*appCtx->decode[i].decodeLatencyCount),
+                    (double)appCtx->decode[i].decodeLatencyMax/1000.0 );
+         }
+         if ( appCtx->decode[i].displayDurationCount )
+         {
+            DecCtx *decCtx= &appCtx->decode[i];
+            double mean= decCtx->displayDurationSum/decCtx->displayDurationCount;
+            double variance= decCtx->displayDurationSumSq/decCtx->displayDurationCount - mean*mean;
+            if ( variance < 0.0 ) variance= 0.0;
+            iprintf(0,"Decoder %d: display: %d frame durations mean %.2f ms stddev %.2f ms nominal %.2f ms, cadence errors %d (%.1f%%) at %.3f Hz\n", i,
+                    decCtx->displayDurationCount, mean/1000.0, sqrt(variance)/1000.0, 1000.0/decCtx->videoRate,
+                    decCtx->cadenceErrorCount, decCtx->cadenceErrorCount*100.0/decCtx->displayDurationCount,
+                    (double)PlatformGetRefreshRate( appCtx->platformCtx )/1000.0 );
+         }
+         if ( appCtx->decode[i].fenceWaitCount )
+         {
+            iprintf(0,"Decoder %d: render fences: %d waits mean %.2f ms max %.2f ms timeouts %d\n", i,
+                    appCtx->decode[i].fenceWaitCount,
+                    (double)appCtx->decode[i].fenceWaitTotal/(1000.0*appCtx->decode[i].fenceWaitCount),
+                    (double)appCtx->decode[i].fenceWaitMax/1000.0,
+                    appCtx->decode[i].fenceTimeoutCount );
          }
-
-         decCtx->prevFrameFd= decCtx->currFrameFd;
-         decCtx->currFrameFd= decCtx->nextFrameFd;
+         if ( appCtx->writebackActive && (appCtx->decode[i].lastSeenFrame >= 0) )
+         {
+            iprintf(0,"Decoder %d: writeback: last frame seen %d, %d frames never displayed\n", i,
+                    appCtx->decode[i].lastSeenFrame, appCtx->decode[i].presentDropCount );
+            emitLatencyStats( "Presentation latency: dequeue to vblank", "us", appCtx->decode[i].presentLatency, appCtx->decode[i].presentCount );
+         }
+         if ( appCtx->decode[i].planeWaitCount )
+         {
+            iprintf(0,"Decoder %d: plane releases: %d waits mean %.2f ms max %.2f ms timeouts %d\n", i,
+                    appCtx->decode[i].planeWaitCount,
+                    (double)appCtx->decode[i].planeWaitTotal/(1000.0*appCtx->decode[i].planeWaitCount),
+                    (double)appCtx->decode[i].planeWaitMax/1000.0,
+                    appCtx->decode[i].planeTimeoutCount );
+         }
+         if ( appCtx->decode[i].drainTime )
+         {
+            iprintf(0,"Decoder %d: drain time: %.3f ms frames after stop: %d\n", i, (double)appCtx->decode[i].drainTime/1000.0, appCtx->decode[i].drainFrameCount );
+         }
+         if ( appCtx->decode[i].resChangeCount )
+         {
+            iprintf(0,"Decoder %d: resolution changes: %d\n", i, appCtx->decode[i].resChangeCount );
+            emitLatencyStats( "Resolution change: capture reallocation", "us", appCtx->decode[i].resChangeRealloc, appCtx->decode[i].resChangeCount );
+            emitLatencyStats( "Resolution change: event to first new frame", "us", appCtx->decode[i].resChangeFirstFrame, appCtx->decode[i].resChangeFrameCount );
+         }
+         if ( appCtx->decode[i].outputFrameCount < appCtx->decode[i].numFramesToDecode )
+         {
+            result= false;
+         }
+         pthread_mutex_destroy( &appCtx->decode[i].mutex );
       }
    }
-   pthread_mutex_unlock( &decCtx->mutex );
 
-   return dirty;
+   return result;
 }
 
-static void testDecode( AppCtx *appCtx, int decodeIndex, int numFramesToDecode, Surface *surface, Async *async, Stream *stream )
+#define CHANNEL_CHANGE_FRAMES (12)
+#define CHANNEL_CHANGE_FLIP_WAIT (8)
+
+static bool testChannelChange( AppCtx *appCtx, int iterations )
 {
-   int rc;
-   DecCtx *decCtx= 0;
+   bool result= false;
+   int decoderIndex= 0;
+   DecCtx *decCtx= &appCtx->decode[decoderIndex];
+   Surface *surface= &appCtx->surface[decoderIndex];
+   Async *async= &appCtx->async[decoderIndex];
+   Stream *stream= &appCtx->stream[decoderIndex];
+   long long *initLatency= 0, *setupLatency= 0, *decodeLatency= 0, *displayLatency= 0;
+   int iter, count, startFrame, wait;
+   bool drew;
+   unsigned int firstSwapSeq;
+   long long firstSwapMillis= 0, firstSwapMicros= 0, flipTime;
+
+   if ( stream->streamIDRCount == 0 )
+   {
+      iprintf(0,"Error: testChannelChange: no IDR frames in stream (%s)\n", stream->inputFilename);
+      goto exit;
+   }
 
-   async->started= true;
+   initLatency= (long long*)calloc( iterations, sizeof(long long) );
+   setupLatency= (long long*)calloc( iterations, sizeof(long long) );
+   decodeLatency= (long long*)calloc( iterations, sizeof(long long) );
+   displayLatency= (long long*)calloc( iterations, sizeof(long long) );
+   if ( !initLatency || !setupLatency || !decodeLatency || !displayLatency )
+   {
+      iprintf(0,"Error: testChannelChange: no memory for %d samples\n", iterations);
+      goto exit;
+   }
 
-   decCtx= &appCtx->decode[decodeIndex];
+   count= 0;
+   for( iter= 0; iter < iterations; ++iter )
+   {
+      /* Tune in at a randomly chosen IDR */
+      startFrame= stream->streamIDRIndex[rand() % stream->streamIDRCount];
 
-   memset( decCtx, 0, sizeof(DecCtx));
+      async->started= false;
+      async->error= false;
+      async->done= false;
 
-   decCtx->appCtx= appCtx;
-   decCtx->surface= surface;
-   decCtx->async= async;
-   decCtx->stream= stream;
-   decCtx->decodeIndex= decodeIndex;
-   decCtx->videoWidth= stream->videoWidth;
-   decCtx->videoHeight= stream->videoHeight;
-   decCtx->videoRate= stream->videoRate;
-   decCtx->numFramesToDecode= (numFramesToDecode*stream->videoRate/24);
-   decCtx->prevFrameFd= -1;
-   decCtx->currFrameFd= -1;
-   decCtx->nextFrameFd= -1;
-   decCtx->nextFrameFd1= -1;
-   decCtx->v4l2.decCtx= decCtx;
-   decCtx->paused= true;
-   pthread_mutex_init( &decCtx->mutex, 0 );
+      memset( surface, 0, sizeof(Surface) );
+      surface->x= 0;
+      surface->y= 0;
+      surface->w= appCtx->windowWidth;
+      surface->h= appCtx->windowHeight;
 
-   iprintf(0,"decoder %d to decode %d frames...\n", decodeIndex, decCtx->numFramesToDecode);
+      testDecode( appCtx, decoderIndex, CHANNEL_CHANGE_FRAMES, surface, async, stream, startFrame );
+      if ( async->error )
+      {
+         iprintf(0,"Error: testChannelChange: iteration %d failed to start decode\n", iter);
+         goto exit;
+      }
+      decCtx->paused= false;
 
-   if ( !initV4l2( &decCtx->v4l2 ) )
-   {
-      iprintf(0,"Error: decoder %d failed to init v4l2\n", decCtx->decodeIndex);
-      async->error= true;
-      goto exit;
-   }
+      firstSwapSeq= 0;
+      for( ; ; )
+      {
+         usleep( 2000 );
 
-   decCtx->playing= true;
-   rc= pthread_create( &decCtx->videoInThreadId, NULL, videoInputThread, decCtx );
-   if ( rc )
-   {
-      iprintf(0,"Error: unable to start video input thread: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
-      async->error= true;
-      goto exit;
+         drew= false;
+         pthread_mutex_lock( &decCtx->mutex );
+         if ( surface->eglImage[0] )
+         {
+            glClearColor( 0, 0, 0, 1 );
+            glClear( GL_COLOR_BUFFER_BIT );
+            drawSurface( &appCtx->gl, surface );
+            surface->dirty= false;
+            drew= true;
+         }
+         pthread_mutex_unlock( &decCtx->mutex );
+
+         if ( drew )
+         {
+            long long swapTime= getMonotonicTimeMicros();
+            eglSwapBuffers( appCtx->egl.eglDisplay, appCtx->egl.eglSurface );
+            TimelineSpan( "swap", -1, swapTime, getMonotonicTimeMicros() );
+            if ( !firstSwapSeq )
+            {
+               /* Swaps are queued, so the first frame is displayed at the flip of this swap */
+               firstSwapSeq= PlatformGetSwapSequence( appCtx->platformCtx );
+               firstSwapMillis= getCurrentTimeMillis();
+               firstSwapMicros= getMonotonicTimeMicros();
+            }
+         }
+
+         if ( firstSwapSeq && !decCtx->firstDisplayTime )
+         {
+            flipTime= PlatformGetFlipTime( appCtx->platformCtx, firstSwapSeq );
+            if ( flipTime > 0 )
+            {
+               decCtx->firstDisplayTime= firstSwapMillis+(flipTime-firstSwapMicros)/1000;
+            }
+            else if ( flipTime < 0 )
+            {
+               /* Flip time unknown, the swap is the best available estimate */
+               decCtx->firstDisplayTime= firstSwapMillis;
+            }
+         }
+
+         if ( async->error )
+         {
+            iprintf(0,"Error: testChannelChange: iteration %d decode error\n", iter);
+            goto exit;
+         }
+         if ( async->done )
+         {
+            break;
+         }
+      }
+
+      /* Flip events are collected by later swaps, so keep swapping until the first one is known */
+      for( wait= 0; firstSwapSeq && !decCtx->firstDisplayTime && (wait < CHANNEL_CHANGE_FLIP_WAIT); ++wait )
+      {
+         glClearColor( 0, 0, 0, 1 );
+         glClear( GL_COLOR_BUFFER_BIT );
+         eglSwapBuffers( appCtx->egl.eglDisplay, appCtx->egl.eglSurface );
+         flipTime= PlatformGetFlipTime( appCtx->platformCtx, firstSwapSeq );
+         if ( flipTime > 0 )
+         {
+            decCtx->firstDisplayTime= firstSwapMillis+(flipTime-firstSwapMicros)/1000;
+         }
+         else if ( flipTime < 0 )
+         {
+            decCtx->firstDisplayTime= firstSwapMillis;
+         }
+      }
+      if ( firstSwapSeq && !decCtx->firstDisplayTime )
+      {
+         iprintf(1,"Warning: testChannelChange: iteration %d no flip for swap %u, using swap time\n", iter, firstSwapSeq);
+         decCtx->firstDisplayTime= firstSwapMillis;
+      }
+
+      pthread_join( decCtx->videoDecodeThreadId, NULL );
+      pthread_mutex_destroy( &decCtx->mutex );
+
+      iprintf(1,"channel change %d: start frame %d init %lld ready %lld first decode %lld first display %lld\n",
+              iter, startFrame,
+              decCtx->initDoneTime-decCtx->openTime,
+              decCtx->readyTime-decCtx->openTime,
+              decCtx->firstDecodeTime-decCtx->openTime,
+              decCtx->firstDisplayTime-decCtx->openTime );
+
+      if ( !decCtx->firstDecodeTime || !decCtx->firstDisplayTime )
+      {
+         iprintf(0,"Error: testChannelChange: iteration %d produced no frames\n", iter);
+         goto exit;
+      }
+
+      initLatency[count]= decCtx->initDoneTime-decCtx->openTime;
+      setupLatency[count]= decCtx->readyTime-decCtx->openTime;
+      decodeLatency[count]= decCtx->firstDecodeTime-decCtx->openTime;
+      displayLatency[count]= decCtx->firstDisplayTime-decCtx->openTime;
+      ++count;
    }
 
-   rc= pthread_create( &decCtx->videoDecodeThreadId, NULL, videoDecodeThread, decCtx );
-   if ( rc )
+   result= true;
+
+exit:
+
+   if ( initLatency && setupLatency && decodeLatency && displayLatency )
    {
-      iprintf(0,"Error: unable to start video decode thread: decoder %d rc %d errno %d\n", decCtx->decodeIndex, rc, errno);
-      async->error= true;
-      goto exit;
+      iprintf(0,"Channel change: %d of %d iterations completed\n", count, iterations);
+      emitLatencyStats( "Channel change: open to init done", "ms", initLatency, count );
+      emitLatencyStats( "Channel change: open to buffers ready", "ms", setupLatency, count );
+      emitLatencyStats( "Channel change: open to first decoded frame", "ms", decodeLatency, count );
+      emitLatencyStats( "Channel change: open to first displayed frame", "ms", displayLatency, count );
    }
 
-   for( ; ; )
+   if ( initLatency ) free( initLatency );
+   if ( setupLatency ) free( setupLatency );
+   if ( decodeLatency ) free( decodeLatency );
+   if ( displayLatency ) free( displayLatency );
+
+   return result;
+}
+
+static bool testSeek( AppCtx *appCtx, int seekCount )
+{
+   bool result;
+   int decoderIndex= 0;
+   DecCtx *decCtx= &appCtx->decode[decoderIndex];
+   Surface *surface= &appCtx->surface[decoderIndex];
+   Async *async= &appCtx->async[decoderIndex];
+   Stream *stream= &appCtx->stream[decoderIndex];
+
+   if ( stream->streamIDRCount == 0 )
    {
-      if ( decCtx->ready ) break;
-      usleep( 1000 );
+      iprintf(0,"Error: testSeek: no IDR frames in stream (%s)\n", stream->inputFilename);
+      return false;
    }
 
-exit:
+   async->started= false;
+   async->error= false;
+   async->done= false;
 
-   if ( async->error )
-   {
-      async->done= true;
-      iprintf(0,"decoder %d done with error\n", decodeIndex);
+   memset( surface, 0, sizeof(Surface) );
+   surface->x= 0;
+   surface->y= 0;
+   surface->w= appCtx->windowWidth;
+   surface->h= appCtx->windowHeight;
 
-      decCtx->videoEOSThreadStopRequested= true;
-      decCtx->videoOutThreadStopRequested= true;
+   testDecode( appCtx, decoderIndex, appCtx->numFramesToDecode, surface, async, stream, 0 );
 
-      termV4l2( &decCtx->v4l2 );
+   result= runUntilDone( appCtx );
 
-      if ( decCtx->videoOutThreadStarted )
-      {
-         pthread_join( decCtx->videoOutThreadId, NULL );
-      }
+   iprintf(0,"Seek: %d of %d seeks performed, %d stale frames dropped\n", decCtx->seekCount, seekCount, decCtx->seekDroppedFrames);
+   emitLatencyStats( "Seek: input flush", "us", decCtx->seekFlushLatency, decCtx->seekCount );
+   emitLatencyStats( "Seek: seek to first decoded frame", "ms", decCtx->seekFrameLatency, decCtx->seekFrameCount );
 
-      if ( decCtx->videoEOSThreadStarted )
-      {
-         pthread_join( decCtx->videoEOSThreadId, NULL );
-      }
+   if ( decCtx->seekFrameCount < decCtx->seekCount )
+   {
+      iprintf(0,"Seek: %d seeks produced no frame with a matching timestamp\n", decCtx->seekCount-decCtx->seekFrameCount);
    }
 
-   return;
+   if ( decCtx->seekCount < seekCount )
+   {
+      result= false;
+   }
+
+   return result;
 }
 
-static bool runUntilDone( AppCtx *appCtx )
+static bool testAbr( AppCtx *appCtx, int switchCount )
 {
    bool result;
-   bool running;
-   bool dirty;
-   int i, frameCount, minFrame, maxFrame, maxFrameGap;
-   double idleTotal= 0.0;
-   int numIdleSamples= 0;
+   int decoderIndex= 0;
+   DecCtx *decCtx= &appCtx->decode[decoderIndex];
+   Surface *surface= &appCtx->surface[decoderIndex];
+   Async *async= &appCtx->async[decoderIndex];
+   long long glitch[MAX_ABR_SWITCHES];
+   long long dropped[MAX_ABR_SWITCHES];
+   int i, j, count;
 
-   running= false;
-   while( !running )
+   if ( appCtx->numStreams < 2 )
    {
-      running= true;
-      for( i= 0; i < NUM_DECODE; ++i )
+      iprintf(0,"Error: testAbr: need at least two rendition descriptors\n");
+      return false;
+   }
+
+   /* Order the renditions from lowest to highest resolution */
+   appCtx->abrLadderCount= 0;
+   for( i= 0; i < appCtx->numStreams; ++i )
+   {
+      Stream *stream= &appCtx->stream[i];
+      if ( stream->streamIDRCount == 0 )
       {
-         if ( appCtx->async[i].started && !(appCtx->decode[i].ready || appCtx->async[i].error) )
+         iprintf(0,"Error: testAbr: no IDR frames in stream (%s)\n", stream->inputFilename);
+         return false;
+      }
+      for( j= appCtx->abrLadderCount; j > 0; --j )
+      {
+         Stream *other= appCtx->abrLadder[j-1];
+         if ( other->videoWidth*other->videoHeight <= stream->videoWidth*stream->videoHeight )
          {
-            running= false;
+            break;
          }
+         appCtx->abrLadder[j]= other;
       }
-      usleep( 1000 );
+      appCtx->abrLadder[j]= stream;
+      ++appCtx->abrLadderCount;
+   }
+   for( i= 0; i < appCtx->abrLadderCount; ++i )
+   {
+      iprintf(0,"ABR: rendition %d: %dx%d (%s)\n", i, appCtx->abrLadder[i]->videoWidth, appCtx->abrLadder[i]->videoHeight, appCtx->abrLadder[i]->inputFilename);
    }
 
-   for( i= 0; i < NUM_DECODE; ++i )
+   async->started= false;
+   async->error= false;
+   async->done= false;
+
+   memset( surface, 0, sizeof(Surface) );
+   surface->x= 0;
+   surface->y= 0;
+   surface->w= appCtx->windowWidth;
+   surface->h= appCtx->windowHeight;
+
+   testDecode( appCtx, decoderIndex, appCtx->numFramesToDecode, surface, async, appCtx->abrLadder[0], 0 );
+
+   result= runUntilDone( appCtx );
+
+   count= 0;
+   for( i= 0; i < decCtx->abrSwitchCount; ++i )
    {
-      if ( appCtx->async[i].started )
+      Stream *from= appCtx->abrLadder[decCtx->abrSwitchFrom[i]];
+      Stream *to= appCtx->abrLadder[decCtx->abrSwitchTo[i]];
+      if ( decCtx->abrGlitch[i] < 0 )
       {
-         appCtx->decode[i].paused= false;
-         appCtx->decode[i].startTime= getCurrentTimeMillis();
+         iprintf(0,"ABR: switch %d: %dx%d -> %dx%d: no frame from new rendition\n", i, from->videoWidth, from->videoHeight, to->videoWidth, to->videoHeight);
+         continue;
       }
+      iprintf(0,"ABR: switch %d: %dx%d -> %dx%d: glitch %lld ms dropped frames %lld\n",
+              i, from->videoWidth, from->videoHeight, to->videoWidth, to->videoHeight, decCtx->abrGlitch[i], decCtx->abrDroppedFrames[i]);
+      glitch[count]= decCtx->abrGlitch[i];
+      dropped[count]= decCtx->abrDroppedFrames[i];
+      ++count;
    }
+   iprintf(0,"ABR: %d of %d switches performed, %d measured\n", decCtx->abrSwitchCount, switchCount, count);
+   emitLatencyStats( "ABR: switch glitch", "ms", glitch, count );
+   emitLatencyStats( "ABR: dropped frames per switch", "frames", dropped, count );
 
-   maxFrameGap= 0;
-   running= true;
-   while( running )
+   if ( decCtx->abrSwitchCount < switchCount )
    {
-      usleep( 16000 );
+      result= false;
+   }
 
-      glClearColor( 0, 0, 0, 1 );
-      glClear( GL_COLOR_BUFFER_BIT );
+   return result;
+}
 
-      running= false;
-      dirty= false;
-      minFrame= INT_MAX;
-      maxFrame= 0;
-      for( i= 0; i < NUM_DECODE; ++i )
+static bool testBufferSweep( AppCtx *appCtx, int maxBuffers )
+{
+   bool result= false;
+   int decoderIndex= 0;
+   DecCtx *decCtx= &appCtx->decode[decoderIndex];
+   Surface *surface= &appCtx->surface[decoderIndex];
+   Async *async= &appCtx->async[decoderIndex];
+   Stream *stream= &appCtx->stream[decoderIndex];
+   int count, prevBuffersOut, bestBuffers;
+   double fps, meanLatency, maxLatency;
+   bool runResult, sustained;
+
+   prevBuffersOut= -1;
+   bestBuffers= -1;
+   for( count= 1; count <= maxBuffers; ++count )
+   {
+      appCtx->captureBufferCount= count;
+
+      async->started= false;
+      async->error= false;
+      async->done= false;
+
+      memset( surface, 0, sizeof(Surface) );
+      surface->x= 0;
+      surface->y= 0;
+      surface->w= appCtx->windowWidth;
+      surface->h= appCtx->windowHeight;
+
+      testDecode( appCtx, decoderIndex, appCtx->numFramesToDecode, surface, async, stream, 0 );
+
+      runResult= runUntilDone( appCtx );
+
+      if ( decCtx->buffersOut == prevBuffersOut )
       {
-         if ( appCtx->async[i].started && !appCtx->async[i].error )
-         {
-            pthread_mutex_lock( &appCtx->decode[i].mutex );
+         /* The driver raised the request to a count already measured */
+         continue;
+      }
+      prevBuffersOut= decCtx->buffersOut;
 
-            frameCount= appCtx->decode[i].outputFrameCount*24/appCtx->stream[i].videoRate;
-            if ( frameCount < minFrame ) minFrame= frameCount;
-            if ( frameCount > maxFrame ) maxFrame= frameCount;
+      fps= 0.0;
+      if ( decCtx->stopTime > decCtx->startTime )
+      {
+         fps= (double)(decCtx->outputFrameCount*1000)/(double)(decCtx->stopTime-decCtx->startTime);
+      }
+      meanLatency= 0.0;
+      if ( decCtx->decodeLatencyCount )
+      {
+         meanLatency= (double)decCtx->decodeLatencyTotal/(1000.0*decCtx->decodeLatencyCount);
+      }
+      maxLatency= (double)decCtx->decodeLatencyMax/1000.0;
 
-            if ( appCtx->surface[i].eglImage[0] )
-            {
-               drawSurface( &appCtx->gl, &appCtx->surface[i] );
-               appCtx->surface[i].dirty= false;
-               dirty= true;
-            }
-            if ( appCtx->async[i].done )
-            {
-               if ( appCtx->decode[i].stopTime == 0 )
-               {
-                  appCtx->decode[i].stopTime= getCurrentTimeMillis();
-               }
-            }
-            else
-            {
-               running= true;
-            }
-            pthread_mutex_unlock( &appCtx->decode[i].mutex );
-         }
+      /* Sustained means within 5% of the stream rate and, if given, under the latency limit */
+      sustained= runResult && (fps*100.0 >= stream->videoRate*95.0);
+      if ( appCtx->bufferSweepLatency && (meanLatency > appCtx->bufferSweepLatency) )
+      {
+         sustained= false;
       }
-      if ( dirty )
+
+      iprintf(0,"Buffer sweep: capture buffers %d: mean fps %.2f decode latency mean %.2f ms max %.2f ms memory %.2f MB: %s\n",
+              decCtx->buffersOut, fps, meanLatency, maxLatency,
+              (double)(decCtx->bytesIn+decCtx->bytesOut)/(1024.0*1024.0),
+              sustained ? "sustained" : "not sustained" );
+
+      if ( sustained && (bestBuffers < 0) )
       {
-         eglSwapBuffers( appCtx->egl.eglDisplay, appCtx->egl.eglSurface );
+         bestBuffers= decCtx->buffersOut;
       }
-      if ( (maxFrame-minFrame) > maxFrameGap ) maxFrameGap= maxFrame-minFrame;
 
-      idleTotal += getCpuIdle();
-      ++numIdleSamples;
+      usleep( 500000 );
    }
+   appCtx->captureBufferCount= 0;
 
-   if ( maxFrameGap > 8 )
+   if ( bestBuffers >= 0 )
    {
-     iprintf(0,"Playback anomaly: gap between decoders: %d frames\n", maxFrameGap);
+      iprintf(0,"Buffer sweep: minimum capture buffers sustaining %d fps: %d\n", stream->videoRate, bestBuffers);
+      result= true;
+   }
+   else
+   {
+      iprintf(0,"Buffer sweep: no capture buffer count up to %d sustains %d fps\n", maxBuffers, stream->videoRate);
    }
 
-   if ( numIdleSamples )
+   return result;
+}
+
+static bool testTrickPlay( AppCtx *appCtx, int speed )
+{
+   bool result;
+   int decoderIndex= 0;
+   DecCtx *decCtx= &appCtx->decode[decoderIndex];
+   Surface *surface= &appCtx->surface[decoderIndex];
+   Async *async= &appCtx->async[decoderIndex];
+   Stream *stream= &appCtx->stream[decoderIndex];
+   int numFrames;
+   double elapsed, decodeRate= 0.0, effectiveSpeed= 0.0;
+
+   if ( stream->streamIntraCount == 0 )
    {
-     iprintf(0,"Cpu idle: %2.2f\n", (idleTotal/numIdleSamples));
+      iprintf(0,"Error: testTrickPlay: no intra frames in stream (%s)\n", stream->inputFilename);
+      return false;
    }
 
-   emitLoadAverage();
+   async->started= false;
+   async->error= false;
+   async->done= false;
 
-   result= true;
-   for( i= 0; i < NUM_DECODE; ++i )
+   memset( surface, 0, sizeof(Surface) );
+   surface->x= 0;
+   surface->y= 0;
+   surface->w= appCtx->windowWidth;
+   surface->h= appCtx->windowHeight;
+
+   numFrames= stream->streamIntraCount;
+   if ( numFrames > appCtx->numFramesToDecode )
    {
-      double decodeRate= 0.0;
-      if ( appCtx->async[i].started )
-      {
-         if ( appCtx->async[i].error )
-         {
-            result= false;
-         }
-         if ( appCtx->decode[i].stopTime == 0 )
-         {
-            appCtx->decode[i].stopTime= getCurrentTimeMillis();
-         }
-         if ( appCtx->decode[i].stopTime > appCtx->decode[i].startTime )
-         {
-            decodeRate= (double)(appCtx->decode[i].outputFrameCount*1000)/(double)(appCtx->decode[i].stopTime-appCtx->decode[i].startTime);
-         }
-         iprintf(0,"Decoder %d: target fps: %d mean fps: %f\n", i, appCtx->stream[i].videoRate, decodeRate );
-         pthread_mutex_destroy( &appCtx->decode[i].mutex );
-      }
+      numFrames= appCtx->numFramesToDecode;
    }
 
-   if ( minFrame < appCtx->numFramesToDecode )
+   testDecode( appCtx, decoderIndex, numFrames, surface, async, stream, 0 );
+
+   result= runUntilDone( appCtx );
+
+   elapsed= (double)(decCtx->stopTime-decCtx->startTime)/1000.0;
+   if ( elapsed > 0.0 )
    {
-      result= false;
+      decodeRate= (double)decCtx->outputFrameCount/elapsed;
+      effectiveSpeed= (double)decCtx->trickContentFrames/(elapsed*stream->videoRate);
    }
+   iprintf(0,"Trick play: speed %dx I-frames fed %d skipped %d decoded %d\n",
+           speed, decCtx->trickFramesFed, decCtx->trickFramesSkipped, decCtx->outputFrameCount);
+   iprintf(0,"Trick play: I-frame decode rate %.2f fps effective speed %.2fx\n", decodeRate, (speed < 0) ? -effectiveSpeed : effectiveSpeed);
 
    return result;
 }
@@ -3059,9 +8400,33 @@ static void showUsage( void )
    printf("\n");
    printf("options are one of:\n");
    printf("--report <reportfilename>\n");
-   printf("--devname <devname>\n");
+   printf("--devname <devname> : use mock[:latency=<ms>,fps=<n>,pattern=<0|1>] for the built in mock decoder\n");
    printf("--window-size <width>x<height> (eg --window-size 640x480)\n");
    printf("--numframes <n>\n" );
+   printf("--channel-change <iterations> : measure channel change latency instead of the standard tests\n" );
+   printf("--seek <count> : measure seek latency instead of the standard tests\n" );
+   printf("--trickplay <speed> : play I-frames only at the given speed (eg 8 or -8 for reverse) instead of the standard tests\n" );
+   printf("--abr <switches> : switch between the given stream renditions at IDR frames instead of the standard tests\n" );
+   printf("--abr-random : choose ABR renditions pseudo-randomly rather than stepping up and down the ladder\n" );
+   printf("--ioctl-record <file> : record all decoder ioctls with timing to a binary trace\n" );
+   printf("--ioctl-replay <file> : replay a recorded trace in place of the decoder device (not stateless decoders: media requests are not recorded)\n" );
+   printf("--input-buffers <n> : number of bitstream buffers to request (raised to the decoder minimum)\n" );
+   printf("--pack-input : pack several frames into each bitstream buffer when the decoder parses the bytestream\n" );
+   printf("--capture-buffers <n> : number of capture buffers to request (raised to the decoder minimum)\n" );
+   printf("--buffer-sweep <max> : find the fewest capture buffers, up to max, that sustain the stream rate instead of the standard tests\n" );
+   printf("--sweep-latency <ms> : with --buffer-sweep, also require mean decode latency of at most ms\n" );
+   printf("--capture-dmabuf : import decoded frames into buffers from a pool shared by all decoders\n" );
+   printf("--program-cache <dir> : load and save linked GL program binaries in dir (needs GL_OES_get_program_binary)\n" );
+   printf("--match-refresh : choose a display mode whose refresh rate is a multiple of the first stream's frame rate\n" );
+   printf("--flip-queue <n> : number of frames the display may hold (on screen, flipping and queued), default 2\n" );
+   printf("--drm-device <card> : DRM device path or card index, default /dev/dri/card0\n" );
+   printf("--outputs <list> : comma separated connector names (eg HDMI-A-1) or indices, or all, default the first connected\n" );
+   printf("--mirror : show the same composition on every output instead of composing each output independently\n" );
+   printf("--video-planes : scan decoded frames out on hardware planes where TEST_ONLY commits accept them, composing the rest with GL\n" );
+   printf("--no-modifiers : use linear buffers for decoder output and the window instead of negotiating tiled or compressed layouts\n" );
+   printf("--writeback <n> : capture every n-th composed frame with a DRM writeback connector and verify the frames it shows\n" );
+   printf("--list-outputs : list DRM devices, connectors and crtcs and exit\n" );
+   printf("--timeline <file> : write a Chrome trace event JSON timeline of the decode and render pipeline at exit\n" );
    printf("--verbose\n");
    printf("-? : show usage\n");
    printf("\n");
@@ -3079,7 +8444,11 @@ int main( int argc, const char **argv )
    Stream *stream;
    int rc, i;
    bool testResult;
+   bool listOutputs= false;
    const char *reportFilename= 0;
+   const char *ioctlRecordFile= 0;
+   const char *ioctlReplayFile= 0;
+   const char *timelineFile= 0;
    const char *eglExtensions= 0;
    const char *glExtensions= 0;
    const char *s= 0;
@@ -3159,6 +8528,178 @@ int main( int argc, const char **argv )
                }
             }
          }
+         else if ( (len == 16) && !strncmp( argv[argidx], "--channel-change", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               int num= atoi(argv[argidx]);
+               if ( num > 0 )
+               {
+                  appCtx->channelChangeCount= num;
+               }
+            }
+         }
+         else if ( (len == 6) && !strncmp( argv[argidx], "--seek", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               int num= atoi(argv[argidx]);
+               if ( num > 0 )
+               {
+                  appCtx->seekCount= (num > MAX_SEEKS) ? MAX_SEEKS : num;
+               }
+            }
+         }
+         else if ( (len == 11) && !strncmp( argv[argidx], "--trickplay", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->trickSpeed= atoi(argv[argidx]);
+            }
+         }
+         else if ( (len == 5) && !strncmp( argv[argidx], "--abr", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               int count= atoi(argv[argidx]);
+               if ( count > 0 )
+               {
+                  appCtx->abrSwitchCount= (count > MAX_ABR_SWITCHES) ? MAX_ABR_SWITCHES : count;
+               }
+            }
+         }
+         else if ( (len == 12) && !strncmp( argv[argidx], "--abr-random", len) )
+         {
+            appCtx->abrRandom= true;
+         }
+         else if ( (len == 14) && !strncmp( argv[argidx], "--ioctl-record", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               ioctlRecordFile= argv[argidx];
+            }
+         }
+         else if ( (len == 14) && !strncmp( argv[argidx], "--ioctl-replay", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               ioctlReplayFile= argv[argidx];
+            }
+         }
+         else if ( (len == 15) && !strncmp( argv[argidx], "--input-buffers", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->inputBufferCount= atoi( argv[argidx] );
+            }
+         }
+         else if ( (len == 12) && !strncmp( argv[argidx], "--pack-input", len) )
+         {
+            appCtx->packInput= true;
+         }
+         else if ( (len == 17) && !strncmp( argv[argidx], "--capture-buffers", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->captureBufferCount= atoi( argv[argidx] );
+            }
+         }
+         else if ( (len == 14) && !strncmp( argv[argidx], "--buffer-sweep", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->bufferSweepMax= atoi( argv[argidx] );
+            }
+         }
+         else if ( (len == 15) && !strncmp( argv[argidx], "--sweep-latency", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->bufferSweepLatency= atoi( argv[argidx] );
+            }
+         }
+         else if ( (len == 16) && !strncmp( argv[argidx], "--capture-dmabuf", len) )
+         {
+            gCaptureDmaBuf= true;
+         }
+         else if ( (len == 15) && !strncmp( argv[argidx], "--program-cache", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->programCacheDir= argv[argidx];
+            }
+         }
+         else if ( (len == 15) && !strncmp( argv[argidx], "--match-refresh", len) )
+         {
+            appCtx->matchRefresh= true;
+         }
+         else if ( (len == 12) && !strncmp( argv[argidx], "--flip-queue", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->flipQueueDepth= atoi( argv[argidx] );
+            }
+         }
+         else if ( (len == 12) && !strncmp( argv[argidx], "--drm-device", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->drmDevice= argv[argidx];
+            }
+         }
+         else if ( (len == 9) && !strncmp( argv[argidx], "--outputs", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->drmOutputs= argv[argidx];
+            }
+         }
+         else if ( (len == 8) && !strncmp( argv[argidx], "--mirror", len) )
+         {
+            appCtx->mirrorOutputs= true;
+         }
+         else if ( (len == 14) && !strncmp( argv[argidx], "--video-planes", len) )
+         {
+            appCtx->videoPlanes= true;
+         }
+         else if ( (len == 14) && !strncmp( argv[argidx], "--no-modifiers", len) )
+         {
+            appCtx->noModifiers= true;
+         }
+         else if ( (len == 11) && !strncmp( argv[argidx], "--writeback", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               appCtx->writebackInterval= atoi( argv[argidx] );
+            }
+         }
+         else if ( (len == 14) && !strncmp( argv[argidx], "--list-outputs", len) )
+         {
+            listOutputs= true;
+         }
+         else if ( (len == 10) && !strncmp( argv[argidx], "--timeline", len) )
+         {
+            ++argidx;
+            if ( argidx < argc )
+            {
+               timelineFile= argv[argidx];
+            }
+         }
          else if ( (len == 9) && !strncmp( argv[argidx], "--verbose", len) )
          {
             gVerbose= true;
@@ -3196,6 +8737,21 @@ int main( int argc, const char **argv )
       ++argidx;
    }
 
+   if ( listOutputs )
+   {
+      PlatformListOutputs( appCtx->drmDevice );
+      nRC= 0;
+      goto exit;
+   }
+
+   for( i= 0; i < NUM_DECODE; ++i )
+   {
+      if ( appCtx->stream[i].inputFilename )
+      {
+         ++appCtx->numStreams;
+      }
+   }
+
    for( i= 0; i < NUM_DECODE; ++i )
    {
       if ( appCtx->stream[i].inputFilename == 0 )
@@ -3224,16 +8780,47 @@ int main( int argc, const char **argv )
 
    gReport= fopen( reportFilename, "wt" );
 
+   LogStart( gReport );
+
    iprintf(0,"v4l2test v%s\n", V4L2TEST_VERSION );
    iprintf(0,"-----------------------------------------------------------------\n");
 
-   appCtx->platformCtx= PlatfromInit();
+   appCtx->platformCtx= PlatfromInit( appCtx->drmDevice, appCtx->drmOutputs, appCtx->mirrorOutputs );
    if ( !appCtx->platformCtx )
    {
       iprintf(0,"Error: PlatformInit failed\n");
       goto exit;
    }
 
+   if ( appCtx->flipQueueDepth )
+   {
+      PlatformSetFlipQueueDepth( appCtx->platformCtx, appCtx->flipQueueDepth );
+   }
+
+   if ( appCtx->noModifiers )
+   {
+      PlatformSetUseModifiers( appCtx->platformCtx, false );
+   }
+
+   if ( appCtx->matchRefresh )
+   {
+      PlatformSetFrameRate( appCtx->platformCtx, appCtx->stream[0].videoRate );
+   }
+
+   if ( appCtx->writebackInterval > 0 )
+   {
+      appCtx->writebackActive= PlatformEnableWriteback( appCtx->platformCtx, appCtx->writebackInterval );
+      if ( !appCtx->writebackActive )
+      {
+         iprintf(0,"Warning: writeback capture not available\n");
+      }
+   }
+
+   if ( gCaptureDmaBuf )
+   {
+      initCapturePool( appCtx->platformCtx );
+   }
+
    appCtx->egl.appCtx= appCtx;
    appCtx->egl.useWayland= false;
    appCtx->egl.nativeDisplay= PlatformGetEGLDisplayType( appCtx->platformCtx );
@@ -3261,6 +8848,10 @@ int main( int argc, const char **argv )
       {
          appCtx->haveDmaBufImport= true;
       }
+      if ( strstr( eglExtensions, "EGL_EXT_image_dma_buf_import_modifiers" ) && !appCtx->noModifiers )
+      {
+         queryDmaBufModifiers( appCtx );
+      }
    }
 
    glExtensions= (const char *)glGetString(GL_EXTENSIONS);
@@ -3277,6 +8868,7 @@ int main( int argc, const char **argv )
    iprintf(0,"-----------------------------------------------------------------\n");
    iprintf(0,"Have dmabuf import: %d\n", appCtx->haveDmaBufImport );
    iprintf(0,"Have external image: %d\n", appCtx->haveExternalImage );
+   iprintf(0,"Have dmabuf modifiers: %d (%d for NV12)\n", appCtx->haveDmaBufModifiers, appCtx->dmaBufModifierCount );
    iprintf(0,"-----------------------------------------------------------------\n");
 
    s= eglQueryString( appCtx->egl.eglDisplay, EGL_VENDOR );
@@ -3294,7 +8886,26 @@ int main( int argc, const char **argv )
       iprintf(0,"Error: EGL has no dmabuf import support\n");
    }
 
-   if ( !gDeviceName )
+   if ( ioctlReplayFile )
+   {
+      if ( !TraceReplayStart( ioctlReplayFile ) )
+      {
+         goto exit;
+      }
+      iprintf(0,"replaying decoder sessions from (%s)\n", ioctlReplayFile);
+      gIoctlReplay= true;
+      if ( gDeviceName )
+      {
+         free( gDeviceName );
+      }
+      gDeviceName= strdup( ioctlReplayFile );
+   }
+   else if ( MockDecIsName( gDeviceName ) )
+   {
+      iprintf(0,"using mock decoder (%s)\n", gDeviceName);
+      gMockDecoder= true;
+   }
+   else if ( !gDeviceName )
    {
       discoverVideoDecoder();
       if ( !gDeviceName )
@@ -3304,6 +8915,26 @@ int main( int argc, const char **argv )
       }
    }
 
+   if ( ioctlRecordFile )
+   {
+      if ( !TraceRecordStart( ioctlRecordFile ) )
+      {
+         goto exit;
+      }
+      iprintf(0,"recording decoder sessions to (%s)\n", ioctlRecordFile);
+      gIoctlRecord= true;
+   }
+
+   if ( timelineFile )
+   {
+      if ( !TimelineStart( timelineFile ) )
+      {
+         goto exit;
+      }
+      iprintf(0,"recording timeline to (%s)\n", timelineFile);
+      TimelineNameThread( "render" );
+   }
+
    for( i= 0; i < NUM_DECODE; ++i )
    {
       if ( !prepareStream( appCtx, &appCtx->stream[i] ) )
@@ -3315,6 +8946,86 @@ int main( int argc, const char **argv )
 
    usleep( 2000000 );
 
+   if ( appCtx->channelChangeCount )
+   {
+      iprintf(0,"\n");
+      iprintf(0,"-----------------------------------------------------------------\n");
+      iprintf(0,"Test channel change: %d iterations\n", appCtx->channelChangeCount);
+
+      testResult= testChannelChange( appCtx, appCtx->channelChangeCount );
+      iprintf(0,"result: %s\n", testResult ? "PASS" : "FAIL");
+
+      glClearColor( 0, 0, 0, 1 );
+      glClear( GL_COLOR_BUFFER_BIT );
+      eglSwapBuffers( appCtx->egl.eglDisplay, appCtx->egl.eglSurface );
+      iprintf(0,"-----------------------------------------------------------------\n");
+      goto exit;
+   }
+
+   if ( appCtx->bufferSweepMax )
+   {
+      iprintf(0,"\n");
+      iprintf(0,"-----------------------------------------------------------------\n");
+      iprintf(0,"Test capture buffer sweep: up to %d buffers\n", appCtx->bufferSweepMax);
+
+      testResult= testBufferSweep( appCtx, appCtx->bufferSweepMax );
+      iprintf(0,"result: %s\n", testResult ? "PASS" : "FAIL");
+
+      glClearColor( 0, 0, 0, 1 );
+      glClear( GL_COLOR_BUFFER_BIT );
+      eglSwapBuffers( appCtx->egl.eglDisplay, appCtx->egl.eglSurface );
+      iprintf(0,"-----------------------------------------------------------------\n");
+      goto exit;
+   }
+
+   if ( appCtx->abrSwitchCount )
+   {
+      iprintf(0,"\n");
+      iprintf(0,"-----------------------------------------------------------------\n");
+      iprintf(0,"Test ABR rendition switching: %d switches%s\n", appCtx->abrSwitchCount, appCtx->abrRandom ? " (random)" : "");
+
+      testResult= testAbr( appCtx, appCtx->abrSwitchCount );
+      iprintf(0,"result: %s\n", testResult ? "PASS" : "FAIL");
+
+      glClearColor( 0, 0, 0, 1 );
+      glClear( GL_COLOR_BUFFER_BIT );
+      eglSwapBuffers( appCtx->egl.eglDisplay, appCtx->egl.eglSurface );
+      iprintf(0,"-----------------------------------------------------------------\n");
+      goto exit;
+   }
+
+   if ( appCtx->trickSpeed )
+   {
+      iprintf(0,"\n");
+      iprintf(0,"-----------------------------------------------------------------\n");
+      iprintf(0,"Test trick play: speed %dx\n", appCtx->trickSpeed);
+
+      testResult= testTrickPlay( appCtx, appCtx->trickSpeed );
+      iprintf(0,"result: %s\n", testResult ? "PASS" : "FAIL");
+
+      glClearColor( 0, 0, 0, 1 );
+      glClear( GL_COLOR_BUFFER_BIT );
+      eglSwapBuffers( appCtx->egl.eglDisplay, appCtx->egl.eglSurface );
+      iprintf(0,"-----------------------------------------------------------------\n");
+      goto exit;
+   }
+
+   if ( appCtx->seekCount )
+   {
+      iprintf(0,"\n");
+      iprintf(0,"-----------------------------------------------------------------\n");
+      iprintf(0,"Test seek: %d seeks\n", appCtx->seekCount);
+
+      testResult= testSeek( appCtx, appCtx->seekCount );
+      iprintf(0,"result: %s\n", testResult ? "PASS" : "FAIL");
+
+      glClearColor( 0, 0, 0, 1 );
+      glClear( GL_COLOR_BUFFER_BIT );
+      eglSwapBuffers( appCtx->egl.eglDisplay, appCtx->egl.eglSurface );
+      iprintf(0,"-----------------------------------------------------------------\n");
+      goto exit;
+   }
+
    iprintf(0,"\n");
    iprintf(0,"-----------------------------------------------------------------\n");
    iprintf(0,"Test single decode:\n");
@@ -3336,7 +9047,7 @@ int main( int argc, const char **argv )
    surface->h= videoHeight;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    testResult= runUntilDone( appCtx );
    iprintf(0,"result: %s\n", testResult ? "PASS" : "FAIL");
@@ -3375,7 +9086,7 @@ int main( int argc, const char **argv )
    surface->dirty= false;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    ++decoderIndex;
    async= &appCtx->async[decoderIndex];
@@ -3392,7 +9103,7 @@ int main( int argc, const char **argv )
    surface->dirty= false;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    testResult= runUntilDone( appCtx );
    iprintf(0,"result: %s\n", testResult ? "PASS" : "FAIL");
@@ -3430,7 +9141,7 @@ int main( int argc, const char **argv )
    surface->dirty= false;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    ++decoderIndex;
    async= &appCtx->async[decoderIndex];
@@ -3447,7 +9158,7 @@ int main( int argc, const char **argv )
    surface->dirty= false;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    ++decoderIndex;
    async= &appCtx->async[decoderIndex];
@@ -3464,7 +9175,7 @@ int main( int argc, const char **argv )
    surface->dirty= false;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    testResult= runUntilDone( appCtx );
    iprintf(0,"result: %s\n", testResult ? "PASS" : "FAIL");
@@ -3502,7 +9213,7 @@ int main( int argc, const char **argv )
    surface->dirty= false;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    ++decoderIndex;
    async= &appCtx->async[decoderIndex];
@@ -3519,7 +9230,7 @@ int main( int argc, const char **argv )
    surface->dirty= false;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    ++decoderIndex;
    async= &appCtx->async[decoderIndex];
@@ -3536,7 +9247,7 @@ int main( int argc, const char **argv )
    surface->dirty= false;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    ++decoderIndex;
    async= &appCtx->async[decoderIndex];
@@ -3553,7 +9264,7 @@ int main( int argc, const char **argv )
    surface->dirty= false;
 
    stream= &appCtx->stream[decoderIndex];
-   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream );
+   testDecode( appCtx, decoderIndex, numFramesToDecode, surface, async, stream, 0 );
 
    testResult= runUntilDone( appCtx );
    iprintf(0,"result: %s\n", testResult ? "PASS" : "FAIL");
@@ -3590,6 +9301,14 @@ exit:
 
       termEGL( &appCtx->egl );
 
+      emitIoctlStats();
+
+      if ( gCaptureDmaBuf && gCapturePool.platformCtx )
+      {
+         emitCapturePoolStats();
+         termCapturePool();
+      }
+
       if ( appCtx->platformCtx )
       {
          PlatformTerm( appCtx->platformCtx );
@@ -3599,12 +9318,28 @@ exit:
       free( appCtx );
    }
 
+   if ( gIoctlRecord )
+   {
+      gIoctlRecord= false;
+      TraceRecordStop();
+   }
+
+   TimelineStop();
+
+   if ( gIoctlReplay )
+   {
+      gIoctlReplay= false;
+      TraceReplayStop();
+   }
+
    if ( gDeviceName )
    {
       free( gDeviceName );
       gDeviceName= 0;
    }
 
+   LogStop();
+
    if ( gReport )
    {
       fclose( gReport );